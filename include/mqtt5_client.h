@@ -101,6 +101,11 @@ typedef struct {
     mqtt5_user_property_handle_t user_property;  /*!< The handle for user property, call function esp_mqtt5_client_set_user_property to set it */
 } esp_mqtt5_publish_property_config_t;
 
+/**
+ *  Publish properties encoded once, see esp_mqtt5_client_create_publish_property_block()
+ */
+typedef struct mqtt5_property_block *esp_mqtt5_publish_property_block_handle_t;
+
 /**
  *  MQTT5 protocol subscribe properties configuration, more details refer to MQTT5 protocol document section 3.8.2.1
  */
@@ -147,6 +152,28 @@ typedef struct {
     mqtt5_user_property_handle_t user_property;  /*!< The handle for user property, call function esp_mqtt5_client_delete_user_property to free the memory */
 } esp_mqtt5_event_property_t;
 
+/**
+ *  Response to a request sent with esp_mqtt5_client_request()
+ *
+ *  A large response is delivered in several chunks, the response is complete when
+ *  `current_data_offset + data_len == total_data_len`.
+ */
+typedef struct {
+    int request_id;                              /*!< Id returned by esp_mqtt5_client_request() */
+    esp_err_t status;                            /*!< ESP_OK if response data are received, ESP_ERR_TIMEOUT if no response came in time,
+                                                      ESP_ERR_INVALID_STATE if the client is destroyed while the request is pending */
+    const char *data;                            /*!< Response payload (chunk) */
+    int data_len;                                /*!< Length of the payload chunk */
+    int total_data_len;                          /*!< Total length of the response payload */
+    int current_data_offset;                     /*!< Offset of the chunk in the response payload */
+    const esp_mqtt5_event_property_t *property;  /*!< Properties of the response message, NULL if status is not ESP_OK */
+} esp_mqtt5_response_t;
+
+/**
+ *  Callback completing a request, called from the *MQTT* task
+ */
+typedef void (*esp_mqtt5_response_cb_t)(esp_mqtt5_client_handle_t client, const esp_mqtt5_response_t *response, void *ctx);
+
 /**
  *  MQTT5 protocol for user property
  */
@@ -174,6 +201,9 @@ esp_err_t esp_mqtt5_client_set_connect_property(esp_mqtt5_client_handle_t client
  * This API will not store the publish property, it is one-time configuration.
  * Before call `esp_mqtt_client_publish` to publish data, call this API to set publish property if have
  *
+ * QoS0 publishes sent right away get topic aliases from the client, unless a topic alias is set here.
+ * An alias set here is not assigned by the client anymore until the next connection.
+ *
  * @param client            mqtt client handle
  * @param property          publish property
  *
@@ -183,6 +213,68 @@ esp_err_t esp_mqtt5_client_set_connect_property(esp_mqtt5_client_handle_t client
  */
 esp_err_t esp_mqtt5_client_set_publish_property(esp_mqtt5_client_handle_t client, const esp_mqtt5_publish_property_config_t *property);
 
+/**
+ * @brief Encode publish properties once, to be reused by many publishes
+ *
+ * The properties are copied, `property` may be freed afterwards.
+ * Response topic and topic alias depend on the connection and can't be part of a block.
+ *
+ * @param property          publish property
+ *
+ * @return the block handle, NULL if the properties are not supported or on memory failure
+ */
+esp_mqtt5_publish_property_block_handle_t esp_mqtt5_client_create_publish_property_block(const esp_mqtt5_publish_property_config_t *property);
+
+/**
+ * @brief Free a block created by `esp_mqtt5_client_create_publish_property_block`
+ *
+ * @param block             property block, it must not be set to any client
+ */
+void esp_mqtt5_client_delete_publish_property_block(esp_mqtt5_publish_property_block_handle_t block);
+
+/**
+ * @brief Set the precompiled properties of the following publishes
+ *
+ * Unlike `esp_mqtt5_client_set_publish_property`, the block stays set until it is replaced or cleared with NULL,
+ * and the encoded properties are copied into each message as they are.
+ * Properties set with `esp_mqtt5_client_set_publish_property` are added to those of the block, a property
+ * which may appear once in a message (payload format indicator, message expiry interval, correlation data,
+ * content type) is then taken from `esp_mqtt5_client_set_publish_property`.
+ *
+ * @param client            mqtt client handle
+ * @param block             property block, NULL to stop using it
+ *
+ * @return ESP_ERR_INVALID_ARG on wrong initialization
+ *         ESP_FAIL if the protocol version is not v5
+ *         ESP_OK on success
+ */
+esp_err_t esp_mqtt5_client_set_publish_property_block(esp_mqtt5_client_handle_t client, esp_mqtt5_publish_property_block_handle_t block);
+
+/**
+ * @brief Send a request and wait for its response asynchronously (CONFIG_MQTT_REQUEST_RESPONSE)
+ *
+ * The request is published with the response topic of the client (CONFIG_MQTT_REQUEST_TOPIC_PREFIX/<client id>)
+ * and a correlation data identifying the request.
+ * The response topic is subscribed with the first request and after each reconnection without a session.
+ * The callback is called with the response, or with ESP_ERR_TIMEOUT if it doesn't arrive within the timeout.
+ * Publish properties set with `esp_mqtt5_client_set_publish_property` are used for the request,
+ * except the response topic and correlation data.
+ *
+ * @param client            mqtt client handle
+ * @param topic             request topic
+ * @param data              request payload
+ * @param len               payload length, if set to 0, length is calculated from payload string
+ * @param qos               QoS of the request
+ * @param timeout_ms        time to wait for the response
+ * @param cb                callback completing the request
+ * @param ctx               context passed to the callback
+ *
+ * @return request_id (positive) of the request, passed to the callback
+ *         -1 on failure, the callback is not called
+ */
+int esp_mqtt5_client_request(esp_mqtt5_client_handle_t client, const char *topic, const char *data, int len, int qos,
+                             uint32_t timeout_ms, esp_mqtt5_response_cb_t cb, void *ctx);
+
 /**
  * @brief Set MQTT5 client subscribe property configuration
  *
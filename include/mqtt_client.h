@@ -28,6 +28,7 @@ typedef void *esp_event_handler_t;
 #endif
 
 typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+typedef struct esp_mqtt_fanout *esp_mqtt_fanout_handle_t;
 
 #define MQTT_OVER_TCP_SCHEME "mqtt"
 #define MQTT_OVER_SSL_SCHEME "mqtts"
@@ -118,7 +119,9 @@ typedef enum esp_mqtt_error_type_t {
     MQTT_ERROR_TYPE_NONE = 0,
     MQTT_ERROR_TYPE_TCP_TRANSPORT,
     MQTT_ERROR_TYPE_CONNECTION_REFUSED,
-    MQTT_ERROR_TYPE_SUBSCRIBE_FAILED
+    MQTT_ERROR_TYPE_SUBSCRIBE_FAILED,
+    MQTT_ERROR_TYPE_DECOMPRESSION_FAILED,   /*!< the compressed payload of the message `msg_id` is corrupted or truncated,
+                                                 its DATA events stopped at `current_data_offset`, short of `total_data_len` */
 } esp_mqtt_error_type_t;
 
 /**
@@ -148,6 +151,34 @@ typedef enum esp_mqtt_protocol_ver_t {
     MQTT_PROTOCOL_V_5,
 } esp_mqtt_protocol_ver_t;
 
+/**
+ *  Priority lane of an outbound message, queued messages are sent from the highest lane first
+ */
+typedef enum esp_mqtt_priority_t {
+    MQTT_PRIORITY_LOW = 0,      /*!< Bulk data, e.g. diagnostics dumps */
+    MQTT_PRIORITY_NORMAL,       /*!< Default priority */
+    MQTT_PRIORITY_HIGH,
+    MQTT_PRIORITY_URGENT,       /*!< Alarms */
+} esp_mqtt_priority_t;
+
+/**
+ * Token bucket limits of published messages (CONFIG_MQTT_RATE_LIMIT), a zero rate means unlimited
+ */
+typedef struct esp_mqtt_rate_limit {
+    uint32_t msgs_per_sec;  /*!< Sustained rate of messages */
+    uint32_t msg_burst;     /*!< Messages which can be sent at once after an idle period, defaults to `msgs_per_sec` */
+    uint32_t bytes_per_sec; /*!< Sustained rate of payload bytes */
+    uint32_t byte_burst;    /*!< Bytes which can be sent at once after an idle period, defaults to `bytes_per_sec` */
+} esp_mqtt_rate_limit_t;
+
+/**
+ * Rate limit of the messages published to topics matching a filter
+ */
+typedef struct esp_mqtt_topic_rate_limit {
+    const char *filter;             /*!< Topic filter, wildcards are allowed */
+    esp_mqtt_rate_limit_t limit;    /*!< Limits shared by all the matching topics */
+} esp_mqtt_topic_rate_limit_t;
+
 /**
  * @brief *MQTT* error code structure to be passed as a contextual information
  * into ERROR event
@@ -165,7 +196,8 @@ typedef enum esp_mqtt_protocol_ver_t {
  * esp_tls_cert_verify_flags, sock_errno | Error reported from
  * tcp_transport/esp-tls | | MQTT_ERROR_TYPE_CONNECTION_REFUSED |
  * connect_return_code | Internal error reported from *MQTT* broker on
- * connection |
+ * connection | | MQTT_ERROR_TYPE_DECOMPRESSION_FAILED | none, see msg_id and
+ * current_data_offset of the event | Received payload could not be decompressed |
  */
 typedef struct esp_mqtt_error_codes {
     /* compatible portion of the struct corresponding to struct esp_tls_last_error
@@ -224,6 +256,51 @@ typedef struct esp_mqtt_event_t {
 
 typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
 
+/**
+ * Storage backend of the offline message log (CONFIG_MQTT_OFFLINE_LOG)
+ *
+ * The log is split into numbered segments, each of them is only appended to and
+ * removed as a whole. Custom backends (e.g. raw flash partition, NVS blobs) implement
+ * these callbacks; if not provided, the client uses a stdio file backend.
+ */
+typedef struct esp_mqtt_offline_storage {
+    esp_err_t (*append)(void *ctx, uint32_t segment, const void *data, size_t len); /*!< Append data at the end of the segment, creating it if needed */
+    int (*read)(void *ctx, uint32_t segment, uint32_t offset, void *data, size_t len); /*!< Read up to len bytes at offset, returns number of bytes read, 0 at the end of segment, -1 if the segment doesn't exist */
+    esp_err_t (*remove)(void *ctx, uint32_t segment); /*!< Remove the segment */
+    esp_err_t (*write_checkpoint)(void *ctx, const void *data, size_t len); /*!< Atomically replace the checkpoint blob */
+    int (*read_checkpoint)(void *ctx, void *data, size_t len); /*!< Read the checkpoint blob, returns its length or -1 if not present */
+    void *ctx; /*!< Context passed to all the callbacks */
+} esp_mqtt_offline_storage_t;
+
+/**
+ * Storage backend of the persistent session snapshot (CONFIG_MQTT_SESSION_PERSISTENCE)
+ *
+ * The snapshot is a single versioned blob, `save` must replace the previous one atomically
+ * (e.g. one NVS blob, or a file written to a temporary name and renamed).
+ */
+typedef struct esp_mqtt_session_storage {
+    esp_err_t (*save)(void *ctx, const void *data, size_t len); /*!< Replace the stored snapshot */
+    int (*load)(void *ctx, void *data, size_t len); /*!< Read the snapshot, returns its length or -1 if there is none */
+    void *ctx; /*!< Context passed to the callbacks */
+} esp_mqtt_session_storage_t;
+
+/**
+ * Memory allocator of client-internal memory
+ *
+ * Blocks are requested with the alignment of `max_align_t`, their size and alignment are passed
+ * back when freed, so that e.g. a `std::pmr::memory_resource` can be used directly.
+ */
+typedef struct esp_mqtt_allocator {
+    void *(*alloc)(void *ctx, size_t size, size_t align); /*!< Allocate a block, returns NULL on failure */
+    void (*free)(void *ctx, void *ptr, size_t size, size_t align); /*!< Free a block, with the size and alignment it was allocated with */
+    void *ctx; /*!< Context passed to the hooks, must be valid during the client lifetime */
+} esp_mqtt_allocator_t;
+
+/**
+ * MQTT5 content type of payloads compressed by the client (CONFIG_MQTT_COMPRESSION)
+ */
+#define MQTT_COMPRESSION_CONTENT_TYPE "application/x-esp-mqtt-lz4"
+
 /**
  * *MQTT* client configuration structure
  *
@@ -338,6 +415,10 @@ typedef struct esp_mqtt_client_config_t {
                         keepalive feature, but uses a default keepalive period */
         esp_mqtt_protocol_ver_t protocol_ver; /*!< *MQTT* protocol version used for connection.*/
         int message_retransmit_timeout; /*!< timeout for retransmitting of failed packet */
+        const esp_mqtt_session_storage_t *storage; /*!< Storage of the session state, used only if CONFIG_MQTT_SESSION_PERSISTENCE
+                                                   is enabled and `disable_clean_session` is set. In-flight messages and
+                                                   subscriptions are restored at init and topics are resubscribed if the
+                                                   broker didn't keep the session. Callbacks are copied, `ctx` must be valid during the client lifetime */
     } session; /*!< *MQTT* session configuration. */
     /**
      * Network related configuration
@@ -370,6 +451,9 @@ typedef struct esp_mqtt_client_config_t {
         int size;     /*!< size of *MQTT* send/receive buffer*/
         int out_size; /*!< size of *MQTT* output buffer. If not defined, defaults to the size defined by
               ``buffer_size`` */
+        int max_size; /*!< size the input buffer may grow to for messages larger than ``size``, it shrinks
+              back once no such message arrived for a while. If not defined, the input buffer has a fixed
+              size: larger publish messages are delivered in chunks, other large messages close the connection */
     } buffer; /*!< Buffer size configuration.*/
 
     /**
@@ -377,7 +461,127 @@ typedef struct esp_mqtt_client_config_t {
      */
     struct outbox_config_t {
         uint64_t limit; /*!< Size limit for the outbox in bytes.*/
+        const char *const *coalesce_topics; /*!< NULL terminated list of topic filters of state topics, where only the latest value matters.
+                                                 A message enqueued on a matching topic replaces the not yet transmitted message on the same topic,
+                                                 keeping its place in the queue (and takes its slot in the QoS1 queue). Not copied, must be valid
+                                                 during the client lifetime */
     } outbox; /*!< Outbox configuration. */
+
+    /**
+     * Offline store-and-forward log configuration, used only if CONFIG_MQTT_OFFLINE_LOG is enabled.
+     *
+     * While disconnected (or while the log is being replayed) messages passed to `esp_mqtt_client_enqueue()`
+     * are appended to the log and replayed in order after reconnection. The log is disabled if neither
+     * `path` nor `storage` is set.
+     */
+    struct offline_log_t {
+        const char *path; /*!< Directory used by the default file backend, must exist */
+        const esp_mqtt_offline_storage_t *storage; /*!< Custom storage backend, takes precedence over `path`. Not copied, must be valid during the client lifetime */
+        size_t segment_size; /*!< Segment size in bytes, defaults to CONFIG_MQTT_OFFLINE_LOG_SEGMENT_SIZE */
+        int max_segments; /*!< Maximum number of segments, oldest messages are dropped when exceeded (0 = unlimited) */
+    } offline_log; /*!< Offline log configuration */
+
+    /**
+     * Payload compression configuration, used only if CONFIG_MQTT_COMPRESSION is enabled.
+     *
+     * Payloads published to matching topics are compressed if it makes them smaller. With MQTT5 they are tagged
+     * with the MQTT_COMPRESSION_CONTENT_TYPE content type (replacing the one set in publish properties).
+     * Received payloads with this content type (with MQTT 3.1.1, received on matching topics) are decompressed
+     * before posting MQTT_EVENT_DATA, large payloads are decompressed block by block while being received.
+     */
+    struct compression_t {
+        const char *const *topics; /*!< NULL terminated list of topic filters, wildcards are allowed. Not copied, must be valid during the client lifetime */
+        int min_size; /*!< Payloads shorter than this are sent as is, defaults to CONFIG_MQTT_COMPRESSION_MIN_SIZE */
+    } compression; /*!< Payload compression configuration */
+
+    /**
+     * Publish rate limiting, used only if CONFIG_MQTT_RATE_LIMIT is enabled.
+     *
+     * A message is sent when the client bucket and the buckets of all the filters matching its topic allow it,
+     * otherwise it's kept in the outbox (counted in its limit) and sent, in order, once the buckets refill.
+     * Retransmissions are not limited.
+     */
+    struct rate_limit_config_t {
+        esp_mqtt_rate_limit_t client; /*!< Limits of the whole client */
+        const esp_mqtt_topic_rate_limit_t *topics; /*!< Per topic filter limits, copied at init */
+        int topics_count; /*!< Number of entries in `topics` */
+    } rate_limit; /*!< Rate limiting configuration */
+
+    /**
+     * Telemetry batching, used only if CONFIG_MQTT_BATCHING is enabled. Applied at init only.
+     *
+     * Samples passed to `esp_mqtt_client_batch_publish()` are collected per topic and published as one message
+     * once the next sample doesn't fit in `max_size` bytes, once the batch holds `max_samples` samples or once
+     * its oldest sample waited for `max_latency_ms`. Subscribers split the message with `esp_mqtt_batch_next()`.
+     */
+    struct batch_config_t {
+        size_t max_size; /*!< Maximum size of a batch message, defaults to CONFIG_MQTT_BATCH_MAX_SIZE */
+        int max_samples; /*!< Number of samples publishing the batch, 0 = no limit */
+        uint32_t max_latency_ms; /*!< Latency budget of a sample, defaults to CONFIG_MQTT_BATCH_MAX_LATENCY_MS */
+        int max_topics; /*!< Number of topics batched at a time, the oldest batch is published to make room for another topic. Defaults to 4 */
+    } batch; /*!< Telemetry batching configuration */
+
+    /**
+     * Inbound flow control, used only if CONFIG_MQTT_INBOUND_FLOW_CONTROL is enabled. Applied at init only.
+     *
+     * Each received PUBLISH consumes one message and its payload length of credit. Once either credit is
+     * exhausted, the client stops reading from the transport (after the message being read) until the
+     * application grants more with `esp_mqtt_client_grant_credit()`. Keepalive and outbound messages go on
+     * in the meantime. With MQTT5 the Receive Maximum sent in CONNECT is lowered to `messages`.
+     */
+    struct inbound_config_t {
+        int messages; /*!< Initial message credit, 0 = not limited */
+        size_t bytes; /*!< Initial payload byte credit, 0 = not limited */
+    } inbound; /*!< Inbound flow control configuration */
+
+    /**
+     * Local loopback, used only if CONFIG_MQTT_LOCAL_LOOPBACK is enabled. Applied at init only.
+     *
+     * A message passed to `esp_mqtt_client_publish()` on a topic matching a subscription of the client acknowledged by the
+     * broker is posted as MQTT_EVENT_DATA right away, from the publishing task, and sent to the broker as usual. MQTT5
+     * subscriptions are then made with the No Local option, so that the broker doesn't send the message back (shared
+     * subscriptions are not looped back); with MQTT 3.1.1 the echo is dropped if it arrives within
+     * CONFIG_MQTT_LOOPBACK_DEDUP_WINDOW_MS. Local events have no message id, their QoS is the lower of the published and the granted one.
+     */
+    struct loopback_config_t {
+        bool enable; /*!< Enables the local delivery */
+        const char *const *local_topics; /*!< NULL terminated list of topic filters of messages delivered only locally, with or
+                                              without a subscription; they're never sent to the broker. Not copied, must be valid
+                                              during the client lifetime */
+    } loopback; /*!< Local loopback configuration */
+
+    /**
+     * Broker failover, used only if CONFIG_MQTT_BROKER_FAILOVER is enabled. Applied at init only.
+     *
+     * The client connects to one of the listed endpoints instead of `broker.address`, the other broker settings
+     * (verification, credentials) apply to all of them. Before each connection the best ranked endpoint is selected,
+     * by connect latency, ping round trip time and consecutive failures; endpoints not connected yet rank in the
+     * configured order. A failed endpoint, or one the connection was lost to, is retried after a delay doubling from
+     * `network.reconnect_timeout_ms` up to `max_backoff_ms`, randomized by half, while the next endpoint out of its
+     * delay is tried right away. `esp_mqtt_client_set_uri()` only lasts until the next connection.
+     */
+    struct failover_config_t {
+        const char *const *uris; /*!< NULL terminated list of broker URIs, copied at init */
+        int max_backoff_ms; /*!< Maximum reconnect delay of an endpoint, defaults to CONFIG_MQTT_FAILOVER_MAX_BACKOFF_MS */
+        int connect_timeout_ms; /*!< Timeout of the transport connection while another endpoint is ready, so that a dead
+                                     endpoint costs less than `network.timeout_ms`. 0 = `network.timeout_ms` */
+    } failover; /*!< Broker failover configuration */
+
+    /**
+     * Allocators of the client-internal memory, applied at init only. Allocators without hooks use the heap.
+     *
+     * Objects shared with the application (user property lists, precompiled publish properties) and the memory
+     * of the transport and event loop components are allocated from the heap. With `esp_mqtt_client_init_static()`
+     * the state carved from the memory region doesn't use the `state` allocator.
+     */
+    struct memory_config_t {
+        esp_mqtt_allocator_t state; /*!< Long-lived state: the client, its configuration, buffers, session, rate limits and
+                                         request tables. Must return internal memory if CONFIG_MQTT_EVENT_QUEUE_SIZE > 1 */
+        esp_mqtt_allocator_t message; /*!< Stored messages: outbox items, the QoS1 queue, offline log buffers and batches.
+                                           Without hooks, external memory is used if CONFIG_MQTT_OUTBOX_DATA_ON_EXTERNAL_MEMORY is set */
+        esp_mqtt_allocator_t transient; /*!< Per packet data: compression frames and tables, topics of chunked messages,
+                                             shared subscription topics */
+    } memory; /*!< Memory allocation configuration */
 } esp_mqtt_client_config_t;
 
 /**
@@ -388,6 +592,25 @@ typedef struct topic_t {
     int qos; /*!< Max QoS level of the subscription */
 } esp_mqtt_topic_t;
 
+/**
+ * Callback providing the payload of a streamed publish, see `esp_mqtt_client_publish_stream()`
+ *
+ * Fills `buf` with up to `len` next bytes of the payload and returns the number of bytes written,
+ * 0 or a negative value aborts the publish (and the connection, which is left with a partial message).
+ */
+typedef int (*esp_mqtt_publish_read_cb_t)(void *ctx, char *buf, int len);
+
+/**
+ * Application storage of complete received messages, see `esp_mqtt_client_set_data_storage()`
+ */
+typedef struct esp_mqtt_data_storage {
+    char *(*alloc)(void *ctx, const char *topic, int topic_len, int total_len); /*!< Returns a buffer of `total_len` bytes
+                                                                                     for the payload, NULL to receive the
+                                                                                     message in chunks as usual */
+    void (*release)(void *ctx, char *buf); /*!< Takes back a buffer which payload couldn't be received completely */
+    void *ctx; /*!< Context passed to the callbacks */
+} esp_mqtt_data_storage_t;
+
 /**
  * @brief Creates *MQTT* client handle based on the configuration
  *
@@ -398,6 +621,39 @@ typedef struct topic_t {
 esp_mqtt_client_handle_t
 esp_mqtt_client_init(const esp_mqtt_client_config_t *config);
 
+/**
+ * @brief Size of the memory region `esp_mqtt_client_init_static()` needs for the configuration
+ *
+ * @param config    *MQTT* configuration structure
+ *
+ * @return size in bytes
+ */
+size_t esp_mqtt_client_required_memory(const esp_mqtt_client_config_t *config);
+
+/**
+ * @brief Creates *MQTT* client handle in a memory region provided by the caller
+ *
+ * The client structure, its configuration storage, the input and output buffers, the API lock,
+ * the status event group and the MQTT5 storage are carved from `memory` instead of being allocated,
+ * so that the client doesn't fragment the heap. `buffer.max_size` doesn't apply, the input buffer
+ * keeps its configured size.
+ *
+ * Notes:
+ * - The configuration strings, the outbox messages and the objects of other components (transports,
+ * event loop) are still allocated from the heap.
+ * - The region has to stay valid until `esp_mqtt_client_destroy()`, which doesn't free it.
+ * - The buffer sizes are fixed at init, `esp_mqtt_set_config()` keeps them.
+ * - With CONFIG_MQTT_EVENT_QUEUE_SIZE > 1 the region has to be in internal memory.
+ *
+ * @param config    *MQTT* configuration structure
+ * @param memory    memory region
+ * @param size      size of the region, at least `esp_mqtt_client_required_memory(config)`
+ *
+ * @return mqtt_client_handle if successfully created, NULL on error
+ */
+esp_mqtt_client_handle_t
+esp_mqtt_client_init_static(const esp_mqtt_client_config_t *config, void *memory, size_t size);
+
 /**
  * @brief Sets *MQTT* connection URI. This API is usually used to overrides the
  * URI configured in esp_mqtt_client_init
@@ -570,6 +826,76 @@ int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client,
 int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
                             const char *data, int len, int qos, int retain);
 
+/**
+ * @brief Client to send a publish message with a payload streamed from a callback
+ *
+ * The publish header is sent first, then the payload is pulled from `read_cb` in chunks of
+ * the size of the output buffer and written to the network, so that payloads of any size (files
+ * in flash, data received from another socket) are published in constant memory.
+ *
+ * Notes:
+ * - The client has to be connected, the API blocks until the whole payload is written
+ * and holds the client lock meanwhile.
+ * - The payload is not kept by the client, messages with qos>0 are not retransmitted
+ * after reconnection. MQTT_EVENT_PUBLISHED is posted once acknowledged.
+ * - Compression, the offline log and the outbox don't apply, the rate limiter is charged
+ * after the message is sent. With MQTT5 the publish properties apply, the TTL set for the
+ * next publish is sent as message expiry interval.
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic string
+ * @param total_len length of the payload
+ * @param qos       QoS of publish message
+ * @param read_cb   callback providing the payload
+ * @param ctx       context passed to `read_cb`
+ *
+ * @return message_id of the publish message (for QoS 0 message_id will always
+ * be zero) on success. -1 on failure.
+ */
+int esp_mqtt_client_publish_stream(esp_mqtt_client_handle_t client, const char *topic, int total_len,
+                                   int qos, esp_mqtt_publish_read_cb_t read_cb, void *ctx);
+
+/**
+ * @brief Sets the storage of complete messages received on a topic filter
+ *
+ * The payload of messages matching `filter` is read into a buffer returned by `storage->alloc`
+ * and delivered in a single MQTT_EVENT_DATA (`data_len == total_data_len`), whatever the size
+ * of the input buffer. The buffer then belongs to the application, which frees it once the event
+ * is handled. The first matching filter applies. Compressed payloads and MQTT5 responses of
+ * requests are delivered as usual.
+ *
+ * Requires CONFIG_MQTT_REASSEMBLY.
+ *
+ * @param client    *MQTT* client handle
+ * @param filter    topic filter, the subscription is made separately
+ * @param storage   storage callbacks (copied), NULL to remove the filter
+ *
+ * @return ESP_OK on success
+ *         ESP_ERR_INVALID_ARG on wrong arguments
+ *         ESP_ERR_NOT_FOUND if the filter to remove isn't set
+ *         ESP_ERR_NO_MEM if memory allocation fails
+ *         ESP_ERR_NOT_SUPPORTED if CONFIG_MQTT_REASSEMBLY is not enabled
+ */
+esp_err_t esp_mqtt_client_set_data_storage(esp_mqtt_client_handle_t client, const char *filter,
+        const esp_mqtt_data_storage_t *storage);
+
+/**
+ * @brief Grants receive credit to the client, see `inbound` in the client configuration
+ *
+ * Typically called once the application has consumed received messages. Credit is only counted
+ * for the limits set in the configuration, a client paused on exhausted credit resumes reading.
+ *
+ * @param client    *MQTT* client handle
+ * @param messages  number of messages to add
+ * @param bytes     number of payload bytes to add
+ *
+ * @return ESP_OK on success
+ *         ESP_ERR_INVALID_ARG on wrong arguments
+ *         ESP_ERR_INVALID_STATE if the client is configured without receive credit
+ *         ESP_ERR_NOT_SUPPORTED if CONFIG_MQTT_INBOUND_FLOW_CONTROL is not enabled
+ */
+esp_err_t esp_mqtt_client_grant_credit(esp_mqtt_client_handle_t client, int messages, size_t bytes);
+
 /**
  * @brief Enqueue a message to the outbox, to be sent later. Typically used for
  * messages with qos>0, but could be also used for qos=0 messages if store=true.
@@ -580,6 +906,10 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
  * immediately in the user task's context). Thus, it could be used as a non
  * blocking version of esp_mqtt_client_publish().
  *
+ * If the offline log is configured (CONFIG_MQTT_OFFLINE_LOG), messages enqueued while the client
+ * is disconnected (or while the log is still being replayed) are appended to the log instead
+ * of the outbox and 0 is returned, the message id is assigned when the message is replayed.
+ *
  * @param client    *MQTT* client handle
  * @param topic     topic string
  * @param data      payload string (set to NULL, sending empty payload message)
@@ -596,6 +926,143 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client, const char *topic,
                             const char *data, int len, int qos, int retain,
                             bool store);
 
+/**
+ * @brief Adds a sample to the batch of a topic (CONFIG_MQTT_BATCHING)
+ *
+ * The batch is published with `esp_mqtt_client_publish()` once a threshold of the batch configuration
+ * is reached. The message is published with the highest QoS of its samples, a sample with a different
+ * retain flag publishes the pending batch first. While the client is disconnected, the latency budget
+ * is not enforced; a batch filled meanwhile is handled like any other publish (QoS0 messages are lost).
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic string
+ * @param data      sample
+ * @param len       sample length, if set to 0, length is calculated from the sample string
+ * @param qos       QoS the sample requires
+ * @param retain    retain flag
+ *
+ * @return ESP_OK if the sample was added
+ *         ESP_ERR_INVALID_SIZE if the sample can't fit in a batch
+ *         ESP_FAIL if a batch had to be published and it failed, its samples are dropped
+ *         ESP_ERR_NOT_SUPPORTED if batching is disabled
+ */
+esp_err_t esp_mqtt_client_batch_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len,
+                                        int qos, int retain);
+
+/**
+ * @brief Publishes the pending batch of a topic right away
+ *
+ * @param client    *MQTT* client handle
+ * @param topic     topic string, NULL to publish all pending batches
+ *
+ * @return ESP_OK on success, ESP_FAIL if a publish failed, ESP_ERR_NOT_SUPPORTED if batching is disabled
+ */
+esp_err_t esp_mqtt_client_batch_flush(esp_mqtt_client_handle_t client, const char *topic);
+
+/**
+ * @brief Iterates over the samples of a received batch message (CONFIG_MQTT_BATCHING)
+ *
+ * The whole payload is needed, see `esp_mqtt_client_set_data_storage()` for messages larger than the input buffer.
+ *
+ * @param data          payload of the batch message
+ * @param data_len      payload length
+ * @param offset        position of the next sample, to be set to 0 before the first call
+ * @param sample        receives the sample, pointing into `data`
+ * @param sample_len    receives the sample length
+ *
+ * @return ESP_OK if a sample was read
+ *         ESP_ERR_NOT_FOUND past the last sample
+ *         ESP_ERR_INVALID_RESPONSE if the payload isn't a valid batch message
+ *         ESP_ERR_NOT_SUPPORTED if batching is disabled
+ */
+esp_err_t esp_mqtt_batch_next(const char *data, int data_len, int *offset, const char **sample, int *sample_len);
+
+/**
+ * @brief Creates a group of clients for fan-out publishing with `esp_mqtt_fanout_publish()`
+ *
+ * The clients are typically connected to different brokers. The group only refers to them,
+ * it must be destroyed before any of its clients.
+ *
+ * @param clients   array of *MQTT* client handles, copied by the group
+ * @param count     number of clients
+ *
+ * @return group handle, NULL on failure
+ */
+esp_mqtt_fanout_handle_t esp_mqtt_fanout_create(const esp_mqtt_client_handle_t *clients, int count);
+
+/**
+ * @brief Destroys a fan-out group, the messages already queued by its clients are still sent
+ *
+ * @param group     fan-out group handle
+ */
+void esp_mqtt_fanout_destroy(esp_mqtt_fanout_handle_t group);
+
+/**
+ * @brief Publishes a message to every client of the group
+ *
+ * The payload is copied once into a reference counted buffer shared by the outboxes
+ * of all the clients, it's released when the last client no longer needs it (QoS0 sent,
+ * QoS>0 acknowledged). The publish header is encoded once per protocol version and QoS,
+ * each client only patches its own packet id. Connected clients send the message right away,
+ * QoS>0 messages of the other clients are sent after reconnection by their task.
+ *
+ * Notes:
+ * - The per-message settings (publish TTL, priority, MQTT5 publish properties) are not used,
+ *   neither are the payload compression and the offline log
+ * - With MQTT5 the QoS is reduced to the maximum QoS of each broker
+ * - As with `esp_mqtt_client_publish()`, QoS1 messages a client may send now are written at once
+ *   and tracked in the QoS1 queue of that client, the outbox only keeps the ones held back
+ *
+ * @param group     fan-out group handle
+ * @param topic     topic string
+ * @param data      payload string (set to NULL, sending empty payload message)
+ * @param len       data length, if set to 0, length is calculated from payload string
+ * @param qos       QoS of publish message
+ * @param retain    retain flag
+ * @param msg_ids   optional array with one item per client of the group, receives the message id
+ *                  of each client (0 for QoS0 messages), -1 if the client didn't accept the message
+ *
+ * @return number of clients which accepted the message, -1 on failure
+ */
+int esp_mqtt_fanout_publish(esp_mqtt_fanout_handle_t group, const char *topic, const char *data, int len,
+                            int qos, int retain, int *msg_ids);
+
+/**
+ * @brief Sets the time to live of the next message published with `esp_mqtt_client_publish()`
+ * or `esp_mqtt_client_enqueue()`
+ *
+ * This API is a one-time configuration, it applies to the next publish only. Messages waiting
+ * in the outbox (or tracked in the QoS1 queue) are dropped once expired instead of being sent
+ * after reconnection. With MQTT5 the TTL is sent as message expiry interval (unless set in the
+ * publish properties), the interval is reduced by the time spent queued when the message is resent.
+ * An expiry interval set in the MQTT5 publish properties is enforced the same way without calling this API.
+ *
+ * @param client    *MQTT* client handle
+ * @param ttl_ms    time to live in milliseconds, 0 to disable
+ *
+ * @return ESP_ERR_INVALID_ARG on wrong initialization
+ *         ESP_OK on success
+ */
+esp_err_t esp_mqtt_client_set_publish_ttl(esp_mqtt_client_handle_t client, uint32_t ttl_ms);
+
+/**
+ * @brief Sets the priority lane of the next message enqueued with `esp_mqtt_client_enqueue()`
+ *
+ * This API is a one-time configuration, it applies to the next publish only (MQTT_PRIORITY_NORMAL
+ * is used otherwise). The mqtt task sends queued messages from the highest lane first, one message
+ * at a time, so a large low priority message delays an alarm by at most its own transmit time.
+ * A message gains one level per CONFIG_MQTT_PRIORITY_AGING_MS spent in the outbox, so that lower
+ * lanes are not starved. Messages sent directly by `esp_mqtt_client_publish()` are not queued and
+ * ignore the priority.
+ *
+ * @param client    *MQTT* client handle
+ * @param priority  priority lane
+ *
+ * @return ESP_ERR_INVALID_ARG on wrong initialization or priority
+ *         ESP_OK on success
+ */
+esp_err_t esp_mqtt_client_set_publish_priority(esp_mqtt_client_handle_t client, esp_mqtt_priority_t priority);
+
 /**
  * @brief Destroys the client handle
  *
@@ -666,6 +1133,20 @@ esp_err_t esp_mqtt_client_unregister_event(esp_mqtt_client_handle_t client, esp_
  */
 int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client);
 
+/**
+ * @brief Stores the session snapshot immediately
+ *
+ * The client saves the snapshot periodically (CONFIG_MQTT_SESSION_SAVE_INTERVAL_MS) and when stopped,
+ * this allows to store it before a planned restart or deep sleep.
+ *
+ * @param client            *MQTT* client handle
+ * @return ESP_OK on success
+ *         ESP_ERR_INVALID_ARG on wrong initialization
+ *         ESP_ERR_NOT_SUPPORTED if the session persistence is disabled or not configured
+ *         error of the storage callback otherwise
+ */
+esp_err_t esp_mqtt_client_save_session(esp_mqtt_client_handle_t client);
+
 /**
  * @brief Dispatch user event to the mqtt internal event loop
  *
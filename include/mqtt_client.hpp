@@ -0,0 +1,261 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_CLIENT_HPP_
+#define _MQTT_CLIENT_HPP_
+
+/*
+ * Header-only C++20 facade of the MQTT client.
+ *
+ * - `esp_mqtt::client` owns the client handle (move-only), it doesn't throw: check it with
+ *   `operator bool` after construction, the other operations return the values of the C API.
+ * - Payloads are passed as `std::span<const std::byte>` (or `std::string_view`) and topics as
+ *   `esp_mqtt::topic_view`, none of them is copied by the facade.
+ * - Handlers are any callables, called from the event handler instantiated for their own type,
+ *   so the call is direct (and usually inlined) instead of going through a void* handler.
+ */
+
+#include <cstddef>
+#include <new>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "mqtt_client.h"
+
+namespace esp_mqtt {
+
+/**
+ * Non-owning view of a NUL terminated topic, as required by the C API, so that it's never copied.
+ * Constructed from string literals, C strings and std::string.
+ */
+class topic_view {
+public:
+    constexpr topic_view(const char *topic) noexcept : str{topic} {}
+    topic_view(const std::string &topic) noexcept : str{topic.c_str()} {}
+    // would need a copy to be NUL terminated
+    topic_view(std::string_view) = delete;
+
+    [[nodiscard]] constexpr const char *c_str() const noexcept
+    {
+        return str;
+    }
+    [[nodiscard]] std::string_view view() const noexcept
+    {
+        return str;
+    }
+private:
+    const char *str;
+};
+
+/**
+ * Message received in MQTT_EVENT_DATA
+ *
+ * The views point into the input buffer of the client (or the application buffer of
+ * `esp_mqtt_client_set_data_storage()`) and are valid only during the handler call.
+ * Messages larger than the input buffer are received in several parts, the topic
+ * is set in the first one only.
+ */
+struct message_view {
+    std::string_view topic;
+    std::span<const std::byte> data;
+    std::size_t offset;         /*!< offset of `data` in the message */
+    std::size_t total_len;      /*!< length of the whole message */
+    int msg_id;
+    int qos;
+    bool retain;
+    bool dup;
+
+    [[nodiscard]] static message_view from(const esp_mqtt_event_t &event) noexcept
+    {
+        return {
+            .topic = event.topic ? std::string_view(event.topic, event.topic_len) : std::string_view{},
+            .data = event.data ? std::as_bytes(std::span(event.data, event.data_len)) : std::span<const std::byte> {},
+            .offset = static_cast<std::size_t>(event.current_data_offset),
+            .total_len = static_cast<std::size_t>(event.total_data_len),
+            .msg_id = event.msg_id,
+            .qos = event.qos,
+            .retain = event.retain,
+            .dup = event.dup,
+        };
+    }
+    [[nodiscard]] bool is_first() const noexcept
+    {
+        return offset == 0;
+    }
+    [[nodiscard]] bool is_complete() const noexcept
+    {
+        return offset + data.size() == total_len;
+    }
+    [[nodiscard]] std::string_view text() const noexcept
+    {
+        return {reinterpret_cast<const char *>(data.data()), data.size()};
+    }
+};
+
+class client {
+public:
+    explicit client(const esp_mqtt_client_config_t &config) noexcept : handle{esp_mqtt_client_init(&config)} {}
+    ~client()
+    {
+        reset();
+    }
+    client(const client &) = delete;
+    client &operator=(const client &) = delete;
+    client(client &&other) noexcept : handle{std::exchange(other.handle, nullptr)}, handlers{std::move(other.handlers)} {}
+    client &operator=(client &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            handle = std::exchange(other.handle, nullptr);
+            handlers = std::move(other.handlers);
+        }
+        return *this;
+    }
+
+    [[nodiscard]] explicit operator bool() const noexcept
+    {
+        return handle != nullptr;
+    }
+    [[nodiscard]] esp_mqtt_client_handle_t get() const noexcept
+    {
+        return handle;
+    }
+
+    esp_err_t start() noexcept
+    {
+        return esp_mqtt_client_start(handle);
+    }
+    esp_err_t stop() noexcept
+    {
+        return esp_mqtt_client_stop(handle);
+    }
+    esp_err_t reconnect() noexcept
+    {
+        return esp_mqtt_client_reconnect(handle);
+    }
+    esp_err_t disconnect() noexcept
+    {
+        return esp_mqtt_client_disconnect(handle);
+    }
+
+    /**
+     * @brief See `esp_mqtt_client_publish()`, returns the message id or a negative value on failure
+     */
+    int publish(topic_view topic, std::span<const std::byte> data, int qos = 0, bool retain = false) noexcept
+    {
+        // an empty payload must not be passed with a pointer, the C API would take its string length
+        return esp_mqtt_client_publish(handle, topic.c_str(), payload(data), static_cast<int>(data.size()), qos, retain);
+    }
+    int publish(topic_view topic, std::string_view data, int qos = 0, bool retain = false) noexcept
+    {
+        return publish(topic, std::as_bytes(std::span(data)), qos, retain);
+    }
+
+    /**
+     * @brief See `esp_mqtt_client_enqueue()`
+     */
+    int enqueue(topic_view topic, std::span<const std::byte> data, int qos = 0, bool retain = false, bool store = false) noexcept
+    {
+        return esp_mqtt_client_enqueue(handle, topic.c_str(), payload(data), static_cast<int>(data.size()), qos, retain, store);
+    }
+    int enqueue(topic_view topic, std::string_view data, int qos = 0, bool retain = false, bool store = false) noexcept
+    {
+        return enqueue(topic, std::as_bytes(std::span(data)), qos, retain, store);
+    }
+
+    int subscribe(topic_view filter, int qos = 0) noexcept
+    {
+        return esp_mqtt_client_subscribe_single(handle, filter.c_str(), qos);
+    }
+    int unsubscribe(topic_view filter) noexcept
+    {
+        return esp_mqtt_client_unsubscribe(handle, filter.c_str());
+    }
+
+    /**
+     * @brief Calls `handler(const esp_mqtt_event_t &)` for the event (MQTT_EVENT_ANY for all)
+     *
+     * The handler is moved into the client and lives as long as the client.
+     */
+    template <typename Handler>
+    esp_err_t on_event(esp_mqtt_event_id_t event, Handler &&handler)
+    {
+        return add_handler(event, std::forward<Handler>(handler));
+    }
+
+    /**
+     * @brief Calls `handler(const message_view &)` for each MQTT_EVENT_DATA
+     */
+    template <typename Handler>
+    esp_err_t on_data(Handler &&handler)
+    {
+        return add_handler(MQTT_EVENT_DATA, [h = std::forward<Handler>(handler)](const esp_mqtt_event_t &event) mutable {
+            h(message_view::from(event));
+        });
+    }
+
+private:
+    struct registration {
+        void *handler;
+        void (*destroy)(void *handler);
+    };
+
+    static const char *payload(std::span<const std::byte> data) noexcept
+    {
+        return data.empty() ? nullptr : reinterpret_cast<const char *>(data.data());
+    }
+
+    template <typename Handler>
+    static void dispatch(void *handler, esp_event_base_t, int32_t, void *event_data)
+    {
+        (*static_cast<Handler *>(handler))(*static_cast<const esp_mqtt_event_t *>(event_data));
+    }
+
+    template <typename Handler>
+    esp_err_t add_handler(esp_mqtt_event_id_t event, Handler &&handler)
+    {
+        using handler_t = std::remove_cvref_t<Handler>;
+        if (handle == nullptr) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        auto *stored = new (std::nothrow) handler_t(std::forward<Handler>(handler));
+        if (stored == nullptr) {
+            return ESP_ERR_NO_MEM;
+        }
+        auto destroy = [](void *h) {
+            delete static_cast<handler_t *>(h);
+        };
+        esp_err_t err = esp_mqtt_client_register_event(handle, event, dispatch<handler_t>, stored);
+        if (err != ESP_OK) {
+            destroy(stored);
+            return err;
+        }
+        handlers.push_back({stored, destroy});
+        return ESP_OK;
+    }
+
+    void reset() noexcept
+    {
+        if (handle) {
+            // the event loop of the client goes away with it, no handler is called afterwards
+            esp_mqtt_client_destroy(std::exchange(handle, nullptr));
+        }
+        for (auto &h : handlers) {
+            h.destroy(h.handler);
+        }
+        handlers.clear();
+    }
+
+    esp_mqtt_client_handle_t handle;
+    std::vector<registration> handlers;
+};
+
+}  // namespace esp_mqtt
+
+#endif
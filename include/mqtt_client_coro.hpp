@@ -0,0 +1,501 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_CLIENT_CORO_HPP_
+#define _MQTT_CLIENT_CORO_HPP_
+
+/*
+ * C++20 coroutine awaitables of the MQTT client, on top of the facade of mqtt_client.hpp.
+ *
+ * - `co_await client.publish(...)` completes on PUBACK (QoS1) or PUBCOMP (QoS2), right away for QoS0,
+ *   `co_await client.subscribe(...)` and `co_await client.unsubscribe(...)` on SUBACK and UNSUBACK.
+ * - The operation is issued when it's awaited, the awaiting coroutine is resumed directly
+ *   by the *MQTT* task from the event handler, through a table of continuations indexed by
+ *   the message id, so any number of operations may be pending without a task per operation.
+ * - As in event handlers, a resumed coroutine may use the client but must not destroy it.
+ * - An operation is completed only if its acknowledgement (or its deletion from the outbox,
+ *   with MQTT_REPORT_DELETED_MESSAGES) is received, stopping the client doesn't resume its awaiters.
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <span>
+#include <string_view>
+#include <utility>
+#include "mqtt_client.hpp"
+
+namespace esp_mqtt {
+
+/**
+ * Result of an acknowledged operation
+ */
+struct ack {
+    int msg_id;                 /*!< message id of the operation, negative if it couldn't be sent */
+    esp_err_t err;              /*!< ESP_OK if acknowledged (or sent, for QoS0 publish),
+                                     ESP_FAIL if not sent, ESP_ERR_INVALID_RESPONSE if refused by the broker,
+                                     ESP_ERR_TIMEOUT if deleted from the outbox before acknowledged,
+                                     ESP_ERR_NO_MEM if the continuation couldn't be stored */
+    int granted_qos;            /*!< subscribe: QoS granted by the broker (its first return code) */
+
+    [[nodiscard]] explicit operator bool() const noexcept
+    {
+        return err == ESP_OK;
+    }
+};
+
+/**
+ * Return type of fire-and-forget coroutines, the coroutine runs until its first suspension
+ * when called and its frame is freed when it completes.
+ */
+struct detached {
+    struct promise_type {
+        detached get_return_object() noexcept
+        {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+    };
+};
+
+namespace detail {
+
+/**
+ * Continuations of the pending operations, indexed by message id
+ *
+ * Open addressing with linear probing: message ids are mostly consecutive, so they
+ * rarely collide in the power of two table. The acknowledgement may be processed
+ * by the *MQTT* task before the continuation of its operation is stored, such an early
+ * completion is kept until the operation is awaited, as long as some operation is being issued.
+ */
+class pending_table {
+public:
+    pending_table() = default;
+    pending_table(const pending_table &) = delete;
+    pending_table &operator=(const pending_table &) = delete;
+
+    /**
+     * @brief Brackets the issue of an operation, until its continuation is stored
+     */
+    void begin() noexcept
+    {
+        std::lock_guard lock{mutex};
+        ++issuing;
+    }
+    void end() noexcept
+    {
+        std::lock_guard lock{mutex};
+        if (--issuing == 0 && early > 0) {
+            // the other completions belong to operations nobody awaits
+            drop_early();
+        }
+    }
+
+    /**
+     * @brief Stores the continuation of the operation
+     *
+     * @return false if the operation is complete already, `*result` is set then
+     */
+    bool wait(int msg_id, std::coroutine_handle<> waiter, ack *result) noexcept
+    {
+        std::lock_guard lock{mutex};
+        if (slot *s = find(msg_id); s != nullptr) {
+            *result = s->early;
+            erase(s - slots.get());
+            --early;
+            return false;
+        }
+        slot *s = insert(msg_id);
+        if (s == nullptr) {
+            *result = {msg_id, ESP_ERR_NO_MEM, 0};
+            return false;
+        }
+        s->waiter = waiter;
+        s->result = result;
+        return true;
+    }
+
+    /**
+     * @brief Completes the operation
+     *
+     * @return continuation to resume (by the caller, without any lock), null if none
+     */
+    std::coroutine_handle<> complete(int msg_id, const ack &result) noexcept
+    {
+        std::lock_guard lock{mutex};
+        if (slot *s = find(msg_id); s != nullptr) {
+            if (!s->waiter) {
+                return nullptr;
+            }
+            auto waiter = s->waiter;
+            *s->result = result;
+            erase(s - slots.get());
+            return waiter;
+        }
+        if (issuing > 0 && msg_id > 0) {
+            if (slot *s = insert(msg_id); s != nullptr) {
+                s->early = result;
+                ++early;
+            }
+        }
+        return nullptr;
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        std::lock_guard lock{mutex};
+        return count;
+    }
+
+private:
+    struct slot {
+        int msg_id;                         // 0 if free
+        std::coroutine_handle<> waiter;     // null for early completions
+        ack *result;
+        ack early;
+    };
+
+    [[nodiscard]] std::size_t home(int msg_id) const noexcept
+    {
+        return static_cast<std::size_t>(msg_id) & (capacity - 1);
+    }
+
+    slot *find(int msg_id) noexcept
+    {
+        if (count == 0) {
+            return nullptr;
+        }
+        for (std::size_t i = home(msg_id);; i = (i + 1) & (capacity - 1)) {
+            if (slots[i].msg_id == msg_id) {
+                return &slots[i];
+            }
+            if (slots[i].msg_id == 0) {
+                return nullptr;
+            }
+        }
+    }
+
+    slot *insert(int msg_id) noexcept
+    {
+        // load factor kept under 1/2
+        if (2 * (count + 1) > capacity && !rehash(capacity ? 2 * capacity : 16, false)) {
+            return nullptr;
+        }
+        std::size_t i = home(msg_id);
+        while (slots[i].msg_id != 0) {
+            i = (i + 1) & (capacity - 1);
+        }
+        slots[i] = {msg_id, nullptr, nullptr, {}};
+        ++count;
+        return &slots[i];
+    }
+
+    void erase(std::size_t i) noexcept
+    {
+        // backward shift, so that lookups never need tombstones
+        const std::size_t mask = capacity - 1;
+        for (std::size_t j = (i + 1) & mask; slots[j].msg_id != 0; j = (j + 1) & mask) {
+            std::size_t h = home(slots[j].msg_id);
+            if (((j - h) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = {};
+        --count;
+    }
+
+    bool rehash(std::size_t new_capacity, bool skip_early) noexcept
+    {
+        std::unique_ptr<slot[]> old{new (std::nothrow) slot[new_capacity]()};
+        if (!old) {
+            return false;
+        }
+        std::swap(old, slots);
+        std::size_t old_capacity = std::exchange(capacity, new_capacity);
+        count = 0;
+        for (std::size_t i = 0; i < old_capacity; ++i) {
+            if (old[i].msg_id == 0 || (skip_early && !old[i].waiter)) {
+                continue;
+            }
+            std::size_t j = home(old[i].msg_id);
+            while (slots[j].msg_id != 0) {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = old[i];
+            ++count;
+        }
+        return true;
+    }
+
+    void drop_early() noexcept
+    {
+        if (rehash(capacity, true)) {
+            early = 0;
+        }
+    }
+
+    mutable std::mutex mutex;
+    std::unique_ptr<slot[]> slots;
+    std::size_t capacity = 0;
+    std::size_t count = 0;
+    std::size_t early = 0;
+    int issuing = 0;
+};
+
+/**
+ * @brief Completes the operation acknowledged by the event, resuming its awaiter
+ */
+inline void complete(pending_table &table, const esp_mqtt_event_t &event) noexcept
+{
+    ack result = {event.msg_id, ESP_OK, 0};
+    switch (event.event_id) {
+    case MQTT_EVENT_PUBLISHED:
+    case MQTT_EVENT_UNSUBSCRIBED:
+        break;
+    case MQTT_EVENT_SUBSCRIBED:
+        if (event.data && event.data_len > 0) {
+            result.granted_qos = static_cast<uint8_t>(event.data[0]);
+            if (result.granted_qos >= 0x80) {
+                result.err = ESP_ERR_INVALID_RESPONSE;
+            }
+        }
+        break;
+    case MQTT_EVENT_DELETED:
+        result.err = ESP_ERR_TIMEOUT;
+        break;
+    default:
+        return;
+    }
+    if (auto waiter = table.complete(event.msg_id, result)) {
+        waiter.resume();
+    }
+}
+
+/**
+ * Awaitable of an operation acknowledged by the broker, `issue()` sends it and returns its message id
+ */
+template <typename Issue>
+class ack_awaitable {
+public:
+    ack_awaitable(pending_table &table, Issue issue, bool acknowledged) noexcept
+        : table{table}, issue{std::move(issue)}, acknowledged{acknowledged} {}
+
+    bool await_ready() noexcept
+    {
+        table.begin();
+        result.msg_id = issue();
+        if (result.msg_id >= 0 && acknowledged) {
+            return false;
+        }
+        result.err = result.msg_id < 0 ? ESP_FAIL : ESP_OK;
+        table.end();
+        return true;
+    }
+
+    bool await_suspend(std::coroutine_handle<> waiter) noexcept
+    {
+        // the coroutine may be resumed (and this awaitable gone) as soon as it's stored
+        pending_table &pending = table;
+        bool suspended = pending.wait(result.msg_id, waiter, &result);
+        pending.end();
+        return suspended;
+    }
+
+    ack await_resume() const noexcept
+    {
+        return result;
+    }
+
+private:
+    pending_table &table;
+    Issue issue;
+    bool acknowledged;
+    ack result = {-1, ESP_FAIL, 0};
+};
+
+}  // namespace detail
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+/**
+ * Response of `async_client::request()`, with the chunks of a large response put together
+ */
+struct response {
+    esp_err_t status;                   /*!< see esp_mqtt5_response_t, ESP_FAIL if the request couldn't be sent,
+                                             ESP_ERR_NO_MEM if the response couldn't be stored */
+    std::unique_ptr<char[]> data;
+    std::size_t len;
+
+    [[nodiscard]] std::string_view text() const noexcept
+    {
+        return {data.get(), len};
+    }
+};
+#endif
+
+/**
+ * Client with awaitable operations
+ *
+ * Only move constructible, since the event handler refers to its table of continuations.
+ */
+class async_client {
+public:
+    explicit async_client(const esp_mqtt_client_config_t &config) noexcept
+        : pending{new (std::nothrow) detail::pending_table}, mqtt{config}
+    {
+        ready = pending && mqtt && mqtt.on_event(MQTT_EVENT_ANY, [table = pending.get()](const esp_mqtt_event_t &event) {
+            detail::complete(*table, event);
+        }) == ESP_OK;
+    }
+    async_client(async_client &&other) noexcept = default;
+    async_client &operator=(async_client &&) = delete;
+
+    [[nodiscard]] explicit operator bool() const noexcept
+    {
+        return ready;
+    }
+
+    /**
+     * @brief Facade of the client, to start it, register handlers or send operations nobody awaits
+     */
+    [[nodiscard]] client &sync() noexcept
+    {
+        return mqtt;
+    }
+
+    /**
+     * @brief Awaitable publish, the payload is copied when it's awaited
+     */
+    [[nodiscard]] auto publish(topic_view topic, std::span<const std::byte> data, int qos = 1, bool retain = false) noexcept
+    {
+        return detail::ack_awaitable(*pending, [c = &mqtt, topic, data, qos, retain]() noexcept {
+            return c->publish(topic, data, qos, retain);
+        }, qos > 0);
+    }
+    [[nodiscard]] auto publish(topic_view topic, std::string_view data, int qos = 1, bool retain = false) noexcept
+    {
+        return publish(topic, std::as_bytes(std::span(data)), qos, retain);
+    }
+
+    [[nodiscard]] auto subscribe(topic_view filter, int qos = 0) noexcept
+    {
+        return detail::ack_awaitable(*pending, [c = &mqtt, filter, qos]() noexcept {
+            return c->subscribe(filter, qos);
+        }, true);
+    }
+
+    [[nodiscard]] auto unsubscribe(topic_view filter) noexcept
+    {
+        return detail::ack_awaitable(*pending, [c = &mqtt, filter]() noexcept {
+            return c->unsubscribe(filter);
+        }, true);
+    }
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    class request_awaitable {
+    public:
+        request_awaitable(esp_mqtt_client_handle_t handle, topic_view topic, std::span<const std::byte> data, int qos,
+                          uint32_t timeout_ms) noexcept
+            : handle{handle}, topic{topic}, data{data}, qos{qos}, timeout_ms{timeout_ms} {}
+
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> waiter) noexcept
+        {
+            this->waiter = waiter;
+            const char *payload = data.empty() ? nullptr : reinterpret_cast<const char *>(data.data());
+            if (esp_mqtt5_client_request(handle, topic.c_str(), payload, static_cast<int>(data.size()), qos, timeout_ms,
+                                         on_response, this) < 0) {
+                result.status = ESP_FAIL;
+                return false;
+            }
+            // the response may be received already, this awaitable mustn't be used anymore
+            return true;
+        }
+
+        response await_resume() noexcept
+        {
+            return std::move(result);
+        }
+
+    private:
+        static void on_response(esp_mqtt5_client_handle_t, const esp_mqtt5_response_t *r, void *ctx)
+        {
+            auto *self = static_cast<request_awaitable *>(ctx);
+            response &result = self->result;
+            result.status = r->status;
+            if (r->status == ESP_OK) {
+                if (r->current_data_offset == 0 && r->total_data_len > 0) {
+                    result.data.reset(new (std::nothrow) char[r->total_data_len]);
+                    result.len = 0;
+                }
+                if (r->total_data_len > 0 && !result.data) {
+                    result.status = ESP_ERR_NO_MEM;
+                } else if (r->data_len > 0) {
+                    std::memcpy(result.data.get() + r->current_data_offset, r->data, r->data_len);
+                    result.len = r->current_data_offset + r->data_len;
+                }
+                if (r->current_data_offset + r->data_len < r->total_data_len) {
+                    // the last chunk completes the request, whatever the status of the previous ones
+                    return;
+                }
+            }
+            self->waiter.resume();
+        }
+
+        esp_mqtt_client_handle_t handle;
+        topic_view topic;
+        std::span<const std::byte> data;
+        int qos;
+        uint32_t timeout_ms;
+        std::coroutine_handle<> waiter;
+        response result = {ESP_FAIL, nullptr, 0};
+    };
+
+    /**
+     * @brief Awaitable MQTT5 request (CONFIG_MQTT_REQUEST_RESPONSE), see `esp_mqtt5_client_request()`
+     */
+    [[nodiscard]] request_awaitable request(topic_view topic, std::span<const std::byte> data, int qos = 1,
+                                            uint32_t timeout_ms = 5000) noexcept
+    {
+        return {mqtt.get(), topic, data, qos, timeout_ms};
+    }
+    [[nodiscard]] request_awaitable request(topic_view topic, std::string_view data, int qos = 1,
+                                            uint32_t timeout_ms = 5000) noexcept
+    {
+        return request(topic, std::as_bytes(std::span(data)), qos, timeout_ms);
+    }
+#endif
+
+private:
+    // declared first, so that the client and its handler are destroyed before the table
+    std::unique_ptr<detail::pending_table> pending;
+    client mqtt;
+    bool ready;
+};
+
+}  // namespace esp_mqtt
+
+#endif
@@ -1,8 +1,8 @@
 #include "ED_mqtt_qos1_queue.h"
 #include "esp_log.h"
 #include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "freertos/FreeRTOS.h"
-#include "freertos/timers.h"
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,58 +24,59 @@ typedef struct
     uint64_t last_active_us; // last time all slots were free
 } DynBlock;
 
-static DynBlock *dynamic_blocks[MAX_DYNAMIC_BLOCKS] = {0};
-static int dynamic_block_count = 0;
+// One queue per client, owned by its outbox
+struct mqtt_qos1q
+{
+    MqttSlot static_slots[STATIC_SLOT_COUNT];
+    char static_topics[STATIC_SLOT_COUNT][TOPIC_MAX];
+    char static_payloads[STATIC_SLOT_COUNT][PAYLOAD_MAX];
+    DynBlock *dynamic_blocks[MAX_DYNAMIC_BLOCKS];
+    int dynamic_block_count;
+    mqtt_allocator_t alloc;  // of the queue and its dynamic blocks
+    size_t diag_max_burst;
+    size_t diag_max_payload_len;
+    size_t diag_timeout_count;
+};
 
 static const char *TAG = "MQTT_QOS1Q";
 
-static TimerHandle_t timeout_timer = NULL;
-
 // Forward decls for helper functions (replaces lambda)
-static void sweep_slots(MqttSlot *pool, int count, uint64_t now_us, uint64_t thresh_us);
+static void sweep_slots(mqtt_qos1q_handle_t q, MqttSlot *pool, int count, uint64_t now_us, uint64_t thresh_us);
 // static void mqtt_alloc_dynamic_pool(void);
 // static void mqtt_free_dynamic_pool_if_empty(void);
-static void log_qos1_queue_stats(void);
-
-static MqttSlot static_slots[STATIC_SLOT_COUNT];
-static char static_topics[STATIC_SLOT_COUNT][TOPIC_MAX];
-static char static_payloads[STATIC_SLOT_COUNT][PAYLOAD_MAX];
+static void log_qos1_queue_stats(mqtt_qos1q_handle_t q);
 
 // static MqttSlot *dynamic_slots = NULL;
 // static char *dynamic_topics_block = NULL;
 // static char *dynamic_payloads_block = NULL;
 
-static size_t diag_max_burst = 0;
-static size_t diag_max_payload_len = 0;
-static size_t diag_timeout_count = 0;
-
 static inline uint64_t now_us(void) { return (uint64_t)esp_timer_get_time(); }
 
-static DynBlock *alloc_dynamic_block(void)
+static DynBlock *alloc_dynamic_block(mqtt_qos1q_handle_t q)
 {
-    if (dynamic_block_count >= MAX_DYNAMIC_BLOCKS)
+    if (q->dynamic_block_count >= MAX_DYNAMIC_BLOCKS)
     {
         ESP_LOGW(TAG, "[DYN] max blocks reached (%d)", MAX_DYNAMIC_BLOCKS);
         return NULL;
     }
-    DynBlock *blk = (DynBlock *)calloc(1, sizeof(DynBlock));
+    DynBlock *blk = (DynBlock *)mqtt_calloc(&q->alloc, 1, sizeof(DynBlock));
     if (!blk)
     {
         ESP_LOGE(TAG, "Failed to allocate DynBlock struct");
         return NULL;
     }
 
-    blk->slots = (MqttSlot *)calloc(DYNAMIC_SLOT_COUNT, sizeof(MqttSlot));
-    blk->topics_block = (char *)malloc(DYNAMIC_SLOT_COUNT * TOPIC_MAX);
-    blk->payloads_block = (char *)malloc(DYNAMIC_SLOT_COUNT * PAYLOAD_MAX);
+    blk->slots = (MqttSlot *)mqtt_calloc(&q->alloc, DYNAMIC_SLOT_COUNT, sizeof(MqttSlot));
+    blk->topics_block = (char *)mqtt_alloc(&q->alloc, DYNAMIC_SLOT_COUNT * TOPIC_MAX);
+    blk->payloads_block = (char *)mqtt_alloc(&q->alloc, DYNAMIC_SLOT_COUNT * PAYLOAD_MAX);
 
     if (!blk->slots || !blk->topics_block || !blk->payloads_block)
     {
         ESP_LOGE(TAG, "Failed to allocate dynamic block buffers");
-        free(blk->payloads_block);
-        free(blk->topics_block);
-        free(blk->slots);
-        free(blk);
+        mqtt_free(&q->alloc, blk->payloads_block);
+        mqtt_free(&q->alloc, blk->topics_block);
+        mqtt_free(&q->alloc, blk->slots);
+        mqtt_free(&q->alloc, blk);
         return NULL;
     }
 
@@ -91,29 +92,29 @@ static DynBlock *alloc_dynamic_block(void)
     blk->in_use = false;
     blk->last_active_us = 0;
 
-    dynamic_blocks[dynamic_block_count++] = blk;
-    ESP_LOGI(TAG, "Allocated dynamic block %d (%d slots)", dynamic_block_count, DYNAMIC_SLOT_COUNT);
+    q->dynamic_blocks[q->dynamic_block_count++] = blk;
+    ESP_LOGI(TAG, "Allocated dynamic block %d (%d slots)", q->dynamic_block_count, DYNAMIC_SLOT_COUNT);
     return blk;
 }
 
-static void free_dynamic_block_at_index(int idx)
+static void free_dynamic_block_at_index(mqtt_qos1q_handle_t q, int idx)
 {
-    DynBlock *blk = dynamic_blocks[idx];
+    DynBlock *blk = q->dynamic_blocks[idx];
     if (!blk)
         return;
 
-    free(blk->payloads_block);
-    free(blk->topics_block);
-    free(blk->slots);
-    free(blk);
+    mqtt_free(&q->alloc, blk->payloads_block);
+    mqtt_free(&q->alloc, blk->topics_block);
+    mqtt_free(&q->alloc, blk->slots);
+    mqtt_free(&q->alloc, blk);
     // Compact the array
-    for (int j = idx; j < dynamic_block_count - 1; ++j)
+    for (int j = idx; j < q->dynamic_block_count - 1; ++j)
     {
-        dynamic_blocks[j] = dynamic_blocks[j + 1];
+        q->dynamic_blocks[j] = q->dynamic_blocks[j + 1];
     }
-    dynamic_blocks[dynamic_block_count - 1] = NULL;
-    dynamic_block_count--;
-    ESP_LOGI(TAG, "Freed dynamic block at idx=%d, remaining=%d", idx, dynamic_block_count);
+    q->dynamic_blocks[q->dynamic_block_count - 1] = NULL;
+    q->dynamic_block_count--;
+    ESP_LOGI(TAG, "Freed dynamic block at idx=%d, remaining=%d", idx, q->dynamic_block_count);
 }
 
 static bool block_all_slots_free(const DynBlock *blk)
@@ -126,70 +127,74 @@ static bool block_all_slots_free(const DynBlock *blk)
     return true;
 }
 
-static void diag_update_burst(void)
+static void diag_update_burst(mqtt_qos1q_handle_t q)
 {
     size_t in_use_count = 0;
 
     for (int i = 0; i < STATIC_SLOT_COUNT; ++i)
-        if (static_slots[i].in_use)
+        if (q->static_slots[i].in_use)
             ++in_use_count;
 
-    for (int b = 0; b < dynamic_block_count; ++b)
+    for (int b = 0; b < q->dynamic_block_count; ++b)
     {
-        DynBlock *blk = dynamic_blocks[b];
+        DynBlock *blk = q->dynamic_blocks[b];
         for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s)
             if (blk->slots[s].in_use)
                 ++in_use_count;
     }
 
-    if (in_use_count > diag_max_burst)
-        diag_max_burst = in_use_count;
+    if (in_use_count > q->diag_max_burst)
+        q->diag_max_burst = in_use_count;
 }
 
-static void diag_update_payload_len(size_t len)
+static void diag_update_payload_len(mqtt_qos1q_handle_t q, size_t len)
 {
-    if (len > diag_max_payload_len)
-        diag_max_payload_len = len;
+    if (len > q->diag_max_payload_len)
+        q->diag_max_payload_len = len;
 }
 
-static void diag_inc_timeout(void) { ++diag_timeout_count; }
-
-static void timeout_timer_cb(TimerHandle_t xTimer)
-{
-    static TickType_t last = 0; // persist across calls
-    TickType_t now_ticks = xTaskGetTickCount();
-    if (now_ticks - last > pdMS_TO_TICKS(20000))
-    {
-        mqtt_qos1q_log_diagnostics();
-        last = now_ticks;
-    }
-    mqtt_qos1q_check_timeouts();
-}
+static void diag_inc_timeout(mqtt_qos1q_handle_t q) { ++q->diag_timeout_count; }
 
 
-void mqtt_qos1q_init(void)
+mqtt_qos1q_handle_t mqtt_qos1q_create(const mqtt_allocator_t *allocator)
 {
-
-    // clear static slots
-    for (int i = 0; i < STATIC_SLOT_COUNT; ++i) {
-        static_slots[i].in_use = false;
-        static_slots[i].msg_id = -1;
+    mqtt_allocator_t alloc;
+    if (allocator) {
+        alloc = *allocator;
+    } else {
+        mqtt_allocator_init(&alloc, NULL, MALLOC_CAP_DEFAULT);
     }
-
-    // free any dynamic blocks
-    for (int b = dynamic_block_count - 1; b >= 0; --b) {
-        free_dynamic_block_at_index(b);
+    mqtt_qos1q_handle_t q = (mqtt_qos1q_handle_t)mqtt_calloc(&alloc, 1, sizeof(struct mqtt_qos1q));
+    if (!q) {
+        ESP_LOGE(TAG, "Failed to allocate QoS1 queue");
+        return NULL;
     }
+    q->alloc = alloc;
 
-    diag_max_burst = 0;
-    diag_max_payload_len = 0;
-    diag_timeout_count = 0;
+    // wire static slots to their buffers
+    for (int i = 0; i < STATIC_SLOT_COUNT; ++i) {
+        q->static_slots[i].topic = q->static_topics[i];
+        q->static_slots[i].payload = q->static_payloads[i];
+        q->static_slots[i].in_use = false;
+        q->static_slots[i].msg_id = -1;
+    }
 
     ESP_LOGI(TAG, "QoS1 queue initialized (client handle stored)");
+    return q;
+}
+
+void mqtt_qos1q_destroy(mqtt_qos1q_handle_t q)
+{
+    if (!q) {
+        return;
+    }
+    mqtt_qos1q_clear_all(q);
+    mqtt_allocator_t alloc = q->alloc;
+    mqtt_free(&alloc, q);
 }
 
 
-static void log_qos1_queue_stats(void)
+static void log_qos1_queue_stats(mqtt_qos1q_handle_t q)
 {
     int static_used = 0, static_free = 0;
     int dynamic_used = 0, dynamic_free = 0;
@@ -197,10 +202,10 @@ static void log_qos1_queue_stats(void)
     // Static slots
     for (int i = 0; i < STATIC_SLOT_COUNT; ++i)
     {
-        if (static_slots[i].in_use)
+        if (q->static_slots[i].in_use)
         {
             static_used++;
-            ESP_LOGI(TAG, "[STAT%d] msg_id=%d", i + 1, static_slots[i].msg_id);
+            ESP_LOGI(TAG, "[STAT%d] msg_id=%d", i + 1, q->static_slots[i].msg_id);
         }
         else
         {
@@ -210,9 +215,9 @@ static void log_qos1_queue_stats(void)
     }
 
     // Dynamic blocks
-    for (int b = 0; b < dynamic_block_count; ++b)
+    for (int b = 0; b < q->dynamic_block_count; ++b)
     {
-        DynBlock *blk = dynamic_blocks[b];
+        DynBlock *blk = q->dynamic_blocks[b];
         for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s)
         {
             if (blk->slots[s].in_use)
@@ -229,13 +234,35 @@ static void log_qos1_queue_stats(void)
     }
 
     ESP_LOGI(TAG, "Static slots: %d used / %d free, Dynamic slots: %d used / %d free (blocks=%d)",
-             static_used, static_free, dynamic_used, dynamic_free, dynamic_block_count);
+             static_used, static_free, dynamic_used, dynamic_free, q->dynamic_block_count);
 }
 
-int mqtt_qos1q_track(const char *topic, size_t topic_len,
-                     const char *payload, size_t payload_len,
-                     bool retain,
-                     int msg_id)
+static MqttSlot *find_slot_by_topic(mqtt_qos1q_handle_t q, const char *topic, size_t topic_len)
+{
+    for (int i = 0; i < STATIC_SLOT_COUNT; ++i)
+    {
+        MqttSlot *ms = &q->static_slots[i];
+        if (ms->in_use && ms->topic_len == topic_len && memcmp(ms->topic, topic, topic_len) == 0)
+            return ms;
+    }
+    for (int b = 0; b < q->dynamic_block_count; ++b)
+    {
+        DynBlock *blk = q->dynamic_blocks[b];
+        for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s)
+        {
+            MqttSlot *ms = &blk->slots[s];
+            if (ms->in_use && ms->topic_len == topic_len && memcmp(ms->topic, topic, topic_len) == 0)
+                return ms;
+        }
+    }
+    return NULL;
+}
+
+static int track(mqtt_qos1q_handle_t q, const char *topic, size_t topic_len,
+                 const char *payload, size_t payload_len,
+                 bool retain,
+                 int msg_id,
+                 bool latest)
 {
     if (!topic || (!payload && payload_len > 0)) {
         ESP_LOGE(TAG, "[QOS1Q] track: invalid args");
@@ -255,10 +282,15 @@ int mqtt_qos1q_track(const char *topic, size_t topic_len,
     }
 
     // Hygiene sweep before enqueue
-    mqtt_qos1q_check_timeouts();
-
-    // Pick a slot
-    MqttSlot *slot = find_slot_or_drop_oldest();
+    mqtt_qos1q_check_timeouts(q);
+
+    // Pick a slot, the latest value of a state topic replaces the previous one
+    MqttSlot *slot = latest ? find_slot_by_topic(q, topic, topic_len) : NULL;
+    if (slot) {
+        ESP_LOGI(TAG, "[QOS1Q] msg_id=%d replaced by msg_id=%d", slot->msg_id, msg_id);
+    } else {
+        slot = find_slot_or_drop_oldest(q);
+    }
     if (!slot) {
         ESP_LOGE(TAG, "[QOS1Q] no slot available");
         return -2;
@@ -274,36 +306,53 @@ int mqtt_qos1q_track(const char *topic, size_t topic_len,
     slot->payload_len  = (uint16_t)payload_len;
     slot->in_use       = true;
     slot->timestamp_us = now_us();
+    slot->expiry_us    = 0;
     slot->msg_id       = msg_id;
     slot->retain       = retain;
 
     // Diagnostics
-    diag_update_burst();
-    diag_update_payload_len(payload_len);
+    diag_update_burst(q);
+    diag_update_payload_len(q, payload_len);
     ESP_LOGI(TAG, "[QOS1Q] Tracked QoS1 msg_id=%d topic='%s' payload_len=%u",
              msg_id, slot->topic, (unsigned)payload_len);
-    log_qos1_queue_stats();
+    log_qos1_queue_stats(q);
 
     return msg_id;
 }
 
-void mqtt_qos1q_rebind_msg_id(int provisional_id, int final_id)
+int mqtt_qos1q_track(mqtt_qos1q_handle_t q, const char *topic, size_t topic_len,
+                     const char *payload, size_t payload_len,
+                     bool retain,
+                     int msg_id)
+{
+    return track(q, topic, topic_len, payload, payload_len, retain, msg_id, false);
+}
+
+int mqtt_qos1q_track_latest(mqtt_qos1q_handle_t q, const char *topic, size_t topic_len,
+                            const char *payload, size_t payload_len,
+                            bool retain,
+                            int msg_id)
+{
+    return track(q, topic, topic_len, payload, payload_len, retain, msg_id, true);
+}
+
+void mqtt_qos1q_rebind_msg_id(mqtt_qos1q_handle_t q, int provisional_id, int final_id)
 {
     if (provisional_id <= 0 || final_id <= 0 || provisional_id == final_id)
         return;
 
     // Static
     for (int i = 0; i < STATIC_SLOT_COUNT; ++i) {
-        if (static_slots[i].in_use && static_slots[i].msg_id == provisional_id) {
-            static_slots[i].msg_id = final_id;
+        if (q->static_slots[i].in_use && q->static_slots[i].msg_id == provisional_id) {
+            q->static_slots[i].msg_id = final_id;
             ESP_LOGI(TAG, "Rebound msg_id %d -> %d (static idx=%d)", provisional_id, final_id, i);
             return;
         }
     }
 
     // Dynamic blocks
-    for (int b = 0; b < dynamic_block_count; ++b) {
-        DynBlock *blk = dynamic_blocks[b];
+    for (int b = 0; b < q->dynamic_block_count; ++b) {
+        DynBlock *blk = q->dynamic_blocks[b];
         for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s) {
             if (blk->slots[s].in_use && blk->slots[s].msg_id == provisional_id) {
                 blk->slots[s].msg_id = final_id;
@@ -317,6 +366,31 @@ void mqtt_qos1q_rebind_msg_id(int provisional_id, int final_id)
     ESP_LOGW(TAG, "Rebind miss: provisional_id=%d not found to rebind to %d", provisional_id, final_id);
 }
 
+static MqttSlot *find_slot(mqtt_qos1q_handle_t q, int msg_id)
+{
+    for (int i = 0; i < STATIC_SLOT_COUNT; ++i)
+    {
+        if (q->static_slots[i].in_use && q->static_slots[i].msg_id == msg_id)
+            return &q->static_slots[i];
+    }
+    for (int b = 0; b < q->dynamic_block_count; ++b)
+    {
+        DynBlock *blk = q->dynamic_blocks[b];
+        for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s)
+        {
+            if (blk->slots[s].in_use && blk->slots[s].msg_id == msg_id)
+                return &blk->slots[s];
+        }
+    }
+    return NULL;
+}
+
+void mqtt_qos1q_set_expiry(mqtt_qos1q_handle_t q, int msg_id, uint64_t expiry_us)
+{
+    MqttSlot *slot = find_slot(q, msg_id);
+    if (slot)
+        slot->expiry_us = expiry_us;
+}
 
 // static void mqtt_alloc_dynamic_pool(void) {
 //   int i;
@@ -362,19 +436,19 @@ void mqtt_qos1q_rebind_msg_id(int provisional_id, int final_id)
 //   ESP_LOGI(TAG, "Freed dynamic overflow pool");
 // }
 
-void mqtt_qos1q_check_timeouts(void)
+void mqtt_qos1q_check_timeouts(mqtt_qos1q_handle_t q)
 {
     uint64_t now = now_us();
     uint64_t thresh_us = (uint64_t)ACK_TIMEOUT_MS * 1000ULL;
 
     // Sweep static slots
-    sweep_slots(static_slots, STATIC_SLOT_COUNT, now, thresh_us);
+    sweep_slots(q, q->static_slots, STATIC_SLOT_COUNT, now, thresh_us);
 
     // Sweep dynamic slots per block
-    for (int b = 0; b < dynamic_block_count; ++b)
+    for (int b = 0; b < q->dynamic_block_count; ++b)
     {
-        DynBlock *blk = dynamic_blocks[b];
-        sweep_slots(blk->slots, DYNAMIC_SLOT_COUNT, now, thresh_us);
+        DynBlock *blk = q->dynamic_blocks[b];
+        sweep_slots(q, blk->slots, DYNAMIC_SLOT_COUNT, now, thresh_us);
         // If the block is now completely free, remember when it became idle
         if (block_all_slots_free(blk))
         {
@@ -390,15 +464,15 @@ void mqtt_qos1q_check_timeouts(void)
     }
 
     // Free blocks that have been idle for the configured timeout
-    for (int b = 0; b < dynamic_block_count; /* advance inside */)
+    for (int b = 0; b < q->dynamic_block_count; /* advance inside */)
     {
-        DynBlock *blk = dynamic_blocks[b];
+        DynBlock *blk = q->dynamic_blocks[b];
         if (blk && block_all_slots_free(blk) &&
             blk->last_active_us &&
             (now - blk->last_active_us) > ((uint64_t)DYN_BLOCK_IDLE_TIMEOUT_MS * 1000ULL))
         {
             ESP_LOGI(TAG, "Freeing idle dynamic block %d", b);
-            free_dynamic_block_at_index(b);
+            free_dynamic_block_at_index(q, b);
             // do not increment b; array now shifted
         }
         else
@@ -408,41 +482,47 @@ void mqtt_qos1q_check_timeouts(void)
     }
 }
 
-static void sweep_slots(MqttSlot *pool, int count, uint64_t now, uint64_t thresh_us)
+static void sweep_slots(mqtt_qos1q_handle_t q, MqttSlot *pool, int count, uint64_t now, uint64_t thresh_us)
 {
     int i;
     for (i = 0; i < count; ++i)
     {
-        if (pool[i].in_use && (now - pool[i].timestamp_us) > thresh_us)
+        if (pool[i].in_use && pool[i].expiry_us && now >= pool[i].expiry_us)
+        {
+            ESP_LOGW(TAG, "Expired msg_id=%d, freeing slot", pool[i].msg_id);
+            pool[i].in_use = false;
+            pool[i].msg_id = -1;
+        }
+        else if (pool[i].in_use && (now - pool[i].timestamp_us) > thresh_us)
         {
             ESP_LOGW(TAG, "Timeout msg_id=%d, freeing slot", pool[i].msg_id);
             pool[i].in_use = false;
             pool[i].msg_id = -1;
-            diag_inc_timeout();
+            diag_inc_timeout(q);
         }
     }
 }
 
-void mqtt_qos1q_on_published(int msg_id)
+void mqtt_qos1q_on_published(mqtt_qos1q_handle_t q, int msg_id)
 {
     int i;
 
     for (i = 0; i < STATIC_SLOT_COUNT; ++i)
     {
-        if (static_slots[i].in_use && static_slots[i].msg_id == msg_id)
+        if (q->static_slots[i].in_use && q->static_slots[i].msg_id == msg_id)
         {
-            static_slots[i].in_use = false;
-            static_slots[i].msg_id = -1;
+            q->static_slots[i].in_use = false;
+            q->static_slots[i].msg_id = -1;
             ESP_LOGI(TAG, "ACK msg_id=%d (static)", msg_id);
             return;
         }
     }
 
-    if (dynamic_block_count > 0)
+    if (q->dynamic_block_count > 0)
     {
-        for (int b = 0; b < dynamic_block_count; ++b)
+        for (int b = 0; b < q->dynamic_block_count; ++b)
         {
-            DynBlock *blk = dynamic_blocks[b];
+            DynBlock *blk = q->dynamic_blocks[b];
             for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s)
             {
                 if (blk->slots[s].in_use && blk->slots[s].msg_id == msg_id)
@@ -465,22 +545,22 @@ void mqtt_qos1q_on_published(int msg_id)
     ESP_LOGW(TAG, "Late ACK msg_id=%d (no matching slot)", msg_id);
 }
 
-MqttSlot *find_slot_or_drop_oldest(void)
+MqttSlot *find_slot_or_drop_oldest(mqtt_qos1q_handle_t q)
 {
     int i;
 
     // 1) Static free
     for (i = 0; i < STATIC_SLOT_COUNT; ++i)
-        if (!static_slots[i].in_use)
+        if (!q->static_slots[i].in_use)
         {
 
-            return &static_slots[i];
+            return &q->static_slots[i];
         }
 
     // 2) Existing dynamic blocks: find a free slot
-    for (int b = 0; b < dynamic_block_count; ++b)
+    for (int b = 0; b < q->dynamic_block_count; ++b)
     {
-        DynBlock *blk = dynamic_blocks[b];
+        DynBlock *blk = q->dynamic_blocks[b];
         for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s)
         {
             if (!blk->slots[s].in_use)
@@ -493,11 +573,11 @@ MqttSlot *find_slot_or_drop_oldest(void)
     }
 
     // 3) No free slot: allocate a new dynamic block (tier growth)
-    DynBlock *new_blk = alloc_dynamic_block();
+    DynBlock *new_blk = alloc_dynamic_block(q);
     if (new_blk)
     {
         new_blk->in_use = true;
-        ESP_LOGI(TAG, "[DYN] allocated new block=%d; using slot=0", dynamic_block_count - 1);
+        ESP_LOGI(TAG, "[DYN] allocated new block=%d; using slot=0", q->dynamic_block_count - 1);
 
         return &new_blk->slots[0];
     }
@@ -508,15 +588,15 @@ MqttSlot *find_slot_or_drop_oldest(void)
 
     for (i = 0; i < STATIC_SLOT_COUNT; ++i)
     {
-        if (static_slots[i].in_use && static_slots[i].timestamp_us < oldest_time)
+        if (q->static_slots[i].in_use && q->static_slots[i].timestamp_us < oldest_time)
         {
-            oldest_time = static_slots[i].timestamp_us;
-            oldest = &static_slots[i];
+            oldest_time = q->static_slots[i].timestamp_us;
+            oldest = &q->static_slots[i];
         }
     }
-    for (int b = 0; b < dynamic_block_count; ++b)
+    for (int b = 0; b < q->dynamic_block_count; ++b)
     {
-        DynBlock *blk = dynamic_blocks[b];
+        DynBlock *blk = q->dynamic_blocks[b];
         for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s)
         {
             MqttSlot *ms = &blk->slots[s];
@@ -640,36 +720,55 @@ MqttSlot *find_slot_or_drop_oldest(void)
 // // }
 
 
-void mqtt_qos1q_log_diagnostics(void)
+void mqtt_qos1q_for_each(mqtt_qos1q_handle_t q, mqtt_qos1q_visitor_t visitor, void *ctx)
+{
+    for (int i = 0; i < STATIC_SLOT_COUNT; ++i)
+    {
+        if (q->static_slots[i].in_use)
+            visitor(&q->static_slots[i], ctx);
+    }
+
+    for (int b = 0; b < q->dynamic_block_count; ++b)
+    {
+        DynBlock *blk = q->dynamic_blocks[b];
+        for (int s = 0; s < DYNAMIC_SLOT_COUNT; ++s)
+        {
+            if (blk->slots[s].in_use)
+                visitor(&blk->slots[s], ctx);
+        }
+    }
+}
+
+void mqtt_qos1q_log_diagnostics(mqtt_qos1q_handle_t q)
 {
-    ESP_LOGI(TAG, "Max burst size: %u", (unsigned)diag_max_burst);
-    ESP_LOGI(TAG, "Max payload len: %u", (unsigned)diag_max_payload_len);
-    ESP_LOGI(TAG, "Timeout count: %u", (unsigned)diag_timeout_count);
+    ESP_LOGI(TAG, "Max burst size: %u", (unsigned)q->diag_max_burst);
+    ESP_LOGI(TAG, "Max payload len: %u", (unsigned)q->diag_max_payload_len);
+    ESP_LOGI(TAG, "Timeout count: %u", (unsigned)q->diag_timeout_count);
     ESP_LOGI(TAG, "Dynamic blocks: %d (slots per block=%d, idle_timeout_ms=%d)",
-             dynamic_block_count, DYNAMIC_SLOT_COUNT, DYN_BLOCK_IDLE_TIMEOUT_MS);
+             q->dynamic_block_count, DYNAMIC_SLOT_COUNT, DYN_BLOCK_IDLE_TIMEOUT_MS);
 }
 
-void mqtt_qos1q_clear_all(void)
+void mqtt_qos1q_clear_all(mqtt_qos1q_handle_t q)
 {
     // Clear static slots
     for (int i = 0; i < STATIC_SLOT_COUNT; ++i)
     {
-        static_slots[i].in_use = false;
-        static_slots[i].msg_id = -1;
-        static_slots[i].topic_len = 0;
-        static_slots[i].payload_len = 0;
+        q->static_slots[i].in_use = false;
+        q->static_slots[i].msg_id = -1;
+        q->static_slots[i].topic_len = 0;
+        q->static_slots[i].payload_len = 0;
     }
 
     // Free all dynamic blocks
-    for (int b = dynamic_block_count - 1; b >= 0; --b)
+    for (int b = q->dynamic_block_count - 1; b >= 0; --b)
     {
-        free_dynamic_block_at_index(b);
+        free_dynamic_block_at_index(q, b);
     }
 
     // Reset diagnostics
-    diag_max_burst = 0;
-    diag_max_payload_len = 0;
-    diag_timeout_count = 0;
+    q->diag_max_burst = 0;
+    q->diag_max_payload_len = 0;
+    q->diag_timeout_count = 0;
 
     ESP_LOGI(TAG, "QoS1 queue cleared");
 }
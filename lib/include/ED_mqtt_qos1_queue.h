@@ -2,6 +2,7 @@
 
 #include "mqtt_client.h"
 #include "esp_timer.h"
+#include "mqtt_alloc.h"
 #include <stddef.h>   // size_t
 #include <stdint.h>
 #include <stdbool.h>
@@ -45,26 +46,39 @@ typedef struct
     bool in_use;
     int msg_id;
     uint64_t timestamp_us;
+    uint64_t expiry_us;     // absolute esp_timer time after which the slot is dropped, 0 = never
     bool retain;
 } MqttSlot;
-MqttSlot *find_slot_or_drop_oldest(void);
+
+/**
+ * QoS1 publish queue of one client, owned by the client's outbox.
+ */
+typedef struct mqtt_qos1q *mqtt_qos1q_handle_t;
+
+MqttSlot *find_slot_or_drop_oldest(mqtt_qos1q_handle_t q);
+
 /**
- * Initialise the QoS1 publish queue (idempotent).
- * Safe to call multiple times (on reconnects).
- * Pass allow_dynamic=true to enable elastic behavior within the queue.
+ * Create a QoS1 publish queue.
+ * The queue and its dynamic blocks are allocated with `allocator` (NULL: heap).
+ * Returns NULL if out of memory.
  */
-void mqtt_qos1q_init();
+mqtt_qos1q_handle_t mqtt_qos1q_create(const mqtt_allocator_t *allocator);
+
+/**
+ * Free the queue, its slots and dynamic blocks.
+ */
+void mqtt_qos1q_destroy(mqtt_qos1q_handle_t q);
 
 /**
  * Periodic timeout sweep (safe to call frequently).
  * Drops expired static slots and frees expired dynamic slots.
  */
-void mqtt_qos1q_check_timeouts(void);
+void mqtt_qos1q_check_timeouts(mqtt_qos1q_handle_t q);
 
 /**
  * Notify the queue that a PUBACK was received (idempotent).
  */
-void mqtt_qos1q_on_published(int msg_id);
+void mqtt_qos1q_on_published(mqtt_qos1q_handle_t q, int msg_id);
 
 /**
  * Publish a QoS1 message, copying into queue slot and calling client publish.
@@ -84,23 +98,43 @@ int mqtt_qos1q_publish(esp_mqtt_client_handle_t client,
  * Track an already enqueued QoS1 message (no sending).
  * Returns msg_id >=0 on success, -1 on failure, -2 if no slot available.
  */
-int mqtt_qos1q_track(const char *topic, size_t topic_len,
+int mqtt_qos1q_track(mqtt_qos1q_handle_t q, const char *topic, size_t topic_len,
                      const char *payload, size_t payload_len,
                      bool retain,
                      int msg_id);
 
 
-void mqtt_qos1q_rebind_msg_id(int provisional_id, int final_id);
+/**
+ * Same as mqtt_qos1q_track(), but reuses the slot tracking a message on the same topic.
+ */
+int mqtt_qos1q_track_latest(mqtt_qos1q_handle_t q, const char *topic, size_t topic_len,
+                            const char *payload, size_t payload_len,
+                            bool retain,
+                            int msg_id);
+
+void mqtt_qos1q_rebind_msg_id(mqtt_qos1q_handle_t q, int provisional_id, int final_id);
+
+/**
+ * Set the expiry (esp_timer time in us, 0 = never) of a tracked message,
+ * expired slots are dropped by the timeout sweep.
+ */
+void mqtt_qos1q_set_expiry(mqtt_qos1q_handle_t q, int msg_id, uint64_t expiry_us);
 
 /**
  * Clear all slots and free dynamic slots.
  */
-void mqtt_qos1q_clear_all(void);
+void mqtt_qos1q_clear_all(mqtt_qos1q_handle_t q);
+
+/**
+ * Call visitor for every slot in use (static slots first, then dynamic blocks).
+ */
+typedef void (*mqtt_qos1q_visitor_t)(const MqttSlot *slot, void *ctx);
+void mqtt_qos1q_for_each(mqtt_qos1q_handle_t q, mqtt_qos1q_visitor_t visitor, void *ctx);
 
 /**
  * Log diagnostics for current state.
  */
-void mqtt_qos1q_log_diagnostics(void);
+void mqtt_qos1q_log_diagnostics(mqtt_qos1q_handle_t q);
 
 // uint64_t now_us(void);
 // void diag_update_burst(void);
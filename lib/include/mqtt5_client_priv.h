@@ -10,6 +10,9 @@
 #include "mqtt5_client.h"
 #include "mqtt_client_priv.h"
 #include "mqtt5_msg.h"
+#ifdef MQTT_REQUEST_RESPONSE
+#include "mqtt5_request.h"
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,9 +34,20 @@ typedef struct {
     esp_mqtt5_connection_server_resp_property_t server_resp_property_info;
     esp_mqtt5_disconnect_property_config_t disconnect_property_info;
     const esp_mqtt5_publish_property_config_t *publish_property_info;
+    const mqtt5_property_block_t *publish_property_block;     /* persistent, set until replaced */
     const esp_mqtt5_subscribe_property_config_t *subscribe_property_info;
     const esp_mqtt5_unsubscribe_property_config_t *unsubscribe_property_info;
     mqtt5_topic_alias_handle_t peer_topic_alias;
+    char *own_topic_alias[MQTT_TOPIC_ALIAS_MAX];  /* topic of alias i + 1, for this connection only */
+    uint16_t own_topic_alias_count;
+#ifdef MQTT_REQUEST_RESPONSE
+    mqtt5_request_table_handle_t requests;
+    char *response_base;        /* response topic set in requests */
+    char *response_topic;       /* subscribed response topic, with the response information of the broker */
+    bool response_subscribed;
+    bool response_received;     /* the publish being delivered is on the response topic */
+    mqtt5_request_t response;   /* request answered by the publish being delivered, cb is NULL for late responses */
+#endif
 } mqtt5_config_storage_t;
 
 void esp_mqtt5_increment_packet_counter(esp_mqtt5_client_handle_t client);
@@ -46,9 +60,23 @@ void esp_mqtt5_parse_disconnect(esp_mqtt5_client_handle_t client, int *disconnec
 esp_err_t esp_mqtt5_parse_connack(esp_mqtt5_client_handle_t client, int *connect_rsp_code);
 void esp_mqtt5_client_destory(esp_mqtt5_client_handle_t client);
 esp_err_t esp_mqtt5_client_publish_check(esp_mqtt5_client_handle_t client, int qos, int retain);
+/* the receive maximum of the broker is reached, QoS1 and QoS2 publishes have to wait for acknowledgements */
+bool esp_mqtt5_client_flow_blocked(esp_mqtt5_client_handle_t client);
+/* the packet is over the maximum packet size of the broker */
+bool esp_mqtt5_client_packet_too_large(esp_mqtt5_client_handle_t client, size_t packet_len);
+/* alias for a publish of the topic sent right away, 0 if none is left; mapped is set once the broker knows it */
+uint16_t esp_mqtt5_client_own_topic_alias(esp_mqtt5_client_handle_t client, const char *topic, bool *mapped);
+/* the publish with a new alias was sent, its topic is left out from now on */
+void esp_mqtt5_client_own_topic_alias_sent(esp_mqtt5_client_handle_t client, const char *topic, uint16_t topic_alias);
 esp_err_t esp_mqtt5_client_subscribe_check(esp_mqtt5_client_handle_t client, int qos);
 esp_err_t esp_mqtt5_create_default_config(esp_mqtt5_client_handle_t client);
 esp_err_t esp_mqtt5_get_publish_data(esp_mqtt5_client_handle_t client, uint8_t *msg_buf, size_t msg_read_len, char **msg_topic, size_t *msg_topic_len, char **msg_data, size_t *msg_data_len);
+#ifdef MQTT_REQUEST_RESPONSE
+void esp_mqtt5_request_expire(esp_mqtt5_client_handle_t client);
+void esp_mqtt5_request_resubscribe(esp_mqtt5_client_handle_t client);
+void esp_mqtt5_request_match(esp_mqtt5_client_handle_t client, const char *topic, size_t topic_len);
+bool esp_mqtt5_request_respond(esp_mqtt5_client_handle_t client);
+#endif
 #ifdef __cplusplus
 }
 #endif //__cplusplus
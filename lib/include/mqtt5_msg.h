@@ -40,6 +40,24 @@ enum mqtt_properties_type {
     MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE       = 0x2A,
 };
 
+#define MQTT5_PROPERTY_BLOCK_FIELDS     4
+#define MQTT5_PROPERTY_BLOCK_MAX_SIZE   (64 * 1024)
+
+/**
+ * Publish properties encoded once and spliced into the messages (without the properties length)
+ */
+typedef struct mqtt5_property_block {
+    uint8_t *data;
+    size_t len;
+    uint32_t message_expiry_interval;
+    int fields_count;
+    struct {
+        uint8_t id;
+        size_t offset;
+        size_t len;
+    } fields[MQTT5_PROPERTY_BLOCK_FIELDS];  /* properties which may appear once, those set for a message override them */
+} mqtt5_property_block_t;
+
 typedef struct mqtt5_user_property {
     char *key;
     char *value;
@@ -123,8 +141,27 @@ char *mqtt5_get_publish_property_payload(uint8_t *buffer, size_t buffer_length,
 char *mqtt5_get_suback_data(uint8_t *buffer, size_t *length, mqtt5_user_property_handle_t *user_property);
 char *mqtt5_get_puback_data(uint8_t *buffer, size_t *length, mqtt5_user_property_handle_t *user_property);
 mqtt_message_t *mqtt5_msg_connect(mqtt_connection_t *connection, mqtt_connect_info_t *info, esp_mqtt5_connection_property_storage_t *property, esp_mqtt5_connection_will_property_storage_t *will_property);
-mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id, const esp_mqtt5_publish_property_config_t *property, const char *resp_info);
-esp_err_t mqtt5_msg_parse_connack_property(uint8_t *buffer, size_t buffer_len, mqtt_connect_info_t *connection_info, esp_mqtt5_connection_property_storage_t *connection_property, esp_mqtt5_connection_server_resp_property_t *resp_property, int *reason_code, uint8_t *ack_flag, mqtt5_user_property_handle_t *user_property);
+/**
+ * @brief Builds a PUBLISH message
+ *
+ * The properties of the precompiled `block` (if any) follow those of `property`, properties set in both
+ * are taken from `property`.
+ */
+mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id, const esp_mqtt5_publish_property_config_t *property, const mqtt5_property_block_t *block, const char *resp_info);
+mqtt_message_t *mqtt5_msg_publish_header(mqtt_connection_t *connection, const char *topic, int data_length, int qos, int retain, uint16_t *message_id, const esp_mqtt5_publish_property_config_t *property, const mqtt5_property_block_t *block, const char *resp_info);
+/**
+ * @brief Encodes publish properties once, response topic and topic alias are not supported
+ */
+mqtt5_property_block_t *mqtt5_property_block_create(const esp_mqtt5_publish_property_config_t *property);
+void mqtt5_property_block_destroy(mqtt5_property_block_t *block);
+/**
+ * @brief Rewrites the message expiry interval of an encoded PUBLISH in place
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the message has no expiry interval,
+ *         ESP_ERR_INVALID_ARG if it's not a valid PUBLISH
+ */
+esp_err_t mqtt5_msg_set_message_expiry(uint8_t *buffer, size_t length, uint32_t interval);
+esp_err_t mqtt5_msg_parse_connack_property(uint8_t *buffer, size_t buffer_len, const mqtt_allocator_t *allocator, mqtt_connect_info_t *connection_info, esp_mqtt5_connection_property_storage_t *connection_property, esp_mqtt5_connection_server_resp_property_t *resp_property, int *reason_code, uint8_t *ack_flag, mqtt5_user_property_handle_t *user_property);
 int mqtt5_msg_get_reason_code(uint8_t *buffer, size_t length);
 mqtt_message_t *mqtt5_msg_subscribe(mqtt_connection_t *connection, const esp_mqtt_topic_t *topic, int size, uint16_t *message_id, const esp_mqtt5_subscribe_property_config_t *property);
 mqtt_message_t *mqtt5_msg_unsubscribe(mqtt_connection_t *connection, const char *topic, uint16_t *message_id, const esp_mqtt5_unsubscribe_property_config_t *property);
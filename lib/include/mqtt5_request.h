@@ -0,0 +1,90 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT5_REQUEST_H_
+#define _MQTT5_REQUEST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "mqtt_client.h"
+#include "mqtt_alloc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Table of pending requests of the MQTT5 request/response engine.
+ *
+ * Requests are stored in a fixed array of slots and identified by the slot index
+ * and a generation counter of the slot, which are also sent as the correlation data.
+ * A response is thus matched without any search, and late responses to a reused
+ * slot are recognized by the generation. Deadlines are kept in a hashed timing wheel,
+ * so that expiring requests only visits the wheel buckets of the elapsed ticks.
+ */
+
+#define MQTT5_REQUEST_CORRELATION_LEN 4
+
+typedef struct mqtt5_request_table *mqtt5_request_table_handle_t;
+
+typedef struct {
+    int id;
+    esp_mqtt5_response_cb_t cb;
+    void *ctx;
+} mqtt5_request_t;
+
+typedef void (*mqtt5_request_visitor_t)(const mqtt5_request_t *request, void *arg);
+
+/* The table is allocated with `allocator`, NULL for the heap */
+mqtt5_request_table_handle_t mqtt5_request_table_create(int capacity, const mqtt_allocator_t *allocator);
+
+/**
+ * @brief Destroys the table, calling the visitor for each pending request
+ */
+void mqtt5_request_table_destroy(mqtt5_request_table_handle_t table, mqtt5_request_visitor_t visitor, void *arg);
+
+/**
+ * @brief Adds a request
+ *
+ * @return request id (positive), -1 if the table is full
+ */
+int mqtt5_request_add(mqtt5_request_table_handle_t table, esp_mqtt5_response_cb_t cb, void *ctx, uint64_t deadline_ms);
+
+/**
+ * @brief Encodes the correlation data of a request
+ */
+void mqtt5_request_correlation(int id, uint8_t correlation[MQTT5_REQUEST_CORRELATION_LEN]);
+
+/**
+ * @brief Removes a request
+ *
+ * @return true if the request was pending, it's copied to `request` if not NULL
+ */
+bool mqtt5_request_remove(mqtt5_request_table_handle_t table, int id, mqtt5_request_t *request);
+
+/**
+ * @brief Removes the request the correlation data belongs to
+ *
+ * @return true if the request was pending
+ */
+bool mqtt5_request_take(mqtt5_request_table_handle_t table, const char *correlation, size_t len, mqtt5_request_t *request);
+
+/**
+ * @brief Removes the requests past their deadline and calls the visitor for each of them
+ *
+ * The visitor may add new requests.
+ *
+ * @return number of expired requests
+ */
+int mqtt5_request_expire(mqtt5_request_table_handle_t table, uint64_t now_ms, mqtt5_request_visitor_t visitor, void *arg);
+
+int mqtt5_request_count(mqtt5_request_table_handle_t table);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
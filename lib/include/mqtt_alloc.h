@@ -0,0 +1,63 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_ALLOC_H_
+#define _MQTT_ALLOC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mqtt_client.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Allocation of the client-internal memory through the hooks of `esp_mqtt_client_config_t::memory`.
+ *
+ * Without hooks (or with a NULL allocator) blocks come from the heap, with the heap capabilities
+ * of the allocator. With hooks, each block is prefixed by its size, so that it's freed (or reallocated)
+ * with the size and alignment it was allocated with, as memory resources like std::pmr require.
+ * A block must be freed with the allocator it was allocated with.
+ */
+
+typedef struct {
+    esp_mqtt_allocator_t hooks;
+    uint32_t caps;              /* heap capabilities of the allocations without hooks */
+} mqtt_allocator_t;
+
+/* allocators of a client, by lifetime of the memory */
+typedef struct {
+    mqtt_allocator_t state;
+    mqtt_allocator_t message;
+    mqtt_allocator_t transient;
+} mqtt_allocators_t;
+
+/* allocator of the kind, NULL (heap) if `allocators` is NULL */
+#define MQTT_ALLOCATOR(allocators, kind) ((allocators) ? &(allocators)->kind : NULL)
+
+void mqtt_allocator_init(mqtt_allocator_t *allocator, const esp_mqtt_allocator_t *hooks, uint32_t caps);
+
+void *mqtt_alloc(const mqtt_allocator_t *allocator, size_t size);
+void *mqtt_calloc(const mqtt_allocator_t *allocator, size_t count, size_t size);
+/* on failure the block is left untouched and NULL returned */
+void *mqtt_realloc(const mqtt_allocator_t *allocator, void *ptr, size_t size);
+void mqtt_free(const mqtt_allocator_t *allocator, void *ptr);
+
+char *mqtt_strdup(const mqtt_allocator_t *allocator, const char *str);
+char *mqtt_strndup(const mqtt_allocator_t *allocator, const char *str, size_t len);
+
+/**
+ * @brief Formats into a new string
+ *
+ * @return length of the string, -1 on failure
+ */
+int mqtt_asprintf(const mqtt_allocator_t *allocator, char **str, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,83 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_BATCH_H_
+#define _MQTT_BATCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "mqtt_alloc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Telemetry batch frame:
+ *
+ *   header: | magic:2 (little endian) | version:1 |
+ *   sample: | len:1..4 (MQTT variable byte integer) | data |
+ *
+ * Samples published to the same topic are appended to the frame of the topic, the frame
+ * is published as one message once full, once it holds the configured number of samples
+ * or once its oldest sample reached the latency budget. The message is published with
+ * the highest QoS of its samples, samples with a different retain flag start a new frame.
+ */
+
+#define MQTT_BATCH_HEADER_LEN   3
+
+typedef struct mqtt_batcher *mqtt_batcher_handle_t;
+
+/**
+ * @brief Publishes a complete frame
+ *
+ * @return message id, negative on failure
+ */
+typedef int (*mqtt_batch_publish_t)(void *ctx, const char *topic, const uint8_t *frame, size_t len, int qos, int retain);
+
+/* Frames are allocated with `allocator`, NULL for the heap */
+mqtt_batcher_handle_t mqtt_batcher_create(size_t max_size, int max_samples, uint32_t max_latency_ms, int max_topics,
+                                          mqtt_batch_publish_t publish, void *ctx, const mqtt_allocator_t *allocator);
+/* Pending samples are dropped */
+void mqtt_batcher_destroy(mqtt_batcher_handle_t batcher);
+
+/**
+ * @brief Appends a sample to the frame of the topic, publishing the frame when a threshold is reached
+ *
+ * @return ESP_OK if the sample was queued, ESP_ERR_INVALID_SIZE if it can't fit in a frame,
+ *         ESP_FAIL if a frame had to be published and it failed (its samples are dropped)
+ */
+esp_err_t mqtt_batcher_add(mqtt_batcher_handle_t batcher, const char *topic, const uint8_t *data, size_t len,
+                           int qos, int retain, uint64_t now_ms);
+
+/**
+ * @brief Publishes the pending frame of the topic, of all topics if NULL
+ *
+ * @return ESP_OK on success, ESP_FAIL if a publish failed
+ */
+esp_err_t mqtt_batcher_flush(mqtt_batcher_handle_t batcher, const char *topic);
+
+/**
+ * @brief Publishes the frames whose oldest sample reached the latency budget
+ *
+ * @return number of published frames
+ */
+int mqtt_batcher_flush_expired(mqtt_batcher_handle_t batcher, uint64_t now_ms);
+
+/**
+ * @brief Reads the sample at *offset of a received frame, 0 being the start of the frame
+ *
+ * @return ESP_OK and advances *offset, ESP_ERR_NOT_FOUND past the last sample,
+ *         ESP_ERR_INVALID_RESPONSE if the frame is malformed
+ */
+esp_err_t mqtt_batch_next(const uint8_t *frame, size_t frame_len, size_t *offset, const uint8_t **sample, size_t *sample_len);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -26,6 +26,28 @@
 #include "esp_transport_ws.h"
 #include "esp_log.h"
 #include "mqtt_outbox.h"
+#include "mqtt_qos2.h"
+#ifdef MQTT_OFFLINE_LOG
+#include "mqtt_offline_log.h"
+#endif
+#ifdef MQTT_SESSION_PERSISTENCE
+#include "mqtt_session.h"
+#endif
+#ifdef MQTT_COMPRESSION
+#include "mqtt_compress.h"
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+#include "mqtt_loopback.h"
+#endif
+#ifdef MQTT_BROKER_FAILOVER
+#include "mqtt_failover.h"
+#endif
+#ifdef MQTT_RATE_LIMIT
+#include "mqtt_rate_limit.h"
+#endif
+#ifdef MQTT_BATCHING
+#include "mqtt_batch.h"
+#endif
 #include "freertos/event_groups.h"
 #include <errno.h>
 #include <string.h>
@@ -58,6 +80,9 @@ extern "C" {
 typedef struct mqtt_state {
     uint8_t *in_buffer;
     int in_buffer_length;
+    int in_buffer_size;             /* configured size, a grown buffer shrinks back to it once idle */
+    int in_buffer_max_size;         /* size the buffer may grow to, 0 = fixed size */
+    uint64_t in_buffer_tick;        /* last message which needed the grown buffer */
     size_t message_length;
     size_t in_buffer_read_len;
     mqtt_connection_t connection;
@@ -66,6 +91,22 @@ typedef struct mqtt_state {
     int pending_publish_qos;
 } mqtt_state_t;
 
+#ifdef MQTT_REASSEMBLY
+typedef struct {
+    char *filter;
+    esp_mqtt_data_storage_t storage;
+} mqtt_data_storage_t;
+#endif
+
+#ifdef MQTT_INBOUND_FLOW_CONTROL
+typedef struct {
+    int window;                 /* configured message credit, 0 = not limited */
+    bool limit_bytes;
+    int64_t messages;           /* remaining credit, reading pauses at 0 */
+    int64_t bytes;
+} mqtt_inbound_credit_t;
+#endif
+
 typedef struct {
     esp_event_loop_handle_t event_loop_handle;
     int task_stack;
@@ -104,6 +145,17 @@ typedef struct {
     esp_transport_handle_t transport;
     struct ifreq * if_name;
     esp_transport_keep_alive_t tcp_keep_alive_cfg;
+    const char *const *coalesce_topics;
+#ifdef MQTT_COMPRESSION
+    const char *const *compression_topics;
+    int compression_min_size;
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    const char *const *local_topics;
+#endif
+#ifdef MQTT_BROKER_FAILOVER
+    int failover_connect_timeout_ms;
+#endif
 } mqtt_config_storage_t;
 
 typedef enum {
@@ -113,6 +165,22 @@ typedef enum {
     MQTT_STATE_WAIT_RECONNECT,
 } mqtt_client_state_t;
 
+/**
+ * Codec operations of a protocol version, selected once per connection
+ */
+typedef struct {
+    uint16_t (*get_id)(uint8_t *buffer, size_t length);
+    esp_err_t (*get_publish_data)(esp_mqtt_client_handle_t client, uint8_t *msg_buf, size_t msg_read_len,
+                                  char **msg_topic, size_t *msg_topic_len, char **msg_data, size_t *msg_data_len);
+    char *(*get_suback_data)(esp_mqtt_client_handle_t client, uint8_t *buffer, size_t *length);
+    mqtt_message_t *(*puback)(mqtt_connection_t *connection, uint16_t message_id);
+    mqtt_message_t *(*pubrec)(mqtt_connection_t *connection, uint16_t message_id);
+    mqtt_message_t *(*pubrel)(mqtt_connection_t *connection, uint16_t message_id);
+    mqtt_message_t *(*pubcomp)(mqtt_connection_t *connection, uint16_t message_id);
+    void (*publish_completed)(esp_mqtt_client_handle_t client);     /* PUBACK or PUBCOMP received, may be NULL */
+    void (*event_dispatched)(esp_mqtt_client_handle_t client);      /* may be NULL */
+} mqtt_protocol_ops_t;
+
 struct esp_mqtt_client {
     esp_transport_list_handle_t transport_list;
     esp_transport_handle_t transport;
@@ -123,6 +191,7 @@ struct esp_mqtt_client {
     int64_t keepalive_tick;
     uint64_t reconnect_tick;
 #ifdef MQTT_PROTOCOL_5
+    const mqtt_protocol_ops_t *protocol_ops;    /* without MQTT5, the 3.1.1 operations are used directly */
     mqtt5_config_storage_t *mqtt5_config;
     uint16_t send_publish_packet_count; // This is for MQTT v5.0 flow control
 #endif
@@ -132,15 +201,60 @@ struct esp_mqtt_client {
     bool run;
     bool wait_for_ping_resp;
     outbox_handle_t outbox;
+    mqtt_qos2_table_handle_t qos2;  /* QoS2 publishes in flight, from PUBLISH until PUBCOMP */
     EventGroupHandle_t status_bits;
     SemaphoreHandle_t  api_lock;
     TaskHandle_t       task_handle;
+    mqtt_allocators_t alloc;    /* allocators of the client-internal memory */
+    uint8_t *memory;            /* region the client is carved from (esp_mqtt_client_init_static()), NULL if allocated */
+    size_t memory_size;
+    size_t memory_used;
+#ifdef MQTT_OFFLINE_LOG
+    mqtt_offline_log_handle_t offline_log;
+#endif
+#ifdef MQTT_SESSION_PERSISTENCE
+    mqtt_session_handle_t session;
+    uint64_t session_save_tick;
+#endif
+#ifdef MQTT_RATE_LIMIT
+    mqtt_rate_limit_handle_t rate_limit;
+    uint32_t rate_limit_wait_ms;
+#endif
+#ifdef MQTT_BATCHING
+    mqtt_batcher_handle_t batcher;
+#endif
+#ifdef MQTT_REASSEMBLY
+    mqtt_data_storage_t *data_storage;  /* topic filters of messages delivered complete into application buffers */
+    int data_storage_count;
+#endif
+#ifdef MQTT_INBOUND_FLOW_CONTROL
+    mqtt_inbound_credit_t inbound;
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    mqtt_loopback_handle_t loopback;    /* NULL if loopback is not enabled */
+#ifdef MQTT_SUPPORTED_FEATURE_EVENT_LOOP
+    esp_event_loop_handle_t loopback_loop;  /* runs the handlers of locally delivered messages, NULL if there are none */
+#endif
+#endif
+#ifdef MQTT_BROKER_FAILOVER
+    mqtt_failover_handle_t failover;    /* NULL without broker endpoints */
+    uint64_t connect_tick;              /* start of the connection to the selected endpoint */
+    uint64_t ping_tick;                 /* last PINGREQ sent */
+#endif
+#ifdef MQTT_COMPRESSION
+    bool payload_compressed;    /* the publish being built carries a compressed payload */
+#endif
+    uint32_t publish_ttl_ms;    /* time to live of the next publish, 0 = none */
+    esp_mqtt_priority_t publish_priority;   /* priority lane of the next publish */
 #if MQTT_EVENT_QUEUE_SIZE > 1
     atomic_int         queued_events;
 #endif
 };
 
-bool esp_mqtt_set_if_config(char const *const new_config, char **old_config);
+bool esp_mqtt_set_if_config(esp_mqtt_client_handle_t client, char const *const new_config, char **old_config);
+/* allocate/free client state, carved from the memory region of static clients, from the state allocator otherwise */
+void *mqtt_client_calloc(esp_mqtt_client_handle_t client, size_t size);
+void mqtt_client_free(esp_mqtt_client_handle_t client, void *ptr);
 void esp_mqtt_destroy_config(esp_mqtt_client_handle_t client);
 
 #ifdef __cplusplus
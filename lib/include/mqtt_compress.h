@@ -0,0 +1,80 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_COMPRESS_H_
+#define _MQTT_COMPRESS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "mqtt_alloc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Payload compression frame (all integers little endian):
+ *
+ *   header: | magic:2 | version:1 | block_shift:1 | raw_len:4 |
+ *   block:  | comp_len:2 | raw_len:2 | data |
+ *
+ * Blocks of at most (1 << block_shift) bytes are compressed independently with
+ * an LZ4 block format codec, so the receiver can decompress the payload while
+ * it's being received, one block at a time. A block with comp_len == raw_len
+ * is stored uncompressed.
+ */
+
+#define MQTT_COMPRESS_HEADER_LEN        8
+#define MQTT_COMPRESS_BLOCK_HEADER_LEN  4
+#define MQTT_COMPRESS_MAX_BLOCK_SHIFT   15
+
+typedef struct mqtt_decompress *mqtt_decompress_handle_t;
+
+/**
+ * @brief Called for every decompressed block
+ */
+typedef esp_err_t (*mqtt_decompress_output_t)(void *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Maximum size of the frame for a payload of len bytes
+ */
+size_t mqtt_compress_bound(size_t len, int block_shift);
+
+/**
+ * @brief Compresses src into a frame, the hash table is taken from `allocator` (NULL for the heap)
+ *
+ * @return frame length, -1 if dst is too small or memory couldn't be allocated
+ */
+int mqtt_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len, int block_shift,
+                  const mqtt_allocator_t *allocator);
+
+/**
+ * @brief Returns true if data starts with a valid frame header, optionally reports the decompressed length
+ */
+bool mqtt_compress_is_frame(const uint8_t *data, size_t len, size_t *raw_len);
+
+mqtt_decompress_handle_t mqtt_decompress_create(const mqtt_allocator_t *allocator);
+void mqtt_decompress_destroy(mqtt_decompress_handle_t decompress);
+
+/**
+ * @brief Feeds the next part of the frame, decompressed blocks are passed to output as soon as complete
+ *
+ * @return ESP_OK on success, ESP_ERR_INVALID_RESPONSE if the frame is malformed, error of output otherwise
+ */
+esp_err_t mqtt_decompress_feed(mqtt_decompress_handle_t decompress, const uint8_t *data, size_t len,
+                               mqtt_decompress_output_t output, void *ctx);
+
+/**
+ * @brief Returns true once the whole frame has been decompressed
+ */
+bool mqtt_decompress_is_done(mqtt_decompress_handle_t decompress);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -97,6 +97,30 @@
 #define OUTBOX_EXPIRED_TIMEOUT_MS   (30*1000)
 #endif
 
+#ifdef  CONFIG_MQTT_PRIORITY_AGING_MS
+#define MQTT_PRIORITY_AGING_MS      CONFIG_MQTT_PRIORITY_AGING_MS
+#else
+#define MQTT_PRIORITY_AGING_MS      2000
+#endif
+
+#ifdef  CONFIG_MQTT_QOS2_MAX_INFLIGHT
+#define MQTT_QOS2_MAX_INFLIGHT      CONFIG_MQTT_QOS2_MAX_INFLIGHT
+#else
+#define MQTT_QOS2_MAX_INFLIGHT      128
+#endif
+
+#ifdef  CONFIG_MQTT_QOS2_PUBREL_BATCH
+#define MQTT_QOS2_PUBREL_BATCH      CONFIG_MQTT_QOS2_PUBREL_BATCH
+#else
+#define MQTT_QOS2_PUBREL_BATCH      16
+#endif
+
+#ifdef  CONFIG_MQTT_TOPIC_ALIAS_MAX
+#define MQTT_TOPIC_ALIAS_MAX        CONFIG_MQTT_TOPIC_ALIAS_MAX
+#else
+#define MQTT_TOPIC_ALIAS_MAX        8
+#endif
+
 #define MQTT_ENABLE_SSL             CONFIG_MQTT_TRANSPORT_SSL
 #define MQTT_ENABLE_WS              CONFIG_MQTT_TRANSPORT_WEBSOCKET
 #define MQTT_ENABLE_WSS             CONFIG_MQTT_TRANSPORT_WEBSOCKET_SECURE
@@ -115,4 +139,77 @@
 #endif
 
 #define OUTBOX_MAX_SIZE             (4*1024)
+
+#ifdef CONFIG_MQTT_OUTBOX_POOL
+#define MQTT_OUTBOX_POOL                CONFIG_MQTT_OUTBOX_POOL
+#define MQTT_OUTBOX_POOL_SIZE           CONFIG_MQTT_OUTBOX_POOL_SIZE
+#define MQTT_OUTBOX_ARENA_SIZE          CONFIG_MQTT_OUTBOX_ARENA_SIZE
+#endif
+
+#ifdef CONFIG_MQTT_OFFLINE_LOG
+#define MQTT_OFFLINE_LOG                CONFIG_MQTT_OFFLINE_LOG
+#define MQTT_OFFLINE_LOG_SEGMENT_SIZE   CONFIG_MQTT_OFFLINE_LOG_SEGMENT_SIZE
+#define MQTT_OFFLINE_LOG_REPLAY_BATCH   CONFIG_MQTT_OFFLINE_LOG_REPLAY_BATCH
+#endif
+
+#ifdef CONFIG_MQTT_SESSION_PERSISTENCE
+#define MQTT_SESSION_PERSISTENCE        CONFIG_MQTT_SESSION_PERSISTENCE
+#define MQTT_SESSION_MAX_SIZE           CONFIG_MQTT_SESSION_MAX_SIZE
+#define MQTT_SESSION_SAVE_INTERVAL_MS   CONFIG_MQTT_SESSION_SAVE_INTERVAL_MS
+#define MQTT_SESSION_RESUBSCRIBE_TOPICS 8
+#endif
+
+#ifdef CONFIG_MQTT_COMPRESSION
+#define MQTT_COMPRESSION                CONFIG_MQTT_COMPRESSION
+#define MQTT_COMPRESSION_MIN_SIZE       CONFIG_MQTT_COMPRESSION_MIN_SIZE
+#if CONFIG_MQTT_COMPRESSION_BLOCK_1K
+#define MQTT_COMPRESSION_BLOCK_SHIFT    10
+#elif CONFIG_MQTT_COMPRESSION_BLOCK_16K
+#define MQTT_COMPRESSION_BLOCK_SHIFT    14
+#else
+#define MQTT_COMPRESSION_BLOCK_SHIFT    12
+#endif
+#endif
+
+#ifdef CONFIG_MQTT_RATE_LIMIT
+#define MQTT_RATE_LIMIT                 CONFIG_MQTT_RATE_LIMIT
+#endif
+
+#ifdef CONFIG_MQTT_BATCHING
+#define MQTT_BATCHING                   CONFIG_MQTT_BATCHING
+#define MQTT_BATCH_MAX_SIZE             CONFIG_MQTT_BATCH_MAX_SIZE
+#define MQTT_BATCH_MAX_LATENCY_MS       CONFIG_MQTT_BATCH_MAX_LATENCY_MS
+#define MQTT_BATCH_MAX_TOPICS           4
+#endif
+
+#ifdef CONFIG_MQTT_REASSEMBLY
+#define MQTT_REASSEMBLY                 CONFIG_MQTT_REASSEMBLY
+#endif
+
+#ifdef CONFIG_MQTT_INBOUND_FLOW_CONTROL
+#define MQTT_INBOUND_FLOW_CONTROL       CONFIG_MQTT_INBOUND_FLOW_CONTROL
+#endif
+
+#ifdef CONFIG_MQTT_LOCAL_LOOPBACK
+#define MQTT_LOCAL_LOOPBACK             CONFIG_MQTT_LOCAL_LOOPBACK
+#define MQTT_LOOPBACK_DEDUP_WINDOW_MS   CONFIG_MQTT_LOOPBACK_DEDUP_WINDOW_MS
+#define MQTT_LOOPBACK_DEDUP_SIZE        CONFIG_MQTT_LOOPBACK_DEDUP_SIZE
+#endif
+
+#ifdef CONFIG_MQTT_BROKER_FAILOVER
+#define MQTT_BROKER_FAILOVER            CONFIG_MQTT_BROKER_FAILOVER
+#define MQTT_FAILOVER_MAX_BACKOFF_MS    CONFIG_MQTT_FAILOVER_MAX_BACKOFF_MS
+#endif
+
+// a grown input buffer shrinks back to its configured size after this time without large messages
+#define MQTT_IN_BUFFER_SHRINK_TIMEOUT_MS    10000
+
+#ifdef CONFIG_MQTT_REQUEST_RESPONSE
+#define MQTT_REQUEST_RESPONSE           CONFIG_MQTT_REQUEST_RESPONSE
+#define MQTT_REQUEST_MAX_PENDING        CONFIG_MQTT_REQUEST_MAX_PENDING
+#define MQTT_REQUEST_TOPIC_PREFIX       CONFIG_MQTT_REQUEST_TOPIC_PREFIX
+// requests time out up to one wheel tick late
+#define MQTT_REQUEST_WHEEL_TICK_MS      100
+#define MQTT_REQUEST_WHEEL_SLOTS        64
+#endif
 #endif
@@ -0,0 +1,88 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_FAILOVER_H_
+#define _MQTT_FAILOVER_H_
+
+#include <stdint.h>
+#include "mqtt_alloc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Broker endpoints of the failover, ranked by their health.
+ *
+ * The score of an endpoint (in ms, lower is better) adds its connect latency, its ping round
+ * trip time and a penalty per consecutive failure, both times smoothed over the last samples.
+ * Endpoints not measured yet count with MQTT_FAILOVER_UNKNOWN_LATENCY_MS, ties go to the endpoint
+ * configured first. Each failure puts the endpoint in a backoff doubling from the base delay
+ * up to the maximum, with half of it random ("equal jitter"), so that a fleet of devices
+ * doesn't come back to a recovered broker at once.
+ */
+
+#define MQTT_FAILOVER_UNKNOWN_LATENCY_MS    1000
+#define MQTT_FAILOVER_FAILURE_PENALTY_MS    2000
+
+typedef struct mqtt_failover *mqtt_failover_handle_t;
+
+/* Random number in [0, max) */
+typedef int (*mqtt_failover_random_t)(int max);
+
+/**
+ * @brief Creates the endpoint table, the URIs are copied
+ *
+ * @param uris           NULL terminated list of broker URIs
+ * @param base_backoff   delay after the first failure of an endpoint, in ms
+ * @param max_backoff    upper bound of the delay, in ms
+ * @param allocator      allocator of the table, NULL for the heap
+ */
+mqtt_failover_handle_t mqtt_failover_create(const char *const *uris, uint32_t base_backoff, uint32_t max_backoff,
+                                            const mqtt_allocator_t *allocator);
+void mqtt_failover_destroy(mqtt_failover_handle_t failover);
+
+int mqtt_failover_count(mqtt_failover_handle_t failover);
+const char *mqtt_failover_uri(mqtt_failover_handle_t failover, int endpoint);
+uint32_t mqtt_failover_score(mqtt_failover_handle_t failover, int endpoint);
+
+/**
+ * @brief Selects the endpoint of the next connection: the best ranked one out of backoff,
+ *        the one ready first if all are in backoff
+ *
+ * @return index of the endpoint, the following calls report on it
+ */
+int mqtt_failover_select(mqtt_failover_handle_t failover, uint64_t now);
+
+/**
+ * @brief Number of endpoints out of backoff
+ */
+int mqtt_failover_ready(mqtt_failover_handle_t failover, uint64_t now);
+
+/**
+ * @brief Time until an endpoint is out of backoff, 0 if one is ready
+ */
+uint32_t mqtt_failover_wait(mqtt_failover_handle_t failover, uint64_t now);
+
+/**
+ * @brief Reports the selected endpoint connected, `latency` from the start of the transport connection to CONNACK
+ */
+void mqtt_failover_connected(mqtt_failover_handle_t failover, uint32_t latency);
+
+/**
+ * @brief Reports a failed connection or a lost one, the selected endpoint backs off
+ */
+void mqtt_failover_failed(mqtt_failover_handle_t failover, uint64_t now, mqtt_failover_random_t random);
+
+/**
+ * @brief Reports the round trip time of a ping to the selected endpoint
+ */
+void mqtt_failover_ping(mqtt_failover_handle_t failover, uint32_t rtt);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,88 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_LOOPBACK_H_
+#define _MQTT_LOOPBACK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+#include "mqtt_alloc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Local loopback of the messages published on topics the client subscribes to.
+ *
+ * Keeps the subscriptions of the client as acknowledged by the broker, so that a published
+ * message is delivered locally if the broker would send it back, and a window of the messages
+ * delivered locally, so that their echo from an MQTT 3.1.1 broker is dropped. Echoes are
+ * recognized by a fingerprint of the topic, the payload length and the start of the payload.
+ */
+
+typedef struct mqtt_loopback *mqtt_loopback_handle_t;
+
+/**
+ * @brief Creates the loopback state
+ *
+ * @param window_size number of messages delivered locally remembered at a time
+ * @param allocator   allocator of the state and the filters, NULL for the heap
+ */
+mqtt_loopback_handle_t mqtt_loopback_create(int window_size, const mqtt_allocator_t *allocator);
+void mqtt_loopback_destroy(mqtt_loopback_handle_t loopback);
+
+/**
+ * @brief Records the topics of a SUBSCRIBE sent with msg_id, they match once acknowledged
+ */
+esp_err_t mqtt_loopback_subscribe(mqtt_loopback_handle_t loopback, int msg_id, const esp_mqtt_topic_t *topic_list, int size);
+
+/**
+ * @brief Records an UNSUBSCRIBE sent with msg_id, the topic doesn't match anymore
+ */
+void mqtt_loopback_unsubscribe(mqtt_loopback_handle_t loopback, int msg_id, const char *topic);
+
+/**
+ * @brief Applies the return codes of a SUBACK, rejected topics are forgotten
+ */
+void mqtt_loopback_suback(mqtt_loopback_handle_t loopback, int msg_id, const uint8_t *return_codes, int count);
+void mqtt_loopback_unsuback(mqtt_loopback_handle_t loopback, int msg_id);
+
+/**
+ * @brief Forgets all the subscriptions, when the broker didn't keep the session
+ */
+void mqtt_loopback_clear_subscriptions(mqtt_loopback_handle_t loopback);
+
+/**
+ * @brief Finds the acknowledged subscriptions matching topic
+ *
+ * @return the highest QoS granted to them, -1 if no subscription matches
+ */
+int mqtt_loopback_match(mqtt_loopback_handle_t loopback, const char *topic, size_t topic_len);
+
+/**
+ * @brief Remembers a message delivered locally and sent to the broker, the oldest one is forgotten if the window is full
+ */
+void mqtt_loopback_delivered(mqtt_loopback_handle_t loopback, const char *topic, size_t topic_len,
+                             const char *data, size_t total_len, uint64_t tick);
+
+/**
+ * @brief Checks if a received message is the echo of one delivered locally within `window` ms, it's forgotten if so
+ *
+ * @param data      start of the payload
+ * @param data_len  length of `data`, the payload may be longer
+ * @param total_len length of the whole payload
+ */
+bool mqtt_loopback_is_echo(mqtt_loopback_handle_t loopback, const char *topic, size_t topic_len,
+                           const char *data, size_t data_len, size_t total_len, uint64_t now, uint64_t window);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -5,6 +5,7 @@
 
 #include "mqtt_config.h"
 #include "mqtt_client.h"
+#include "mqtt_alloc.h"
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -90,6 +91,7 @@ typedef struct mqtt_connection {
     uint8_t *buffer;
     size_t buffer_length;
     mqtt_connect_info_t information;
+    const mqtt_allocators_t *alloc;     /*!< allocators of the buffer and of the strings of `information`, NULL for the heap */
 
 } mqtt_connection_t;
 
@@ -129,12 +131,18 @@ char *mqtt_get_publish_data(uint8_t *buffer, size_t *length);
 char *mqtt_get_suback_data(uint8_t *buffer, size_t *length);
 uint16_t mqtt_get_id(uint8_t *buffer, size_t length);
 int mqtt_has_valid_msg_hdr(uint8_t *buffer, size_t length);
+bool mqtt_topic_matches(const char *filter, const char *topic, size_t topic_len);
+bool mqtt_topic_matches_any(const char *const *filters, const char *topic, size_t topic_len);
 
 esp_err_t mqtt_msg_buffer_init(mqtt_connection_t *connection, int buffer_size);
 void mqtt_msg_buffer_destroy(mqtt_connection_t *connection);
 
 mqtt_message_t *mqtt_msg_connect(mqtt_connection_t *connection, mqtt_connect_info_t *info);
 mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id);
+/* builds the publish message up to the payload, data_length bytes of payload are to be written after it */
+mqtt_message_t *mqtt_msg_publish_header(mqtt_connection_t *connection, const char *topic, int data_length, int qos, int retain, uint16_t *message_id);
+/* reserves the next message id of the connection, for messages encoded elsewhere */
+uint16_t mqtt_msg_next_id(mqtt_connection_t *connection);
 mqtt_message_t *mqtt_msg_puback(mqtt_connection_t *connection, uint16_t message_id);
 mqtt_message_t *mqtt_msg_pubrec(mqtt_connection_t *connection, uint16_t message_id);
 mqtt_message_t *mqtt_msg_pubrel(mqtt_connection_t *connection, uint16_t message_id);
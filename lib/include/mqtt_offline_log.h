@@ -0,0 +1,119 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_OFFLINE_LOG_H_
+#define _MQTT_OFFLINE_LOG_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+#include "mqtt_alloc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Segmented append-only log used to store publish messages while the client
+ * is offline. Records are framed as
+ *
+ *   | magic:1 | flags:1 | topic_len:2 | data_len:4 | crc32:4 | topic | data |
+ *
+ * (all integers little endian, crc covers the first 8 header bytes, topic and data).
+ * Records never span segments. A checkpoint stores the position of the first
+ * record which hasn't been acknowledged by the broker; segments entirely below
+ * the checkpoint are removed (compaction).
+ */
+
+#define MQTT_OFFLINE_LOG_RECORD_HEADER_LEN  12
+
+typedef struct mqtt_offline_log *mqtt_offline_log_handle_t;
+
+typedef struct mqtt_offline_log_pos {
+    uint32_t segment;
+    uint32_t offset;
+} mqtt_offline_log_pos_t;
+
+typedef struct mqtt_offline_log_record {
+    const char *topic;          /* NUL terminated, valid until the next read */
+    int topic_len;
+    const char *data;           /* valid until the next read */
+    int data_len;
+    int qos;
+    int retain;
+} mqtt_offline_log_record_t;
+
+typedef struct mqtt_offline_log_stats {
+    uint64_t appended_bytes;    /* topic and payload bytes accepted by append */
+    uint64_t written_bytes;     /* bytes physically written (records and checkpoints) */
+    uint32_t appended_records;
+    uint32_t replayed_records;
+    uint32_t acked_records;
+    uint32_t corrupted_records;
+    uint32_t dropped_segments;  /* unacknowledged segments dropped to honor max_segments */
+    uint32_t compacted_segments;
+} mqtt_offline_log_stats_t;
+
+/**
+ * @brief Opens (or creates) the log, recovering the write position and the last checkpoint
+ *
+ * @param storage       storage backend, if NULL the stdio file backend rooted at `path` is used
+ * @param path          directory of the file backend (ignored if storage is set)
+ * @param segment_size  maximum size of one segment in bytes
+ * @param max_segments  maximum number of segments kept (0 = unlimited)
+ * @param batch_size    maximum number of records replayed before waiting for acknowledges
+ * @param allocator     allocator of the log and its buffers, NULL for the heap
+ */
+mqtt_offline_log_handle_t mqtt_offline_log_open(const esp_mqtt_offline_storage_t *storage, const char *path,
+                                                size_t segment_size, int max_segments, int batch_size,
+                                                const mqtt_allocator_t *allocator);
+void mqtt_offline_log_close(mqtt_offline_log_handle_t log);
+
+esp_err_t mqtt_offline_log_append(mqtt_offline_log_handle_t log, const char *topic, int topic_len,
+                                  const char *data, int data_len, int qos, int retain);
+
+/**
+ * @brief Returns true if there are no records waiting to be replayed or acknowledged
+ */
+bool mqtt_offline_log_is_drained(mqtt_offline_log_handle_t log);
+
+/**
+ * @brief Returns true if another record of the current batch could be read
+ */
+bool mqtt_offline_log_can_replay(mqtt_offline_log_handle_t log);
+
+/**
+ * @brief Reads the next record to replay
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if nothing to replay (or batch is full)
+ */
+esp_err_t mqtt_offline_log_read(mqtt_offline_log_handle_t log, mqtt_offline_log_record_t *record);
+
+/**
+ * @brief Binds the last read record to the msg_id it was sent with (0 for QoS0, acknowledged immediately)
+ */
+void mqtt_offline_log_sent(mqtt_offline_log_handle_t log, int msg_id);
+
+/**
+ * @brief Acknowledges a replayed record; once the batch is fully acknowledged the checkpoint is stored
+ *
+ * @return true if msg_id belonged to the log
+ */
+bool mqtt_offline_log_ack(mqtt_offline_log_handle_t log, int msg_id);
+
+/**
+ * @brief Drops the in-flight batch and restarts replay from the last checkpoint (on disconnection)
+ */
+void mqtt_offline_log_rewind(mqtt_offline_log_handle_t log);
+
+void mqtt_offline_log_get_stats(mqtt_offline_log_handle_t log, mqtt_offline_log_stats_t *stats);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -3,6 +3,7 @@
 
 #include "platform.h"
 #include "esp_err.h"
+#include "mqtt_alloc.h"
 
 /* --- QoS1 queue integration --- */
 #include "ED_mqtt_qos1_queue.h"
@@ -17,6 +18,7 @@ typedef struct outbox_t outbox_t;
 typedef struct outbox_t *outbox_handle_t;
 typedef struct outbox_item *outbox_item_handle_t;
 typedef struct outbox_message *outbox_message_handle_t;
+typedef struct outbox_shared_payload *outbox_shared_payload_handle_t;
 typedef long long outbox_tick_t;
 
 typedef struct outbox_message {
@@ -27,6 +29,7 @@ typedef struct outbox_message {
     int msg_type;
     uint8_t *remaining_data;
     int remaining_len;
+    outbox_shared_payload_handle_t shared;  /* payload referenced by the item, sent after data */
 } outbox_message_t;
 
 typedef enum pending_state {
@@ -36,11 +39,28 @@ typedef enum pending_state {
     CONFIRMED
 } pending_state_t;
 
-outbox_handle_t outbox_init(esp_mqtt_client_handle_t client);
+typedef void (*outbox_item_visitor_t)(outbox_item_handle_t item, void *ctx);
+
+/*
+ * Reference counted payload, an item enqueued with it takes a reference until it's deleted.
+ * Provided by lib/mqtt_outbox_shared.c to any outbox implementation, custom ones included.
+ */
+outbox_shared_payload_handle_t outbox_shared_payload_create(const uint8_t *data, size_t len);
+outbox_shared_payload_handle_t outbox_shared_payload_retain(outbox_shared_payload_handle_t payload);
+/* NULL and a zero length for a NULL payload */
+const uint8_t *outbox_shared_payload_get_data(outbox_shared_payload_handle_t payload, size_t *len);
+void outbox_shared_payload_release(outbox_shared_payload_handle_t payload);
+
+/* the outbox, its messages and its QoS1 queue are allocated with `allocator` (NULL: heap) */
+outbox_handle_t outbox_init(esp_mqtt_client_handle_t client, const mqtt_allocator_t *allocator);
 outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick);
+/* Same as outbox_enqueue(), but replaces a queued (not transmitted) publish on the same topic, keeping its tick */
+outbox_item_handle_t outbox_enqueue_latest(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick);
 outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick);
 outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id);
 uint8_t *outbox_item_get_data(outbox_item_handle_t item,  size_t *len, uint16_t *msg_id, int *msg_type, int *qos);
+/* Shared payload of the item following its data, NULL if none */
+const uint8_t *outbox_item_get_shared(outbox_item_handle_t item, size_t *len);
 esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type);
 esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item);
 int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout);
@@ -48,7 +68,18 @@ int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_t
 esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending);
 pending_state_t outbox_item_get_pending(outbox_item_handle_t item);
 esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick);
+/* Messages past their expiry tick (0 = never) are removed by outbox_delete_expired() */
+void outbox_item_set_expiry(outbox_item_handle_t item, outbox_tick_t expiry);
+outbox_tick_t outbox_item_get_expiry(outbox_item_handle_t item);
+/* Queued messages are dequeued from the highest priority first (MQTT_PRIORITY_NORMAL by default) */
+void outbox_item_set_priority(outbox_item_handle_t item, int priority);
+int outbox_item_get_priority(outbox_item_handle_t item);
 size_t outbox_get_size(outbox_handle_t outbox);
+/* True if the next outbox_enqueue() would drop the oldest message */
+bool outbox_is_full(outbox_handle_t outbox);
+/* QoS1 queue of the outbox's client, freed with the outbox */
+mqtt_qos1q_handle_t outbox_get_qos1_queue(outbox_handle_t outbox);
+void outbox_for_each(outbox_handle_t outbox, outbox_item_visitor_t visitor, void *ctx);
 void outbox_destroy(outbox_handle_t outbox);
 void outbox_delete_all_items(outbox_handle_t outbox);
 
@@ -0,0 +1,565 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_OUTBOX_POOL_HPP_
+#define _MQTT_OUTBOX_POOL_HPP_
+
+/*
+ * Pool-based outbox, the implementation behind the `mqtt_outbox.h` API with CONFIG_MQTT_OUTBOX_POOL
+ * (lib/mqtt_outbox_pool.cpp). Kept header-only so that it can be benchmarked against lib/mqtt_outbox.c.
+ *
+ * - Items come from a `std::pmr::unsynchronized_pool_resource` over a monotonic buffer, so enqueue and
+ *   delete don't go to the heap once the pool is warm.
+ * - Message bytes are copied to a contiguous byte arena (a ring, see `byte_arena`), or to the allocator
+ *   of the outbox when they don't fit.
+ * - Items are found by id through a hash table and kept in one list per state (and per priority lane
+ *   for queued messages), ordered by tick, so dequeue and the expiry scans touch only the list heads.
+ *
+ * Allocations of the pool throw `std::bad_alloc` once the allocator is exhausted, they are caught here
+ * and reported as failures of the outbox API.
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include "mqtt_outbox.h"
+#include "mqtt_alloc.h"
+#include "mqtt_msg.h"
+#include "mqtt_config.h"
+
+namespace esp_mqtt {
+
+/*
+ * Memory resource over an allocator of the client, throws std::bad_alloc when it fails.
+ * Over-aligned blocks (the pool aligns its chunks) keep the allocated pointer right before them.
+ */
+class allocator_resource : public std::pmr::memory_resource {
+public:
+    explicit allocator_resource(const mqtt_allocator_t *allocator) noexcept : allocator{allocator} {}
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if (alignment <= alignof(std::max_align_t)) {
+            void *ptr = mqtt_alloc(allocator, bytes);
+            if (ptr == nullptr) {
+                throw std::bad_alloc();
+            }
+            return ptr;
+        }
+        void *raw = bytes <= SIZE_MAX - alignment ? mqtt_alloc(allocator, bytes + alignment) : nullptr;
+        if (raw == nullptr) {
+            throw std::bad_alloc();
+        }
+        auto aligned = (reinterpret_cast<std::uintptr_t>(raw) + alignment) & ~(alignment - 1);
+        reinterpret_cast<void **>(aligned)[-1] = raw;
+        return reinterpret_cast<void *>(aligned);
+    }
+    void do_deallocate(void *ptr, std::size_t, std::size_t alignment) override
+    {
+        mqtt_free(allocator, alignment <= alignof(std::max_align_t) ? ptr : static_cast<void **>(ptr)[-1]);
+    }
+    [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+    const mqtt_allocator_t *allocator;
+};
+
+/*
+ * Ring of variable sized records in one contiguous block.
+ * Records are freed in any order, the space of a freed record is reused once all the
+ * records allocated before it are freed too.
+ */
+class byte_arena {
+public:
+    byte_arena(std::uint8_t *base, std::size_t capacity) noexcept
+        : base{base}, capacity{base ? capacity / sizeof(record) * sizeof(record) : 0} {}
+
+    [[nodiscard]] std::uint8_t *allocate(std::size_t len) noexcept
+    {
+        if (len > capacity) {
+            return nullptr;
+        }
+        std::size_t size = (len + 2 * sizeof(record) - 1) / sizeof(record) * sizeof(record);
+        if (size > capacity) {
+            return nullptr;
+        }
+        if (used == 0) {
+            head = tail = 0;
+        }
+        if (head >= tail && !(used && head == tail)) {
+            if (capacity - head < size) {
+                // the end is too short, skip it if the beginning is large enough
+                if (tail < size) {
+                    return nullptr;
+                }
+                *at(head) = {static_cast<std::uint32_t>(capacity - head), false};
+                used += capacity - head;
+                head = 0;
+            }
+        } else if (tail - head < size) {
+            return nullptr;
+        }
+        record *rec = at(head);
+        *rec = {static_cast<std::uint32_t>(size), true};
+        head = (head + size) % capacity;
+        used += size;
+        return reinterpret_cast<std::uint8_t *>(rec + 1);
+    }
+
+    void deallocate(std::uint8_t *ptr) noexcept
+    {
+        reinterpret_cast<record *>(ptr)[-1].live = false;
+        while (used && !at(tail)->live) {
+            used -= at(tail)->size;
+            tail = (tail + at(tail)->size) % capacity;
+        }
+    }
+
+    [[nodiscard]] bool owns(const std::uint8_t *ptr) const noexcept
+    {
+        // records start with their header, so a record ending the block points at its end
+        return ptr > base && ptr <= base + capacity;
+    }
+    /* bytes between the oldest live record and the next one, holes included */
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return used;
+    }
+private:
+    struct record {
+        std::uint32_t size;     /* with this header */
+        std::uint32_t live;
+    };
+    record *at(std::size_t offset) const noexcept
+    {
+        return reinterpret_cast<record *>(base + offset);
+    }
+    std::uint8_t *base;
+    std::size_t capacity;
+    std::size_t head = 0;
+    std::size_t tail = 0;
+    std::size_t used = 0;
+};
+
+class pool_outbox {
+public:
+    static constexpr int priority_lanes = MQTT_PRIORITY_URGENT + 1;
+
+    struct item {
+        pool_outbox *owner;     /* the item API of mqtt_outbox.h has no outbox parameter */
+        item *prev;             /* in the list of its state */
+        item *next;
+        item *id_next;          /* in the hash bucket of its id */
+        item *expiry_prev;      /* in the expiry list, if it expires */
+        item *expiry_next;
+        std::uint8_t *data;
+        std::size_t len;
+        outbox_shared_payload_handle_t shared;
+        outbox_tick_t tick;
+        outbox_tick_t expiry;
+        int msg_id;
+        int msg_type;
+        int qos;
+        int priority;
+        pending_state_t state;
+    };
+
+    /**
+     * @param allocator  allocator of the buffers and of the messages not fitting in the arena, NULL for the heap
+     * @param pool_size  size of the monotonic buffer the items are taken from
+     * @param arena_size size of the byte arena
+     */
+    pool_outbox(const mqtt_allocator_t *allocator, std::size_t pool_size, std::size_t arena_size) noexcept
+        : allocator{allocator}, upstream{allocator},
+          pool_buffer{allocator, pool_size}, arena_buffer{allocator, arena_size},
+          monotonic{pool_buffer.data, pool_buffer.data ? pool_size : 0, &upstream},
+          // small chunks, the pool would otherwise double them and draw far more than used from the buffer.
+          // The hash table grows by doubling, its larger arrays go to the monotonic buffer
+          pool{std::pmr::pool_options{.max_blocks_per_chunk = 16, .largest_required_pool_block = 512}, &monotonic},
+          arena{static_cast<std::uint8_t *>(arena_buffer.data), arena_size} {}
+    ~pool_outbox()
+    {
+        clear();
+        release_buckets();
+    }
+    pool_outbox(const pool_outbox &) = delete;
+    pool_outbox &operator=(const pool_outbox &) = delete;
+
+    [[nodiscard]] explicit operator bool() const noexcept
+    {
+        return pool_buffer.data && arena_buffer.data;
+    }
+
+    item *enqueue(const outbox_message_t &message, outbox_tick_t tick) noexcept
+    {
+        std::size_t len = message.len + message.remaining_len;
+        if (!reserve()) {
+            return nullptr;
+        }
+        item *it;
+        try {
+            it = static_cast<item *>(pool.allocate(sizeof(item), alignof(item)));
+        } catch (const std::bad_alloc &) {
+            return nullptr;
+        }
+        std::uint8_t *data = arena.allocate(len);
+        if (data == nullptr) {
+            data = static_cast<std::uint8_t *>(mqtt_alloc(allocator, len));
+            if (data == nullptr) {
+                pool.deallocate(it, sizeof(item), alignof(item));
+                return nullptr;
+            }
+        }
+        std::memcpy(data, message.data, message.len);
+        if (message.remaining_data) {
+            std::memcpy(data + message.len, message.remaining_data, message.remaining_len);
+        }
+        new (it) item{
+            .owner = this, .prev = nullptr, .next = nullptr, .id_next = nullptr, .expiry_prev = nullptr, .expiry_next = nullptr,
+            .data = data, .len = len,
+            // the header stays per client, the payload is shared
+            .shared = outbox_shared_payload_retain(message.shared),
+            .tick = tick, .expiry = 0,
+            .msg_id = message.msg_id, .msg_type = message.msg_type, .qos = message.msg_qos,
+            .priority = MQTT_PRIORITY_NORMAL, .state = QUEUED,
+        };
+        link(it);
+        hash_insert(it);
+        total_size += len + shared_len(it);
+        return it;
+    }
+
+    /* Same as enqueue(), but replaces a queued publish on the same topic, keeping its tick */
+    item *enqueue_latest(const outbox_message_t &message, outbox_tick_t tick) noexcept
+    {
+        std::size_t topic_len = message.len;
+        const char *topic = mqtt_get_publish_topic(message.data, &topic_len);
+        if (message.msg_type == MQTT_MSG_TYPE_PUBLISH && topic && topic_len > 0) {
+            for (int lane = 0; lane < priority_lanes; ++lane) {
+                for (item *it = lists[lane].head; it; it = it->next) {
+                    if (it->msg_type != MQTT_MSG_TYPE_PUBLISH) {
+                        continue;
+                    }
+                    std::size_t item_topic_len = it->len;
+                    const char *item_topic = mqtt_get_publish_topic(it->data, &item_topic_len);
+                    if (item_topic && item_topic_len == topic_len && std::memcmp(item_topic, topic, topic_len) == 0) {
+                        tick = it->tick;
+                        erase(it);
+                        return enqueue(message, tick);
+                    }
+                }
+            }
+        }
+        return enqueue(message, tick);
+    }
+
+    [[nodiscard]] item *get(int msg_id) const noexcept
+    {
+        if (buckets == nullptr) {
+            return nullptr;
+        }
+        for (item *it = buckets[bucket_of(msg_id)]; it; it = it->id_next) {
+            if (it->msg_id == msg_id) {
+                return it;
+            }
+        }
+        return nullptr;
+    }
+
+    /*
+     * Queued messages are served from the highest lane first, each MQTT_PRIORITY_AGING_MS of waiting
+     * counts as one more level. Messages in the other states are served oldest first.
+     */
+    [[nodiscard]] item *dequeue(pending_state_t state, outbox_tick_t now) const noexcept
+    {
+        if (state != QUEUED) {
+            return lists[list_of(state, 0)].head;
+        }
+        item *best = nullptr;
+        outbox_tick_t best_score = 0;
+        for (int lane = priority_lanes - 1; lane >= 0; --lane) {
+            item *it = lists[lane].head;
+            if (it) {
+                outbox_tick_t score = static_cast<outbox_tick_t>(lane) * MQTT_PRIORITY_AGING_MS + (now - it->tick);
+                if (best == nullptr || score > best_score) {
+                    best = it;
+                    best_score = score;
+                }
+            }
+        }
+        return best;
+    }
+
+    void erase(item *it) noexcept
+    {
+        unlink(it);
+        hash_remove(it);
+        expiry_unlink(it);
+        total_size -= it->len + shared_len(it);
+        if (arena.owns(it->data)) {
+            arena.deallocate(it->data);
+        } else {
+            mqtt_free(allocator, it->data);
+        }
+        outbox_shared_payload_release(it->shared);
+        pool.deallocate(it, sizeof(item), alignof(item));
+    }
+
+    void set_state(item *it, pending_state_t state) noexcept
+    {
+        if (it->state != state) {
+            unlink(it);
+            it->state = state;
+            link(it);
+        }
+    }
+
+    void set_tick(item *it, outbox_tick_t tick) noexcept
+    {
+        unlink(it);
+        it->tick = tick;
+        link(it);
+    }
+
+    void set_priority(item *it, int priority) noexcept
+    {
+        priority = priority < MQTT_PRIORITY_LOW ? MQTT_PRIORITY_LOW : priority >= priority_lanes ? priority_lanes - 1 : priority;
+        unlink(it);
+        it->priority = priority;
+        link(it);
+    }
+
+    void set_expiry(item *it, outbox_tick_t expiry) noexcept
+    {
+        expiry_unlink(it);
+        it->expiry = expiry;
+        if (expiry == 0) {
+            return;
+        }
+        item *after = expiring.tail;
+        while (after && after->expiry > expiry) {
+            after = after->expiry_prev;
+        }
+        it->expiry_prev = after;
+        it->expiry_next = after ? after->expiry_next : expiring.head;
+        (it->expiry_next ? it->expiry_next->expiry_prev : expiring.tail) = it;
+        (after ? after->expiry_next : expiring.head) = it;
+    }
+
+    /*
+     * Removes the messages older than the timeout and the ones past their expiry, unless already
+     * received by the broker. Stops after the first one if `single` is set.
+     *
+     * @return number of removed messages, or the id of the removed message if `single`, -1 if none
+     */
+    int delete_expired(outbox_tick_t now, outbox_tick_t timeout, bool single = false) noexcept
+    {
+        int removed = 0;
+        for (auto &list : lists) {
+            while (list.head && now - list.head->tick > timeout) {
+                if (single) {
+                    int msg_id = list.head->msg_id;
+                    erase(list.head);
+                    return msg_id;
+                }
+                erase(list.head);
+                ++removed;
+            }
+        }
+        item *it = expiring.head;
+        while (it && it->expiry <= now) {
+            item *next = it->expiry_next;
+            if (it->state != ACKNOWLEDGED) {
+                if (single) {
+                    int msg_id = it->msg_id;
+                    erase(it);
+                    return msg_id;
+                }
+                erase(it);
+                ++removed;
+            }
+            it = next;
+        }
+        return single ? -1 : removed;
+    }
+
+    template <typename Visitor>
+    void for_each(Visitor &&visitor)
+    {
+        for (auto &list : lists) {
+            for (item *it = list.head, *next; it; it = next) {
+                next = it->next;
+                visitor(it);
+            }
+        }
+    }
+
+    void clear() noexcept
+    {
+        for (auto &list : lists) {
+            while (list.head) {
+                erase(list.head);
+            }
+        }
+    }
+
+    /* bytes of the queued messages, shared payloads included */
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return total_size;
+    }
+
+private:
+    /* Block of the allocator, freed after the resources using it */
+    struct buffer {
+        buffer(const mqtt_allocator_t *allocator, std::size_t size) noexcept
+            : allocator{allocator}, data{mqtt_alloc(allocator, size)} {}
+        ~buffer()
+        {
+            mqtt_free(allocator, data);
+        }
+        const mqtt_allocator_t *allocator;
+        void *data;
+    };
+
+    struct list {
+        item *head = nullptr;
+        item *tail = nullptr;
+    };
+
+    static std::size_t shared_len(const item *it) noexcept
+    {
+        std::size_t len;
+        outbox_shared_payload_get_data(it->shared, &len);
+        return len;
+    }
+
+    static int list_of(pending_state_t state, int priority) noexcept
+    {
+        return state == QUEUED ? priority : priority_lanes + state - 1;
+    }
+
+    /* Inserts the item in the list of its state, after the items with the same or an older tick */
+    void link(item *it) noexcept
+    {
+        list &l = lists[list_of(it->state, it->priority)];
+        item *after = l.tail;
+        while (after && after->tick > it->tick) {
+            after = after->prev;
+        }
+        it->prev = after;
+        it->next = after ? after->next : l.head;
+        (it->next ? it->next->prev : l.tail) = it;
+        (after ? after->next : l.head) = it;
+    }
+
+    void unlink(item *it) noexcept
+    {
+        list &l = lists[list_of(it->state, it->priority)];
+        (it->prev ? it->prev->next : l.head) = it->next;
+        (it->next ? it->next->prev : l.tail) = it->prev;
+        it->prev = it->next = nullptr;
+    }
+
+    void expiry_unlink(item *it) noexcept
+    {
+        if (it->expiry == 0) {
+            return;
+        }
+        (it->expiry_prev ? it->expiry_prev->expiry_next : expiring.head) = it->expiry_next;
+        (it->expiry_next ? it->expiry_next->expiry_prev : expiring.tail) = it->expiry_prev;
+        it->expiry_prev = it->expiry_next = nullptr;
+    }
+
+    [[nodiscard]] std::size_t bucket_of(int msg_id) const noexcept
+    {
+        return static_cast<unsigned>(msg_id) & (bucket_count - 1);
+    }
+
+    /* Grows the table at load 1, a table that can't grow stays correct, with longer chains */
+    bool reserve() noexcept
+    {
+        if (count + 1 > bucket_count) {
+            rehash(bucket_count ? bucket_count * 2 : 16);
+        }
+        return buckets != nullptr;
+    }
+
+    void hash_insert(item *it) noexcept
+    {
+        ++count;
+        item *&bucket = buckets[bucket_of(it->msg_id)];
+        it->id_next = bucket;
+        bucket = it;
+    }
+
+    void hash_remove(item *it) noexcept
+    {
+        --count;
+        for (item **link = &buckets[bucket_of(it->msg_id)]; *link; link = &(*link)->id_next) {
+            if (*link == it) {
+                *link = it->id_next;
+                return;
+            }
+        }
+    }
+
+    void rehash(std::size_t new_count) noexcept
+    {
+        item **new_buckets;
+        try {
+            new_buckets = static_cast<item **>(pool.allocate(new_count * sizeof(item *), alignof(item *)));
+        } catch (const std::bad_alloc &) {
+            return;
+        }
+        std::fill_n(new_buckets, new_count, nullptr);
+        std::size_t old_count = bucket_count;
+        item **old_buckets = buckets;
+        buckets = new_buckets;
+        bucket_count = new_count;
+        for (std::size_t i = 0; old_buckets && i < old_count; ++i) {
+            for (item *it = old_buckets[i], *next; it; it = next) {
+                next = it->id_next;
+                item *&bucket = buckets[bucket_of(it->msg_id)];
+                it->id_next = bucket;
+                bucket = it;
+            }
+        }
+        if (old_buckets) {
+            pool.deallocate(old_buckets, old_count * sizeof(item *), alignof(item *));
+        }
+    }
+
+    void release_buckets() noexcept
+    {
+        if (buckets) {
+            pool.deallocate(buckets, bucket_count * sizeof(item *), alignof(item *));
+            buckets = nullptr;
+        }
+    }
+
+    const mqtt_allocator_t *allocator;
+    allocator_resource upstream;
+    buffer pool_buffer;
+    buffer arena_buffer;
+    std::pmr::monotonic_buffer_resource monotonic;
+    std::pmr::unsynchronized_pool_resource pool;
+    byte_arena arena;
+    list lists[priority_lanes + 3];     /* queued lanes, then TRANSMITTED, ACKNOWLEDGED, CONFIRMED */
+    list expiring;                      /* items with an expiry, by expiry */
+    item **buckets = nullptr;
+    std::size_t bucket_count = 0;
+    std::size_t count = 0;
+    std::size_t total_size = 0;
+};
+
+}  // namespace esp_mqtt
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_QOS2_H_
+#define _MQTT_QOS2_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "mqtt_alloc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * In-flight table of the outgoing QoS2 publishes.
+ *
+ * Each packet id in flight has an explicit state: PUBLISH_SENT until PUBREC, then PUBREL_SENT
+ * until PUBCOMP. The publish itself stays in the outbox only until PUBREC, afterwards the table
+ * entry is all that's kept. Entries are found by packet id through an open addressed index,
+ * and the entries of each state are linked in the order of their last transmission, so that
+ * the PUBRELs due for a retry are the head of their list.
+ * The capacity is fixed at creation, it bounds the number of QoS2 publishes in flight.
+ */
+
+typedef struct mqtt_qos2_table *mqtt_qos2_table_handle_t;
+
+typedef enum {
+    MQTT_QOS2_NONE = 0,         /* not in flight */
+    MQTT_QOS2_PUBLISH_SENT,     /* waiting for PUBREC */
+    MQTT_QOS2_PUBREL_SENT,      /* waiting for PUBCOMP */
+} mqtt_qos2_state_t;
+
+typedef esp_err_t (*mqtt_qos2_send_t)(uint16_t msg_id, void *ctx);
+typedef void (*mqtt_qos2_visitor_t)(uint16_t msg_id, mqtt_qos2_state_t state, void *ctx);
+
+/* The table is allocated with `allocator`, NULL for the heap */
+mqtt_qos2_table_handle_t mqtt_qos2_table_create(int capacity, const mqtt_allocator_t *allocator);
+void mqtt_qos2_table_destroy(mqtt_qos2_table_handle_t table);
+
+/**
+ * @brief Records a publish (re)transmitted with msg_id
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM if the table is full, ESP_ERR_INVALID_STATE if the id
+ *         was already received by the broker
+ */
+esp_err_t mqtt_qos2_publish_sent(mqtt_qos2_table_handle_t table, uint16_t msg_id, uint64_t tick);
+
+/**
+ * @brief Moves msg_id to PUBREL_SENT on PUBREC, the id is added if it's unknown (restored session)
+ *
+ * @return ESP_OK, ESP_ERR_NO_MEM if an unknown id doesn't fit
+ */
+esp_err_t mqtt_qos2_pubrel_sent(mqtt_qos2_table_handle_t table, uint16_t msg_id, uint64_t tick);
+
+/**
+ * @brief Removes msg_id on PUBCOMP
+ *
+ * @return true if the id was waiting for PUBCOMP
+ */
+bool mqtt_qos2_pubcomp(mqtt_qos2_table_handle_t table, uint16_t msg_id);
+
+mqtt_qos2_state_t mqtt_qos2_get_state(mqtt_qos2_table_handle_t table, uint16_t msg_id);
+int mqtt_qos2_count(mqtt_qos2_table_handle_t table, mqtt_qos2_state_t state);
+bool mqtt_qos2_is_full(mqtt_qos2_table_handle_t table);
+
+/**
+ * @brief Sends the PUBRELs not acknowledged within `timeout`, up to `max` of them, oldest first
+ *
+ * Stops at the first send error.
+ *
+ * @return number of PUBRELs sent
+ */
+int mqtt_qos2_resend_pubrel(mqtt_qos2_table_handle_t table, uint64_t now, uint64_t timeout, int max,
+                            mqtt_qos2_send_t send, void *ctx);
+
+/**
+ * @brief Removes the ids first sent more than `timeout` ago
+ *
+ * @return number of ids removed
+ */
+int mqtt_qos2_delete_expired(mqtt_qos2_table_handle_t table, uint64_t now, uint64_t timeout);
+
+/**
+ * @brief Calls the visitor for each id in the given state, oldest first
+ */
+void mqtt_qos2_for_each(mqtt_qos2_table_handle_t table, mqtt_qos2_state_t state, mqtt_qos2_visitor_t visitor, void *ctx);
+
+void mqtt_qos2_clear(mqtt_qos2_table_handle_t table);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
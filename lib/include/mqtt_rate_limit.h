@@ -0,0 +1,74 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_RATE_LIMIT_H_
+#define _MQTT_RATE_LIMIT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "mqtt_client.h"
+#include "mqtt_alloc.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Token buckets (messages and bytes) for the whole client and for each configured
+ * topic filter. A bucket holds at most `burst` tokens and refills at `rate` tokens
+ * per second. A message may be sent while all its buckets hold at least one token,
+ * its size is then taken even if the bucket goes into debt, so that messages larger
+ * than the burst still get through (followed by a proportionally longer pause).
+ */
+
+typedef struct mqtt_rate_limit *mqtt_rate_limit_handle_t;
+
+/**
+ * @brief Creates the limiter, topic filters are copied
+ *
+ * @param allocator allocator of the limiter, NULL for the heap
+ *
+ * @return NULL if no limit is configured or on allocation failure
+ */
+mqtt_rate_limit_handle_t mqtt_rate_limit_create(const esp_mqtt_rate_limit_t *client_limit,
+                                                const esp_mqtt_topic_rate_limit_t *topics, int topics_count,
+                                                const mqtt_allocator_t *allocator);
+void mqtt_rate_limit_destroy(mqtt_rate_limit_handle_t limiter);
+
+/**
+ * @brief Returns true if the client and all matching topic buckets allow sending a message now, nothing is taken
+ */
+bool mqtt_rate_limit_check(mqtt_rate_limit_handle_t limiter, const char *topic, size_t topic_len, uint64_t now_ms);
+
+/**
+ * @brief Takes the tokens of a message if the client and all matching topic buckets allow it
+ *
+ * @return true if the message can be sent now, false if it has to wait (nothing is taken)
+ */
+bool mqtt_rate_limit_acquire(mqtt_rate_limit_handle_t limiter, const char *topic, size_t topic_len,
+                             size_t len, uint64_t now_ms);
+
+/**
+ * @brief Returns true if the client bucket allows sending (topic buckets are not checked)
+ */
+bool mqtt_rate_limit_ready(mqtt_rate_limit_handle_t limiter, uint64_t now_ms);
+
+/**
+ * @brief Takes the tokens of a message unconditionally
+ */
+void mqtt_rate_limit_consume(mqtt_rate_limit_handle_t limiter, const char *topic, size_t topic_len,
+                             size_t len, uint64_t now_ms);
+
+/**
+ * @brief Time until mqtt_rate_limit_check() allows a message on topic, 0 if it does now
+ */
+uint32_t mqtt_rate_limit_wait_ms(mqtt_rate_limit_handle_t limiter, const char *topic, size_t topic_len, uint64_t now_ms);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,98 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _MQTT_SESSION_H_
+#define _MQTT_SESSION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+#include "mqtt_alloc.h"
+#include "mqtt_outbox.h"
+#include "mqtt_qos2.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Client side session state kept across restarts when clean session is disabled.
+ * The snapshot is a versioned blob (all integers little endian):
+ *
+ *   header:       | magic:4 | version:1 | reserved:1 | last_msg_id:2 | outbox:2 | qos1:2 | subscriptions:2 | pubrel:2 |
+ *   outbox item:  | msg_id:2 | type:1 | qos:1 | state:1 | priority:1 | len:4 | packet |
+ *   qos1 slot:    | msg_id:2 | retain:1 | reserved:1 | topic_len:2 | payload_len:2 | topic | payload |
+ *   subscription: | msg_id:2 | state:1 | qos:1 | ack_index:2 | filter_len:2 | filter |
+ *   pubrel:       | msg_id:2 |
+ *   trailer:      | crc32:4 |
+ *
+ * Outbox items carry the encoded packets (in-flight QoS2 publishes, unacknowledged
+ * SUBSCRIBE/UNSUBSCRIBE); QoS0 publishes are never stored. QoS2 publishes received by the
+ * broker are only kept as the ids waiting for PUBCOMP, in the former reserved header field,
+ * so that snapshots of older releases are restored as well.
+ */
+
+#define MQTT_SESSION_VERSION 1
+
+typedef struct mqtt_session *mqtt_session_handle_t;
+
+/**
+ * @brief Creates the session, storage callbacks are copied
+ *
+ * @param storage   storage backend of the snapshot
+ * @param max_size  maximum size of the snapshot blob
+ * @param allocator allocator of the session and its snapshots, NULL for the heap
+ */
+mqtt_session_handle_t mqtt_session_create(const esp_mqtt_session_storage_t *storage, size_t max_size, const mqtt_allocator_t *allocator);
+void mqtt_session_destroy(mqtt_session_handle_t session);
+
+/**
+ * @brief Records the topics of a SUBSCRIBE sent with msg_id, they become active once acknowledged
+ */
+esp_err_t mqtt_session_subscribe(mqtt_session_handle_t session, int msg_id, const esp_mqtt_topic_t *topic_list, int size);
+
+/**
+ * @brief Records an UNSUBSCRIBE sent with msg_id, the topic is removed once acknowledged
+ */
+void mqtt_session_unsubscribe(mqtt_session_handle_t session, int msg_id, const char *topic);
+
+/**
+ * @brief Applies the return codes of a SUBACK, rejected topics are forgotten
+ */
+void mqtt_session_suback(mqtt_session_handle_t session, int msg_id, const uint8_t *return_codes, int count);
+void mqtt_session_unsuback(mqtt_session_handle_t session, int msg_id);
+
+/**
+ * @brief Lists the subscriptions (active or being subscribed), starting from offset
+ *
+ * Filters point to the session memory and are valid until the subscription is removed.
+ *
+ * @return number of topics stored in topic_list
+ */
+int mqtt_session_get_subscriptions(mqtt_session_handle_t session, esp_mqtt_topic_t *topic_list, int size, int offset);
+
+/**
+ * @brief Serializes the outbox, the QoS1 queue, the subscriptions and the pending PUBRELs and stores them,
+ *        the storage is skipped if nothing changed since the last save
+ */
+esp_err_t mqtt_session_save(mqtt_session_handle_t session, outbox_handle_t outbox, mqtt_qos2_table_handle_t qos2, uint16_t last_message_id);
+
+/**
+ * @brief Loads the snapshot into the (empty) outbox, QoS1 queue, QoS2 table and the subscription list
+ *
+ * The whole snapshot is checked first, it's restored completely or not at all
+ *
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if there is no snapshot, ESP_ERR_INVALID_CRC,
+ *         ESP_ERR_INVALID_VERSION or ESP_ERR_INVALID_SIZE if it cannot be used, ESP_ERR_NO_MEM
+ *         if it doesn't fit in memory
+ */
+esp_err_t mqtt_session_restore(mqtt_session_handle_t session, outbox_handle_t outbox, mqtt_qos2_table_handle_t qos2, uint16_t *last_message_id);
+
+#ifdef  __cplusplus
+}
+#endif
+#endif
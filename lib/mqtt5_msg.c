@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include "mqtt5_msg.h"
 #include "mqtt_client.h"
@@ -14,17 +15,14 @@ static const char *TAG = "mqtt5_msg";
         return (ret);                                           \
         }
 #define MQTT5_SHARED_SUB "$share/%s/%s"
-#define MQTT5_CONVERT_ONE_BYTE_TO_FOUR(i, a, b, c, d) i = (a << 24); \
-                                                      i |= (b << 16); \
-                                                      i |= (c << 8); \
-                                                      i |= d;
-
 #define MQTT5_CONVERT_ONE_BYTE_TO_TWO(i, a, b)        i = (a << 8); \
                                                       i |= b;
 
 #define MQTT5_CONVERT_TWO_BYTE(i, a)                  i = (a >> 8) & 0xff; \
                                                       i = a & 0xff;
 
+#define PROPERTY_BIT(id) (1ULL << (id))
+
 enum mqtt5_connect_flag {
     MQTT5_CONNECT_FLAG_USERNAME = 1 << 7,
     MQTT5_CONNECT_FLAG_PASSWORD = 1 << 6,
@@ -216,47 +214,308 @@ static esp_err_t mqtt5_msg_set_user_property(mqtt5_user_property_handle_t *user_
     return ESP_OK;
 }
 
-static mqtt5_user_property_handle_t mqtt5_msg_get_user_property(uint8_t *buffer, size_t buffer_length)
+typedef enum {
+    PROPERTY_NONE = 0,          /* not a property id */
+    PROPERTY_BYTE = 1,          /* fixed size integers, the value is their width */
+    PROPERTY_TWO_BYTE = 2,
+    PROPERTY_FOUR_BYTE = 4,
+    PROPERTY_VARIABLE,          /* variable byte integer */
+    PROPERTY_BINARY,            /* two byte length followed by the data, strings included */
+    PROPERTY_STRING_PAIR,
+} property_wire_type_t;
+
+#define PACKET_BIT(type) (1 << (type))
+#define PACKETS_ACK (PACKET_BIT(MQTT_MSG_TYPE_PUBACK) | PACKET_BIT(MQTT_MSG_TYPE_PUBREC) | PACKET_BIT(MQTT_MSG_TYPE_PUBREL) | \
+                     PACKET_BIT(MQTT_MSG_TYPE_PUBCOMP) | PACKET_BIT(MQTT_MSG_TYPE_SUBACK) | PACKET_BIT(MQTT_MSG_TYPE_UNSUBACK))
+#define PACKETS_ANY 0xfffe
+
+typedef struct {
+    uint8_t type;               /* property_wire_type_t */
+    bool repeatable;            /* may appear more than once, the last one is kept */
+    uint16_t packets;           /* PACKET_BIT()s of the packets it's allowed in, will properties count as CONNECT */
+} property_spec_t;
+
+static const property_spec_t property_specs[MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE + 1] = {
+    [MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR]    = {PROPERTY_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_PUBLISH) | PACKET_BIT(MQTT_MSG_TYPE_CONNECT)},
+    [MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL]     = {PROPERTY_FOUR_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_PUBLISH) | PACKET_BIT(MQTT_MSG_TYPE_CONNECT)},
+    [MQTT5_PROPERTY_CONTENT_TYPE]                = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_PUBLISH) | PACKET_BIT(MQTT_MSG_TYPE_CONNECT)},
+    [MQTT5_PROPERTY_RESPONSE_TOPIC]              = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_PUBLISH) | PACKET_BIT(MQTT_MSG_TYPE_CONNECT)},
+    [MQTT5_PROPERTY_CORRELATION_DATA]            = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_PUBLISH) | PACKET_BIT(MQTT_MSG_TYPE_CONNECT)},
+    [MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER]        = {PROPERTY_VARIABLE, true, PACKET_BIT(MQTT_MSG_TYPE_PUBLISH) | PACKET_BIT(MQTT_MSG_TYPE_SUBSCRIBE)},
+    [MQTT5_PROPERTY_SESSION_EXPIRY_INTERVAL]     = {PROPERTY_FOUR_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT) | PACKET_BIT(MQTT_MSG_TYPE_CONNACK) | PACKET_BIT(MQTT_MSG_TYPE_DISCONNECT)},
+    [MQTT5_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER]  = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_SERVER_KEEP_ALIVE]           = {PROPERTY_TWO_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_AUTHENTICATION_METHOD]       = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT) | PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_AUTHENTICATION_DATA]         = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT) | PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_REQUEST_PROBLEM_INFO]        = {PROPERTY_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT)},
+    [MQTT5_PROPERTY_WILL_DELAY_INTERVAL]         = {PROPERTY_FOUR_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT)},
+    [MQTT5_PROPERTY_REQUEST_RESP_INFO]           = {PROPERTY_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT)},
+    [MQTT5_PROPERTY_RESP_INFO]                   = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_SERVER_REFERENCE]            = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK) | PACKET_BIT(MQTT_MSG_TYPE_DISCONNECT)},
+    [MQTT5_PROPERTY_REASON_STRING]               = {PROPERTY_BINARY, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK) | PACKETS_ACK | PACKET_BIT(MQTT_MSG_TYPE_DISCONNECT)},
+    [MQTT5_PROPERTY_RECEIVE_MAXIMUM]             = {PROPERTY_TWO_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT) | PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_TOPIC_ALIAS_MAXIMIM]         = {PROPERTY_TWO_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT) | PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_TOPIC_ALIAS]                 = {PROPERTY_TWO_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_PUBLISH)},
+    [MQTT5_PROPERTY_MAXIMUM_QOS]                 = {PROPERTY_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_RETAIN_AVAILABLE]            = {PROPERTY_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_USER_PROPERTY]               = {PROPERTY_STRING_PAIR, true, PACKETS_ANY},
+    [MQTT5_PROPERTY_MAXIMUM_PACKET_SIZE]         = {PROPERTY_FOUR_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNECT) | PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_WILDCARD_SUBSCR_AVAILABLE]   = {PROPERTY_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_SUBSCR_IDENTIFIER_AVAILABLE] = {PROPERTY_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+    [MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE]     = {PROPERTY_BYTE, false, PACKET_BIT(MQTT_MSG_TYPE_CONNACK)},
+};
+
+/*
+ * Properties of a received packet, decoded in a single pass: integers as their value, binary data and strings as
+ * their offset in the property block (upper 16 bits) and their length. Repeated properties keep the last value,
+ * user properties are collected in a list instead.
+ */
+typedef struct {
+    uint64_t present;                                                   /* PROPERTY_BIT()s of the properties found */
+    uint32_t value[MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE + 1];
+} mqtt5_properties_t;
+
+#define PROPERTY_PRESENT(properties, id) ((properties)->present & PROPERTY_BIT(id))
+#define PROPERTY_VALUE(properties, id)   ((properties)->value[id])
+
+static inline const property_spec_t *property_spec(uint8_t id)
 {
-    mqtt5_user_property_handle_t user_porperty = NULL;
-    uint8_t *property = buffer;
-    uint16_t property_offset = 0, len = 0;
-    while (property_offset < buffer_length) {
-        uint8_t property_id = property[property_offset ++];
-        switch (property_id) {
-        case MQTT5_PROPERTY_REASON_STRING: //only print now
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_REASON_STRING %.*s", len, &property[property_offset]);
-            property_offset += len;
-            continue;
-        case MQTT5_PROPERTY_USER_PROPERTY: {
-            uint8_t *key = NULL, *value = NULL;
-            size_t key_len = 0, value_len = 0;
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            key = &property[property_offset];
-            key_len = len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_USER_PROPERTY key: %.*s", key_len, (char *)key);
-            property_offset += len;
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            value = &property[property_offset];
-            value_len = len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_USER_PROPERTY value: %.*s", value_len, (char *)value);
-            property_offset += len;
-            if (mqtt5_msg_set_user_property(&user_porperty, (char *)key, key_len, (char *)value, value_len) != ESP_OK) {
+    if (id >= sizeof(property_specs) / sizeof(property_specs[0]) || property_specs[id].type == PROPERTY_NONE) {
+        return NULL;
+    }
+    return &property_specs[id];
+}
+
+/**
+ * @brief Length of a binary value at offset, its two byte length included
+ *
+ * @return the length, 0 if it runs past end
+ */
+static inline size_t property_binary_len(const uint8_t *property, size_t offset, size_t end)
+{
+    if (offset + 2 > end) {
+        return 0;
+    }
+    size_t len = 2 + ((property[offset] << 8) | property[offset + 1]);
+    return offset + len <= end ? len : 0;
+}
+
+/**
+ * @brief Decodes a property value of variable length at offset, see property_decode()
+ */
+static size_t property_decode_variable(const uint8_t *property, size_t offset, size_t end, property_wire_type_t type, uint32_t *value)
+{
+    size_t len = 0;
+    *value = 0;
+    switch (type) {
+    case PROPERTY_VARIABLE:
+        // at most four bytes, the last one without continuation bit
+        do {
+            if (len == 4 || offset + len >= end) {
+                return 0;
+            }
+            *value |= (uint32_t)(property[offset + len] & 0x7f) << (7 * len);
+        } while (property[offset + len ++] & 0x80);
+        return len;
+    case PROPERTY_STRING_PAIR: {
+        size_t key_len = property_binary_len(property, offset, end);
+        size_t value_len = key_len ? property_binary_len(property, offset + key_len, end) : 0;
+        return value_len ? key_len + value_len : 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Decodes a property value at offset
+ *
+ * @param[out] value the integer, the offset and length of binary data (as in mqtt5_properties_t), 0 for string pairs
+ * @return length of the value on the wire, 0 if it's malformed or runs past end
+ */
+static inline size_t property_decode(const uint8_t *property, size_t offset, size_t end, property_wire_type_t type, uint32_t *value)
+{
+    if (type == PROPERTY_BINARY) {
+        size_t len = property_binary_len(property, offset, end);
+        *value = ((uint32_t)(offset + 2) << 16) | (len - 2);
+        return len;
+    }
+    if (type > PROPERTY_FOUR_BYTE) {
+        return property_decode_variable(property, offset, end, type, value);
+    }
+    // fixed size integers
+    if (offset + type > end) {
+        return 0;
+    }
+    *value = 0;
+    for (size_t i = 0; i < type; ++i) {
+        *value = (*value << 8) | property[offset + i];
+    }
+    return type;
+}
+
+/**
+ * @brief Decodes a property block of a received packet in a single pass
+ *
+ * Properties not allowed in the packet type are skipped, unknown ids, values running past the block and
+ * duplicated properties fail the packet. User properties are appended to `user_property` (if not NULL),
+ * the list is deleted on failure.
+ */
+static esp_err_t mqtt5_parse_properties(const uint8_t *property, size_t property_len, int packet_type, mqtt5_properties_t *properties, mqtt5_user_property_handle_t *user_property)
+{
+    size_t offset = 0;
+    uint64_t present = 0;
+    if (property_len > UINT16_MAX) {
+        ESP_LOGE(TAG, "Property length %zu is too long", property_len);
+        goto err;
+    }
+    while (offset < property_len) {
+        uint8_t property_id = property[offset ++];
+        const property_spec_t *spec = property_spec(property_id);
+        if (spec == NULL) {
+            ESP_LOGW(TAG, "Unknow property id 0x%02x", property_id);
+            goto err;
+        }
+        uint32_t value = 0;
+        size_t len = property_decode(property, offset, property_len, spec->type, &value);
+        if (len == 0) {
+            ESP_LOGE(TAG, "Malformed property 0x%02x", property_id);
+            goto err;
+        }
+        if (!(spec->packets & PACKET_BIT(packet_type))) {
+            ESP_LOGW(TAG, "Property 0x%02x not allowed in packet type %d, skipped", property_id, packet_type);
+        } else if (property_id == MQTT5_PROPERTY_USER_PROPERTY) {
+            size_t key_len = property_binary_len(property, offset, property_len) - 2;
+            const uint8_t *key = property + offset + 2;
+            const uint8_t *key_value = key + key_len + 2;
+            ESP_LOGD(TAG, "MQTT5_PROPERTY_USER_PROPERTY key: %.*s value: %.*s", (int)key_len, (char *)key, (int)(len - key_len - 4), (char *)key_value);
+            if (user_property && mqtt5_msg_set_user_property(user_property, (char *)key, key_len, (char *)key_value, len - key_len - 4) != ESP_OK) {
                 ESP_LOGE(TAG, "mqtt5_msg_set_user_property fail");
                 goto err;
             }
+        } else if ((present & PROPERTY_BIT(property_id)) && !spec->repeatable) {
+            ESP_LOGE(TAG, "Duplicated property 0x%02x", property_id);
+            goto err;
+        } else {
+            ESP_LOGD(TAG, "Property 0x%02x, %zu bytes", property_id, len);
+            present |= PROPERTY_BIT(property_id);
+            properties->value[property_id] = value;
+        }
+        offset += len;
+    }
+    properties->present = present;
+    return ESP_OK;
+err:
+    properties->present = 0;
+    if (user_property) {
+        esp_mqtt5_client_delete_user_property(*user_property);
+        *user_property = NULL;
+    }
+    return ESP_FAIL;
+}
+
+/**
+ * @brief Data of a binary or string property found by mqtt5_parse_properties()
+ */
+static inline const uint8_t *property_data(const uint8_t *property, const mqtt5_properties_t *properties, uint8_t id, uint16_t *len)
+{
+    *len = properties->value[id] & 0xffff;
+    return property + (properties->value[id] >> 16);
+}
+
+static mqtt5_user_property_handle_t mqtt5_msg_get_user_property(uint8_t *buffer, size_t buffer_length, int packet_type)
+{
+    mqtt5_user_property_handle_t user_property = NULL;
+    mqtt5_properties_t properties;
+    if (mqtt5_parse_properties(buffer, buffer_length, packet_type, &properties, &user_property) != ESP_OK) {
+        return NULL;
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_REASON_STRING)) {
+        uint16_t len = 0;
+        const uint8_t *reason = property_data(buffer, &properties, MQTT5_PROPERTY_REASON_STRING, &len);
+        ESP_LOGD(TAG, "MQTT5_PROPERTY_REASON_STRING %.*s", len, (const char *)reason);
+    }
+    return user_property;
+}
+
+/**
+ * @brief Decodes the properties of a PUBLISH straight into resp_property, for the blocks most publishes carry:
+ * fixed width ids, binary data and the subscription identifier, without user properties
+ *
+ * @return false if the block holds other properties or malformed or duplicated ones, they are left to
+ * mqtt5_parse_properties() which decodes the whole block again
+ */
+static inline bool mqtt5_parse_publish_properties_fast(const uint8_t *property, size_t property_len, esp_mqtt5_publish_resp_property_t *resp_property)
+{
+    uint64_t present = 0;
+    size_t offset = 0;
+    while (offset < property_len) {
+        uint8_t property_id = property[offset ++];
+        if (property_id > MQTT5_PROPERTY_TOPIC_ALIAS || (present & PROPERTY_BIT(property_id))) {
+            return false;
+        }
+        const uint8_t *value = property + offset;
+        size_t left = property_len - offset;
+        switch (property_id) {
+        case MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR:
+            if (left < 1) {
+                return false;
+            }
+            resp_property->payload_format_indicator = value[0];
+            offset += 1;
+            break;
+        case MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL:
+            if (left < 4) {
+                return false;
+            }
+            resp_property->message_expiry_interval = ((uint32_t)value[0] << 24) | ((uint32_t)value[1] << 16) | ((uint32_t)value[2] << 8) | value[3];
+            offset += 4;
+            break;
+        case MQTT5_PROPERTY_TOPIC_ALIAS:
+            if (left < 2) {
+                return false;
+            }
+            resp_property->topic_alias = (value[0] << 8) | value[1];
+            offset += 2;
+            break;
+        case MQTT5_PROPERTY_RESPONSE_TOPIC:
+        case MQTT5_PROPERTY_CORRELATION_DATA:
+        case MQTT5_PROPERTY_CONTENT_TYPE: {
+            size_t len = property_binary_len(property, offset, property_len);
+            if (len == 0) {
+                return false;
+            }
+            char *data = (char *)value + 2;
+            if (property_id == MQTT5_PROPERTY_RESPONSE_TOPIC) {
+                resp_property->response_topic = data;
+                resp_property->response_topic_len = len - 2;
+            } else if (property_id == MQTT5_PROPERTY_CORRELATION_DATA) {
+                resp_property->correlation_data = data;
+                resp_property->correlation_data_len = len - 2;
+            } else {
+                resp_property->content_type = data;
+                resp_property->content_type_len = len - 2;
+            }
+            offset += len;
+            break;
+        }
+        case MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER: {
+            // repeated when several subscriptions match, the last one is kept
+            uint32_t id = 0;
+            size_t len = property_decode_variable(property, offset, property_len, PROPERTY_VARIABLE, &id);
+            if (len == 0) {
+                return false;
+            }
+            resp_property->subscribe_id = id;
+            offset += len;
             continue;
         }
         default:
-            ESP_LOGW(TAG, "Unknow property id 0x%02x", property_id);
-            goto err;
+            return false;
         }
+        present |= PROPERTY_BIT(property_id);
     }
-    return user_porperty;
-err:
-    esp_mqtt5_client_delete_user_property(user_porperty);
-    return NULL;
+    return true;
 }
 
 uint16_t mqtt5_get_id(uint8_t *buffer, size_t length)
@@ -308,6 +567,9 @@ char *mqtt5_get_publish_property_payload(uint8_t *buffer, size_t buffer_length,
     offset += len_bytes;
     totlen += offset;
 
+    if (offset + 2 > buffer_length) {
+        return NULL;
+    }
     size_t topic_len = buffer[offset ++] << 8;
     topic_len |= buffer[offset ++] & 0xff;
     *msg_topic = (char *)(buffer + offset);
@@ -325,82 +587,55 @@ char *mqtt5_get_publish_property_payload(uint8_t *buffer, size_t buffer_length,
         offset += 2; // skip the message id
     }
 
-    *property_len = get_variable_len(buffer, offset, buffer_length, &len_bytes);
+    size_t properties_len = get_variable_len(buffer, offset, buffer_length, &len_bytes);
     offset += len_bytes;
+    // the properties are expected within the first chunk of the message
+    if (properties_len > UINT16_MAX || offset + properties_len > buffer_length) {
+        ESP_LOGE(TAG, "Publish properties of %zu bytes exceed the buffer", properties_len);
+        return NULL;
+    }
+    *property_len = properties_len;
 
-    uint16_t len = 0, property_offset = 0;
     uint8_t *property = (buffer + offset);
-    while (property_offset < *property_len) {
-        uint8_t property_id = property[property_offset ++];
-        switch (property_id) {
-        case MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR:
-            resp_property->payload_format_indicator = property[property_offset ++];
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR %d", resp_property->payload_format_indicator);
-            continue;
-        case MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL:
-            MQTT5_CONVERT_ONE_BYTE_TO_FOUR(resp_property->message_expiry_interval, property[property_offset ++], property[property_offset ++], property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL %"PRIu32, resp_property->message_expiry_interval);
-            continue;
-        case MQTT5_PROPERTY_TOPIC_ALIAS:
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(resp_property->topic_alias, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_TOPIC_ALIAS %d", resp_property->topic_alias);
-            continue;
-        case MQTT5_PROPERTY_RESPONSE_TOPIC:
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(resp_property->response_topic_len, property[property_offset ++], property[property_offset ++])
-            resp_property->response_topic = (char *)(property + property_offset);
-            property_offset += resp_property->response_topic_len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_RESPONSE_TOPIC %.*s", resp_property->response_topic_len, resp_property->response_topic);
-            continue;
-        case MQTT5_PROPERTY_CORRELATION_DATA:
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(resp_property->correlation_data_len, property[property_offset ++], property[property_offset ++])
-            resp_property->correlation_data = (char *)(property + property_offset);
-            property_offset += resp_property->correlation_data_len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_CORRELATION_DATA length %d", resp_property->correlation_data_len);
-            continue;
-        case MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER:
-            resp_property->subscribe_id = get_variable_len(property, property_offset, buffer_length, &len_bytes);
-            property_offset += len_bytes;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER %d", resp_property->subscribe_id);
-            continue;
-        case MQTT5_PROPERTY_CONTENT_TYPE:
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(resp_property->content_type_len, property[property_offset ++], property[property_offset ++])
-            resp_property->content_type = (char *)(property + property_offset);
-            property_offset += resp_property->content_type_len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_CONTENT_TYPE  %.*s", resp_property->content_type_len, resp_property->content_type);
-            continue;
-        case MQTT5_PROPERTY_USER_PROPERTY: {
-            uint8_t *key = NULL, *value = NULL;
-            size_t key_len = 0, value_len = 0;
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            key = &property[property_offset];
-            key_len = len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_USER_PROPERTY key: %.*s", key_len, (char *)key);
-            property_offset += len;
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            value = &property[property_offset];
-            value_len = len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_USER_PROPERTY value: %.*s", value_len, (char *)value);
-            property_offset += len;
-            if (mqtt5_msg_set_user_property(user_property, (char *)key, key_len, (char *)value, value_len) != ESP_OK) {
-                esp_mqtt5_client_delete_user_property(*user_property);
-                *user_property = NULL;
-                ESP_LOGE(TAG, "mqtt5_msg_set_user_property fail");
-                return NULL;
-            }
-            continue;
-        }
-        case MQTT5_PROPERTY_REASON_STRING: //only print now
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_REASON_STRING %.*s", len, &property[property_offset]);
-            property_offset += len;
-            continue;
-        default:
-            ESP_LOGW(TAG, "Unknow publish property id 0x%02x", property_id);
+    if (!mqtt5_parse_publish_properties_fast(property, properties_len, resp_property)) {
+        mqtt5_properties_t properties;
+        uint16_t len = 0;
+        if (mqtt5_parse_properties(property, properties_len, MQTT_MSG_TYPE_PUBLISH, &properties, user_property) != ESP_OK) {
             return NULL;
         }
+        if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR)) {
+            resp_property->payload_format_indicator = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR);
+        }
+        if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL)) {
+            resp_property->message_expiry_interval = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL);
+        }
+        if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_TOPIC_ALIAS)) {
+            resp_property->topic_alias = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_TOPIC_ALIAS);
+        }
+        if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_RESPONSE_TOPIC)) {
+            resp_property->response_topic = (char *)property_data(property, &properties, MQTT5_PROPERTY_RESPONSE_TOPIC, &len);
+            resp_property->response_topic_len = len;
+        }
+        if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_CORRELATION_DATA)) {
+            resp_property->correlation_data = (char *)property_data(property, &properties, MQTT5_PROPERTY_CORRELATION_DATA, &len);
+            resp_property->correlation_data_len = len;
+        }
+        if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER)) {
+            resp_property->subscribe_id = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_SUBSCRIBE_IDENTIFIER);
+        }
+        if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_CONTENT_TYPE)) {
+            resp_property->content_type = (char *)property_data(property, &properties, MQTT5_PROPERTY_CONTENT_TYPE, &len);
+            resp_property->content_type_len = len;
+        }
     }
 
-    offset += property_offset;
+    offset += properties_len;
+    if (offset > totlen) {
+        ESP_LOGE(TAG, "Publish headers exceed the remaining length");
+        esp_mqtt5_client_delete_user_property(*user_property);
+        *user_property = NULL;
+        return NULL;
+    }
     if (totlen <= buffer_length) {
         *payload_len = totlen - offset;
     } else {
@@ -424,7 +659,10 @@ char *mqtt5_get_suback_data(uint8_t *buffer, size_t *length, mqtt5_user_property
     if (offset < totlen) {
         size_t property_len = get_variable_len(buffer, offset, totlen, &len_bytes);
         offset += len_bytes;
-        *user_property = mqtt5_msg_get_user_property(buffer + offset, property_len);
+        if (offset + property_len > totlen) {
+            goto err;
+        }
+        *user_property = mqtt5_msg_get_user_property(buffer + offset, property_len, mqtt5_get_type(buffer));
         offset += property_len;
         if (offset < totlen) {
             *length =  totlen - offset;
@@ -446,14 +684,16 @@ char *mqtt5_get_puback_data(uint8_t *buffer, size_t *length, mqtt5_user_property
     totlen += offset;
 
     offset += 2; // skip the message id
-    if (offset < totlen) {
+    if (offset < totlen && totlen <= *length) {
         *length = 1;
         char *data = (char *)(buffer + offset);
         offset ++;
         if (offset < totlen) {
             size_t property_len = get_variable_len(buffer, offset, totlen, &len_bytes);
             offset += len_bytes;
-            *user_property = mqtt5_msg_get_user_property(buffer + offset, property_len);
+            if (offset + property_len <= totlen) {
+                *user_property = mqtt5_msg_get_user_property(buffer + offset, property_len, mqtt5_get_type(buffer));
+            }
         }
         return data;
     } else {
@@ -584,7 +824,7 @@ mqtt_message_t *mqtt5_msg_connect(mqtt_connection_t *connection, mqtt_connect_in
     return fini_message(connection, MQTT_MSG_TYPE_CONNECT, 0, 0, 0);
 }
 
-esp_err_t mqtt5_msg_parse_connack_property(uint8_t *buffer, size_t buffer_len, mqtt_connect_info_t *connection_info, esp_mqtt5_connection_property_storage_t *connection_property, esp_mqtt5_connection_server_resp_property_t *resp_property, int *reason_code, uint8_t *ack_flag, mqtt5_user_property_handle_t *user_property)
+esp_err_t mqtt5_msg_parse_connack_property(uint8_t *buffer, size_t buffer_len, const mqtt_allocator_t *allocator, mqtt_connect_info_t *connection_info, esp_mqtt5_connection_property_storage_t *connection_property, esp_mqtt5_connection_server_resp_property_t *resp_property, int *reason_code, uint8_t *ack_flag, mqtt5_user_property_handle_t *user_property)
 {
     *reason_code = 0;
     *user_property = NULL;
@@ -594,142 +834,277 @@ esp_err_t mqtt5_msg_parse_connack_property(uint8_t *buffer, size_t buffer_len, m
     offset += len_bytes;
     totlen += offset;
 
-    if (totlen > buffer_len) {
+    if (totlen > buffer_len || offset + 2 > totlen) {
         ESP_LOGE(TAG, "Total length %d is over read len %d", totlen, buffer_len);
         return ESP_FAIL;
     }
 
     *ack_flag = buffer[offset ++]; //acknowledge flags
     *reason_code = buffer[offset ++]; //reason code
-    size_t property_len = get_variable_len(buffer, offset, buffer_len, &len_bytes);
+    if (offset == totlen) {
+        return ESP_OK;
+    }
+    size_t property_len = get_variable_len(buffer, offset, totlen, &len_bytes);
     offset += len_bytes;
-    uint16_t property_offset = 0, len = 0;
+    if (offset + property_len > totlen) {
+        ESP_LOGE(TAG, "Property length %d is over the packet", property_len);
+        return ESP_FAIL;
+    }
+    mqtt5_properties_t properties;
     uint8_t *property = (buffer + offset);
-    while (property_offset < property_len) {
-        uint8_t property_id = property[property_offset ++];
-        switch (property_id) {
-        case MQTT5_PROPERTY_SESSION_EXPIRY_INTERVAL:
-            MQTT5_CONVERT_ONE_BYTE_TO_FOUR(connection_property->session_expiry_interval, property[property_offset ++], property[property_offset ++], property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_SESSION_EXPIRY_INTERVAL %"PRIu32, connection_property->session_expiry_interval);
-            continue;
-        case MQTT5_PROPERTY_RECEIVE_MAXIMUM:
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(resp_property->receive_maximum, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_RECEIVE_MAXIMUM %d", resp_property->receive_maximum);
-            continue;
-        case MQTT5_PROPERTY_MAXIMUM_QOS:
-            resp_property->max_qos = property[property_offset ++];
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_MAXIMUM_QOS %d", resp_property->max_qos);
-            continue;
-        case MQTT5_PROPERTY_RETAIN_AVAILABLE:
-            resp_property->retain_available = property[property_offset ++];
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_RETAIN_AVAILABLE %d", resp_property->retain_available);
-            continue;
-        case MQTT5_PROPERTY_MAXIMUM_PACKET_SIZE:
-            MQTT5_CONVERT_ONE_BYTE_TO_FOUR(resp_property->maximum_packet_size, property[property_offset ++], property[property_offset ++], property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_MAXIMUM_PACKET_SIZE %"PRIu32, resp_property->maximum_packet_size);
-            continue;
-        case MQTT5_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER:
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            if (connection_info->client_id) {
-                free(connection_info->client_id);
-            }
-            connection_info->client_id = calloc(1, len + 1);
-            if (!connection_info->client_id) {
-                ESP_LOGE(TAG, "Failed to calloc %d data", len);
-                return ESP_FAIL;
-            }
-            memcpy(connection_info->client_id, &property[property_offset], len);
-            connection_info->client_id[len] = '\0';
-            property_offset += len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER %s", connection_info->client_id);
-            continue;
-        case MQTT5_PROPERTY_TOPIC_ALIAS_MAXIMIM:
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(resp_property->topic_alias_maximum, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_TOPIC_ALIAS_MAXIMIM %d", resp_property->topic_alias_maximum);
-            continue;
-        case MQTT5_PROPERTY_REASON_STRING: //only print now
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_REASON_STRING %.*s", len, &property[property_offset]);
-            property_offset += len;
-            continue;
-        case MQTT5_PROPERTY_USER_PROPERTY: {
-            uint8_t *key = NULL, *value = NULL;
-            size_t key_len = 0, value_len = 0;
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            key = &property[property_offset];
-            key_len = len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_USER_PROPERTY key: %.*s", key_len, (char *)key);
-            property_offset += len;
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            value = &property[property_offset];
-            value_len = len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_USER_PROPERTY value: %.*s", value_len, (char *)value);
-            property_offset += len;
-            if (mqtt5_msg_set_user_property(user_property, (char *)key, key_len, (char *)value, value_len) != ESP_OK) {
-                esp_mqtt5_client_delete_user_property(*user_property);
-                *user_property = NULL;
-                ESP_LOGE(TAG, "mqtt5_msg_set_user_property fail");
-                return ESP_FAIL;
-            }
-            continue;
+    uint16_t len = 0;
+    if (mqtt5_parse_properties(property, property_len, MQTT_MSG_TYPE_CONNACK, &properties, user_property) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_SESSION_EXPIRY_INTERVAL)) {
+        connection_property->session_expiry_interval = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_SESSION_EXPIRY_INTERVAL);
+        ESP_LOGD(TAG, "MQTT5_PROPERTY_SESSION_EXPIRY_INTERVAL %"PRIu32, connection_property->session_expiry_interval);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_RECEIVE_MAXIMUM)) {
+        resp_property->receive_maximum = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_RECEIVE_MAXIMUM);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_MAXIMUM_QOS)) {
+        resp_property->max_qos = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_MAXIMUM_QOS);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_RETAIN_AVAILABLE)) {
+        resp_property->retain_available = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_RETAIN_AVAILABLE);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_MAXIMUM_PACKET_SIZE)) {
+        resp_property->maximum_packet_size = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_MAXIMUM_PACKET_SIZE);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_TOPIC_ALIAS_MAXIMIM)) {
+        resp_property->topic_alias_maximum = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_TOPIC_ALIAS_MAXIMIM);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_WILDCARD_SUBSCR_AVAILABLE)) {
+        resp_property->wildcard_subscribe_available = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_WILDCARD_SUBSCR_AVAILABLE);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_SUBSCR_IDENTIFIER_AVAILABLE)) {
+        resp_property->subscribe_identifiers_available = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_SUBSCR_IDENTIFIER_AVAILABLE);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE)) {
+        resp_property->shared_subscribe_available = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_SERVER_KEEP_ALIVE)) {
+        connection_info->keepalive = PROPERTY_VALUE(&properties, MQTT5_PROPERTY_SERVER_KEEP_ALIVE);
+        ESP_LOGD(TAG, "MQTT5_PROPERTY_SERVER_KEEP_ALIVE %lld", connection_info->keepalive);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER)) {
+        const uint8_t *client_id = property_data(property, &properties, MQTT5_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER, &len);
+        mqtt_free(allocator, connection_info->client_id);
+        connection_info->client_id = mqtt_strndup(allocator, (const char *)client_id, len);
+        ESP_MEM_CHECK(TAG, connection_info->client_id, return ESP_FAIL);
+        ESP_LOGD(TAG, "MQTT5_PROPERTY_ASSIGNED_CLIENT_IDENTIFIER %s", connection_info->client_id);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_RESP_INFO)) {
+        const uint8_t *response_info = property_data(property, &properties, MQTT5_PROPERTY_RESP_INFO, &len);
+        mqtt_free(allocator, resp_property->response_info);
+        resp_property->response_info = mqtt_strndup(allocator, (const char *)response_info, len);
+        ESP_MEM_CHECK(TAG, resp_property->response_info, return ESP_FAIL);
+        ESP_LOGD(TAG, "MQTT5_PROPERTY_RESP_INFO %s", resp_property->response_info);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_REASON_STRING)) { //only print now
+        const uint8_t *reason = property_data(property, &properties, MQTT5_PROPERTY_REASON_STRING, &len);
+        ESP_LOGD(TAG, "MQTT5_PROPERTY_REASON_STRING %.*s", len, (const char *)reason);
+    }
+    if (PROPERTY_PRESENT(&properties, MQTT5_PROPERTY_SERVER_REFERENCE)) { //only print now
+        const uint8_t *reference = property_data(property, &properties, MQTT5_PROPERTY_SERVER_REFERENCE, &len);
+        ESP_LOGD(TAG, "MQTT5_PROPERTY_SERVER_REFERENCE %.*s", len, (const char *)reference);
+    }
+    return ESP_OK;
+}
+
+    const bool LOGPROP=false;
+
+esp_err_t mqtt5_msg_set_message_expiry(uint8_t *buffer, size_t length, uint32_t interval)
+{
+    uint8_t len_bytes = 0;
+    size_t offset = 1;
+    get_variable_len(buffer, offset, length, &len_bytes);
+    offset += len_bytes;
+    if (mqtt5_get_type(buffer) != MQTT_MSG_TYPE_PUBLISH || offset + 2 > length) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    offset += 2 + ((buffer[offset] << 8) | buffer[offset + 1]);  // topic
+    if (mqtt5_get_qos(buffer) > 0) {
+        offset += 2; // message id
+    }
+    if (offset >= length) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t property_end = get_variable_len(buffer, offset, length, &len_bytes);
+    offset += len_bytes;
+    property_end += offset;
+    if (property_end > length) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while (offset < property_end) {
+        uint8_t property_id = buffer[offset ++];
+        const property_spec_t *spec = property_spec(property_id);
+        uint32_t value = 0;
+        size_t property_len = spec ? property_decode(buffer, offset, property_end, spec->type, &value) : 0;
+        if (property_len == 0) {
+            return ESP_ERR_INVALID_ARG;
         }
-        case MQTT5_PROPERTY_WILDCARD_SUBSCR_AVAILABLE:
-            resp_property->wildcard_subscribe_available = property[property_offset++];
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_WILDCARD_SUBSCR_AVAILABLE %d", resp_property->wildcard_subscribe_available);
-            continue;
-        case MQTT5_PROPERTY_SUBSCR_IDENTIFIER_AVAILABLE:
-            resp_property->subscribe_identifiers_available = property[property_offset++];
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_SUBSCR_IDENTIFIER_AVAILABLE %d", resp_property->subscribe_identifiers_available);
-            continue;
-        case MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE:
-            resp_property->shared_subscribe_available = property[property_offset++];
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_SHARED_SUBSCR_AVAILABLE %d", resp_property->shared_subscribe_available);
-            continue;
-        case MQTT5_PROPERTY_SERVER_KEEP_ALIVE:
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(connection_info->keepalive, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_SERVER_KEEP_ALIVE %lld", connection_info->keepalive);
+        if (property_id == MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL) {
+            buffer[offset] = interval >> 24;
+            buffer[offset + 1] = interval >> 16;
+            buffer[offset + 2] = interval >> 8;
+            buffer[offset + 3] = interval;
+            return ESP_OK;
+        }
+        offset += property_len;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+/**
+ * @brief Properties of a publish which may appear only once, as PROPERTY_BIT()s
+ */
+static uint64_t publish_property_ids(const esp_mqtt5_publish_property_config_t *property)
+{
+    uint64_t ids = 0;
+    if (property == NULL) {
+        return 0;
+    }
+    if (property->payload_format_indicator) {
+        ids |= PROPERTY_BIT(MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR);
+    }
+    if (property->message_expiry_interval) {
+        ids |= PROPERTY_BIT(MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL);
+    }
+    if (property->topic_alias) {
+        ids |= PROPERTY_BIT(MQTT5_PROPERTY_TOPIC_ALIAS);
+    }
+    if (property->response_topic) {
+        ids |= PROPERTY_BIT(MQTT5_PROPERTY_RESPONSE_TOPIC);
+    }
+    if (property->correlation_data && property->correlation_data_len) {
+        ids |= PROPERTY_BIT(MQTT5_PROPERTY_CORRELATION_DATA);
+    }
+    if (property->content_type) {
+        ids |= PROPERTY_BIT(MQTT5_PROPERTY_CONTENT_TYPE);
+    }
+    return ids;
+}
+
+/**
+ * @brief Appends the response topic followed by /<response information>, without building the string
+ */
+static int append_response_topic(mqtt_connection_t *connection, const char *response_topic, const char *resp_info)
+{
+    size_t topic_len = strlen(response_topic);
+    size_t info_len = strlen(resp_info);
+    size_t len = topic_len + 1 + info_len;
+    if (len > UINT16_MAX || append_property(connection, MQTT5_PROPERTY_RESPONSE_TOPIC, 2, response_topic, topic_len) == -1 ||
+            connection->outbound_message.length + 1 + info_len > connection->buffer_length) {
+        return -1;
+    }
+    int len_offset = connection->outbound_message.length - topic_len - 2;
+    connection->buffer[len_offset] = len >> 8;
+    connection->buffer[len_offset + 1] = len & 0xff;
+    connection->buffer[connection->outbound_message.length++] = '/';
+    memcpy(connection->buffer + connection->outbound_message.length, resp_info, info_len);
+    connection->outbound_message.length += info_len;
+    return len + 3;
+}
+
+/**
+ * @brief Splices a precompiled property block, except the properties already set for the message
+ */
+static int append_property_block(mqtt_connection_t *connection, const mqtt5_property_block_t *block, uint64_t message_ids)
+{
+    if (connection->outbound_message.length + block->len > connection->buffer_length) {
+        return -1;
+    }
+    size_t start = 0;
+    for (int i = 0; i < block->fields_count; ++i) {
+        if (!(message_ids & PROPERTY_BIT(block->fields[i].id))) {
             continue;
-        case MQTT5_PROPERTY_RESP_INFO:
-            if (resp_property->response_info) {
-                free(resp_property->response_info);
-            }
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            resp_property->response_info = calloc(1, len + 1);
-            if (!resp_property->response_info) {
-                ESP_LOGE(TAG, "Failed to calloc %d data", len);
-                return ESP_FAIL;
+        }
+        memcpy(connection->buffer + connection->outbound_message.length, block->data + start, block->fields[i].offset - start);
+        connection->outbound_message.length += block->fields[i].offset - start;
+        start = block->fields[i].offset + block->fields[i].len;
+    }
+    memcpy(connection->buffer + connection->outbound_message.length, block->data + start, block->len - start);
+    connection->outbound_message.length += block->len - start;
+    return 0;
+}
+
+mqtt5_property_block_t *mqtt5_property_block_create(const esp_mqtt5_publish_property_config_t *property)
+{
+    if (property->response_topic || property->topic_alias) {
+        ESP_LOGE(TAG, "Response topic and topic alias depend on the connection, they can't be precompiled");
+        return NULL;
+    }
+    mqtt5_property_block_t *block = calloc(1, sizeof(mqtt5_property_block_t));
+    ESP_MEM_CHECK(TAG, block, return NULL);
+    mqtt_connection_t encoder = {0};
+    encoder.buffer_length = 64;
+    bool encoded = false;
+    while (!encoded && encoder.buffer_length <= MQTT5_PROPERTY_BLOCK_MAX_SIZE) {
+        free(encoder.buffer);
+        encoder.buffer = malloc(encoder.buffer_length);
+        ESP_MEM_CHECK(TAG, encoder.buffer, free(block); return NULL);
+        encoder.outbound_message.length = 0;
+        block->fields_count = 0;
+        encoded = true;
+#define APPEND_FIELD(property_id, len_occupy, data, data_len) do {                                   \
+            size_t offset = encoder.outbound_message.length;                                         \
+            if (append_property(&encoder, property_id, len_occupy, data, data_len) == -1) {          \
+                encoded = false;                                                                     \
+                break;                                                                               \
+            }                                                                                        \
+            block->fields[block->fields_count].id = property_id;                                     \
+            block->fields[block->fields_count].offset = offset;                                      \
+            block->fields[block->fields_count++].len = encoder.outbound_message.length - offset;     \
+        } while (0)
+        if (property->payload_format_indicator) {
+            APPEND_FIELD(MQTT5_PROPERTY_PAYLOAD_FORMAT_INDICATOR, 1, NULL, 1);
+        }
+        if (encoded && property->message_expiry_interval) {
+            APPEND_FIELD(MQTT5_PROPERTY_MESSAGE_EXPIRY_INTERVAL, 4, NULL, property->message_expiry_interval);
+        }
+        if (encoded && property->correlation_data && property->correlation_data_len) {
+            APPEND_FIELD(MQTT5_PROPERTY_CORRELATION_DATA, 2, property->correlation_data, property->correlation_data_len);
+        }
+        if (encoded && property->user_property) {
+            mqtt5_user_property_item_t item;
+            STAILQ_FOREACH(item, property->user_property, next) {
+                if (append_property(&encoder, MQTT5_PROPERTY_USER_PROPERTY, 2, item->key, strlen(item->key)) == -1 ||
+                        append_property(&encoder, 0, 2, item->value, strlen(item->value)) == -1) {
+                    encoded = false;
+                    break;
+                }
             }
-            memcpy(resp_property->response_info, &property[property_offset], len);
-            resp_property->response_info[len] = '\0';
-            property_offset += len;
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_RESP_INFO %s", resp_property->response_info);
-            continue;
-        case MQTT5_PROPERTY_SERVER_REFERENCE: //only print now
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_SERVER_REFERENCE %.*s", len, &property[property_offset]);
-            property_offset += len;
-            continue;
-        case MQTT5_PROPERTY_AUTHENTICATION_METHOD: //only print now
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_AUTHENTICATION_METHOD %.*s", len, &property[property_offset]);
-            property_offset += len;
-            continue;
-        case MQTT5_PROPERTY_AUTHENTICATION_DATA: //only print now
-            MQTT5_CONVERT_ONE_BYTE_TO_TWO(len, property[property_offset ++], property[property_offset ++])
-            ESP_LOGD(TAG, "MQTT5_PROPERTY_AUTHENTICATION_DATA length %d", len);
-            property_offset += len;
-            continue;
-        default:
-            ESP_LOGW(TAG, "Unknow connack property id 0x%02x", property_id);
-            return ESP_FAIL;
         }
+        if (encoded && property->content_type) {
+            APPEND_FIELD(MQTT5_PROPERTY_CONTENT_TYPE, 2, property->content_type, strlen(property->content_type));
+        }
+#undef APPEND_FIELD
+        encoder.buffer_length *= 2;
     }
-    return ESP_OK;
+    if (!encoded) {
+        ESP_LOGE(TAG, "Publish properties larger than %d bytes", MQTT5_PROPERTY_BLOCK_MAX_SIZE);
+        free(encoder.buffer);
+        free(block);
+        return NULL;
+    }
+    block->data = encoder.buffer;
+    block->len = encoder.outbound_message.length;
+    block->message_expiry_interval = property->message_expiry_interval;
+    return block;
 }
 
-    const bool LOGPROP=false;
+void mqtt5_property_block_destroy(mqtt5_property_block_t *block)
+{
+    if (block) {
+        free(block->data);
+        free(block);
+    }
+}
 
-mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id, const esp_mqtt5_publish_property_config_t *property, const char *resp_info)
+static mqtt_message_t *msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id, const esp_mqtt5_publish_property_config_t *property, const mqtt5_property_block_t *block, const char *resp_info, bool header_only)
 {
     init_message(connection);
 
@@ -743,7 +1118,7 @@ mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *top
     int topic_len = (topic == NULL || topic[0] == '\0') ? 0 : strlen(topic);
     APPEND_CHECK(append_property(connection, 0, 2, topic, topic_len), fail_message(connection));
 
-    if (data == NULL && data_length > 0) {
+    if (data == NULL && data_length > 0 && !header_only) {
         return fail_message(connection);
     }
 
@@ -775,20 +1150,8 @@ mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *top
         }
         if (property->response_topic) {
             if(LOGPROP)ESP_LOGI("mqtt5_msg", "PUBLISH prop id=0x%02X (ResponseTopic) resp_info=%s", MQTT5_PROPERTY_RESPONSE_TOPIC, resp_info ? resp_info : "(null)");
-            if (resp_info && strlen(resp_info)) {
-                uint16_t response_topic_size = strlen(property->response_topic) + strlen(resp_info) + 1;
-                char *response_topic = calloc(1, response_topic_size);
-                if (!response_topic) {
-                    ESP_LOGE("mqtt5_msg", "Failed to calloc %d memory", response_topic_size);
-                    return fail_message(connection);
-                }
-                snprintf(response_topic, response_topic_size, "%s/%s", property->response_topic, resp_info);
-                if (append_property(connection, MQTT5_PROPERTY_RESPONSE_TOPIC, 2, response_topic, response_topic_size) == -1) {
-                    ESP_LOGE("mqtt5_msg", "%s(%d) fail", __FUNCTION__, __LINE__);
-                    free(response_topic);
-                    return fail_message(connection);
-                }
-                free(response_topic);
+            if (resp_info && resp_info[0]) {
+                APPEND_CHECK(append_response_topic(connection, property->response_topic, resp_info), fail_message(connection));
             } else {
                 APPEND_CHECK(append_property(connection, MQTT5_PROPERTY_RESPONSE_TOPIC, 2, property->response_topic, strlen(property->response_topic)), fail_message(connection));
             }
@@ -812,12 +1175,20 @@ mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *top
         }
     }
 
+    if (block) {
+        APPEND_CHECK(append_property_block(connection, block, publish_property_ids(property)), fail_message(connection));
+    }
+
     int props_len = connection->outbound_message.length - properties_offset - 1;
     if(LOGPROP)ESP_LOGI("mqtt5_msg", "PUBLISH props_len=%d", props_len);
     APPEND_CHECK(update_property_len_value(connection, props_len, properties_offset), fail_message(connection));
 
     /* payload */
-    if (connection->outbound_message.length + data_length > connection->buffer_length) {
+    if (header_only) {
+        // the remaining length covers the payload, which is written separately
+        connection->outbound_message.fragmented_msg_data_offset = connection->outbound_message.length;
+        connection->outbound_message.fragmented_msg_total_length = data_length + connection->outbound_message.length;
+    } else if (connection->outbound_message.length + data_length > connection->buffer_length) {
         connection->outbound_message.fragmented_msg_data_offset = connection->outbound_message.length;
         memcpy(connection->buffer + connection->outbound_message.length, data, connection->buffer_length - connection->outbound_message.length);
         connection->outbound_message.length = connection->buffer_length;
@@ -839,6 +1210,16 @@ mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *top
     return msg;
 }
 
+mqtt_message_t *mqtt5_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id, const esp_mqtt5_publish_property_config_t *property, const mqtt5_property_block_t *block, const char *resp_info)
+{
+    return msg_publish(connection, topic, data, data_length, qos, retain, message_id, property, block, resp_info, false);
+}
+
+mqtt_message_t *mqtt5_msg_publish_header(mqtt_connection_t *connection, const char *topic, int data_length, int qos, int retain, uint16_t *message_id, const esp_mqtt5_publish_property_config_t *property, const mqtt5_property_block_t *block, const char *resp_info)
+{
+    return msg_publish(connection, topic, NULL, data_length, qos, retain, message_id, property, block, resp_info, true);
+}
+
 
 int mqtt5_msg_get_reason_code(uint8_t *buffer, size_t length)
 {
@@ -918,7 +1299,7 @@ mqtt_message_t *mqtt5_msg_subscribe(mqtt_connection_t *connection, const esp_mqt
         }
         if (property && property->is_share_subscribe) {
             uint16_t shared_topic_size = strlen(topic_list[topic_number].filter) + strlen(MQTT5_SHARED_SUB) + strlen(property->share_name);
-            char *shared_topic = calloc(1, shared_topic_size);
+            char *shared_topic = mqtt_calloc(MQTT_ALLOCATOR(connection->alloc, transient), 1, shared_topic_size);
             if (!shared_topic) {
                 ESP_LOGE(TAG, "Failed to calloc %d memory", shared_topic_size);
                 fail_message(connection);
@@ -926,10 +1307,10 @@ mqtt_message_t *mqtt5_msg_subscribe(mqtt_connection_t *connection, const esp_mqt
             snprintf(shared_topic, shared_topic_size, MQTT5_SHARED_SUB, property->share_name, topic_list[topic_number].filter);
             if (append_property(connection, 0, 2, shared_topic, strlen(shared_topic)) == -1) {
                 ESP_LOGE(TAG, "%s(%d) fail", __FUNCTION__, __LINE__);
-                free(shared_topic);
+                mqtt_free(MQTT_ALLOCATOR(connection->alloc, transient), shared_topic);
                 return fail_message(connection);
             }
-            free(shared_topic);
+            mqtt_free(MQTT_ALLOCATOR(connection->alloc, transient), shared_topic);
         } else {
             APPEND_CHECK(append_property(connection, 0, 2, topic_list[topic_number].filter, strlen(topic_list[topic_number].filter)), fail_message(connection));
         }
@@ -1008,7 +1389,7 @@ mqtt_message_t *mqtt5_msg_unsubscribe(mqtt_connection_t *connection, const char
     APPEND_CHECK(update_property_len_value(connection, connection->outbound_message.length - properties_offset - 1, properties_offset), fail_message(connection));
     if (property && property->is_share_subscribe) {
         uint16_t shared_topic_size = strlen(topic) + strlen(MQTT5_SHARED_SUB) + strlen(property->share_name);
-        char *shared_topic = calloc(1, shared_topic_size);
+        char *shared_topic = mqtt_calloc(MQTT_ALLOCATOR(connection->alloc, transient), 1, shared_topic_size);
         if (!shared_topic) {
             ESP_LOGE(TAG, "Failed to calloc %d memory", shared_topic_size);
             fail_message(connection);
@@ -1016,10 +1397,10 @@ mqtt_message_t *mqtt5_msg_unsubscribe(mqtt_connection_t *connection, const char
         snprintf(shared_topic, shared_topic_size, MQTT5_SHARED_SUB, property->share_name, topic);
         if (append_property(connection, 0, 2, shared_topic, strlen(shared_topic)) == -1) {
             ESP_LOGE(TAG, "%s(%d) fail", __FUNCTION__, __LINE__);
-            free(shared_topic);
+            mqtt_free(MQTT_ALLOCATOR(connection->alloc, transient), shared_topic);
             return fail_message(connection);
         }
-        free(shared_topic);
+        mqtt_free(MQTT_ALLOCATOR(connection->alloc, transient), shared_topic);
     } else {
         APPEND_CHECK(append_property(connection, 0, 2, topic, strlen(topic)), fail_message(connection));
     }
@@ -0,0 +1,227 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt5_request.h"
+#include "mqtt_config.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt5_request";
+
+#define NO_ENTRY            (-1)
+#define EXPIRING            (-2)        /* prev of requests being expired, no longer in the wheel */
+#define INDEX_BITS          16
+#define INDEX_MASK          ((1 << INDEX_BITS) - 1)
+#define GENERATION_MASK     0x7FFF      /* keeps the ids positive */
+
+typedef struct {
+    esp_mqtt5_response_cb_t cb;         /* NULL if the slot is free */
+    void *ctx;
+    uint64_t deadline;
+    uint16_t generation;
+    int32_t prev;                       /* wheel bucket list, unused for free slots */
+    int32_t next;                       /* wheel bucket list or free list */
+} entry_t;
+
+struct mqtt5_request_table {
+    const mqtt_allocator_t *alloc;
+    entry_t *entries;
+    int capacity;
+    int count;
+    int32_t free_head;
+    int32_t wheel[MQTT_REQUEST_WHEEL_SLOTS];
+    uint64_t wheel_tick;                /* next wheel tick to expire, no request is due before it */
+};
+
+static inline int32_t *bucket_of(mqtt5_request_table_handle_t table, uint64_t deadline)
+{
+    return &table->wheel[(deadline / MQTT_REQUEST_WHEEL_TICK_MS) % MQTT_REQUEST_WHEEL_SLOTS];
+}
+
+static void wheel_insert(mqtt5_request_table_handle_t table, int32_t index)
+{
+    entry_t *entry = &table->entries[index];
+    int32_t *head = bucket_of(table, entry->deadline);
+    entry->prev = NO_ENTRY;
+    entry->next = *head;
+    if (*head != NO_ENTRY) {
+        table->entries[*head].prev = index;
+    }
+    *head = index;
+}
+
+static void wheel_unlink(mqtt5_request_table_handle_t table, int32_t index)
+{
+    entry_t *entry = &table->entries[index];
+    if (entry->prev != NO_ENTRY) {
+        table->entries[entry->prev].next = entry->next;
+    } else {
+        *bucket_of(table, entry->deadline) = entry->next;
+    }
+    if (entry->next != NO_ENTRY) {
+        table->entries[entry->next].prev = entry->prev;
+    }
+}
+
+static void release(mqtt5_request_table_handle_t table, int32_t index, mqtt5_request_t *request)
+{
+    entry_t *entry = &table->entries[index];
+    if (request) {
+        request->id = (entry->generation << INDEX_BITS) | index;
+        request->cb = entry->cb;
+        request->ctx = entry->ctx;
+    }
+    entry->cb = NULL;
+    entry->ctx = NULL;
+    entry->next = table->free_head;
+    table->free_head = index;
+    --table->count;
+}
+
+mqtt5_request_table_handle_t mqtt5_request_table_create(int capacity, const mqtt_allocator_t *allocator)
+{
+    if (capacity <= 0 || capacity > INDEX_MASK + 1) {
+        ESP_LOGE(TAG, "Invalid capacity %d", capacity);
+        return NULL;
+    }
+    mqtt5_request_table_handle_t table = mqtt_calloc(allocator, 1, sizeof(struct mqtt5_request_table));
+    ESP_MEM_CHECK(TAG, table, return NULL);
+    table->entries = mqtt_calloc(allocator, capacity, sizeof(entry_t));
+    ESP_MEM_CHECK(TAG, table->entries, mqtt_free(allocator, table); return NULL);
+    table->alloc = allocator;
+    table->capacity = capacity;
+    for (int i = 0; i < capacity; ++i) {
+        table->entries[i].next = i + 1 < capacity ? i + 1 : NO_ENTRY;
+    }
+    table->free_head = 0;
+    for (int i = 0; i < MQTT_REQUEST_WHEEL_SLOTS; ++i) {
+        table->wheel[i] = NO_ENTRY;
+    }
+    return table;
+}
+
+void mqtt5_request_table_destroy(mqtt5_request_table_handle_t table, mqtt5_request_visitor_t visitor, void *arg)
+{
+    if (table == NULL) {
+        return;
+    }
+    for (int i = 0; i < table->capacity; ++i) {
+        if (table->entries[i].cb) {
+            mqtt5_request_t request;
+            wheel_unlink(table, i);
+            release(table, i, &request);
+            if (visitor) {
+                visitor(&request, arg);
+            }
+        }
+    }
+    mqtt_free(table->alloc, table->entries);
+    mqtt_free(table->alloc, table);
+}
+
+int mqtt5_request_add(mqtt5_request_table_handle_t table, esp_mqtt5_response_cb_t cb, void *ctx, uint64_t deadline_ms)
+{
+    if (table->free_head == NO_ENTRY) {
+        ESP_LOGW(TAG, "Too many pending requests (%d)", table->count);
+        return -1;
+    }
+    int32_t index = table->free_head;
+    entry_t *entry = &table->entries[index];
+    table->free_head = entry->next;
+    entry->cb = cb;
+    entry->ctx = ctx;
+    entry->deadline = deadline_ms;
+    // never 0, so that an id is never 0 either
+    entry->generation = (entry->generation % GENERATION_MASK) + 1;
+    wheel_insert(table, index);
+    if (table->count++ == 0 || deadline_ms / MQTT_REQUEST_WHEEL_TICK_MS < table->wheel_tick) {
+        table->wheel_tick = deadline_ms / MQTT_REQUEST_WHEEL_TICK_MS;
+    }
+    return (entry->generation << INDEX_BITS) | index;
+}
+
+void mqtt5_request_correlation(int id, uint8_t correlation[MQTT5_REQUEST_CORRELATION_LEN])
+{
+    correlation[0] = (id >> 24) & 0xFF;
+    correlation[1] = (id >> 16) & 0xFF;
+    correlation[2] = (id >> 8) & 0xFF;
+    correlation[3] = id & 0xFF;
+}
+
+bool mqtt5_request_remove(mqtt5_request_table_handle_t table, int id, mqtt5_request_t *request)
+{
+    int32_t index = id & INDEX_MASK;
+    if (id <= 0 || index >= table->capacity) {
+        return false;
+    }
+    entry_t *entry = &table->entries[index];
+    if (entry->cb == NULL || entry->prev == EXPIRING || entry->generation != (id >> INDEX_BITS)) {
+        return false;
+    }
+    wheel_unlink(table, index);
+    release(table, index, request);
+    return true;
+}
+
+bool mqtt5_request_take(mqtt5_request_table_handle_t table, const char *correlation, size_t len, mqtt5_request_t *request)
+{
+    if (correlation == NULL || len != MQTT5_REQUEST_CORRELATION_LEN) {
+        return false;
+    }
+    const uint8_t *data = (const uint8_t *)correlation;
+    int id = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+    return mqtt5_request_remove(table, id, request);
+}
+
+int mqtt5_request_expire(mqtt5_request_table_handle_t table, uint64_t now_ms, mqtt5_request_visitor_t visitor, void *arg)
+{
+    // requests expire once their whole wheel tick has elapsed, so each bucket is visited once per tick
+    uint64_t now_tick = now_ms / MQTT_REQUEST_WHEEL_TICK_MS;
+    if (table->count == 0 || now_tick <= table->wheel_tick) {
+        return 0;
+    }
+    uint64_t first_tick = table->wheel_tick;
+    if (now_tick - first_tick > MQTT_REQUEST_WHEEL_SLOTS) {
+        first_tick = now_tick - MQTT_REQUEST_WHEEL_SLOTS;
+    }
+    // unlink the expired requests first, the visitor may add new ones
+    int32_t expired = NO_ENTRY;
+    for (uint64_t tick = first_tick; tick < now_tick; ++tick) {
+        int32_t index = table->wheel[tick % MQTT_REQUEST_WHEEL_SLOTS];
+        while (index != NO_ENTRY) {
+            entry_t *entry = &table->entries[index];
+            int32_t next = entry->next;
+            // requests of the later rounds of the wheel stay in the bucket
+            if (entry->deadline / MQTT_REQUEST_WHEEL_TICK_MS < now_tick) {
+                wheel_unlink(table, index);
+                entry->prev = EXPIRING;
+                entry->next = expired;
+                expired = index;
+            }
+            index = next;
+        }
+    }
+    table->wheel_tick = now_tick;
+
+    int count = 0;
+    while (expired != NO_ENTRY) {
+        int32_t next = table->entries[expired].next;
+        mqtt5_request_t request;
+        release(table, expired, &request);
+        if (visitor) {
+            visitor(&request, arg);
+        }
+        expired = next;
+        ++count;
+    }
+    return count;
+}
+
+int mqtt5_request_count(mqtt5_request_table_handle_t table)
+{
+    return table->count;
+}
@@ -0,0 +1,132 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_alloc.h"
+#include "esp_heap_caps.h"
+
+typedef union {
+    size_t size;                /* size of the whole block, header included */
+    max_align_t align;
+} block_header_t;
+
+#define BLOCK_ALIGN     _Alignof(max_align_t)
+
+static inline bool has_hooks(const mqtt_allocator_t *allocator)
+{
+    return allocator && allocator->hooks.alloc && allocator->hooks.free;
+}
+
+static inline block_header_t *header_of(void *ptr)
+{
+    return (block_header_t *)ptr - 1;
+}
+
+void mqtt_allocator_init(mqtt_allocator_t *allocator, const esp_mqtt_allocator_t *hooks, uint32_t caps)
+{
+    memset(allocator, 0, sizeof(mqtt_allocator_t));
+    if (hooks && hooks->alloc && hooks->free) {
+        allocator->hooks = *hooks;
+    }
+    allocator->caps = caps;
+}
+
+void *mqtt_alloc(const mqtt_allocator_t *allocator, size_t size)
+{
+    if (!has_hooks(allocator)) {
+        return heap_caps_malloc(size, allocator ? allocator->caps : MALLOC_CAP_DEFAULT);
+    }
+    if (size > SIZE_MAX - sizeof(block_header_t)) {
+        return NULL;
+    }
+    size += sizeof(block_header_t);
+    block_header_t *header = allocator->hooks.alloc(allocator->hooks.ctx, size, BLOCK_ALIGN);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->size = size;
+    return header + 1;
+}
+
+void *mqtt_calloc(const mqtt_allocator_t *allocator, size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *ptr = mqtt_alloc(allocator, count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *mqtt_realloc(const mqtt_allocator_t *allocator, void *ptr, size_t size)
+{
+    if (!has_hooks(allocator)) {
+        return heap_caps_realloc(ptr, size, allocator ? allocator->caps : MALLOC_CAP_DEFAULT);
+    }
+    if (ptr == NULL) {
+        return mqtt_alloc(allocator, size);
+    }
+    // the hooks can't resize in place
+    void *new_ptr = mqtt_alloc(allocator, size);
+    if (new_ptr) {
+        size_t old_size = header_of(ptr)->size - sizeof(block_header_t);
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        mqtt_free(allocator, ptr);
+    }
+    return new_ptr;
+}
+
+void mqtt_free(const mqtt_allocator_t *allocator, void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    if (!has_hooks(allocator)) {
+        free(ptr);
+        return;
+    }
+    block_header_t *header = header_of(ptr);
+    allocator->hooks.free(allocator->hooks.ctx, header, header->size, BLOCK_ALIGN);
+}
+
+char *mqtt_strndup(const mqtt_allocator_t *allocator, const char *str, size_t len)
+{
+    len = strnlen(str, len);
+    char *copy = mqtt_alloc(allocator, len + 1);
+    if (copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+char *mqtt_strdup(const mqtt_allocator_t *allocator, const char *str)
+{
+    return mqtt_strndup(allocator, str, strlen(str));
+}
+
+int mqtt_asprintf(const mqtt_allocator_t *allocator, char **str, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (len < 0) {
+        return -1;
+    }
+    *str = mqtt_alloc(allocator, len + 1);
+    if (*str == NULL) {
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(*str, len + 1, format, args);
+    va_end(args);
+    return len;
+}
@@ -0,0 +1,237 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_batch.h"
+#include "mqtt_blob.h"
+#include "mqtt_config.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt_batch";
+
+#define FRAME_MAGIC     0x424D      /* "MB" */
+#define FRAME_VERSION   1
+#define MAX_LEN_BYTES   4
+
+typedef struct {
+    char *topic;                /* NULL if the slot was never used */
+    uint8_t *frame;
+    size_t len;
+    int samples;                /* 0 if nothing is pending */
+    int qos;
+    int retain;
+    uint64_t first_tick;        /* when the oldest pending sample was added */
+} batch_t;
+
+struct mqtt_batcher {
+    const mqtt_allocator_t *alloc;
+    batch_t *batches;
+    int batches_count;
+    size_t max_size;
+    int max_samples;
+    uint32_t max_latency_ms;
+    mqtt_batch_publish_t publish;
+    void *ctx;
+};
+
+static inline size_t len_bytes(size_t len)
+{
+    return len < 128 ? 1 : len < 16384 ? 2 : len < 2097152 ? 3 : 4;
+}
+
+mqtt_batcher_handle_t mqtt_batcher_create(size_t max_size, int max_samples, uint32_t max_latency_ms, int max_topics,
+                                          mqtt_batch_publish_t publish, void *ctx, const mqtt_allocator_t *allocator)
+{
+    if (max_size <= MQTT_BATCH_HEADER_LEN + 1 || max_topics <= 0 || publish == NULL) {
+        ESP_LOGE(TAG, "Invalid batch configuration");
+        return NULL;
+    }
+    mqtt_batcher_handle_t batcher = mqtt_calloc(allocator, 1, sizeof(struct mqtt_batcher));
+    ESP_MEM_CHECK(TAG, batcher, return NULL);
+    batcher->batches = mqtt_calloc(allocator, max_topics, sizeof(batch_t));
+    ESP_MEM_CHECK(TAG, batcher->batches, mqtt_free(allocator, batcher); return NULL);
+    batcher->alloc = allocator;
+    batcher->batches_count = max_topics;
+    batcher->max_size = max_size;
+    batcher->max_samples = max_samples;
+    batcher->max_latency_ms = max_latency_ms;
+    batcher->publish = publish;
+    batcher->ctx = ctx;
+    return batcher;
+}
+
+void mqtt_batcher_destroy(mqtt_batcher_handle_t batcher)
+{
+    if (batcher == NULL) {
+        return;
+    }
+    for (int i = 0; i < batcher->batches_count; ++i) {
+        mqtt_free(batcher->alloc, batcher->batches[i].topic);
+        mqtt_free(batcher->alloc, batcher->batches[i].frame);
+    }
+    mqtt_free(batcher->alloc, batcher->batches);
+    mqtt_free(batcher->alloc, batcher);
+}
+
+static esp_err_t batch_publish(mqtt_batcher_handle_t batcher, batch_t *batch)
+{
+    if (batch->samples == 0) {
+        return ESP_OK;
+    }
+    ESP_LOGD(TAG, "Publishing %d samples of %s (%zu bytes)", batch->samples, batch->topic, batch->len);
+    int msg_id = batcher->publish(batcher->ctx, batch->topic, batch->frame, batch->len, batch->qos, batch->retain);
+    // the frame is reused either way, a failed publish loses its samples like a failed single publish
+    batch->len = MQTT_BATCH_HEADER_LEN;
+    batch->samples = 0;
+    batch->qos = 0;
+    if (msg_id < 0) {
+        ESP_LOGW(TAG, "Failed to publish the batch of %s", batch->topic);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/* Slot of the topic, else a free slot, else the slot with the oldest samples once published */
+static batch_t *batch_for(mqtt_batcher_handle_t batcher, const char *topic, esp_err_t *err)
+{
+    batch_t *free_batch = NULL;
+    batch_t *oldest = NULL;
+    for (int i = 0; i < batcher->batches_count; ++i) {
+        batch_t *batch = &batcher->batches[i];
+        if (batch->topic && strcmp(batch->topic, topic) == 0) {
+            return batch;
+        }
+        if (batch->samples == 0) {
+            if (free_batch == NULL || batch->topic == NULL) {
+                free_batch = batch;
+            }
+        } else if (oldest == NULL || batch->first_tick < oldest->first_tick) {
+            oldest = batch;
+        }
+    }
+    batch_t *batch = free_batch;
+    if (batch == NULL) {
+        *err = batch_publish(batcher, oldest);
+        batch = oldest;
+    }
+    if (batch->frame == NULL) {
+        batch->frame = mqtt_alloc(batcher->alloc, batcher->max_size);
+        ESP_MEM_CHECK(TAG, batch->frame, return NULL);
+        put_le16(batch->frame, FRAME_MAGIC);
+        batch->frame[2] = FRAME_VERSION;
+        batch->len = MQTT_BATCH_HEADER_LEN;
+    }
+    char *copy = mqtt_strdup(batcher->alloc, topic);
+    ESP_MEM_CHECK(TAG, copy, return NULL);
+    mqtt_free(batcher->alloc, batch->topic);
+    batch->topic = copy;
+    return batch;
+}
+
+esp_err_t mqtt_batcher_add(mqtt_batcher_handle_t batcher, const char *topic, const uint8_t *data, size_t len,
+                           int qos, int retain, uint64_t now_ms)
+{
+    size_t sample_len = len_bytes(len) + len;
+    if (MQTT_BATCH_HEADER_LEN + sample_len > batcher->max_size) {
+        ESP_LOGE(TAG, "Sample of %zu bytes doesn't fit in a batch", len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err = ESP_OK;
+    batch_t *batch = batch_for(batcher, topic, &err);
+    if (batch == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (batch->samples && (batch->retain != retain || batch->len + sample_len > batcher->max_size)) {
+        if (batch_publish(batcher, batch) != ESP_OK) {
+            err = ESP_FAIL;
+        }
+    }
+    uint8_t *p = batch->frame + batch->len;
+    size_t remaining = len;
+    do {
+        uint8_t byte = remaining % 128;
+        remaining /= 128;
+        *p++ = remaining ? byte | 0x80 : byte;
+    } while (remaining);
+    if (len) {
+        memcpy(p, data, len);
+    }
+    batch->len += sample_len;
+    if (batch->samples++ == 0) {
+        batch->first_tick = now_ms;
+        batch->retain = retain;
+    }
+    if (qos > batch->qos) {
+        // the batch gets the strongest guarantee asked by its samples
+        batch->qos = qos;
+    }
+    if (batcher->max_samples > 0 && batch->samples >= batcher->max_samples) {
+        if (batch_publish(batcher, batch) != ESP_OK) {
+            err = ESP_FAIL;
+        }
+    }
+    return err;
+}
+
+esp_err_t mqtt_batcher_flush(mqtt_batcher_handle_t batcher, const char *topic)
+{
+    esp_err_t err = ESP_OK;
+    for (int i = 0; i < batcher->batches_count; ++i) {
+        batch_t *batch = &batcher->batches[i];
+        if (topic == NULL || (batch->topic && strcmp(batch->topic, topic) == 0)) {
+            if (batch_publish(batcher, batch) != ESP_OK) {
+                err = ESP_FAIL;
+            }
+        }
+    }
+    return err;
+}
+
+int mqtt_batcher_flush_expired(mqtt_batcher_handle_t batcher, uint64_t now_ms)
+{
+    int count = 0;
+    for (int i = 0; i < batcher->batches_count; ++i) {
+        batch_t *batch = &batcher->batches[i];
+        if (batch->samples && now_ms - batch->first_tick >= batcher->max_latency_ms) {
+            batch_publish(batcher, batch);
+            ++count;
+        }
+    }
+    return count;
+}
+
+esp_err_t mqtt_batch_next(const uint8_t *frame, size_t frame_len, size_t *offset, const uint8_t **sample, size_t *sample_len)
+{
+    size_t pos = *offset;
+    if (pos == 0) {
+        if (frame_len < MQTT_BATCH_HEADER_LEN || get_le16(frame) != FRAME_MAGIC || frame[2] != FRAME_VERSION) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        pos = MQTT_BATCH_HEADER_LEN;
+    }
+    if (pos >= frame_len) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    size_t len = 0;
+    for (int i = 0; ; ++i) {
+        if (i == MAX_LEN_BYTES || pos >= frame_len) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        uint8_t byte = frame[pos++];
+        len |= (size_t)(byte & 0x7F) << (7 * i);
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    if (len > frame_len - pos) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    *sample = frame + pos;
+    *sample_len = len;
+    *offset = pos + len;
+    return ESP_OK;
+}
@@ -0,0 +1,349 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_compress.h"
+#include "mqtt_blob.h"
+#include "mqtt_config.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt_compress";
+
+#define FRAME_MAGIC     0x5A4D      /* "MZ" */
+#define FRAME_VERSION   1
+
+/* LZ4 block format constants */
+#define MIN_MATCH       4
+#define LAST_LITERALS   5           /* the last 5 bytes are always literals */
+#define MF_LIMIT        12          /* the last match starts at least 12 bytes before the end */
+#define MAX_OFFSET      65535
+#define HASH_LOG        10          /* 2kB table, favouring footprint over ratio */
+
+typedef enum {
+    STATE_HEADER,
+    STATE_BLOCK_HEADER,
+    STATE_BLOCK_DATA,
+    STATE_DONE,
+} decompress_state_t;
+
+struct mqtt_decompress {
+    const mqtt_allocator_t *alloc;
+    decompress_state_t state;
+    uint8_t header[MQTT_COMPRESS_HEADER_LEN];
+    size_t header_len;
+    size_t block_size;
+    size_t raw_len;             /* total decompressed length from the frame header */
+    size_t raw_done;
+    size_t block_comp_len;
+    size_t block_raw_len;
+    uint8_t *in;                /* compressed block being collected */
+    size_t in_len;
+    uint8_t *out;               /* decompressed block */
+};
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(const uint8_t *p)
+{
+    return (read32(p) * 2654435761U) >> (32 - HASH_LOG);
+}
+
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/*
+ * Compresses one block (len <= 64kB) into LZ4 block format.
+ * Returns the compressed length or -1 if it doesn't fit into dst_len.
+ */
+static int compress_block(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len, uint16_t *table)
+{
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_len;
+
+    memset(table, 0, sizeof(uint16_t) << HASH_LOG);
+    if (len > MF_LIMIT) {
+        const uint8_t *match_limit = end - MF_LIMIT;
+        const uint8_t *extend_limit = end - LAST_LITERALS;
+        ip++;
+        while (ip < match_limit) {
+            uint32_t h = hash4(ip);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint16_t)(ip - src);
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                ++ip;
+                continue;
+            }
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+            const uint8_t *mp = ip + MIN_MATCH;
+            const uint8_t *mr = ref + MIN_MATCH;
+            while (mp < extend_limit && *mp == *mr) {
+                ++mp;
+                ++mr;
+            }
+            size_t literals = ip - anchor;
+            size_t match_len = mp - ip - MIN_MATCH;
+            if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals + 2 + match_len / 255 + 1) {
+                return -1;
+            }
+            uint8_t *token = op++;
+            *token = (literals >= 15 ? 15 : literals) << 4;
+            if (literals >= 15) {
+                op = write_length(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            put_le16(op, (uint16_t)(ip - ref));
+            op += 2;
+            *token |= match_len >= 15 ? 15 : match_len;
+            if (match_len >= 15) {
+                op = write_length(op, match_len - 15);
+            }
+            ip = mp;
+            anchor = ip;
+        }
+    }
+    size_t literals = end - anchor;
+    if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals) {
+        return -1;
+    }
+    *op = (literals >= 15 ? 15 : literals) << 4;
+    op++;
+    if (literals >= 15) {
+        op = write_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+static bool read_length(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+static int decompress_block(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *end = src + len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_len;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(&ip, end, &literals)) {
+            return -1;
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == end) {
+            break;  // the last sequence has no match
+        }
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = get_le16(ip);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+        size_t match_len = token & 0x0F;
+        if (match_len == 15 && !read_length(&ip, end, &match_len)) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (match_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+        // byte by byte, the match may overlap the output
+        const uint8_t *ref = op - offset;
+        while (match_len--) {
+            *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
+
+size_t mqtt_compress_bound(size_t len, int block_shift)
+{
+    size_t block_size = (size_t)1 << block_shift;
+    return MQTT_COMPRESS_HEADER_LEN + (len + block_size - 1) / block_size * MQTT_COMPRESS_BLOCK_HEADER_LEN + len;
+}
+
+int mqtt_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len, int block_shift,
+                  const mqtt_allocator_t *allocator)
+{
+    if (block_shift > MQTT_COMPRESS_MAX_BLOCK_SHIFT || dst_len < mqtt_compress_bound(len, block_shift)) {
+        return -1;
+    }
+    uint16_t *table = mqtt_alloc(allocator, sizeof(uint16_t) << HASH_LOG);
+    ESP_MEM_CHECK(TAG, table, return -1);
+
+    size_t block_size = (size_t)1 << block_shift;
+    uint8_t *op = dst;
+    put_le16(op, FRAME_MAGIC);
+    op[2] = FRAME_VERSION;
+    op[3] = block_shift;
+    put_le32(op + 4, len);
+    op += MQTT_COMPRESS_HEADER_LEN;
+    for (size_t pos = 0; pos < len; pos += block_size) {
+        size_t raw_len = len - pos < block_size ? len - pos : block_size;
+        uint8_t *block = op + MQTT_COMPRESS_BLOCK_HEADER_LEN;
+        // only keep the compressed block if it's smaller, otherwise store it
+        int comp_len = compress_block(src + pos, raw_len, block, raw_len - 1, table);
+        if (comp_len < 0) {
+            memcpy(block, src + pos, raw_len);
+            comp_len = raw_len;
+        }
+        put_le16(op, comp_len);
+        put_le16(op + 2, raw_len);
+        op = block + comp_len;
+    }
+    mqtt_free(allocator, table);
+    return op - dst;
+}
+
+bool mqtt_compress_is_frame(const uint8_t *data, size_t len, size_t *raw_len)
+{
+    if (len < MQTT_COMPRESS_HEADER_LEN || get_le16(data) != FRAME_MAGIC || data[2] != FRAME_VERSION ||
+            data[3] > MQTT_COMPRESS_MAX_BLOCK_SHIFT) {
+        return false;
+    }
+    if (raw_len) {
+        *raw_len = get_le32(data + 4);
+    }
+    return true;
+}
+
+mqtt_decompress_handle_t mqtt_decompress_create(const mqtt_allocator_t *allocator)
+{
+    mqtt_decompress_handle_t decompress = mqtt_calloc(allocator, 1, sizeof(struct mqtt_decompress));
+    ESP_MEM_CHECK(TAG, decompress, return NULL);
+    decompress->alloc = allocator;
+    return decompress;
+}
+
+void mqtt_decompress_destroy(mqtt_decompress_handle_t decompress)
+{
+    if (decompress == NULL) {
+        return;
+    }
+    mqtt_free(decompress->alloc, decompress->in);
+    mqtt_free(decompress->alloc, decompress->out);
+    mqtt_free(decompress->alloc, decompress);
+}
+
+bool mqtt_decompress_is_done(mqtt_decompress_handle_t decompress)
+{
+    return decompress->state == STATE_DONE;
+}
+
+/* Collects up to `needed` bytes into buf, returns true once complete */
+static bool collect(uint8_t *buf, size_t *buf_len, size_t needed, const uint8_t **data, size_t *len)
+{
+    size_t chunk = needed - *buf_len < *len ? needed - *buf_len : *len;
+    memcpy(buf + *buf_len, *data, chunk);
+    *buf_len += chunk;
+    *data += chunk;
+    *len -= chunk;
+    return *buf_len == needed;
+}
+
+esp_err_t mqtt_decompress_feed(mqtt_decompress_handle_t decompress, const uint8_t *data, size_t len,
+                               mqtt_decompress_output_t output, void *ctx)
+{
+    while (len > 0) {
+        switch (decompress->state) {
+        case STATE_HEADER:
+            if (!collect(decompress->header, &decompress->header_len, MQTT_COMPRESS_HEADER_LEN, &data, &len)) {
+                break;
+            }
+            if (!mqtt_compress_is_frame(decompress->header, MQTT_COMPRESS_HEADER_LEN, &decompress->raw_len)) {
+                ESP_LOGE(TAG, "Invalid compressed frame header");
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            decompress->block_size = (size_t)1 << decompress->header[3];
+            decompress->in = mqtt_alloc(decompress->alloc, decompress->block_size);
+            decompress->out = mqtt_alloc(decompress->alloc, decompress->block_size);
+            ESP_MEM_CHECK(TAG, decompress->in && decompress->out, return ESP_ERR_NO_MEM);
+            decompress->header_len = 0;
+            decompress->state = decompress->raw_len ? STATE_BLOCK_HEADER : STATE_DONE;
+            break;
+        case STATE_BLOCK_HEADER:
+            if (!collect(decompress->header, &decompress->header_len, MQTT_COMPRESS_BLOCK_HEADER_LEN, &data, &len)) {
+                break;
+            }
+            decompress->block_comp_len = get_le16(decompress->header);
+            decompress->block_raw_len = get_le16(decompress->header + 2);
+            if (decompress->block_raw_len == 0 || decompress->block_raw_len > decompress->block_size ||
+                    decompress->block_comp_len > decompress->block_raw_len ||
+                    decompress->block_raw_len > decompress->raw_len - decompress->raw_done) {
+                ESP_LOGE(TAG, "Invalid compressed block header");
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            decompress->header_len = 0;
+            decompress->in_len = 0;
+            decompress->state = STATE_BLOCK_DATA;
+            break;
+        case STATE_BLOCK_DATA: {
+            if (!collect(decompress->in, &decompress->in_len, decompress->block_comp_len, &data, &len)) {
+                break;
+            }
+            const uint8_t *block = decompress->in;
+            if (decompress->block_comp_len < decompress->block_raw_len) {
+                int raw_len = decompress_block(decompress->in, decompress->in_len, decompress->out, decompress->block_raw_len);
+                if (raw_len != (int)decompress->block_raw_len) {
+                    ESP_LOGE(TAG, "Corrupted compressed block");
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                block = decompress->out;
+            }
+            decompress->raw_done += decompress->block_raw_len;
+            decompress->state = decompress->raw_done == decompress->raw_len ? STATE_DONE : STATE_BLOCK_HEADER;
+            esp_err_t err = output(ctx, block, decompress->block_raw_len);
+            if (err != ESP_OK) {
+                return err;
+            }
+            break;
+        }
+        case STATE_DONE:
+            ESP_LOGE(TAG, "Unexpected data after the compressed frame");
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    return ESP_OK;
+}
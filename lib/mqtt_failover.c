@@ -0,0 +1,161 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_failover.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt_failover";
+
+typedef struct {
+    char *uri;
+    uint32_t latency;       /* smoothed connect latency, 0 = not measured */
+    uint32_t rtt;           /* smoothed ping round trip time, 0 = not measured */
+    uint32_t failures;      /* consecutive failures */
+    uint64_t ready_tick;    /* end of the backoff */
+} endpoint_t;
+
+struct mqtt_failover {
+    const mqtt_allocator_t *alloc;
+    endpoint_t *endpoints;
+    int count;
+    int selected;
+    uint32_t base_backoff;
+    uint32_t max_backoff;
+};
+
+static uint32_t smooth(uint32_t average, uint32_t sample)
+{
+    // weight of 1/4 to the new sample, at least 1 so that a measured value is never 0
+    uint32_t value = average ? (3 * average + sample) / 4 : sample;
+    return value ? value : 1;
+}
+
+mqtt_failover_handle_t mqtt_failover_create(const char *const *uris, uint32_t base_backoff, uint32_t max_backoff,
+                                            const mqtt_allocator_t *allocator)
+{
+    int count = 0;
+    while (uris && uris[count]) {
+        ++count;
+    }
+    if (count == 0) {
+        ESP_LOGE(TAG, "No broker endpoint");
+        return NULL;
+    }
+    mqtt_failover_handle_t failover = mqtt_calloc(allocator, 1, sizeof(struct mqtt_failover));
+    ESP_MEM_CHECK(TAG, failover, return NULL);
+    failover->alloc = allocator;
+    failover->endpoints = mqtt_calloc(allocator, count, sizeof(endpoint_t));
+    ESP_MEM_CHECK(TAG, failover->endpoints, mqtt_failover_destroy(failover); return NULL);
+    for (int i = 0; i < count; ++i) {
+        failover->endpoints[i].uri = mqtt_strdup(allocator, uris[i]);
+        ESP_MEM_CHECK(TAG, failover->endpoints[i].uri, failover->count = i; mqtt_failover_destroy(failover); return NULL);
+    }
+    failover->count = count;
+    failover->base_backoff = base_backoff ? base_backoff : 1;
+    failover->max_backoff = max_backoff > failover->base_backoff ? max_backoff : failover->base_backoff;
+    return failover;
+}
+
+void mqtt_failover_destroy(mqtt_failover_handle_t failover)
+{
+    if (failover == NULL) {
+        return;
+    }
+    for (int i = 0; failover->endpoints && i < failover->count; ++i) {
+        mqtt_free(failover->alloc, failover->endpoints[i].uri);
+    }
+    mqtt_free(failover->alloc, failover->endpoints);
+    mqtt_free(failover->alloc, failover);
+}
+
+int mqtt_failover_count(mqtt_failover_handle_t failover)
+{
+    return failover->count;
+}
+
+const char *mqtt_failover_uri(mqtt_failover_handle_t failover, int endpoint)
+{
+    return failover->endpoints[endpoint].uri;
+}
+
+uint32_t mqtt_failover_score(mqtt_failover_handle_t failover, int endpoint)
+{
+    const endpoint_t *e = &failover->endpoints[endpoint];
+    return (e->latency ? e->latency : MQTT_FAILOVER_UNKNOWN_LATENCY_MS) + e->rtt +
+           e->failures * MQTT_FAILOVER_FAILURE_PENALTY_MS;
+}
+
+int mqtt_failover_select(mqtt_failover_handle_t failover, uint64_t now)
+{
+    int best = -1;
+    int first_ready = 0;
+    for (int i = 0; i < failover->count; ++i) {
+        const endpoint_t *e = &failover->endpoints[i];
+        if (e->ready_tick <= now) {
+            if (best < 0 || mqtt_failover_score(failover, i) < mqtt_failover_score(failover, best)) {
+                best = i;
+            }
+        } else if (e->ready_tick < failover->endpoints[first_ready].ready_tick) {
+            first_ready = i;
+        }
+    }
+    failover->selected = best >= 0 ? best : first_ready;
+    ESP_LOGD(TAG, "Selected %s, score %" PRIu32, failover->endpoints[failover->selected].uri,
+             mqtt_failover_score(failover, failover->selected));
+    return failover->selected;
+}
+
+int mqtt_failover_ready(mqtt_failover_handle_t failover, uint64_t now)
+{
+    int ready = 0;
+    for (int i = 0; i < failover->count; ++i) {
+        ready += failover->endpoints[i].ready_tick <= now;
+    }
+    return ready;
+}
+
+uint32_t mqtt_failover_wait(mqtt_failover_handle_t failover, uint64_t now)
+{
+    uint64_t ready_tick = UINT64_MAX;
+    for (int i = 0; i < failover->count; ++i) {
+        if (failover->endpoints[i].ready_tick < ready_tick) {
+            ready_tick = failover->endpoints[i].ready_tick;
+        }
+    }
+    return ready_tick > now ? (uint32_t)(ready_tick - now) : 0;
+}
+
+void mqtt_failover_connected(mqtt_failover_handle_t failover, uint32_t latency)
+{
+    endpoint_t *e = &failover->endpoints[failover->selected];
+    e->latency = smooth(e->latency, latency);
+    e->failures = 0;
+    e->ready_tick = 0;
+}
+
+void mqtt_failover_failed(mqtt_failover_handle_t failover, uint64_t now, mqtt_failover_random_t random)
+{
+    endpoint_t *e = &failover->endpoints[failover->selected];
+    uint32_t backoff = failover->base_backoff;
+    for (uint32_t i = 0; i < e->failures && backoff < failover->max_backoff; ++i) {
+        backoff *= 2;
+    }
+    if (backoff > failover->max_backoff) {
+        backoff = failover->max_backoff;
+    }
+    ++e->failures;
+    e->ready_tick = now + backoff / 2 + random(backoff / 2 + 1);
+    ESP_LOGI(TAG, "%s failed %" PRIu32 " times, retried in %" PRIu64 " ms", e->uri, e->failures, e->ready_tick - now);
+}
+
+void mqtt_failover_ping(mqtt_failover_handle_t failover, uint32_t rtt)
+{
+    endpoint_t *e = &failover->endpoints[failover->selected];
+    e->rtt = smooth(e->rtt, rtt);
+}
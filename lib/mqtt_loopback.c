@@ -0,0 +1,204 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sys/queue.h"
+#include "mqtt_loopback.h"
+#include "mqtt_blob.h"
+#include "mqtt_msg.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt_loopback";
+
+/* payload bytes in the fingerprint, the start of a received payload is available in the first chunk */
+#define FINGERPRINT_DATA_LEN    64
+
+typedef enum {
+    SUBSCRIPTION_PENDING,       /* SUBSCRIBE sent, waiting for SUBACK */
+    SUBSCRIPTION_ACTIVE,
+    SUBSCRIPTION_UNSUBSCRIBING, /* UNSUBSCRIBE sent, waiting for UNSUBACK */
+} subscription_state_t;
+
+typedef struct mqtt_loopback_subscription {
+    char *filter;
+    uint16_t msg_id;
+    uint16_t ack_index;         /* position of the topic in the SUBSCRIBE, selects the SUBACK return code */
+    uint8_t state;
+    uint8_t qos;
+    STAILQ_ENTRY(mqtt_loopback_subscription) next;
+} mqtt_loopback_subscription_t;
+
+STAILQ_HEAD(mqtt_loopback_subscription_list, mqtt_loopback_subscription);
+
+typedef struct {
+    uint64_t tick;
+    uint32_t fingerprint;
+    bool used;
+} delivered_t;
+
+struct mqtt_loopback {
+    const mqtt_allocator_t *alloc;
+    struct mqtt_loopback_subscription_list subscriptions;
+    delivered_t *window;
+    int window_size;
+    int window_next;            /* slot of the next message, the oldest one once the window is full */
+};
+
+static uint32_t fingerprint(const char *topic, size_t topic_len, const char *data, size_t total_len)
+{
+    uint8_t len[4];
+    put_le32(len, total_len);
+    uint32_t crc = mqtt_crc32_update(0, (const uint8_t *)topic, topic_len);
+    crc = mqtt_crc32_update(crc, len, sizeof(len));
+    return mqtt_crc32_update(crc, (const uint8_t *)data, total_len < FINGERPRINT_DATA_LEN ? total_len : FINGERPRINT_DATA_LEN);
+}
+
+static mqtt_loopback_subscription_t *find_subscription(mqtt_loopback_handle_t loopback, const char *filter)
+{
+    mqtt_loopback_subscription_t *sub;
+    STAILQ_FOREACH(sub, &loopback->subscriptions, next) {
+        if (strcmp(sub->filter, filter) == 0) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+static void remove_subscription(mqtt_loopback_handle_t loopback, mqtt_loopback_subscription_t *sub)
+{
+    STAILQ_REMOVE(&loopback->subscriptions, sub, mqtt_loopback_subscription, next);
+    mqtt_free(loopback->alloc, sub->filter);
+    mqtt_free(loopback->alloc, sub);
+}
+
+mqtt_loopback_handle_t mqtt_loopback_create(int window_size, const mqtt_allocator_t *allocator)
+{
+    if (window_size <= 0) {
+        ESP_LOGE(TAG, "Invalid window size %d", window_size);
+        return NULL;
+    }
+    mqtt_loopback_handle_t loopback = mqtt_calloc(allocator, 1, sizeof(struct mqtt_loopback));
+    ESP_MEM_CHECK(TAG, loopback, return NULL);
+    loopback->window = mqtt_calloc(allocator, window_size, sizeof(delivered_t));
+    ESP_MEM_CHECK(TAG, loopback->window, mqtt_free(allocator, loopback); return NULL);
+    loopback->alloc = allocator;
+    loopback->window_size = window_size;
+    STAILQ_INIT(&loopback->subscriptions);
+    return loopback;
+}
+
+void mqtt_loopback_destroy(mqtt_loopback_handle_t loopback)
+{
+    if (loopback == NULL) {
+        return;
+    }
+    mqtt_loopback_clear_subscriptions(loopback);
+    mqtt_free(loopback->alloc, loopback->window);
+    mqtt_free(loopback->alloc, loopback);
+}
+
+esp_err_t mqtt_loopback_subscribe(mqtt_loopback_handle_t loopback, int msg_id, const esp_mqtt_topic_t *topic_list, int size)
+{
+    for (int i = 0; i < size; ++i) {
+        mqtt_loopback_subscription_t *sub = find_subscription(loopback, topic_list[i].filter);
+        if (sub == NULL) {
+            sub = mqtt_calloc(loopback->alloc, 1, sizeof(mqtt_loopback_subscription_t));
+            ESP_MEM_CHECK(TAG, sub, return ESP_ERR_NO_MEM);
+            sub->filter = mqtt_strndup(loopback->alloc, topic_list[i].filter, strlen(topic_list[i].filter));
+            ESP_MEM_CHECK(TAG, sub->filter, mqtt_free(loopback->alloc, sub); return ESP_ERR_NO_MEM);
+            STAILQ_INSERT_TAIL(&loopback->subscriptions, sub, next);
+        }
+        sub->state = SUBSCRIPTION_PENDING;
+        sub->msg_id = msg_id;
+        sub->ack_index = i;
+    }
+    return ESP_OK;
+}
+
+void mqtt_loopback_unsubscribe(mqtt_loopback_handle_t loopback, int msg_id, const char *topic)
+{
+    mqtt_loopback_subscription_t *sub = find_subscription(loopback, topic);
+    if (sub) {
+        sub->state = SUBSCRIPTION_UNSUBSCRIBING;
+        sub->msg_id = msg_id;
+    }
+}
+
+void mqtt_loopback_suback(mqtt_loopback_handle_t loopback, int msg_id, const uint8_t *return_codes, int count)
+{
+    mqtt_loopback_subscription_t *sub, *tmp;
+    STAILQ_FOREACH_SAFE(sub, &loopback->subscriptions, next, tmp) {
+        if (sub->state != SUBSCRIPTION_PENDING || sub->msg_id != msg_id) {
+            continue;
+        }
+        if (sub->ack_index >= count || return_codes[sub->ack_index] >= 0x80) {
+            remove_subscription(loopback, sub);
+            continue;
+        }
+        sub->state = SUBSCRIPTION_ACTIVE;
+        sub->qos = return_codes[sub->ack_index];
+        sub->msg_id = 0;
+    }
+}
+
+void mqtt_loopback_unsuback(mqtt_loopback_handle_t loopback, int msg_id)
+{
+    mqtt_loopback_subscription_t *sub, *tmp;
+    STAILQ_FOREACH_SAFE(sub, &loopback->subscriptions, next, tmp) {
+        if (sub->state == SUBSCRIPTION_UNSUBSCRIBING && sub->msg_id == msg_id) {
+            remove_subscription(loopback, sub);
+        }
+    }
+}
+
+void mqtt_loopback_clear_subscriptions(mqtt_loopback_handle_t loopback)
+{
+    mqtt_loopback_subscription_t *sub, *tmp;
+    STAILQ_FOREACH_SAFE(sub, &loopback->subscriptions, next, tmp) {
+        remove_subscription(loopback, sub);
+    }
+}
+
+int mqtt_loopback_match(mqtt_loopback_handle_t loopback, const char *topic, size_t topic_len)
+{
+    int qos = -1;
+    mqtt_loopback_subscription_t *sub;
+    STAILQ_FOREACH(sub, &loopback->subscriptions, next) {
+        if (sub->state == SUBSCRIPTION_ACTIVE && sub->qos > qos && mqtt_topic_matches(sub->filter, topic, topic_len)) {
+            qos = sub->qos;
+        }
+    }
+    return qos;
+}
+
+void mqtt_loopback_delivered(mqtt_loopback_handle_t loopback, const char *topic, size_t topic_len,
+                             const char *data, size_t total_len, uint64_t tick)
+{
+    delivered_t *delivered = &loopback->window[loopback->window_next];
+    delivered->fingerprint = fingerprint(topic, topic_len, data, total_len);
+    delivered->tick = tick;
+    delivered->used = true;
+    loopback->window_next = (loopback->window_next + 1) % loopback->window_size;
+}
+
+bool mqtt_loopback_is_echo(mqtt_loopback_handle_t loopback, const char *topic, size_t topic_len,
+                           const char *data, size_t data_len, size_t total_len, uint64_t now, uint64_t window)
+{
+    if (topic == NULL || data_len < (total_len < FINGERPRINT_DATA_LEN ? total_len : FINGERPRINT_DATA_LEN)) {
+        return false;
+    }
+    uint32_t received = fingerprint(topic, topic_len, data, total_len);
+    // oldest first, the same message published twice is matched in order
+    for (int i = 0; i < loopback->window_size; ++i) {
+        delivered_t *delivered = &loopback->window[(loopback->window_next + i) % loopback->window_size];
+        if (delivered->used && delivered->fingerprint == received && now - delivered->tick <= window) {
+            delivered->used = false;
+            return true;
+        }
+    }
+    return false;
+}
@@ -60,10 +60,9 @@ static int append_string(mqtt_connection_t *connection, const char *string, int
     return len + 2;
 }
 
-static uint16_t append_message_id(mqtt_connection_t *connection, uint16_t message_id)
+uint16_t mqtt_msg_next_id(mqtt_connection_t *connection)
 {
-    // If message_id is zero then we should assign one, otherwise
-    // we'll use the one supplied by the caller
+    uint16_t message_id = 0;
     while (message_id == 0) {
 #if MQTT_MSG_ID_INCREMENTAL
         message_id = ++connection->last_message_id;
@@ -71,6 +70,16 @@ static uint16_t append_message_id(mqtt_connection_t *connection, uint16_t messag
         message_id = platform_random(65535);
 #endif
     }
+    return message_id;
+}
+
+static uint16_t append_message_id(mqtt_connection_t *connection, uint16_t message_id)
+{
+    // If message_id is zero then we should assign one, otherwise
+    // we'll use the one supplied by the caller
+    if (message_id == 0) {
+        message_id = mqtt_msg_next_id(connection);
+    }
 
     if (connection->outbound_message.length + 2 > connection->buffer_length) {
         return 0;
@@ -436,7 +445,7 @@ mqtt_message_t *mqtt_msg_connect(mqtt_connection_t *connection, mqtt_connect_inf
     return fini_message(connection, MQTT_MSG_TYPE_CONNECT, 0, 0, 0);
 }
 
-mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id)
+static mqtt_message_t *msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id, bool header_only)
 {
     set_message_header_size(connection);
 
@@ -448,7 +457,7 @@ mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topi
         return fail_message(connection);
     }
 
-    if (data == NULL && data_length > 0) {
+    if (data == NULL && data_length > 0 && !header_only) {
         return fail_message(connection);
     }
 
@@ -460,7 +469,11 @@ mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topi
         *message_id = 0;
     }
 
-    if (data != NULL) {
+    if (header_only) {
+        // the remaining length covers the payload, which is written separately
+        connection->outbound_message.fragmented_msg_data_offset = connection->outbound_message.length;
+        connection->outbound_message.fragmented_msg_total_length = data_length + connection->outbound_message.length;
+    } else if (data != NULL) {
         if (connection->outbound_message.length + data_length > connection->buffer_length) {
             // Not enough size in buffer -> fragment this message
             connection->outbound_message.fragmented_msg_data_offset = connection->outbound_message.length;
@@ -476,6 +489,16 @@ mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topi
     return fini_message(connection, MQTT_MSG_TYPE_PUBLISH, 0, qos, retain);
 }
 
+mqtt_message_t *mqtt_msg_publish(mqtt_connection_t *connection, const char *topic, const char *data, int data_length, int qos, int retain, uint16_t *message_id)
+{
+    return msg_publish(connection, topic, data, data_length, qos, retain, message_id, false);
+}
+
+mqtt_message_t *mqtt_msg_publish_header(mqtt_connection_t *connection, const char *topic, int data_length, int qos, int retain, uint16_t *message_id)
+{
+    return msg_publish(connection, topic, NULL, data_length, qos, retain, message_id, true);
+}
+
 mqtt_message_t *mqtt_msg_puback(mqtt_connection_t *connection, uint16_t message_id)
 {
     set_message_header_size(connection);
@@ -616,10 +639,67 @@ int mqtt_has_valid_msg_hdr(uint8_t *buffer, size_t length)
     }
 }
 
+/*
+ * matches topic name against a filter with '+' and '#' wildcards [MQTT-4.7]
+ * topics starting with '$' are not matched by a leading wildcard [MQTT-4.7.2-1]
+ */
+bool mqtt_topic_matches(const char *filter, const char *topic, size_t topic_len)
+{
+    const char *end = topic + topic_len;
+
+    if (topic_len > 0 && topic[0] == '$' && (filter[0] == '+' || filter[0] == '#')) {
+        return false;
+    }
+    while (*filter) {
+        if (filter[0] == '#') {
+            return true;
+        }
+        if (filter[0] == '+') {
+            while (topic < end && *topic != '/') {
+                ++topic;
+            }
+            ++filter;
+        } else {
+            while (*filter && *filter != '/' && topic < end && *topic == *filter) {
+                ++filter;
+                ++topic;
+            }
+            if (*filter && *filter != '/') {
+                return false;
+            }
+            if (topic < end && *topic != '/') {
+                return false;
+            }
+        }
+        // both at a level separator or at the end
+        if (*filter == '\0') {
+            return topic == end;
+        }
+        if (topic == end) {
+            // "a/#" matches "a" as well
+            return filter[0] == '/' && filter[1] == '#' && filter[2] == '\0';
+        }
+        ++filter;
+        ++topic;
+    }
+    return topic == end;
+}
+
+/* filters is a NULL terminated list, NULL matches nothing */
+bool mqtt_topic_matches_any(const char *const *filters, const char *topic, size_t topic_len)
+{
+    for (; filters && *filters; ++filters) {
+        if (mqtt_topic_matches(*filters, topic, topic_len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 esp_err_t mqtt_msg_buffer_init(mqtt_connection_t *connection, int buffer_size)
 {
     memset(&connection->outbound_message, 0, sizeof(mqtt_message_t));
-    connection->buffer = (uint8_t *)calloc(buffer_size, sizeof(uint8_t));
+    connection->buffer = (uint8_t *)mqtt_calloc(MQTT_ALLOCATOR(connection->alloc, state), buffer_size, sizeof(uint8_t));
     if (!connection->buffer) {
         return ESP_ERR_NO_MEM;
     }
@@ -630,7 +710,7 @@ esp_err_t mqtt_msg_buffer_init(mqtt_connection_t *connection, int buffer_size)
 void mqtt_msg_buffer_destroy(mqtt_connection_t *connection)
 {
     if (connection) {
-        free(connection->buffer);
+        mqtt_free(MQTT_ALLOCATOR(connection->alloc, state), connection->buffer);
     }
 }
 
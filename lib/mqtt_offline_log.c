@@ -0,0 +1,560 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "mqtt_offline_log.h"
+#include "mqtt_blob.h"
+#include "mqtt_config.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt_offline_log";
+
+#define RECORD_MAGIC            0xA7
+#define RECORD_FLAG_QOS_MASK    0x03
+#define RECORD_FLAG_RETAIN      0x04
+#define CHECKPOINT_MAGIC        0x4C4F514D  /* "MQOL" */
+#define CHECKPOINT_VERSION      1
+#define CHECKPOINT_LEN          20
+#define FILE_PATH_MAX           128
+
+typedef struct {
+    char *path;
+    FILE *rd;
+    uint32_t rd_segment;
+    FILE *wr;
+    uint32_t wr_segment;
+} file_storage_t;
+
+typedef struct {
+    int msg_id;
+    bool acked;
+} inflight_t;
+
+struct mqtt_offline_log {
+    esp_mqtt_offline_storage_t storage;
+    const mqtt_allocator_t *alloc;
+    file_storage_t *file;
+    size_t segment_size;
+    int max_segments;
+    int batch_size;
+    mqtt_offline_log_pos_t first;   /* oldest segment still present */
+    mqtt_offline_log_pos_t acked;   /* checkpoint: first record not yet acknowledged */
+    mqtt_offline_log_pos_t read;    /* replay cursor */
+    mqtt_offline_log_pos_t head;    /* write position */
+    inflight_t *inflight;
+    int inflight_count;
+    int inflight_acked;
+    uint8_t *rbuf;
+    size_t rbuf_len;
+    uint8_t *wbuf;
+    size_t wbuf_len;
+    mqtt_offline_log_stats_t stats;
+};
+
+static inline bool pos_equal(mqtt_offline_log_pos_t a, mqtt_offline_log_pos_t b)
+{
+    return a.segment == b.segment && a.offset == b.offset;
+}
+
+static inline bool pos_before(mqtt_offline_log_pos_t a, mqtt_offline_log_pos_t b)
+{
+    return a.segment < b.segment || (a.segment == b.segment && a.offset < b.offset);
+}
+
+static bool ensure_buffer(const mqtt_allocator_t *allocator, uint8_t **buf, size_t *buf_len, size_t len)
+{
+    if (*buf_len >= len) {
+        return true;
+    }
+    uint8_t *tmp = mqtt_realloc(allocator, *buf, len);
+    ESP_MEM_CHECK(TAG, tmp, return false);
+    *buf = tmp;
+    *buf_len = len;
+    return true;
+}
+
+/*
+ * Default storage: one file per segment inside a directory (host filesystem or any VFS mounted
+ * filesystem on target). The last used segment is kept open for reading and for writing.
+ */
+static bool file_segment_name(file_storage_t *fs, uint32_t segment, char *name)
+{
+    int len = snprintf(name, FILE_PATH_MAX, "%s/%08" PRIx32 ".log", fs->path, segment);
+    return len > 0 && len < FILE_PATH_MAX;
+}
+
+static bool file_name(file_storage_t *fs, const char *file, char *name)
+{
+    int len = snprintf(name, FILE_PATH_MAX, "%s/%s", fs->path, file);
+    return len > 0 && len < FILE_PATH_MAX;
+}
+
+static FILE *file_open_segment(file_storage_t *fs, FILE **cached, uint32_t *cached_segment, uint32_t segment, const char *mode)
+{
+    if (*cached && *cached_segment == segment) {
+        return *cached;
+    }
+    if (*cached) {
+        fclose(*cached);
+        *cached = NULL;
+    }
+    char name[FILE_PATH_MAX];
+    if (!file_segment_name(fs, segment, name)) {
+        return NULL;
+    }
+    *cached = fopen(name, mode);
+    *cached_segment = segment;
+    return *cached;
+}
+
+static esp_err_t file_append(void *ctx, uint32_t segment, const void *data, size_t len)
+{
+    file_storage_t *fs = ctx;
+    FILE *f = file_open_segment(fs, &fs->wr, &fs->wr_segment, segment, "ab");
+    if (f == NULL) {
+        return ESP_FAIL;
+    }
+    if (fwrite(data, 1, len, f) != len || fflush(f) != 0) {
+        fclose(f);
+        fs->wr = NULL;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static int file_read(void *ctx, uint32_t segment, uint32_t offset, void *data, size_t len)
+{
+    file_storage_t *fs = ctx;
+    FILE *f = file_open_segment(fs, &fs->rd, &fs->rd_segment, segment, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fseek(f, offset, SEEK_SET) != 0) {
+        return 0;
+    }
+    return (int)fread(data, 1, len, f);
+}
+
+static esp_err_t file_remove(void *ctx, uint32_t segment)
+{
+    file_storage_t *fs = ctx;
+    char name[FILE_PATH_MAX];
+    if (fs->rd && fs->rd_segment == segment) {
+        fclose(fs->rd);
+        fs->rd = NULL;
+    }
+    if (fs->wr && fs->wr_segment == segment) {
+        fclose(fs->wr);
+        fs->wr = NULL;
+    }
+    if (!file_segment_name(fs, segment, name)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return remove(name) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t file_write_checkpoint(void *ctx, const void *data, size_t len)
+{
+    file_storage_t *fs = ctx;
+    char name[FILE_PATH_MAX];
+    char tmp_name[FILE_PATH_MAX];
+    if (!file_name(fs, "checkpoint", name) || !file_name(fs, "checkpoint.tmp", tmp_name)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    FILE *f = fopen(tmp_name, "wb");
+    if (f == NULL) {
+        return ESP_FAIL;
+    }
+    bool ok = fwrite(data, 1, len, f) == len && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    fclose(f);
+    if (!ok || rename(tmp_name, name) != 0) {
+        remove(tmp_name);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static int file_read_checkpoint(void *ctx, void *data, size_t len)
+{
+    file_storage_t *fs = ctx;
+    char name[FILE_PATH_MAX];
+    if (!file_name(fs, "checkpoint", name)) {
+        return -1;
+    }
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    int read_len = (int)fread(data, 1, len, f);
+    fclose(f);
+    return read_len;
+}
+
+static void file_storage_destroy(const mqtt_allocator_t *allocator, file_storage_t *fs)
+{
+    if (fs == NULL) {
+        return;
+    }
+    if (fs->rd) {
+        fclose(fs->rd);
+    }
+    if (fs->wr) {
+        fclose(fs->wr);
+    }
+    mqtt_free(allocator, fs->path);
+    mqtt_free(allocator, fs);
+}
+
+static esp_err_t write_checkpoint(mqtt_offline_log_handle_t log)
+{
+    uint8_t blob[CHECKPOINT_LEN];
+    put_le32(blob, CHECKPOINT_MAGIC);
+    put_le16(blob + 4, CHECKPOINT_VERSION);
+    put_le16(blob + 6, 0);
+    put_le32(blob + 8, log->acked.segment);
+    put_le32(blob + 12, log->acked.offset);
+    put_le32(blob + 16, mqtt_crc32_update(0, blob, 16));
+    log->stats.written_bytes += CHECKPOINT_LEN;
+    if (log->storage.write_checkpoint(log->storage.ctx, blob, CHECKPOINT_LEN) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store checkpoint");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static bool read_checkpoint(mqtt_offline_log_handle_t log)
+{
+    uint8_t blob[CHECKPOINT_LEN];
+    if (log->storage.read_checkpoint(log->storage.ctx, blob, sizeof(blob)) != CHECKPOINT_LEN) {
+        return false;
+    }
+    if (get_le32(blob) != CHECKPOINT_MAGIC || get_le16(blob + 4) != CHECKPOINT_VERSION ||
+            get_le32(blob + 16) != mqtt_crc32_update(0, blob, 16)) {
+        ESP_LOGW(TAG, "Invalid checkpoint, replaying the log from the beginning");
+        return false;
+    }
+    log->acked.segment = get_le32(blob + 8);
+    log->acked.offset = get_le32(blob + 12);
+    return true;
+}
+
+static bool segment_exists(mqtt_offline_log_handle_t log, uint32_t segment)
+{
+    uint8_t byte;
+    return log->storage.read(log->storage.ctx, segment, 0, &byte, 1) >= 0;
+}
+
+/*
+ * Validates the record at pos, on success the whole record is left in rbuf.
+ * Returns the record length, 0 at the end of segment, -1 if the segment is missing, -2 if corrupted
+ */
+static int load_record(mqtt_offline_log_handle_t log, mqtt_offline_log_pos_t pos)
+{
+    uint8_t header[MQTT_OFFLINE_LOG_RECORD_HEADER_LEN];
+    int read_len = log->storage.read(log->storage.ctx, pos.segment, pos.offset, header, sizeof(header));
+    if (read_len <= 0) {
+        return read_len;
+    }
+    if (read_len < (int)sizeof(header) || header[0] != RECORD_MAGIC) {
+        return -2;
+    }
+    size_t topic_len = get_le16(header + 2);
+    size_t data_len = get_le32(header + 4);
+    size_t record_len = sizeof(header) + topic_len + data_len;
+    if (topic_len == 0 || record_len > log->segment_size) {
+        return -2;
+    }
+    /* keep one spare byte to NUL terminate the topic when handing out the record */
+    if (!ensure_buffer(log->alloc, &log->rbuf, &log->rbuf_len, record_len + 1)) {
+        return -2;
+    }
+    memcpy(log->rbuf, header, sizeof(header));
+    size_t body_len = topic_len + data_len;
+    if (body_len && log->storage.read(log->storage.ctx, pos.segment, pos.offset + sizeof(header),
+                                      log->rbuf + sizeof(header), body_len) != (int)body_len) {
+        return -2;
+    }
+    uint32_t crc = mqtt_crc32_update(0, header, 8);
+    crc = mqtt_crc32_update(crc, log->rbuf + sizeof(header), body_len);
+    if (crc != get_le32(header + 8)) {
+        return -2;
+    }
+    return (int)record_len;
+}
+
+static void recover_head(mqtt_offline_log_handle_t log)
+{
+    mqtt_offline_log_pos_t pos = log->acked;
+    while (true) {
+        int ret = load_record(log, pos);
+        if (ret > 0) {
+            pos.offset += ret;
+            continue;
+        }
+        if (ret == -1) {
+            break;
+        }
+        if (ret == -2) {
+            /* torn write or corrupted tail, never append behind it */
+            ESP_LOGW(TAG, "Corrupted record at %" PRIu32 ":%" PRIu32, pos.segment, pos.offset);
+            log->stats.corrupted_records++;
+        }
+        if (!segment_exists(log, pos.segment + 1)) {
+            if (ret == -2) {
+                pos.segment++;
+                pos.offset = 0;
+            }
+            break;
+        }
+        pos.segment++;
+        pos.offset = 0;
+    }
+    log->head = pos;
+}
+
+static void remove_segments_before(mqtt_offline_log_handle_t log, uint32_t segment)
+{
+    while (log->first.segment < segment) {
+        if (log->storage.remove(log->storage.ctx, log->first.segment) == ESP_OK) {
+            log->stats.compacted_segments++;
+        }
+        log->first.segment++;
+    }
+}
+
+static void commit_batch(mqtt_offline_log_handle_t log)
+{
+    log->acked = log->read;
+    log->inflight_count = 0;
+    log->inflight_acked = 0;
+    if (pos_equal(log->acked, log->head) && log->head.offset > 0) {
+        /* everything delivered: start a fresh segment so that the current one could be compacted */
+        log->head.segment++;
+        log->head.offset = 0;
+        log->acked = log->read = log->head;
+    }
+    if (write_checkpoint(log) == ESP_OK) {
+        remove_segments_before(log, log->acked.segment);
+    }
+}
+
+mqtt_offline_log_handle_t mqtt_offline_log_open(const esp_mqtt_offline_storage_t *storage, const char *path,
+                                                size_t segment_size, int max_segments, int batch_size,
+                                                const mqtt_allocator_t *allocator)
+{
+    if ((storage == NULL && path == NULL) || segment_size <= MQTT_OFFLINE_LOG_RECORD_HEADER_LEN || batch_size <= 0) {
+        return NULL;
+    }
+    mqtt_offline_log_handle_t log = mqtt_calloc(allocator, 1, sizeof(struct mqtt_offline_log));
+    ESP_MEM_CHECK(TAG, log, return NULL);
+    log->alloc = allocator;
+    log->inflight = mqtt_calloc(allocator, batch_size, sizeof(inflight_t));
+    ESP_MEM_CHECK(TAG, log->inflight, goto _open_failed);
+    if (storage) {
+        log->storage = *storage;
+    } else {
+        log->file = mqtt_calloc(allocator, 1, sizeof(file_storage_t));
+        ESP_MEM_CHECK(TAG, log->file, goto _open_failed);
+        log->file->path = mqtt_strdup(allocator, path);
+        ESP_MEM_CHECK(TAG, log->file->path, goto _open_failed);
+        log->storage = (esp_mqtt_offline_storage_t) {
+            .append = file_append,
+            .read = file_read,
+            .remove = file_remove,
+            .write_checkpoint = file_write_checkpoint,
+            .read_checkpoint = file_read_checkpoint,
+            .ctx = log->file,
+        };
+    }
+    log->segment_size = segment_size;
+    log->max_segments = max_segments;
+    log->batch_size = batch_size;
+
+    read_checkpoint(log);
+    log->first.segment = log->acked.segment;
+    log->read = log->acked;
+    recover_head(log);
+    ESP_LOGI(TAG, "Offline log opened, checkpoint=%" PRIu32 ":%" PRIu32 ", head=%" PRIu32 ":%" PRIu32,
+             log->acked.segment, log->acked.offset, log->head.segment, log->head.offset);
+    return log;
+
+_open_failed:
+    mqtt_offline_log_close(log);
+    return NULL;
+}
+
+void mqtt_offline_log_close(mqtt_offline_log_handle_t log)
+{
+    if (log == NULL) {
+        return;
+    }
+    file_storage_destroy(log->alloc, log->file);
+    mqtt_free(log->alloc, log->inflight);
+    mqtt_free(log->alloc, log->rbuf);
+    mqtt_free(log->alloc, log->wbuf);
+    mqtt_free(log->alloc, log);
+}
+
+esp_err_t mqtt_offline_log_append(mqtt_offline_log_handle_t log, const char *topic, int topic_len,
+                                  const char *data, int data_len, int qos, int retain)
+{
+    if (topic == NULL || topic_len <= 0 || topic_len > UINT16_MAX || data_len < 0 || (data == NULL && data_len > 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t record_len = MQTT_OFFLINE_LOG_RECORD_HEADER_LEN + topic_len + data_len;
+    if (record_len > log->segment_size) {
+        ESP_LOGE(TAG, "Message of %d bytes doesn't fit the log segment", data_len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (log->head.offset + record_len > log->segment_size) {
+        log->head.segment++;
+        log->head.offset = 0;
+    }
+    if (log->max_segments > 0 && log->head.segment - log->acked.segment >= (uint32_t)log->max_segments) {
+        /* drop the oldest undelivered segment(s) to make room */
+        uint32_t oldest = log->head.segment - log->max_segments + 1;
+        ESP_LOGW(TAG, "Offline log full, dropping segments %" PRIu32 "..%" PRIu32, log->acked.segment, oldest - 1);
+        log->stats.dropped_segments += oldest - log->acked.segment;
+        log->acked.segment = oldest;
+        log->acked.offset = 0;
+        if (pos_before(log->read, log->acked)) {
+            log->read = log->acked;
+            log->inflight_count = 0;
+            log->inflight_acked = 0;
+        }
+        if (write_checkpoint(log) == ESP_OK) {
+            remove_segments_before(log, log->acked.segment);
+        }
+    }
+    if (!ensure_buffer(log->alloc, &log->wbuf, &log->wbuf_len, record_len)) {
+        return ESP_ERR_NO_MEM;
+    }
+    uint8_t *rec = log->wbuf;
+    rec[0] = RECORD_MAGIC;
+    rec[1] = (qos & RECORD_FLAG_QOS_MASK) | (retain ? RECORD_FLAG_RETAIN : 0);
+    put_le16(rec + 2, topic_len);
+    put_le32(rec + 4, data_len);
+    memcpy(rec + MQTT_OFFLINE_LOG_RECORD_HEADER_LEN, topic, topic_len);
+    if (data_len) {
+        memcpy(rec + MQTT_OFFLINE_LOG_RECORD_HEADER_LEN + topic_len, data, data_len);
+    }
+    uint32_t crc = mqtt_crc32_update(0, rec, 8);
+    crc = mqtt_crc32_update(crc, rec + MQTT_OFFLINE_LOG_RECORD_HEADER_LEN, topic_len + data_len);
+    put_le32(rec + 8, crc);
+
+    if (log->storage.append(log->storage.ctx, log->head.segment, rec, record_len) != ESP_OK) {
+        /* the segment might end with a partial record now, continue in the next one */
+        ESP_LOGE(TAG, "Failed to append to segment %" PRIu32, log->head.segment);
+        log->head.segment++;
+        log->head.offset = 0;
+        return ESP_FAIL;
+    }
+    log->head.offset += record_len;
+    log->stats.appended_records++;
+    log->stats.appended_bytes += topic_len + data_len;
+    log->stats.written_bytes += record_len;
+    return ESP_OK;
+}
+
+bool mqtt_offline_log_is_drained(mqtt_offline_log_handle_t log)
+{
+    return log->inflight_count == 0 && pos_equal(log->read, log->head);
+}
+
+bool mqtt_offline_log_can_replay(mqtt_offline_log_handle_t log)
+{
+    return log->inflight_count < log->batch_size && !pos_equal(log->read, log->head);
+}
+
+esp_err_t mqtt_offline_log_read(mqtt_offline_log_handle_t log, mqtt_offline_log_record_t *record)
+{
+    while (mqtt_offline_log_can_replay(log)) {
+        int ret = load_record(log, log->read);
+        if (ret > 0) {
+            uint8_t flags = log->rbuf[1];
+            size_t topic_len = get_le16(log->rbuf + 2);
+            uint8_t *body = log->rbuf + MQTT_OFFLINE_LOG_RECORD_HEADER_LEN;
+            /* move the topic in front of its NUL terminator, the header isn't needed anymore */
+            memmove(log->rbuf, body, topic_len);
+            log->rbuf[topic_len] = '\0';
+            record->topic = (const char *)log->rbuf;
+            record->topic_len = topic_len;
+            record->data = (const char *)body + topic_len;
+            record->data_len = ret - MQTT_OFFLINE_LOG_RECORD_HEADER_LEN - topic_len;
+            record->qos = flags & RECORD_FLAG_QOS_MASK;
+            record->retain = (flags & RECORD_FLAG_RETAIN) ? 1 : 0;
+            log->read.offset += ret;
+            log->stats.replayed_records++;
+            return ESP_OK;
+        }
+        if (ret == -2) {
+            ESP_LOGW(TAG, "Skipping corrupted segment %" PRIu32 " at offset %" PRIu32, log->read.segment, log->read.offset);
+            log->stats.corrupted_records++;
+        }
+        if (log->read.segment >= log->head.segment) {
+            log->read = log->head;
+            break;
+        }
+        log->read.segment++;
+        log->read.offset = 0;
+    }
+    if (log->inflight_count > 0 && log->inflight_acked == log->inflight_count) {
+        commit_batch(log);
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+void mqtt_offline_log_sent(mqtt_offline_log_handle_t log, int msg_id)
+{
+    if (log->inflight_count >= log->batch_size) {
+        return;
+    }
+    inflight_t *item = &log->inflight[log->inflight_count++];
+    item->msg_id = msg_id;
+    item->acked = msg_id == 0;
+    if (item->acked) {
+        log->stats.acked_records++;
+        log->inflight_acked++;
+    }
+    if (log->inflight_acked == log->inflight_count && !mqtt_offline_log_can_replay(log)) {
+        commit_batch(log);
+    }
+}
+
+bool mqtt_offline_log_ack(mqtt_offline_log_handle_t log, int msg_id)
+{
+    for (int i = 0; i < log->inflight_count; ++i) {
+        if (!log->inflight[i].acked && log->inflight[i].msg_id == msg_id) {
+            log->inflight[i].acked = true;
+            log->inflight_acked++;
+            log->stats.acked_records++;
+            if (log->inflight_acked == log->inflight_count) {
+                commit_batch(log);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void mqtt_offline_log_rewind(mqtt_offline_log_handle_t log)
+{
+    if (log->inflight_count > 0) {
+        ESP_LOGD(TAG, "Rewinding %d unacknowledged records", log->inflight_count - log->inflight_acked);
+    }
+    log->read = log->acked;
+    log->inflight_count = 0;
+    log->inflight_acked = 0;
+}
+
+void mqtt_offline_log_get_stats(mqtt_offline_log_handle_t log, mqtt_offline_log_stats_t *stats)
+{
+    *stats = log->stats;
+}
@@ -1,101 +1,224 @@
 #include "mqtt_outbox.h"
 #include "mqtt_config.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
 #include "ED_mqtt_qos1_queue.h"
 #include "mqtt_msg.h"
+#include "mqtt_alloc.h"
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 static const char *TAG = "outbox";
 
-/* Minimal static ring for non-QoS1 messages */
+/* Minimal static ring for non-QoS1 messages (QoS1 publishes only while held back by the rate limiter) */
 #define OUTBOX_RING_CAP 8
+/*
+ * Once the ring is full, chunks of OUTBOX_RING_CAP items are added as needed, so that each
+ * QoS2 publish the in-flight table admits keeps its bytes until PUBREC. The oldest message
+ * is only dropped beyond that.
+ */
+#define OUTBOX_MAX_CHUNKS (1 + (MQTT_QOS2_MAX_INFLIGHT + OUTBOX_RING_CAP - 1) / OUTBOX_RING_CAP)
 
 struct outbox_item
 {
     outbox_message_t msg;
     pending_state_t state;
     outbox_tick_t tick;
+    outbox_tick_t expiry;       /* absolute tick after which the message is dropped, 0 = never */
+    int priority;
     bool in_use;
 };
 
 struct outbox_t
 {
     struct outbox_item ring[OUTBOX_RING_CAP];
+    struct outbox_item *chunks[OUTBOX_MAX_CHUNKS];  /* chunks[0] is the ring, the others are allocated */
+    int capacity;
     size_t size;
     esp_mqtt_client_handle_t client;
+    const mqtt_allocator_t *alloc;      /* of the outbox and its messages */
+    mqtt_qos1q_handle_t qos1q;
 };
 
-static struct outbox_t g_outbox;
+static struct outbox_item *item_at(outbox_handle_t outbox, int i)
+{
+    return &outbox->chunks[i / OUTBOX_RING_CAP][i % OUTBOX_RING_CAP];
+}
+
+static void reset_chunks(outbox_handle_t outbox)
+{
+    outbox->chunks[0] = outbox->ring;
+    outbox->capacity = OUTBOX_RING_CAP;
+}
+
+static struct outbox_item *add_chunk(outbox_handle_t outbox)
+{
+    int chunk = outbox->capacity / OUTBOX_RING_CAP;
+    outbox->chunks[chunk] = mqtt_calloc(outbox->alloc, OUTBOX_RING_CAP, sizeof(struct outbox_item));
+    if (!outbox->chunks[chunk]) {
+        return NULL;
+    }
+    outbox->capacity += OUTBOX_RING_CAP;
+    return outbox->chunks[chunk];
+}
 
-outbox_handle_t outbox_init(esp_mqtt_client_handle_t client)
+static size_t shared_len(const struct outbox_item *item)
 {
-    memset(&g_outbox, 0, sizeof(g_outbox));
-    g_outbox.client = client;
-    /* Initialise QoS1 queue with dynamic slots enabled */
-    mqtt_qos1q_init();
+    size_t len;
+    outbox_shared_payload_get_data(item->msg.shared, &len);
+    return len;
+}
+
+outbox_handle_t outbox_init(esp_mqtt_client_handle_t client, const mqtt_allocator_t *allocator)
+{
+    outbox_handle_t outbox = mqtt_calloc(allocator, 1, sizeof(struct outbox_t));
+    if (!outbox) {
+        ESP_LOGE(TAG, "Failed to allocate outbox");
+        return NULL;
+    }
+    outbox->client = client;
+    outbox->alloc = allocator;
+    reset_chunks(outbox);
+    /* QoS1 queue of this client, with dynamic slots enabled */
+    outbox->qos1q = mqtt_qos1q_create(allocator);
+    if (!outbox->qos1q) {
+        mqtt_free(allocator, outbox);
+        return NULL;
+    }
 
     ESP_LOGI(TAG, "Outbox initialised (QoS1 queue owned by client, allow_dynamic=1)");
-    return &g_outbox;
+    return outbox;
 }
 
 outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox,
                                     outbox_message_handle_t message,
                                     outbox_tick_t tick)
 {
-    if (message->msg_qos == 1 && message->msg_type == MQTT_MSG_TYPE_PUBLISH) {
-        ESP_LOGE(TAG, "QoS1 should not enter outbox; check call path");
+    // Copy the message, the caller's data lives in the connection buffer which is reused
+    uint8_t *buffer = mqtt_alloc(outbox->alloc, message->len + message->remaining_len);
+    if (!buffer) {
+        ESP_LOGE(TAG, "Failed to allocate outbox message, msg_id=%d", message->msg_id);
         return NULL;
     }
+    memcpy(buffer, message->data, message->len);
+    if (message->remaining_data) {
+        memcpy(buffer + message->len, message->remaining_data, message->remaining_len);
+    }
 
     // QoS0/QoS2/control messages → store in static ring
-    for (int i = 0; i < OUTBOX_RING_CAP; ++i) {
-        if (!g_outbox.ring[i].in_use) {
-            g_outbox.ring[i].msg    = *message;
-            g_outbox.ring[i].state  = QUEUED;
-            g_outbox.ring[i].tick   = tick;
-            g_outbox.ring[i].in_use = true;
-            g_outbox.size += message->len + message->remaining_len;
-            return &g_outbox.ring[i];
+    struct outbox_item *item = NULL;
+    for (int i = 0; i < outbox->capacity; ++i) {
+        if (!item_at(outbox, i)->in_use) {
+            item = item_at(outbox, i);
+            break;
         }
     }
+    if (!item && outbox->capacity / OUTBOX_RING_CAP < OUTBOX_MAX_CHUNKS) {
+        item = add_chunk(outbox);
+        if (!item) {
+            ESP_LOGE(TAG, "Failed to grow the outbox, msg_id=%d", message->msg_id);
+            mqtt_free(outbox->alloc, buffer);
+            return NULL;
+        }
+    }
+    if (!item) {
+        ESP_LOGW(TAG, "Outbox ring full — dropping oldest control message");
+        item = &outbox->ring[0];
+        outbox_delete_item(outbox, item);
+    }
 
-    ESP_LOGW(TAG, "Outbox ring full — dropping oldest control message");
-    g_outbox.ring[0].msg    = *message;
-    g_outbox.ring[0].state  = QUEUED;
-    g_outbox.ring[0].tick   = tick;
-    g_outbox.ring[0].in_use = true;
-    return &g_outbox.ring[0];
+    item->msg                = *message;
+    item->msg.data           = buffer;
+    item->msg.len            = message->len + message->remaining_len;
+    item->msg.remaining_data = NULL;
+    item->msg.remaining_len  = 0;
+    // the header stays per client, the payload is shared
+    outbox_shared_payload_retain(item->msg.shared);
+    item->state  = QUEUED;
+    item->tick   = tick;
+    item->expiry = 0;
+    item->priority = MQTT_PRIORITY_NORMAL;
+    item->in_use = true;
+    outbox->size += item->msg.len + shared_len(item);
+    return item;
 }
 
 
+outbox_item_handle_t outbox_enqueue_latest(outbox_handle_t outbox,
+                                           outbox_message_handle_t message,
+                                           outbox_tick_t tick)
+{
+    size_t topic_len = message->len;
+    const char *topic = mqtt_get_publish_topic(message->data, &topic_len);
+    if (message->msg_type == MQTT_MSG_TYPE_PUBLISH && topic && topic_len > 0) {
+        for (int i = 0; i < outbox->capacity; ++i) {
+            struct outbox_item *item = item_at(outbox, i);
+            if (!item->in_use || item->state != QUEUED || item->msg.msg_type != MQTT_MSG_TYPE_PUBLISH) {
+                continue;
+            }
+            size_t item_topic_len = item->msg.len;
+            const char *item_topic = mqtt_get_publish_topic(item->msg.data, &item_topic_len);
+            if (item_topic && item_topic_len == topic_len && memcmp(item_topic, topic, topic_len) == 0) {
+                ESP_LOGD(TAG, "Message id=%d replaced by id=%d", item->msg.msg_id, message->msg_id);
+                tick = item->tick;
+                outbox_delete_item(outbox, item);
+                break;
+            }
+        }
+    }
+    return outbox_enqueue(outbox, message, tick);
+}
 
 outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
 {
-    for (int i = 0; i < OUTBOX_RING_CAP; ++i)
+    for (int i = 0; i < outbox->capacity; ++i)
     {
-        if (g_outbox.ring[i].in_use && g_outbox.ring[i].msg.msg_id == msg_id)
+        struct outbox_item *item = item_at(outbox, i);
+        if (item->in_use && item->msg.msg_id == msg_id)
         {
-            return &g_outbox.ring[i];
+            return item;
         }
     }
     return NULL;
 }
 
+/*
+ * Queued messages are served from the highest lane first, each MQTT_PRIORITY_AGING_MS
+ * of waiting counts as one more level so the lower lanes are not starved.
+ * Messages in the other states are served oldest first.
+ */
+static outbox_tick_t dequeue_score(const struct outbox_item *item, pending_state_t pending, outbox_tick_t now)
+{
+    if (pending != QUEUED) {
+        return now - item->tick;
+    }
+    return (outbox_tick_t)item->priority * MQTT_PRIORITY_AGING_MS + (now - item->tick);
+}
+
 outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox,
                                     pending_state_t pending,
                                     outbox_tick_t *tick)
 {
-    for (int i = 0; i < OUTBOX_RING_CAP; ++i)
+    struct outbox_item *best = NULL;
+    outbox_tick_t best_score = 0;
+    outbox_tick_t now = platform_tick_get_ms();
+    for (int i = 0; i < outbox->capacity; ++i)
     {
-        if (g_outbox.ring[i].in_use && g_outbox.ring[i].state == pending)
+        struct outbox_item *item = item_at(outbox, i);
+        if (item->in_use && item->state == pending)
         {
-            if (tick)
-                *tick = g_outbox.ring[i].tick;
-            return &g_outbox.ring[i];
+            outbox_tick_t score = dequeue_score(item, pending, now);
+            if (best == NULL || score > best_score)
+            {
+                best = item;
+                best_score = score;
+            }
         }
     }
-    return NULL;
+    if (best && tick)
+        *tick = best->tick;
+    return best;
 }
 
 esp_err_t outbox_delete_item(outbox_handle_t outbox,
@@ -110,12 +233,16 @@ esp_err_t outbox_delete_item(outbox_handle_t outbox,
     if (item->in_use) {
         // 🔧 decrement size accounting
         if (outbox) {
-            outbox->size -= item->msg.len + item->msg.remaining_len;
+            outbox->size -= item->msg.len + shared_len(item);
             if (outbox->size < 0) {
                 ESP_LOGW(TAG, "Outbox size underflow detected, clamping to 0");
                 outbox->size = 0;
             }
         }
+        mqtt_free(outbox ? outbox->alloc : NULL, item->msg.data);
+        item->msg.data = NULL;
+        outbox_shared_payload_release(item->msg.shared);
+        item->msg.shared = NULL;
         item->in_use = false;
     }
 
@@ -141,10 +268,15 @@ uint8_t *outbox_item_get_data(outbox_item_handle_t item,
     return it->msg.data;
 }
 
+const uint8_t *outbox_item_get_shared(outbox_item_handle_t item, size_t *len)
+{
+    return outbox_shared_payload_get_data(item ? item->msg.shared : NULL, len);
+}
+
 esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type)
 {
     if (msg_type == MQTT_MSG_TYPE_PUBLISH) {
-        mqtt_qos1q_on_published(msg_id);
+        mqtt_qos1q_on_published(outbox->qos1q, msg_id);
     }
 
     outbox_item_handle_t it = outbox_get(outbox, msg_id);
@@ -180,19 +312,56 @@ esp_err_t outbox_set_tick(outbox_handle_t outbox,
     return ESP_OK;
 }
 
+void outbox_item_set_expiry(outbox_item_handle_t item, outbox_tick_t expiry)
+{
+    if (item)
+        ((struct outbox_item *)item)->expiry = expiry;
+}
+
+outbox_tick_t outbox_item_get_expiry(outbox_item_handle_t item)
+{
+    if (!item)
+        return 0;
+    return ((struct outbox_item *)item)->expiry;
+}
+
+void outbox_item_set_priority(outbox_item_handle_t item, int priority)
+{
+    if (item)
+        ((struct outbox_item *)item)->priority = priority;
+}
+
+int outbox_item_get_priority(outbox_item_handle_t item)
+{
+    if (!item)
+        return MQTT_PRIORITY_NORMAL;
+    return ((struct outbox_item *)item)->priority;
+}
+
+static bool item_expired(const struct outbox_item *item, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    if (!item->in_use) {
+        return false;
+    }
+    if (current_tick - item->tick > timeout) {
+        return true;
+    }
+    // a publish past its own expiry is dropped, unless the broker has already received it (PUBREC)
+    return item->expiry && current_tick >= item->expiry && item->state != ACKNOWLEDGED;
+}
+
 int outbox_delete_single_expired(outbox_handle_t outbox,
                                  outbox_tick_t current_tick,
                                  outbox_tick_t timeout)
 {
-    mqtt_qos1q_check_timeouts();
+    mqtt_qos1q_check_timeouts(outbox->qos1q);
 
-    for (int i = 0; i < OUTBOX_RING_CAP; ++i) {
-        if (g_outbox.ring[i].in_use &&
-            (current_tick - g_outbox.ring[i].tick) > timeout) {
+    for (int i = 0; i < outbox->capacity; ++i) {
+        if (item_expired(item_at(outbox, i), current_tick, timeout)) {
 
-            int id = g_outbox.ring[i].msg.msg_id;
+            int id = item_at(outbox, i)->msg.msg_id;
             // ✅ reuse accounting logic
-            outbox_delete_item(outbox, &g_outbox.ring[i]);
+            outbox_delete_item(outbox, item_at(outbox, i));
             return id;
         }
     }
@@ -205,15 +374,14 @@ int outbox_delete_expired(outbox_handle_t outbox,
                           outbox_tick_t timeout)
 {
     /* Let the QoS1 queue handle its own timeouts */
-    mqtt_qos1q_check_timeouts();
+    mqtt_qos1q_check_timeouts(outbox->qos1q);
 
     int removed = 0;
-    for (int i = 0; i < OUTBOX_RING_CAP; ++i) {
-        if (g_outbox.ring[i].in_use &&
-            (current_tick - g_outbox.ring[i].tick) > timeout) {
+    for (int i = 0; i < outbox->capacity; ++i) {
+        if (item_expired(item_at(outbox, i), current_tick, timeout)) {
 
             // ✅ reuse accounting logic
-            outbox_delete_item(outbox, &g_outbox.ring[i]);
+            outbox_delete_item(outbox, item_at(outbox, i));
             ++removed;
         }
     }
@@ -226,15 +394,60 @@ size_t outbox_get_size(outbox_handle_t outbox)
     return outbox->size;
 }
 
+bool outbox_is_full(outbox_handle_t outbox)
+{
+    if (outbox->capacity / OUTBOX_RING_CAP < OUTBOX_MAX_CHUNKS) {
+        return false;
+    }
+    for (int i = 0; i < outbox->capacity; ++i) {
+        if (!item_at(outbox, i)->in_use) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void outbox_for_each(outbox_handle_t outbox, outbox_item_visitor_t visitor, void *ctx)
+{
+    for (int i = 0; i < outbox->capacity; ++i) {
+        if (item_at(outbox, i)->in_use) {
+            visitor(item_at(outbox, i), ctx);
+        }
+    }
+}
 
 void outbox_delete_all_items(outbox_handle_t outbox)
 {
     /* Clear both the static ring and the QoS1 queue */
-    memset(&g_outbox, 0, sizeof(g_outbox));
-    mqtt_qos1q_clear_all();
+    for (int i = 0; i < outbox->capacity; ++i) {
+        mqtt_free(outbox->alloc, item_at(outbox, i)->msg.data);
+        outbox_shared_payload_release(item_at(outbox, i)->msg.shared);
+    }
+    for (int chunk = 1; chunk < outbox->capacity / OUTBOX_RING_CAP; ++chunk) {
+        mqtt_free(outbox->alloc, outbox->chunks[chunk]);
+    }
+    esp_mqtt_client_handle_t client = outbox->client;
+    const mqtt_allocator_t *allocator = outbox->alloc;
+    mqtt_qos1q_handle_t qos1q = outbox->qos1q;
+    memset(outbox, 0, sizeof(struct outbox_t));
+    outbox->client = client;
+    outbox->alloc = allocator;
+    outbox->qos1q = qos1q;
+    reset_chunks(outbox);
+    mqtt_qos1q_clear_all(qos1q);
+}
+
+mqtt_qos1q_handle_t outbox_get_qos1_queue(outbox_handle_t outbox)
+{
+    return outbox->qos1q;
 }
 
 void outbox_destroy(outbox_handle_t outbox)
 {
-    outbox_delete_all_items(outbox);
+    if (outbox) {
+        outbox_delete_all_items(outbox);
+        mqtt_qos1q_destroy(outbox->qos1q);
+        mqtt_free(outbox->alloc, outbox);
+    }
 }
@@ -0,0 +1,227 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <new>
+#include "mqtt_outbox_pool.hpp"
+#include "mqtt_config.h"
+#include "esp_log.h"
+#include "platform.h"
+#include "ED_mqtt_qos1_queue.h"
+
+static const char *TAG = "outbox_pool";
+
+using esp_mqtt::pool_outbox;
+
+struct outbox_t : pool_outbox {
+    using pool_outbox::pool_outbox;
+    esp_mqtt_client_handle_t client;
+    const mqtt_allocator_t *alloc;
+    mqtt_qos1q_handle_t qos1q;
+};
+
+static pool_outbox::item *item_of(outbox_item_handle_t item)
+{
+    return reinterpret_cast<pool_outbox::item *>(item);
+}
+
+static outbox_item_handle_t handle_of(pool_outbox::item *item)
+{
+    return reinterpret_cast<outbox_item_handle_t>(item);
+}
+
+extern "C" {
+
+outbox_handle_t outbox_init(esp_mqtt_client_handle_t client, const mqtt_allocator_t *allocator)
+{
+    void *memory = mqtt_alloc(allocator, sizeof(outbox_t));
+    if (!memory) {
+        ESP_LOGE(TAG, "Failed to allocate outbox");
+        return nullptr;
+    }
+    auto *outbox = new (memory) outbox_t(allocator, MQTT_OUTBOX_POOL_SIZE, MQTT_OUTBOX_ARENA_SIZE);
+    outbox->client = client;
+    outbox->alloc = allocator;
+    outbox->qos1q = mqtt_qos1q_create(allocator);
+    if (!*outbox || !outbox->qos1q) {
+        ESP_LOGE(TAG, "Failed to allocate the outbox pool and arena");
+        mqtt_qos1q_destroy(outbox->qos1q);
+        outbox->~outbox_t();
+        mqtt_free(allocator, memory);
+        return nullptr;
+    }
+    return outbox;
+}
+
+outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    auto *item = outbox->enqueue(*message, tick);
+    if (!item) {
+        ESP_LOGE(TAG, "Failed to allocate outbox message, msg_id=%d", message->msg_id);
+    }
+    return handle_of(item);
+}
+
+outbox_item_handle_t outbox_enqueue_latest(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick)
+{
+    return handle_of(outbox->enqueue_latest(*message, tick));
+}
+
+outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick)
+{
+    auto *item = outbox->dequeue(pending, platform_tick_get_ms());
+    if (item && tick) {
+        *tick = item->tick;
+    }
+    return handle_of(item);
+}
+
+outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id)
+{
+    return handle_of(outbox->get(msg_id));
+}
+
+uint8_t *outbox_item_get_data(outbox_item_handle_t item, size_t *len, uint16_t *msg_id, int *msg_type, int *qos)
+{
+    if (!item) {
+        return nullptr;
+    }
+    auto *it = item_of(item);
+    if (len) {
+        *len = it->len;
+    }
+    if (msg_id) {
+        *msg_id = it->msg_id;
+    }
+    if (msg_type) {
+        *msg_type = it->msg_type;
+    }
+    if (qos) {
+        *qos = it->qos;
+    }
+    return it->data;
+}
+
+const uint8_t *outbox_item_get_shared(outbox_item_handle_t item, size_t *len)
+{
+    return outbox_shared_payload_get_data(item ? item_of(item)->shared : nullptr, len);
+}
+
+esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type)
+{
+    if (msg_type == MQTT_MSG_TYPE_PUBLISH) {
+        mqtt_qos1q_on_published(outbox->qos1q, msg_id);
+    }
+    if (auto *item = outbox->get(msg_id)) {
+        outbox->erase(item);
+    }
+    return ESP_OK;
+}
+
+esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item)
+{
+    if (item) {
+        outbox->erase(item_of(item));
+    }
+    return ESP_OK;
+}
+
+int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    mqtt_qos1q_check_timeouts(outbox->qos1q);
+    return outbox->delete_expired(current_tick, timeout);
+}
+
+int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout)
+{
+    mqtt_qos1q_check_timeouts(outbox->qos1q);
+    return outbox->delete_expired(current_tick, timeout, true);
+}
+
+esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending)
+{
+    if (auto *item = outbox->get(msg_id)) {
+        outbox->set_state(item, pending);
+    }
+    return ESP_OK;
+}
+
+pending_state_t outbox_item_get_pending(outbox_item_handle_t item)
+{
+    return item ? item_of(item)->state : QUEUED;
+}
+
+esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick)
+{
+    if (auto *item = outbox->get(msg_id)) {
+        outbox->set_tick(item, tick);
+    }
+    return ESP_OK;
+}
+
+void outbox_item_set_expiry(outbox_item_handle_t item, outbox_tick_t expiry)
+{
+    if (item) {
+        item_of(item)->owner->set_expiry(item_of(item), expiry);
+    }
+}
+
+outbox_tick_t outbox_item_get_expiry(outbox_item_handle_t item)
+{
+    return item ? item_of(item)->expiry : 0;
+}
+
+void outbox_item_set_priority(outbox_item_handle_t item, int priority)
+{
+    if (item) {
+        item_of(item)->owner->set_priority(item_of(item), priority);
+    }
+}
+
+int outbox_item_get_priority(outbox_item_handle_t item)
+{
+    return item ? item_of(item)->priority : MQTT_PRIORITY_NORMAL;
+}
+
+size_t outbox_get_size(outbox_handle_t outbox)
+{
+    return outbox->size();
+}
+
+bool outbox_is_full(outbox_handle_t outbox)
+{
+    // bounded by the outbox limit of the client only
+    return false;
+}
+
+void outbox_for_each(outbox_handle_t outbox, outbox_item_visitor_t visitor, void *ctx)
+{
+    outbox->for_each([&](pool_outbox::item * item) {
+        visitor(handle_of(item), ctx);
+    });
+}
+
+void outbox_delete_all_items(outbox_handle_t outbox)
+{
+    outbox->clear();
+    mqtt_qos1q_clear_all(outbox->qos1q);
+}
+
+mqtt_qos1q_handle_t outbox_get_qos1_queue(outbox_handle_t outbox)
+{
+    return outbox->qos1q;
+}
+
+void outbox_destroy(outbox_handle_t outbox)
+{
+    if (outbox) {
+        outbox_delete_all_items(outbox);
+        const mqtt_allocator_t *allocator = outbox->alloc;
+        mqtt_qos1q_destroy(outbox->qos1q);
+        outbox->~outbox_t();
+        mqtt_free(allocator, outbox);
+    }
+}
+
+}
@@ -0,0 +1,65 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_outbox.h"
+#include "mqtt_config.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+static const char *TAG = "outbox";
+
+/* Payload referenced by the outboxes of several clients, freed with the last reference */
+struct outbox_shared_payload {
+    atomic_int refs;
+    size_t len;
+    uint8_t data[];
+};
+
+outbox_shared_payload_handle_t outbox_shared_payload_create(const uint8_t *data, size_t len)
+{
+    outbox_shared_payload_handle_t payload = heap_caps_malloc(sizeof(struct outbox_shared_payload) + len, MQTT_OUTBOX_MEMORY);
+    if (!payload) {
+        ESP_LOGE(TAG, "Failed to allocate shared payload of %zu bytes", len);
+        return NULL;
+    }
+    atomic_init(&payload->refs, 1);
+    payload->len = len;
+    if (len) {
+        memcpy(payload->data, data, len);
+    }
+    return payload;
+}
+
+outbox_shared_payload_handle_t outbox_shared_payload_retain(outbox_shared_payload_handle_t payload)
+{
+    if (payload) {
+        atomic_fetch_add(&payload->refs, 1);
+    }
+    return payload;
+}
+
+const uint8_t *outbox_shared_payload_get_data(outbox_shared_payload_handle_t payload, size_t *len)
+{
+    if (!payload) {
+        if (len) {
+            *len = 0;
+        }
+        return NULL;
+    }
+    if (len) {
+        *len = payload->len;
+    }
+    return payload->data;
+}
+
+void outbox_shared_payload_release(outbox_shared_payload_handle_t payload)
+{
+    if (payload && atomic_fetch_sub(&payload->refs, 1) == 1) {
+        free(payload);
+    }
+}
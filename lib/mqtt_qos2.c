@@ -0,0 +1,281 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_qos2.h"
+#include "mqtt_config.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt_qos2";
+
+#define NO_ENTRY        (-1)
+#define STATE_COUNT     (MQTT_QOS2_PUBREL_SENT + 1)    /* lists of the states, MQTT_QOS2_NONE is the free list */
+
+typedef struct {
+    uint64_t tick;                  /* last transmission */
+    uint64_t since;                 /* first transmission of the publish */
+    uint16_t msg_id;
+    uint8_t state;
+    int16_t prev;
+    int16_t next;
+} entry_t;
+
+struct mqtt_qos2_table {
+    const mqtt_allocator_t *alloc;
+    entry_t *entries;
+    int16_t *index;                 /* open addressed by packet id, entry or NO_ENTRY */
+    int capacity;
+    int index_mask;
+    int count[STATE_COUNT];
+    int16_t head[STATE_COUNT];
+    int16_t tail[STATE_COUNT];
+};
+
+static inline int slot_of(mqtt_qos2_table_handle_t table, uint16_t msg_id)
+{
+    // ids are mostly incremental, the multiplication only spreads random ones
+    return (msg_id * 40503u) & table->index_mask;
+}
+
+static int find_slot(mqtt_qos2_table_handle_t table, uint16_t msg_id)
+{
+    for (int slot = slot_of(table, msg_id);; slot = (slot + 1) & table->index_mask) {
+        int16_t e = table->index[slot];
+        if (e == NO_ENTRY || table->entries[e].msg_id == msg_id) {
+            return slot;
+        }
+    }
+}
+
+static void index_remove(mqtt_qos2_table_handle_t table, int slot)
+{
+    // backward shift, so that no tombstones are needed
+    int hole = slot;
+    for (int next = (hole + 1) & table->index_mask; table->index[next] != NO_ENTRY; next = (next + 1) & table->index_mask) {
+        int home = slot_of(table, table->entries[table->index[next]].msg_id);
+        if (((next - home) & table->index_mask) >= ((next - hole) & table->index_mask)) {
+            table->index[hole] = table->index[next];
+            hole = next;
+        }
+    }
+    table->index[hole] = NO_ENTRY;
+}
+
+static void list_unlink(mqtt_qos2_table_handle_t table, int16_t e)
+{
+    entry_t *entry = &table->entries[e];
+    if (entry->prev != NO_ENTRY) {
+        table->entries[entry->prev].next = entry->next;
+    } else {
+        table->head[entry->state] = entry->next;
+    }
+    if (entry->next != NO_ENTRY) {
+        table->entries[entry->next].prev = entry->prev;
+    } else {
+        table->tail[entry->state] = entry->prev;
+    }
+    --table->count[entry->state];
+}
+
+static void list_append(mqtt_qos2_table_handle_t table, int16_t e, mqtt_qos2_state_t state)
+{
+    entry_t *entry = &table->entries[e];
+    entry->state = state;
+    entry->prev = table->tail[state];
+    entry->next = NO_ENTRY;
+    if (entry->prev != NO_ENTRY) {
+        table->entries[entry->prev].next = e;
+    } else {
+        table->head[state] = e;
+    }
+    table->tail[state] = e;
+    ++table->count[state];
+}
+
+static int16_t add_entry(mqtt_qos2_table_handle_t table, int slot, uint16_t msg_id, mqtt_qos2_state_t state, uint64_t tick)
+{
+    int16_t e = table->head[MQTT_QOS2_NONE];
+    if (e == NO_ENTRY) {
+        ESP_LOGW(TAG, "Too many QoS2 publishes in flight (%d), msg_id=%d not tracked", table->capacity, msg_id);
+        return NO_ENTRY;
+    }
+    list_unlink(table, e);
+    entry_t *entry = &table->entries[e];
+    entry->msg_id = msg_id;
+    entry->tick = tick;
+    entry->since = tick;
+    list_append(table, e, state);
+    table->index[slot] = e;
+    return e;
+}
+
+static void remove_entry(mqtt_qos2_table_handle_t table, int slot)
+{
+    int16_t e = table->index[slot];
+    list_unlink(table, e);
+    list_append(table, e, MQTT_QOS2_NONE);
+    index_remove(table, slot);
+}
+
+mqtt_qos2_table_handle_t mqtt_qos2_table_create(int capacity, const mqtt_allocator_t *allocator)
+{
+    if (capacity <= 0 || capacity > INT16_MAX) {
+        ESP_LOGE(TAG, "Invalid capacity %d", capacity);
+        return NULL;
+    }
+    // at most half full, probes stay short
+    int index_size = 2;
+    while (index_size < 2 * capacity) {
+        index_size *= 2;
+    }
+    mqtt_qos2_table_handle_t table = mqtt_calloc(allocator, 1, sizeof(struct mqtt_qos2_table));
+    ESP_MEM_CHECK(TAG, table, return NULL);
+    table->entries = mqtt_calloc(allocator, capacity, sizeof(entry_t));
+    ESP_MEM_CHECK(TAG, table->entries, mqtt_free(allocator, table); return NULL);
+    table->index = mqtt_alloc(allocator, index_size * sizeof(int16_t));
+    ESP_MEM_CHECK(TAG, table->index, mqtt_free(allocator, table->entries); mqtt_free(allocator, table); return NULL);
+    table->alloc = allocator;
+    table->capacity = capacity;
+    table->index_mask = index_size - 1;
+    mqtt_qos2_clear(table);
+    return table;
+}
+
+void mqtt_qos2_table_destroy(mqtt_qos2_table_handle_t table)
+{
+    if (table == NULL) {
+        return;
+    }
+    mqtt_free(table->alloc, table->index);
+    mqtt_free(table->alloc, table->entries);
+    mqtt_free(table->alloc, table);
+}
+
+esp_err_t mqtt_qos2_publish_sent(mqtt_qos2_table_handle_t table, uint16_t msg_id, uint64_t tick)
+{
+    int slot = find_slot(table, msg_id);
+    int16_t e = table->index[slot];
+    if (e == NO_ENTRY) {
+        return add_entry(table, slot, msg_id, MQTT_QOS2_PUBLISH_SENT, tick) == NO_ENTRY ? ESP_ERR_NO_MEM : ESP_OK;
+    }
+    if (table->entries[e].state != MQTT_QOS2_PUBLISH_SENT) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    // retransmission, moves to the tail of its list
+    list_unlink(table, e);
+    list_append(table, e, MQTT_QOS2_PUBLISH_SENT);
+    table->entries[e].tick = tick;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_qos2_pubrel_sent(mqtt_qos2_table_handle_t table, uint16_t msg_id, uint64_t tick)
+{
+    int slot = find_slot(table, msg_id);
+    int16_t e = table->index[slot];
+    if (e == NO_ENTRY) {
+        return add_entry(table, slot, msg_id, MQTT_QOS2_PUBREL_SENT, tick) == NO_ENTRY ? ESP_ERR_NO_MEM : ESP_OK;
+    }
+    list_unlink(table, e);
+    list_append(table, e, MQTT_QOS2_PUBREL_SENT);
+    table->entries[e].tick = tick;
+    return ESP_OK;
+}
+
+bool mqtt_qos2_pubcomp(mqtt_qos2_table_handle_t table, uint16_t msg_id)
+{
+    int slot = find_slot(table, msg_id);
+    int16_t e = table->index[slot];
+    if (e == NO_ENTRY) {
+        return false;
+    }
+    bool released = table->entries[e].state == MQTT_QOS2_PUBREL_SENT;
+    remove_entry(table, slot);
+    return released;
+}
+
+mqtt_qos2_state_t mqtt_qos2_get_state(mqtt_qos2_table_handle_t table, uint16_t msg_id)
+{
+    int16_t e = table->index[find_slot(table, msg_id)];
+    return e == NO_ENTRY ? MQTT_QOS2_NONE : table->entries[e].state;
+}
+
+int mqtt_qos2_count(mqtt_qos2_table_handle_t table, mqtt_qos2_state_t state)
+{
+    return table->count[state];
+}
+
+bool mqtt_qos2_is_full(mqtt_qos2_table_handle_t table)
+{
+    return table->head[MQTT_QOS2_NONE] == NO_ENTRY;
+}
+
+int mqtt_qos2_resend_pubrel(mqtt_qos2_table_handle_t table, uint64_t now, uint64_t timeout, int max,
+                            mqtt_qos2_send_t send, void *ctx)
+{
+    int sent = 0;
+    // resent entries move behind the last one due, which is not visited again
+    int16_t last = table->tail[MQTT_QOS2_PUBREL_SENT];
+    while (sent < max && last != NO_ENTRY) {
+        int16_t e = table->head[MQTT_QOS2_PUBREL_SENT];
+        entry_t *entry = &table->entries[e];
+        if (now - entry->tick <= timeout) {
+            break;
+        }
+        if (send(entry->msg_id, ctx) != ESP_OK) {
+            break;
+        }
+        list_unlink(table, e);
+        list_append(table, e, MQTT_QOS2_PUBREL_SENT);
+        entry->tick = now;
+        ++sent;
+        if (e == last) {
+            break;
+        }
+    }
+    return sent;
+}
+
+int mqtt_qos2_delete_expired(mqtt_qos2_table_handle_t table, uint64_t now, uint64_t timeout)
+{
+    int removed = 0;
+    for (int state = MQTT_QOS2_PUBLISH_SENT; state < STATE_COUNT; ++state) {
+        int16_t e = table->head[state];
+        while (e != NO_ENTRY) {
+            entry_t *entry = &table->entries[e];
+            int16_t next = entry->next;
+            if (now - entry->since > timeout) {
+                ESP_LOGD(TAG, "QoS2 msg_id=%d expired in state %d", entry->msg_id, entry->state);
+                remove_entry(table, find_slot(table, entry->msg_id));
+                ++removed;
+            }
+            e = next;
+        }
+    }
+    return removed;
+}
+
+void mqtt_qos2_for_each(mqtt_qos2_table_handle_t table, mqtt_qos2_state_t state, mqtt_qos2_visitor_t visitor, void *ctx)
+{
+    for (int16_t e = table->head[state]; e != NO_ENTRY; e = table->entries[e].next) {
+        visitor(table->entries[e].msg_id, state, ctx);
+    }
+}
+
+void mqtt_qos2_clear(mqtt_qos2_table_handle_t table)
+{
+    memset(table->count, 0, sizeof(table->count));
+    for (int state = 0; state < STATE_COUNT; ++state) {
+        table->head[state] = NO_ENTRY;
+        table->tail[state] = NO_ENTRY;
+    }
+    for (int16_t e = 0; e < table->capacity; ++e) {
+        list_append(table, e, MQTT_QOS2_NONE);
+    }
+    for (int slot = 0; slot <= table->index_mask; ++slot) {
+        table->index[slot] = NO_ENTRY;
+    }
+}
@@ -0,0 +1,212 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "mqtt_rate_limit.h"
+#include "mqtt_msg.h"
+#include "mqtt_config.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt_rate_limit";
+
+/* levels are kept in 1/1000 of a token, so that the refill is exact for millisecond ticks */
+#define TOKEN_SCALE 1000
+
+typedef struct {
+    uint32_t rate;              /* tokens per second, 0 = unlimited */
+    int64_t capacity;
+    int64_t level;
+    uint64_t tick;
+} bucket_t;
+
+typedef struct {
+    char *filter;
+    bucket_t msgs;
+    bucket_t bytes;
+} topic_limit_t;
+
+struct mqtt_rate_limit {
+    const mqtt_allocator_t *alloc;
+    bucket_t msgs;
+    bucket_t bytes;
+    topic_limit_t *topics;
+    int topics_count;
+};
+
+static void bucket_init(bucket_t *bucket, uint32_t rate, uint32_t burst)
+{
+    bucket->rate = rate;
+    // one second worth of tokens by default
+    bucket->capacity = (int64_t)(burst ? burst : rate) * TOKEN_SCALE;
+    bucket->level = bucket->capacity;
+    bucket->tick = 0;
+}
+
+static void bucket_refill(bucket_t *bucket, uint64_t now_ms)
+{
+    if (bucket->rate == 0) {
+        return;
+    }
+    if (now_ms > bucket->tick) {
+        bucket->level += (int64_t)(now_ms - bucket->tick) * bucket->rate;
+        if (bucket->level > bucket->capacity) {
+            bucket->level = bucket->capacity;
+        }
+    }
+    bucket->tick = now_ms;
+}
+
+static inline bool bucket_ready(const bucket_t *bucket)
+{
+    return bucket->rate == 0 || bucket->level >= TOKEN_SCALE;
+}
+
+static inline void bucket_take(bucket_t *bucket, size_t tokens)
+{
+    if (bucket->rate) {
+        bucket->level -= (int64_t)tokens * TOKEN_SCALE;
+    }
+}
+
+static bool limits_configured(const esp_mqtt_rate_limit_t *limit)
+{
+    return limit && (limit->msgs_per_sec || limit->bytes_per_sec);
+}
+
+mqtt_rate_limit_handle_t mqtt_rate_limit_create(const esp_mqtt_rate_limit_t *client_limit,
+                                                const esp_mqtt_topic_rate_limit_t *topics, int topics_count,
+                                                const mqtt_allocator_t *allocator)
+{
+    if (!limits_configured(client_limit) && (topics == NULL || topics_count <= 0)) {
+        return NULL;
+    }
+    mqtt_rate_limit_handle_t limiter = mqtt_calloc(allocator, 1, sizeof(struct mqtt_rate_limit));
+    ESP_MEM_CHECK(TAG, limiter, return NULL);
+    limiter->alloc = allocator;
+    if (client_limit) {
+        bucket_init(&limiter->msgs, client_limit->msgs_per_sec, client_limit->msg_burst);
+        bucket_init(&limiter->bytes, client_limit->bytes_per_sec, client_limit->byte_burst);
+    }
+    if (topics && topics_count > 0) {
+        limiter->topics = mqtt_calloc(allocator, topics_count, sizeof(topic_limit_t));
+        ESP_MEM_CHECK(TAG, limiter->topics, goto _failed);
+        for (int i = 0; i < topics_count; ++i) {
+            topic_limit_t *topic = &limiter->topics[limiter->topics_count];
+            if (topics[i].filter == NULL) {
+                continue;
+            }
+            topic->filter = mqtt_strdup(allocator, topics[i].filter);
+            ESP_MEM_CHECK(TAG, topic->filter, goto _failed);
+            bucket_init(&topic->msgs, topics[i].limit.msgs_per_sec, topics[i].limit.msg_burst);
+            bucket_init(&topic->bytes, topics[i].limit.bytes_per_sec, topics[i].limit.byte_burst);
+            ++limiter->topics_count;
+        }
+    }
+    return limiter;
+_failed:
+    mqtt_rate_limit_destroy(limiter);
+    return NULL;
+}
+
+void mqtt_rate_limit_destroy(mqtt_rate_limit_handle_t limiter)
+{
+    if (limiter == NULL) {
+        return;
+    }
+    for (int i = 0; i < limiter->topics_count; ++i) {
+        mqtt_free(limiter->alloc, limiter->topics[i].filter);
+    }
+    mqtt_free(limiter->alloc, limiter->topics);
+    mqtt_free(limiter->alloc, limiter);
+}
+
+bool mqtt_rate_limit_ready(mqtt_rate_limit_handle_t limiter, uint64_t now_ms)
+{
+    bucket_refill(&limiter->msgs, now_ms);
+    bucket_refill(&limiter->bytes, now_ms);
+    return bucket_ready(&limiter->msgs) && bucket_ready(&limiter->bytes);
+}
+
+static bool topic_applies(const topic_limit_t *topic, const char *name, size_t name_len)
+{
+    return name && mqtt_topic_matches(topic->filter, name, name_len);
+}
+
+bool mqtt_rate_limit_check(mqtt_rate_limit_handle_t limiter, const char *topic, size_t topic_len, uint64_t now_ms)
+{
+    if (!mqtt_rate_limit_ready(limiter, now_ms)) {
+        return false;
+    }
+    for (int i = 0; i < limiter->topics_count; ++i) {
+        topic_limit_t *limit = &limiter->topics[i];
+        if (!topic_applies(limit, topic, topic_len)) {
+            continue;
+        }
+        bucket_refill(&limit->msgs, now_ms);
+        bucket_refill(&limit->bytes, now_ms);
+        if (!bucket_ready(&limit->msgs) || !bucket_ready(&limit->bytes)) {
+            ESP_LOGD(TAG, "Rate limit of %s reached", limit->filter);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool mqtt_rate_limit_acquire(mqtt_rate_limit_handle_t limiter, const char *topic, size_t topic_len,
+                             size_t len, uint64_t now_ms)
+{
+    if (!mqtt_rate_limit_check(limiter, topic, topic_len, now_ms)) {
+        return false;
+    }
+    mqtt_rate_limit_consume(limiter, topic, topic_len, len, now_ms);
+    return true;
+}
+
+static uint32_t bucket_wait(bucket_t *bucket, uint64_t now_ms)
+{
+    bucket_refill(bucket, now_ms);
+    if (bucket_ready(bucket)) {
+        return 0;
+    }
+    // the level refills by `rate` per ms
+    return (uint32_t)((TOKEN_SCALE - bucket->level + bucket->rate - 1) / bucket->rate);
+}
+
+static inline uint32_t max_wait(uint32_t a, uint32_t b)
+{
+    return a > b ? a : b;
+}
+
+uint32_t mqtt_rate_limit_wait_ms(mqtt_rate_limit_handle_t limiter, const char *topic, size_t topic_len, uint64_t now_ms)
+{
+    uint32_t wait = max_wait(bucket_wait(&limiter->msgs, now_ms), bucket_wait(&limiter->bytes, now_ms));
+    for (int i = 0; i < limiter->topics_count; ++i) {
+        topic_limit_t *limit = &limiter->topics[i];
+        if (topic_applies(limit, topic, topic_len)) {
+            wait = max_wait(wait, max_wait(bucket_wait(&limit->msgs, now_ms), bucket_wait(&limit->bytes, now_ms)));
+        }
+    }
+    return wait;
+}
+
+void mqtt_rate_limit_consume(mqtt_rate_limit_handle_t limiter, const char *topic, size_t topic_len,
+                             size_t len, uint64_t now_ms)
+{
+    bucket_refill(&limiter->msgs, now_ms);
+    bucket_refill(&limiter->bytes, now_ms);
+    bucket_take(&limiter->msgs, 1);
+    bucket_take(&limiter->bytes, len);
+    for (int i = 0; i < limiter->topics_count; ++i) {
+        topic_limit_t *limit = &limiter->topics[i];
+        if (topic_applies(limit, topic, topic_len)) {
+            bucket_refill(&limit->msgs, now_ms);
+            bucket_refill(&limit->bytes, now_ms);
+            bucket_take(&limit->msgs, 1);
+            bucket_take(&limit->bytes, len);
+        }
+    }
+}
@@ -0,0 +1,487 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sys/queue.h"
+#include "mqtt_session.h"
+#include "mqtt_blob.h"
+#include "mqtt_config.h"
+#include "mqtt_msg.h"
+#include "mqtt_alloc.h"
+#include "ED_mqtt_qos1_queue.h"
+#include "esp_log.h"
+#include "platform.h"
+
+static const char *TAG = "mqtt_session";
+
+#define SESSION_MAGIC           0x53534D51  /* "MQSS" */
+#define SESSION_HEADER_LEN      16
+#define OUTBOX_ITEM_HEADER_LEN  10
+#define QOS1_SLOT_HEADER_LEN    8
+#define SUBSCRIPTION_HEADER_LEN 8
+#define PUBREL_LEN              2
+#define SESSION_TRAILER_LEN     4
+
+typedef enum {
+    SUBSCRIPTION_PENDING,       /* SUBSCRIBE sent, waiting for SUBACK */
+    SUBSCRIPTION_ACTIVE,
+    SUBSCRIPTION_UNSUBSCRIBING, /* UNSUBSCRIBE sent, waiting for UNSUBACK */
+} subscription_state_t;
+
+typedef struct mqtt_session_subscription {
+    char *filter;
+    uint16_t msg_id;
+    uint16_t ack_index;         /* position of the topic in the SUBSCRIBE, selects the SUBACK return code */
+    uint8_t state;
+    uint8_t qos;
+    STAILQ_ENTRY(mqtt_session_subscription) next;
+} mqtt_session_subscription_t;
+
+STAILQ_HEAD(mqtt_session_subscription_list, mqtt_session_subscription);
+
+struct mqtt_session {
+    esp_mqtt_session_storage_t storage;
+    const mqtt_allocator_t *alloc;
+    size_t max_size;
+    struct mqtt_session_subscription_list subscriptions;
+    uint8_t *blob;
+    size_t blob_len;
+    size_t saved_len;
+    uint32_t saved_crc;         /* crc of the last stored snapshot */
+};
+
+typedef struct {
+    mqtt_session_handle_t session;
+    size_t len;
+    uint16_t count;
+    bool overflow;
+} blob_writer_t;
+
+static uint8_t *writer_reserve(blob_writer_t *w, size_t len)
+{
+    mqtt_session_handle_t session = w->session;
+    if (w->overflow || w->len + len > session->max_size) {
+        w->overflow = true;
+        return NULL;
+    }
+    if (w->len + len > session->blob_len) {
+        size_t new_len = session->blob_len ? session->blob_len : 256;
+        while (new_len < w->len + len) {
+            new_len *= 2;
+        }
+        if (new_len > session->max_size) {
+            new_len = session->max_size;
+        }
+        uint8_t *blob = mqtt_realloc(session->alloc, session->blob, new_len);
+        if (blob == NULL) {
+            w->overflow = true;
+            return NULL;
+        }
+        session->blob = blob;
+        session->blob_len = new_len;
+    }
+    uint8_t *p = session->blob + w->len;
+    w->len += len;
+    return p;
+}
+
+static mqtt_session_subscription_t *find_subscription(mqtt_session_handle_t session, const char *filter)
+{
+    mqtt_session_subscription_t *sub;
+    STAILQ_FOREACH(sub, &session->subscriptions, next) {
+        if (strcmp(sub->filter, filter) == 0) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+static mqtt_session_subscription_t *add_subscription(mqtt_session_handle_t session, const char *filter, size_t filter_len)
+{
+    mqtt_session_subscription_t *sub = mqtt_calloc(session->alloc, 1, sizeof(mqtt_session_subscription_t));
+    ESP_MEM_CHECK(TAG, sub, return NULL);
+    sub->filter = mqtt_alloc(session->alloc, filter_len + 1);
+    ESP_MEM_CHECK(TAG, sub->filter, mqtt_free(session->alloc, sub); return NULL);
+    memcpy(sub->filter, filter, filter_len);
+    sub->filter[filter_len] = '\0';
+    STAILQ_INSERT_TAIL(&session->subscriptions, sub, next);
+    return sub;
+}
+
+static void remove_subscription(mqtt_session_handle_t session, mqtt_session_subscription_t *sub)
+{
+    STAILQ_REMOVE(&session->subscriptions, sub, mqtt_session_subscription, next);
+    mqtt_free(session->alloc, sub->filter);
+    mqtt_free(session->alloc, sub);
+}
+
+static void clear_subscriptions(mqtt_session_handle_t session)
+{
+    mqtt_session_subscription_t *sub, *tmp;
+    STAILQ_FOREACH_SAFE(sub, &session->subscriptions, next, tmp) {
+        mqtt_free(session->alloc, sub->filter);
+        mqtt_free(session->alloc, sub);
+    }
+    STAILQ_INIT(&session->subscriptions);
+}
+
+mqtt_session_handle_t mqtt_session_create(const esp_mqtt_session_storage_t *storage, size_t max_size, const mqtt_allocator_t *allocator)
+{
+    if (storage == NULL || storage->save == NULL || storage->load == NULL) {
+        ESP_LOGE(TAG, "Session storage callbacks not set");
+        return NULL;
+    }
+    mqtt_session_handle_t session = mqtt_calloc(allocator, 1, sizeof(struct mqtt_session));
+    ESP_MEM_CHECK(TAG, session, return NULL);
+    session->storage = *storage;
+    session->alloc = allocator;
+    session->max_size = max_size;
+    STAILQ_INIT(&session->subscriptions);
+    return session;
+}
+
+void mqtt_session_destroy(mqtt_session_handle_t session)
+{
+    if (session == NULL) {
+        return;
+    }
+    clear_subscriptions(session);
+    mqtt_free(session->alloc, session->blob);
+    mqtt_free(session->alloc, session);
+}
+
+esp_err_t mqtt_session_subscribe(mqtt_session_handle_t session, int msg_id, const esp_mqtt_topic_t *topic_list, int size)
+{
+    for (int i = 0; i < size; ++i) {
+        mqtt_session_subscription_t *sub = find_subscription(session, topic_list[i].filter);
+        if (sub == NULL) {
+            sub = add_subscription(session, topic_list[i].filter, strlen(topic_list[i].filter));
+            if (sub == NULL) {
+                return ESP_ERR_NO_MEM;
+            }
+        }
+        sub->state = SUBSCRIPTION_PENDING;
+        sub->qos = topic_list[i].qos;
+        sub->msg_id = msg_id;
+        sub->ack_index = i;
+    }
+    return ESP_OK;
+}
+
+void mqtt_session_unsubscribe(mqtt_session_handle_t session, int msg_id, const char *topic)
+{
+    mqtt_session_subscription_t *sub = find_subscription(session, topic);
+    if (sub) {
+        sub->state = SUBSCRIPTION_UNSUBSCRIBING;
+        sub->msg_id = msg_id;
+    }
+}
+
+void mqtt_session_suback(mqtt_session_handle_t session, int msg_id, const uint8_t *return_codes, int count)
+{
+    mqtt_session_subscription_t *sub, *tmp;
+    STAILQ_FOREACH_SAFE(sub, &session->subscriptions, next, tmp) {
+        if (sub->state != SUBSCRIPTION_PENDING || sub->msg_id != msg_id) {
+            continue;
+        }
+        if (sub->ack_index >= count || return_codes[sub->ack_index] >= 0x80) {
+            ESP_LOGW(TAG, "Subscription to %s rejected", sub->filter);
+            remove_subscription(session, sub);
+            continue;
+        }
+        sub->state = SUBSCRIPTION_ACTIVE;
+        sub->qos = return_codes[sub->ack_index];
+        sub->msg_id = 0;
+    }
+}
+
+void mqtt_session_unsuback(mqtt_session_handle_t session, int msg_id)
+{
+    mqtt_session_subscription_t *sub, *tmp;
+    STAILQ_FOREACH_SAFE(sub, &session->subscriptions, next, tmp) {
+        if (sub->state == SUBSCRIPTION_UNSUBSCRIBING && sub->msg_id == msg_id) {
+            remove_subscription(session, sub);
+        }
+    }
+}
+
+int mqtt_session_get_subscriptions(mqtt_session_handle_t session, esp_mqtt_topic_t *topic_list, int size, int offset)
+{
+    int count = 0;
+    mqtt_session_subscription_t *sub;
+    STAILQ_FOREACH(sub, &session->subscriptions, next) {
+        if (sub->state == SUBSCRIPTION_UNSUBSCRIBING) {
+            continue;
+        }
+        if (offset > 0) {
+            --offset;
+            continue;
+        }
+        if (count == size) {
+            break;
+        }
+        topic_list[count].filter = sub->filter;
+        topic_list[count].qos = sub->qos;
+        ++count;
+    }
+    return count;
+}
+
+static void write_outbox_item(outbox_item_handle_t item, void *ctx)
+{
+    blob_writer_t *w = ctx;
+    size_t len;
+    uint16_t msg_id;
+    int msg_type;
+    int qos;
+    uint8_t *data = outbox_item_get_data(item, &len, &msg_id, &msg_type, &qos);
+    if (data == NULL || (msg_type == MQTT_MSG_TYPE_PUBLISH && qos == 0)) {
+        return;
+    }
+    // a shared payload is stored with the item, it's restored as an ordinary message
+    size_t shared_len;
+    const uint8_t *shared = outbox_item_get_shared(item, &shared_len);
+    uint8_t *p = writer_reserve(w, OUTBOX_ITEM_HEADER_LEN + len + shared_len);
+    if (p == NULL) {
+        return;
+    }
+    put_le16(p, msg_id);
+    p[2] = msg_type;
+    p[3] = qos;
+    p[4] = outbox_item_get_pending(item);
+    p[5] = outbox_item_get_priority(item);
+    put_le32(p + 6, len + shared_len);
+    memcpy(p + OUTBOX_ITEM_HEADER_LEN, data, len);
+    if (shared_len) {
+        memcpy(p + OUTBOX_ITEM_HEADER_LEN + len, shared, shared_len);
+    }
+    ++w->count;
+}
+
+static void write_qos1_slot(const MqttSlot *slot, void *ctx)
+{
+    blob_writer_t *w = ctx;
+    uint8_t *p = writer_reserve(w, QOS1_SLOT_HEADER_LEN + slot->topic_len + slot->payload_len);
+    if (p == NULL) {
+        return;
+    }
+    put_le16(p, slot->msg_id);
+    p[2] = slot->retain;
+    p[3] = 0;
+    put_le16(p + 4, slot->topic_len);
+    put_le16(p + 6, slot->payload_len);
+    memcpy(p + QOS1_SLOT_HEADER_LEN, slot->topic, slot->topic_len);
+    memcpy(p + QOS1_SLOT_HEADER_LEN + slot->topic_len, slot->payload, slot->payload_len);
+    ++w->count;
+}
+
+static void write_pubrel(uint16_t msg_id, mqtt_qos2_state_t state, void *ctx)
+{
+    blob_writer_t *w = ctx;
+    uint8_t *p = writer_reserve(w, PUBREL_LEN);
+    if (p == NULL) {
+        return;
+    }
+    put_le16(p, msg_id);
+    ++w->count;
+}
+
+esp_err_t mqtt_session_save(mqtt_session_handle_t session, outbox_handle_t outbox, mqtt_qos2_table_handle_t qos2, uint16_t last_message_id)
+{
+    blob_writer_t w = { .session = session };
+    uint8_t *header = writer_reserve(&w, SESSION_HEADER_LEN);
+    if (header == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    outbox_for_each(outbox, write_outbox_item, &w);
+    uint16_t outbox_count = w.count;
+    w.count = 0;
+    mqtt_qos1q_for_each(outbox_get_qos1_queue(outbox), write_qos1_slot, &w);
+    uint16_t qos1_count = w.count;
+    w.count = 0;
+    mqtt_session_subscription_t *sub;
+    STAILQ_FOREACH(sub, &session->subscriptions, next) {
+        size_t filter_len = strlen(sub->filter);
+        uint8_t *p = writer_reserve(&w, SUBSCRIPTION_HEADER_LEN + filter_len);
+        if (p == NULL) {
+            break;
+        }
+        put_le16(p, sub->msg_id);
+        p[2] = sub->state;
+        p[3] = sub->qos;
+        put_le16(p + 4, sub->ack_index);
+        put_le16(p + 6, filter_len);
+        memcpy(p + SUBSCRIPTION_HEADER_LEN, sub->filter, filter_len);
+        ++w.count;
+    }
+    uint16_t sub_count = w.count;
+    w.count = 0;
+    mqtt_qos2_for_each(qos2, MQTT_QOS2_PUBREL_SENT, write_pubrel, &w);
+    uint8_t *trailer = writer_reserve(&w, SESSION_TRAILER_LEN);
+    if (w.overflow) {
+        ESP_LOGE(TAG, "Session snapshot exceeds %u bytes, not saved", (unsigned)session->max_size);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // writer_reserve() may have moved the blob
+    header = session->blob;
+    trailer = session->blob + w.len - SESSION_TRAILER_LEN;
+    put_le32(header, SESSION_MAGIC);
+    header[4] = MQTT_SESSION_VERSION;
+    header[5] = 0;
+    put_le16(header + 6, last_message_id);
+    put_le16(header + 8, outbox_count);
+    put_le16(header + 10, qos1_count);
+    put_le16(header + 12, sub_count);
+    put_le16(header + 14, w.count);
+    uint32_t crc = mqtt_crc32_update(0, session->blob, w.len - SESSION_TRAILER_LEN);
+    put_le32(trailer, crc);
+
+    if (w.len == session->saved_len && crc == session->saved_crc) {
+        return ESP_OK;
+    }
+    esp_err_t err = session->storage.save(session->storage.ctx, session->blob, w.len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store session snapshot (%d bytes), err=0x%x", (int)w.len, err);
+        return err;
+    }
+    ESP_LOGD(TAG, "Session saved: %d bytes, outbox=%d, qos1=%d, subscriptions=%d, pubrel=%d", (int)w.len, outbox_count, qos1_count, sub_count, w.count);
+    session->saved_len = w.len;
+    session->saved_crc = crc;
+    return ESP_OK;
+}
+
+/**
+ * Walks the records of a snapshot, nothing is applied unless all of them fit the blob exactly
+ */
+static bool snapshot_consistent(const uint8_t *p, const uint8_t *end, int outbox_count, int qos1_count, int sub_count, int pubrel_count)
+{
+    for (int i = 0; i < outbox_count; ++i) {
+        if ((size_t)(end - p) < OUTBOX_ITEM_HEADER_LEN || (size_t)(end - p) - OUTBOX_ITEM_HEADER_LEN < get_le32(p + 6)) {
+            return false;
+        }
+        p += OUTBOX_ITEM_HEADER_LEN + get_le32(p + 6);
+    }
+    for (int i = 0; i < qos1_count; ++i) {
+        if ((size_t)(end - p) < QOS1_SLOT_HEADER_LEN || (size_t)(end - p) - QOS1_SLOT_HEADER_LEN < (size_t)get_le16(p + 4) + get_le16(p + 6)) {
+            return false;
+        }
+        p += QOS1_SLOT_HEADER_LEN + get_le16(p + 4) + get_le16(p + 6);
+    }
+    for (int i = 0; i < sub_count; ++i) {
+        if ((size_t)(end - p) < SUBSCRIPTION_HEADER_LEN || (size_t)(end - p) - SUBSCRIPTION_HEADER_LEN < get_le16(p + 6)) {
+            return false;
+        }
+        p += SUBSCRIPTION_HEADER_LEN + get_le16(p + 6);
+    }
+    if ((size_t)(end - p) != (size_t)pubrel_count * PUBREL_LEN) {
+        return false;
+    }
+    return true;
+}
+
+esp_err_t mqtt_session_restore(mqtt_session_handle_t session, outbox_handle_t outbox, mqtt_qos2_table_handle_t qos2, uint16_t *last_message_id)
+{
+    uint8_t *blob = mqtt_alloc(session->alloc, session->max_size);
+    ESP_MEM_CHECK(TAG, blob, return ESP_ERR_NO_MEM);
+    esp_err_t err = ESP_OK;
+    int len = session->storage.load(session->storage.ctx, blob, session->max_size);
+    if (len < 0) {
+        err = ESP_ERR_NOT_FOUND;
+        goto exit;
+    }
+    if (len < SESSION_HEADER_LEN + SESSION_TRAILER_LEN || (size_t)len > session->max_size ||
+            get_le32(blob) != SESSION_MAGIC ||
+            get_le32(blob + len - SESSION_TRAILER_LEN) != mqtt_crc32_update(0, blob, len - SESSION_TRAILER_LEN)) {
+        ESP_LOGE(TAG, "Session snapshot corrupted, starting with an empty session");
+        err = ESP_ERR_INVALID_CRC;
+        goto exit;
+    }
+    if (blob[4] != MQTT_SESSION_VERSION) {
+        ESP_LOGE(TAG, "Unsupported session snapshot version %d", blob[4]);
+        err = ESP_ERR_INVALID_VERSION;
+        goto exit;
+    }
+
+    int outbox_count = get_le16(blob + 8);
+    int qos1_count = get_le16(blob + 10);
+    int sub_count = get_le16(blob + 12);
+    int pubrel_count = get_le16(blob + 14);
+    const uint8_t *p = blob + SESSION_HEADER_LEN;
+    const uint8_t *end = blob + len - SESSION_TRAILER_LEN;
+    if (!snapshot_consistent(p, end, outbox_count, qos1_count, sub_count, pubrel_count)) {
+        ESP_LOGE(TAG, "Session snapshot inconsistent, starting with an empty session");
+        err = ESP_ERR_INVALID_SIZE;
+        goto exit;
+    }
+    outbox_tick_t tick = platform_tick_get_ms();
+
+    for (int i = 0; i < outbox_count; ++i) {
+        outbox_message_t msg = {
+            .data = (uint8_t *)p + OUTBOX_ITEM_HEADER_LEN,
+            .len = get_le32(p + 6),
+            .msg_id = get_le16(p),
+            .msg_type = p[2],
+            .msg_qos = p[3],
+        };
+        if (msg.msg_type == MQTT_MSG_TYPE_PUBLISH && p[4] == ACKNOWLEDGED) {
+            // snapshots of older releases keep the publishes until PUBCOMP, only the id is needed
+            mqtt_qos2_pubrel_sent(qos2, msg.msg_id, tick);
+            p += OUTBOX_ITEM_HEADER_LEN + msg.len;
+            continue;
+        }
+        outbox_item_handle_t item = outbox_enqueue(outbox, &msg, tick);
+        if (item == NULL) {
+            goto no_mem;
+        }
+        outbox_set_pending(outbox, msg.msg_id, p[4]);
+        outbox_item_set_priority(item, p[5]);
+        p += OUTBOX_ITEM_HEADER_LEN + msg.len;
+    }
+    for (int i = 0; i < qos1_count; ++i) {
+        size_t topic_len = get_le16(p + 4);
+        size_t payload_len = get_le16(p + 6);
+        const char *topic = (const char *)p + QOS1_SLOT_HEADER_LEN;
+        if (mqtt_qos1q_track(outbox_get_qos1_queue(outbox), topic, topic_len, topic + topic_len, payload_len, p[2], get_le16(p)) < 0) {
+            goto no_mem;
+        }
+        p += QOS1_SLOT_HEADER_LEN + topic_len + payload_len;
+    }
+    for (int i = 0; i < sub_count; ++i) {
+        size_t filter_len = get_le16(p + 6);
+        mqtt_session_subscription_t *sub = add_subscription(session, (const char *)p + SUBSCRIPTION_HEADER_LEN, filter_len);
+        if (sub == NULL) {
+            goto no_mem;
+        }
+        sub->msg_id = get_le16(p);
+        sub->state = p[2];
+        sub->qos = p[3];
+        sub->ack_index = get_le16(p + 4);
+        p += SUBSCRIPTION_HEADER_LEN + filter_len;
+    }
+    for (int i = 0; i < pubrel_count; ++i) {
+        mqtt_qos2_pubrel_sent(qos2, get_le16(p), tick);
+        p += PUBREL_LEN;
+    }
+    ESP_LOGI(TAG, "Session restored: outbox=%d, qos1=%d, subscriptions=%d, pubrel=%d", outbox_count, qos1_count, sub_count, pubrel_count);
+    *last_message_id = get_le16(blob + 6);
+    session->saved_len = len;
+    session->saved_crc = get_le32(end);
+    goto exit;
+
+no_mem:
+    // a partial session would resend some messages and lose the others, none is restored
+    ESP_LOGE(TAG, "Not enough memory to restore the session, starting with an empty session");
+    outbox_delete_all_items(outbox);
+    mqtt_qos2_clear(qos2);
+    mqtt_qos1q_clear_all(outbox_get_qos1_queue(outbox));
+    clear_subscriptions(session);
+    err = ESP_ERR_NO_MEM;
+exit:
+    mqtt_free(session->alloc, blob);
+    return err;
+}
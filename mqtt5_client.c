@@ -10,11 +10,16 @@
 
 static const char *TAG = "mqtt5_client";
 
+static void esp_mqtt5_reset_server_resp_property(esp_mqtt5_client_handle_t client);
+static void esp_mqtt5_client_delete_own_topic_alias(esp_mqtt5_client_handle_t client);
 static void esp_mqtt5_print_error_code(esp_mqtt5_client_handle_t client, int code);
-static esp_err_t esp_mqtt5_client_update_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, char *topic, size_t topic_len);
+static esp_err_t esp_mqtt5_client_update_topic_alias(const mqtt_allocator_t *allocator, mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, char *topic, size_t topic_len);
 static char *esp_mqtt5_client_get_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, size_t *topic_length);
-static void esp_mqtt5_client_delete_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle);
+static void esp_mqtt5_client_delete_topic_alias(const mqtt_allocator_t *allocator, mqtt5_topic_alias_handle_t topic_alias_handle);
 static esp_err_t esp_mqtt5_user_property_copy(mqtt5_user_property_handle_t user_property_new, const mqtt5_user_property_handle_t user_property_old);
+#ifdef MQTT_REQUEST_RESPONSE
+static void esp_mqtt5_request_abort(const mqtt5_request_t *request, void *arg);
+#endif
 
 void esp_mqtt5_increment_packet_counter(esp_mqtt5_client_handle_t client)
 {
@@ -90,12 +95,10 @@ esp_err_t esp_mqtt5_parse_connack(esp_mqtt5_client_handle_t client, int *connect
     client->mqtt_state.in_buffer_read_len = 0;
     uint8_t ack_flag = 0;
 
-    /* 🔍 Dump raw CONNACK packet */
-    // ESP_LOGI(TAG, "CONNACK raw length=%u", (unsigned)len);
-    // ESP_LOG_BUFFER_HEX(TAG, client->mqtt_state.in_buffer, len);
-
-    /* Parse CONNACK properties */
-    esp_err_t res = mqtt5_msg_parse_connack_property(client->mqtt_state.in_buffer, len,
+    // the limits of the previous connection don't apply to this one
+    esp_mqtt5_reset_server_resp_property(client);
+    esp_mqtt5_client_delete_own_topic_alias(client);
+    esp_err_t res = mqtt5_msg_parse_connack_property(client->mqtt_state.in_buffer, len, &client->alloc.state,
                                                      &client->mqtt_state.connection.information,
                                                      &client->mqtt5_config->connect_property_info,
                                                      &client->mqtt5_config->server_resp_property_info,
@@ -108,21 +111,12 @@ esp_err_t esp_mqtt5_parse_connack(esp_mqtt5_client_handle_t client, int *connect
     }
 
 
-    /* 🔍 Log parsed results */
-    ESP_LOGI(TAG, "CONNACK parsed: return_code=%d (%s), session_present=%d",
-             *connect_rsp_code,
-             (*connect_rsp_code == MQTT_CONNECTION_ACCEPTED) ? "ACCEPTED" : "REFUSED",
-             (ack_flag & 0x01));
-
-    /* Log key MQTT v5 properties from broker */
-    ESP_LOGW(TAG, "Resetting 1 server_resp_property_info: max_qos was %u", client->mqtt5_config->server_resp_property_info.max_qos);
-
-    ESP_LOGI(TAG, "Broker properties: max_qos=%u, receive_max=%u, max_packet_size=%u, topic_alias_max=%u",
+    ESP_LOGD(TAG, "CONNACK return code %d, session present %d", *connect_rsp_code, ack_flag & 0x01);
+    ESP_LOGI(TAG, "Broker limits: max_qos=%u, receive_max=%u, max_packet_size=%" PRIu32 ", topic_alias_max=%u",
              client->mqtt5_config->server_resp_property_info.max_qos,
              client->mqtt5_config->server_resp_property_info.receive_maximum,
              client->mqtt5_config->server_resp_property_info.maximum_packet_size,
              client->mqtt5_config->server_resp_property_info.topic_alias_maximum);
-    ESP_LOGW(TAG, "Resetting 1 server_resp_property_info: max_qos is now %u", client->mqtt5_config->server_resp_property_info.max_qos);
 
     if (*connect_rsp_code == MQTT_CONNECTION_ACCEPTED) {
         ESP_LOGD(TAG, "Connected");
@@ -159,7 +153,7 @@ esp_err_t esp_mqtt5_get_publish_data(esp_mqtt5_client_handle_t client, uint8_t *
                 return ESP_FAIL;
             }
         } else {
-            if (esp_mqtt5_client_update_topic_alias(client->mqtt5_config->peer_topic_alias, property.topic_alias, *msg_topic, *msg_topic_len) != ESP_OK) {
+            if (esp_mqtt5_client_update_topic_alias(&client->alloc.state, client->mqtt5_config->peer_topic_alias, property.topic_alias, *msg_topic, *msg_topic_len) != ESP_OK) {
                 ESP_LOGE(TAG, "%s: esp_mqtt5_client_update_topic_alias() failed", __func__);
                 return ESP_FAIL;
             }
@@ -177,19 +171,30 @@ esp_err_t esp_mqtt5_get_publish_data(esp_mqtt5_client_handle_t client, uint8_t *
     return ESP_OK;
 }
 
+/**
+ * @brief Server capabilities assumed when the CONNACK doesn't carry the property (MQTT5 section 3.2.2.3)
+ */
+static void esp_mqtt5_reset_server_resp_property(esp_mqtt5_client_handle_t client)
+{
+    esp_mqtt5_connection_server_resp_property_t *resp = &client->mqtt5_config->server_resp_property_info;
+    resp->max_qos = 2;
+    resp->retain_available = true;
+    resp->wildcard_subscribe_available = true;
+    resp->subscribe_identifiers_available = true;
+    resp->shared_subscribe_available = true;
+    resp->receive_maximum = 65535;
+    resp->maximum_packet_size = 0;
+    resp->topic_alias_maximum = 0;
+}
+
 esp_err_t esp_mqtt5_create_default_config(esp_mqtt5_client_handle_t client)
 {
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
-        client->event.property = calloc(1, sizeof(esp_mqtt5_event_property_t));
+        client->event.property = mqtt_client_calloc(client, sizeof(esp_mqtt5_event_property_t));
         ESP_MEM_CHECK(TAG, client->event.property, return ESP_FAIL)
-        client->mqtt5_config = calloc(1, sizeof(mqtt5_config_storage_t));
+        client->mqtt5_config = mqtt_client_calloc(client, sizeof(mqtt5_config_storage_t));
         ESP_MEM_CHECK(TAG, client->mqtt5_config, return ESP_FAIL)
-        client->mqtt5_config->server_resp_property_info.max_qos = 2;
-        client->mqtt5_config->server_resp_property_info.retain_available = true;
-        client->mqtt5_config->server_resp_property_info.wildcard_subscribe_available = true;
-        client->mqtt5_config->server_resp_property_info.subscribe_identifiers_available = true;
-        client->mqtt5_config->server_resp_property_info.shared_subscribe_available = true;
-        client->mqtt5_config->server_resp_property_info.receive_maximum = 65535;
+        esp_mqtt5_reset_server_resp_property(client);
     }
     return ESP_OK;
 }
@@ -333,47 +338,108 @@ esp_err_t esp_mqtt5_client_publish_check(esp_mqtt5_client_handle_t client, int q
         return ESP_FAIL;
     }
 
-    /* Flow control to check PUBLISH(No PUBACK or PUBCOMP received) packet sent count(Only record QoS1 and QoS2)*/
-    if (client->send_publish_packet_count > client->mqtt5_config->server_resp_property_info.receive_maximum) {
-        ESP_LOGE(TAG, "Client send more than %d QoS1 and QoS2 PUBLISH packet without no ack", client->mqtt5_config->server_resp_property_info.receive_maximum);
-        return ESP_FAIL;
+    return ESP_OK;
+}
+
+bool esp_mqtt5_client_flow_blocked(esp_mqtt5_client_handle_t client)
+{
+    /* Flow control of the QoS1 and QoS2 PUBLISH packets sent without PUBACK or PUBCOMP received yet */
+    return client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5 &&
+           client->send_publish_packet_count >= client->mqtt5_config->server_resp_property_info.receive_maximum;
+}
+
+bool esp_mqtt5_client_packet_too_large(esp_mqtt5_client_handle_t client, size_t packet_len)
+{
+    uint32_t maximum = client->mqtt5_config->server_resp_property_info.maximum_packet_size;
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5 && maximum && packet_len > maximum) {
+        ESP_LOGE(TAG, "Packet of %d bytes is over the maximum packet size %" PRIu32 " of the broker", (int)packet_len, maximum);
+        return true;
     }
+    return false;
+}
 
-    return ESP_OK;
+uint16_t esp_mqtt5_client_own_topic_alias(esp_mqtt5_client_handle_t client, const char *topic, bool *mapped)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    for (uint16_t i = 0; i < config->own_topic_alias_count; i++) {
+        if (config->own_topic_alias[i] && strcmp(config->own_topic_alias[i], topic) == 0) {
+            *mapped = true;
+            return i + 1;
+        }
+    }
+    *mapped = false;
+    uint16_t maximum = config->server_resp_property_info.topic_alias_maximum;
+    if (maximum > MQTT_TOPIC_ALIAS_MAX) {
+        maximum = MQTT_TOPIC_ALIAS_MAX;
+    }
+    return config->own_topic_alias_count < maximum ? config->own_topic_alias_count + 1 : 0;
+}
+
+void esp_mqtt5_client_own_topic_alias_sent(esp_mqtt5_client_handle_t client, const char *topic, uint16_t topic_alias)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    if (topic_alias != config->own_topic_alias_count + 1) {
+        return;
+    }
+    size_t topic_len = strlen(topic);
+    char *copy = mqtt_alloc(&client->alloc.state, topic_len + 1);
+    if (copy) {
+        // without the copy the topic keeps being sent with the alias, which is still valid
+        memcpy(copy, topic, topic_len + 1);
+        config->own_topic_alias[config->own_topic_alias_count++] = copy;
+    }
+}
+
+/**
+ * @brief Topic aliases are valid for one connection only (MQTT5 section 3.3.2.3.4)
+ */
+static void esp_mqtt5_client_delete_own_topic_alias(esp_mqtt5_client_handle_t client)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    for (uint16_t i = 0; i < config->own_topic_alias_count; i++) {
+        mqtt_free(&client->alloc.state, config->own_topic_alias[i]);
+    }
+    config->own_topic_alias_count = 0;
 }
 
 void esp_mqtt5_client_destory(esp_mqtt5_client_handle_t client)
 {
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5) {
         if (client->mqtt5_config) {
-            free(client->mqtt5_config->will_property_info.content_type);
-            free(client->mqtt5_config->will_property_info.response_topic);
-            free(client->mqtt5_config->will_property_info.correlation_data);
-            free(client->mqtt5_config->server_resp_property_info.response_info);
-            esp_mqtt5_client_delete_topic_alias(client->mqtt5_config->peer_topic_alias);
+            mqtt_free(&client->alloc.state, client->mqtt5_config->will_property_info.content_type);
+            mqtt_free(&client->alloc.state, client->mqtt5_config->will_property_info.response_topic);
+            mqtt_free(&client->alloc.state, client->mqtt5_config->will_property_info.correlation_data);
+            mqtt_free(&client->alloc.state, client->mqtt5_config->server_resp_property_info.response_info);
+            esp_mqtt5_client_delete_topic_alias(&client->alloc.state, client->mqtt5_config->peer_topic_alias);
+            esp_mqtt5_client_delete_own_topic_alias(client);
             esp_mqtt5_client_delete_user_property(client->mqtt5_config->connect_property_info.user_property);
             esp_mqtt5_client_delete_user_property(client->mqtt5_config->will_property_info.user_property);
             esp_mqtt5_client_delete_user_property(client->mqtt5_config->disconnect_property_info.user_property);
-            free(client->mqtt5_config);
+#ifdef MQTT_REQUEST_RESPONSE
+            mqtt5_request_table_destroy(client->mqtt5_config->requests, esp_mqtt5_request_abort, client);
+            mqtt_free(&client->alloc.state, client->mqtt5_config->response_base);
+            mqtt_free(&client->alloc.state, client->mqtt5_config->response_topic);
+#endif
+            mqtt_client_free(client, client->mqtt5_config);
         }
-        free(client->event.property);
+        mqtt_client_free(client, client->event.property);
     }
 }
 
-static void esp_mqtt5_client_delete_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle)
+static void esp_mqtt5_client_delete_topic_alias(const mqtt_allocator_t *allocator, mqtt5_topic_alias_handle_t topic_alias_handle)
 {
     if (topic_alias_handle) {
         mqtt5_topic_alias_item_t item, tmp;
         STAILQ_FOREACH_SAFE(item, topic_alias_handle, next, tmp) {
             STAILQ_REMOVE(topic_alias_handle, item, mqtt5_topic_alias, next);
-            free(item->topic);
-            free(item);
+            mqtt_free(allocator, item->topic);
+            mqtt_free(allocator, item);
         }
-        free(topic_alias_handle);
+        mqtt_free(allocator, topic_alias_handle);
     }
 }
 
-static esp_err_t esp_mqtt5_client_update_topic_alias(mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, char *topic, size_t topic_len)
+static esp_err_t esp_mqtt5_client_update_topic_alias(const mqtt_allocator_t *allocator, mqtt5_topic_alias_handle_t topic_alias_handle, uint16_t topic_alias, char *topic, size_t topic_len)
 {
     mqtt5_topic_alias_item_t item;
     bool found = false;
@@ -385,20 +451,20 @@ static esp_err_t esp_mqtt5_client_update_topic_alias(mqtt5_topic_alias_handle_t
     }
     if (found) {
         if ((item->topic_len != topic_len) || strncmp(topic, item->topic, topic_len)) {
-            free(item->topic);
-            item->topic = calloc(1, topic_len);
+            mqtt_free(allocator, item->topic);
+            item->topic = mqtt_calloc(allocator, 1, topic_len);
             ESP_MEM_CHECK(TAG, item->topic, return ESP_FAIL);
             memcpy(item->topic, topic, topic_len);
             item->topic_len = topic_len;
         }
     } else {
-        item = calloc(1, sizeof(mqtt5_topic_alias_t));
+        item = mqtt_calloc(allocator, 1, sizeof(mqtt5_topic_alias_t));
         ESP_MEM_CHECK(TAG, item, return ESP_FAIL);
         item->topic_alias = topic_alias;
         item->topic_len = topic_len;
-        item->topic = calloc(1, topic_len);
+        item->topic = mqtt_calloc(allocator, 1, topic_len);
         ESP_MEM_CHECK(TAG, item->topic, {
-            free(item);
+            mqtt_free(allocator, item);
             return ESP_FAIL;
         });
         memcpy(item->topic, topic, topic_len);
@@ -467,11 +533,46 @@ esp_err_t esp_mqtt5_client_set_publish_property(esp_mqtt5_client_handle_t client
         MQTT_API_UNLOCK(client);
         return ESP_FAIL;
     }
+    /* The alias may be rebound to another topic, the client doesn't use it on its own anymore */
+    if (property->topic_alias && property->topic_alias <= client->mqtt5_config->own_topic_alias_count) {
+        mqtt_free(&client->alloc.state, client->mqtt5_config->own_topic_alias[property->topic_alias - 1]);
+        client->mqtt5_config->own_topic_alias[property->topic_alias - 1] = NULL;
+    }
     client->mqtt5_config->publish_property_info = property;
     MQTT_API_UNLOCK(client);
     return ESP_OK;
 }
 
+esp_mqtt5_publish_property_block_handle_t esp_mqtt5_client_create_publish_property_block(const esp_mqtt5_publish_property_config_t *property)
+{
+    if (!property) {
+        return NULL;
+    }
+    return mqtt5_property_block_create(property);
+}
+
+void esp_mqtt5_client_delete_publish_property_block(esp_mqtt5_publish_property_block_handle_t block)
+{
+    mqtt5_property_block_destroy(block);
+}
+
+esp_err_t esp_mqtt5_client_set_publish_property_block(esp_mqtt5_client_handle_t client, esp_mqtt5_publish_property_block_handle_t block)
+{
+    if (!client) {
+        ESP_LOGE(TAG, "Client was not initialized");
+        return ESP_ERR_INVALID_ARG;
+    }
+    MQTT_API_LOCK(client);
+    if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5) {
+        ESP_LOGE(TAG, "MQTT protocol version is not v5");
+        MQTT_API_UNLOCK(client);
+        return ESP_FAIL;
+    }
+    client->mqtt5_config->publish_property_block = block;
+    MQTT_API_UNLOCK(client);
+    return ESP_OK;
+}
+
 esp_err_t esp_mqtt5_client_set_subscribe_property(esp_mqtt5_client_handle_t client, const esp_mqtt5_subscribe_property_config_t *property)
 {
     if (!client) {
@@ -622,7 +723,7 @@ esp_err_t esp_mqtt5_client_set_connect_property(esp_mqtt5_client_handle_t client
         if (connect_property->topic_alias_maximum) {
             client->mqtt5_config->connect_property_info.topic_alias_maximum = connect_property->topic_alias_maximum;
             if (!client->mqtt5_config->peer_topic_alias) {
-                client->mqtt5_config->peer_topic_alias = calloc(1, sizeof(struct mqtt5_topic_alias_list_t));
+                client->mqtt5_config->peer_topic_alias = mqtt_calloc(&client->alloc.state, 1, sizeof(struct mqtt5_topic_alias_list_t));
                 ESP_MEM_CHECK(TAG, client->mqtt5_config->peer_topic_alias, goto _mqtt_set_config_failed);
                 STAILQ_INIT(client->mqtt5_config->peer_topic_alias);
             }
@@ -652,11 +753,11 @@ esp_err_t esp_mqtt5_client_set_connect_property(esp_mqtt5_client_handle_t client
         if (connect_property->message_expiry_interval) {
             client->mqtt5_config->will_property_info.message_expiry_interval = connect_property->message_expiry_interval;
         }
-        ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(connect_property->content_type, &client->mqtt5_config->will_property_info.content_type), goto _mqtt_set_config_failed);
-        ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(connect_property->response_topic, &client->mqtt5_config->will_property_info.response_topic), goto _mqtt_set_config_failed);
+        ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, connect_property->content_type, &client->mqtt5_config->will_property_info.content_type), goto _mqtt_set_config_failed);
+        ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, connect_property->response_topic, &client->mqtt5_config->will_property_info.response_topic), goto _mqtt_set_config_failed);
         if (connect_property->correlation_data && connect_property->correlation_data_len) {
-            free(client->mqtt5_config->will_property_info.correlation_data);
-            client->mqtt5_config->will_property_info.correlation_data = malloc(connect_property->correlation_data_len);
+            mqtt_free(&client->alloc.state, client->mqtt5_config->will_property_info.correlation_data);
+            client->mqtt5_config->will_property_info.correlation_data = mqtt_alloc(&client->alloc.state, connect_property->correlation_data_len);
             ESP_MEM_CHECK(TAG, client->mqtt5_config->will_property_info.correlation_data, goto _mqtt_set_config_failed);
             memcpy(client->mqtt5_config->will_property_info.correlation_data, connect_property->correlation_data, connect_property->correlation_data_len);
             client->mqtt5_config->will_property_info.correlation_data_len = connect_property->correlation_data_len;
@@ -798,3 +899,205 @@ void esp_mqtt5_client_delete_user_property(mqtt5_user_property_handle_t user_pro
     }
     free(user_property);
 }
+
+#ifdef MQTT_REQUEST_RESPONSE
+static void esp_mqtt5_request_fail(esp_mqtt5_client_handle_t client, const mqtt5_request_t *request, esp_err_t status)
+{
+    esp_mqtt5_response_t response = {
+        .request_id = request->id,
+        .status = status,
+    };
+    request->cb(client, &response, request->ctx);
+}
+
+static void esp_mqtt5_request_timeout(const mqtt5_request_t *request, void *arg)
+{
+    ESP_LOGD(TAG, "Request %d timed out", request->id);
+    esp_mqtt5_request_fail(arg, request, ESP_ERR_TIMEOUT);
+}
+
+static void esp_mqtt5_request_abort(const mqtt5_request_t *request, void *arg)
+{
+    esp_mqtt5_request_fail(arg, request, ESP_ERR_INVALID_STATE);
+}
+
+static esp_err_t esp_mqtt5_request_subscribe(esp_mqtt5_client_handle_t client)
+{
+    // the subscribe properties set by the user are meant for their next subscribe
+    const esp_mqtt5_subscribe_property_config_t *property = client->mqtt5_config->subscribe_property_info;
+    client->mqtt5_config->subscribe_property_info = NULL;
+    int msg_id = esp_mqtt_client_subscribe_single(client, client->mqtt5_config->response_topic, 1);
+    client->mqtt5_config->subscribe_property_info = property;
+    if (msg_id < 0) {
+        ESP_LOGE(TAG, "Failed to subscribe the response topic %s", client->mqtt5_config->response_topic);
+        return ESP_FAIL;
+    }
+    client->mqtt5_config->response_subscribed = true;
+    return ESP_OK;
+}
+
+/**
+ * @brief Updates the subscribed response topic, the response information of the broker (if any) is
+ * appended to the response topic of published messages by mqtt5_msg_publish()
+ */
+static esp_err_t esp_mqtt5_request_update_topic(esp_mqtt5_client_handle_t client)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    const char *resp_info = config->server_resp_property_info.response_info;
+    char *topic = NULL;
+    int ret = resp_info && resp_info[0] ? mqtt_asprintf(&client->alloc.state, &topic, "%s/%s", config->response_base, resp_info) :
+              mqtt_asprintf(&client->alloc.state, &topic, "%s", config->response_base);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to allocate the response topic");
+        return ESP_ERR_NO_MEM;
+    }
+    if (config->response_topic && strcmp(config->response_topic, topic) == 0) {
+        mqtt_free(&client->alloc.state, topic);
+        return ESP_OK;
+    }
+    mqtt_free(&client->alloc.state, config->response_topic);
+    config->response_topic = topic;
+    config->response_subscribed = false;
+    ESP_LOGI(TAG, "Response topic %s", topic);
+    return ESP_OK;
+}
+
+static esp_err_t esp_mqtt5_request_init(esp_mqtt5_client_handle_t client)
+{
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    if (config->requests == NULL) {
+        config->requests = mqtt5_request_table_create(MQTT_REQUEST_MAX_PENDING, &client->alloc.state);
+        ESP_MEM_CHECK(TAG, config->requests, return ESP_ERR_NO_MEM);
+    }
+    if (config->response_base == NULL) {
+        const char *client_id = client->mqtt_state.connection.information.client_id;
+        char *generated_id = NULL;
+        if (client_id == NULL || client_id[0] == '\0') {
+            client_id = generated_id = platform_create_id_string();
+            ESP_MEM_CHECK(TAG, generated_id, return ESP_ERR_NO_MEM);
+        }
+        int ret = mqtt_asprintf(&client->alloc.state, &config->response_base, "%s/%s", MQTT_REQUEST_TOPIC_PREFIX, client_id);
+        free(generated_id);
+        if (ret < 0) {
+            config->response_base = NULL;
+            ESP_LOGE(TAG, "Failed to allocate the response topic");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    esp_err_t err = esp_mqtt5_request_update_topic(client);
+    if (err == ESP_OK && !config->response_subscribed && client->state == MQTT_STATE_CONNECTED) {
+        err = esp_mqtt5_request_subscribe(client);
+    }
+    return err;
+}
+
+int esp_mqtt5_client_request(esp_mqtt5_client_handle_t client, const char *topic, const char *data, int len, int qos,
+                             uint32_t timeout_ms, esp_mqtt5_response_cb_t cb, void *ctx)
+{
+    if (!client || !topic || !cb || timeout_ms == 0) {
+        ESP_LOGE(TAG, "Invalid request arguments");
+        return -1;
+    }
+    MQTT_API_LOCK(client);
+    if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5) {
+        ESP_LOGE(TAG, "MQTT protocol version is not v5");
+        MQTT_API_UNLOCK(client);
+        return -1;
+    }
+    if (esp_mqtt5_request_init(client) != ESP_OK) {
+        MQTT_API_UNLOCK(client);
+        return -1;
+    }
+    int request_id = mqtt5_request_add(client->mqtt5_config->requests, cb, ctx, platform_tick_get_ms() + timeout_ms);
+    if (request_id < 0) {
+        MQTT_API_UNLOCK(client);
+        return -1;
+    }
+
+    uint8_t correlation[MQTT5_REQUEST_CORRELATION_LEN];
+    mqtt5_request_correlation(request_id, correlation);
+    const esp_mqtt5_publish_property_config_t *user_property = client->mqtt5_config->publish_property_info;
+    esp_mqtt5_publish_property_config_t property = {0};
+    if (user_property) {
+        property = *user_property;
+    }
+    property.response_topic = client->mqtt5_config->response_base;
+    property.correlation_data = (const char *)correlation;
+    property.correlation_data_len = sizeof(correlation);
+    client->mqtt5_config->publish_property_info = &property;
+    int msg_id = esp_mqtt_client_publish(client, topic, data, len, qos, 0);
+    if (client->mqtt5_config->publish_property_info == &property) {
+        // not consumed, the user properties stay set for the next publish
+        client->mqtt5_config->publish_property_info = user_property;
+    }
+    if (msg_id < 0) {
+        ESP_LOGE(TAG, "Failed to publish request to %s", topic);
+        mqtt5_request_remove(client->mqtt5_config->requests, request_id, NULL);
+        request_id = -1;
+    }
+    MQTT_API_UNLOCK(client);
+    return request_id;
+}
+
+void esp_mqtt5_request_expire(esp_mqtt5_client_handle_t client)
+{
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5 && client->mqtt5_config->requests) {
+        mqtt5_request_expire(client->mqtt5_config->requests, platform_tick_get_ms(), esp_mqtt5_request_timeout, client);
+    }
+}
+
+void esp_mqtt5_request_resubscribe(esp_mqtt5_client_handle_t client)
+{
+    if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5 || client->mqtt5_config->response_base == NULL) {
+        return;
+    }
+    if (!client->event.session_present) {
+        client->mqtt5_config->response_subscribed = false;
+    }
+    if (esp_mqtt5_request_update_topic(client) == ESP_OK && !client->mqtt5_config->response_subscribed) {
+        esp_mqtt5_request_subscribe(client);
+    }
+}
+
+void esp_mqtt5_request_match(esp_mqtt5_client_handle_t client, const char *topic, size_t topic_len)
+{
+    if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5) {
+        return;
+    }
+    mqtt5_config_storage_t *config = client->mqtt5_config;
+    config->response_received = false;
+    config->response.cb = NULL;
+    if (config->response_topic == NULL || topic == NULL || strlen(config->response_topic) != topic_len ||
+            memcmp(config->response_topic, topic, topic_len) != 0) {
+        return;
+    }
+    // consumed here even if the request is no longer pending
+    config->response_received = true;
+    if (!mqtt5_request_take(config->requests, client->event.property->correlation_data,
+                            client->event.property->correlation_data_len, &config->response)) {
+        ESP_LOGD(TAG, "Dropping response to an unknown or timed out request");
+        config->response.cb = NULL;
+    }
+}
+
+bool esp_mqtt5_request_respond(esp_mqtt5_client_handle_t client)
+{
+    if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5 || !client->mqtt5_config->response_received) {
+        return false;
+    }
+    const mqtt5_request_t *request = &client->mqtt5_config->response;
+    if (request->cb) {
+        esp_mqtt5_response_t response = {
+            .request_id = request->id,
+            .status = ESP_OK,
+            .data = client->event.data,
+            .data_len = client->event.data_len,
+            .total_data_len = client->event.total_data_len,
+            .current_data_offset = client->event.current_data_offset,
+            .property = client->event.property,
+        };
+        request->cb(client, &response, request->ctx);
+    }
+    return true;
+}
+#endif
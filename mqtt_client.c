@@ -29,16 +29,105 @@ ESP_EVENT_DEFINE_BASE(MQTT_EVENTS);
 const static int STOPPED_BIT = (1 << 0);
 const static int RECONNECT_BIT = (1 << 1);
 const static int DISCONNECT_BIT = (1 << 2);
+const static int CREDIT_BIT = (1 << 3);
 
 static esp_err_t esp_mqtt_dispatch_event(esp_mqtt_client_handle_t client);
 static esp_err_t esp_mqtt_dispatch_event_with_msgid(esp_mqtt_client_handle_t client);
 static esp_err_t esp_mqtt_connect(esp_mqtt_client_handle_t client, int timeout_ms);
 static void esp_mqtt_abort_connection(esp_mqtt_client_handle_t client);
+static void esp_mqtt_close_connection(esp_mqtt_client_handle_t client, bool failed);
 static esp_err_t esp_mqtt_client_ping(esp_mqtt_client_handle_t client);
-static char *create_string(const char *ptr, int len);
+static char *create_string(esp_mqtt_client_handle_t client, const char *ptr, int len);
 static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_timeout_ms);
 static void esp_mqtt_client_dispatch_transport_error(esp_mqtt_client_handle_t client);
 static esp_err_t send_disconnect_msg(esp_mqtt_client_handle_t client);
+static int make_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                        int len, int qos, int retain);
+static esp_err_t esp_mqtt_write_publish(esp_mqtt_client_handle_t client, const char *data, int len);
+#ifdef MQTT_SESSION_PERSISTENCE
+static esp_err_t mqtt_save_session(esp_mqtt_client_handle_t client);
+#endif
+#ifdef MQTT_BATCHING
+static int mqtt_batch_publish(void *ctx, const char *topic, const uint8_t *frame, size_t len, int qos, int retain);
+#endif
+
+static esp_err_t mqtt_get_publish_data_v3(esp_mqtt_client_handle_t client, uint8_t *msg_buf, size_t msg_read_len,
+                                          char **msg_topic, size_t *msg_topic_len, char **msg_data, size_t *msg_data_len)
+{
+    *msg_topic_len = msg_read_len;
+    *msg_topic = mqtt_get_publish_topic(msg_buf, msg_topic_len);
+    if (*msg_topic == NULL)
+    {
+        ESP_LOGE(TAG, "%s: mqtt_get_publish_topic() failed", __func__);
+        return ESP_FAIL;
+    }
+    ESP_LOGD(TAG, "%s: msg_topic_len=%" NEWLIB_NANO_COMPAT_FORMAT, __func__, NEWLIB_NANO_COMPAT_CAST(*msg_topic_len));
+
+    *msg_data_len = msg_read_len;
+    *msg_data = mqtt_get_publish_data(msg_buf, msg_data_len);
+    if (*msg_data_len > 0 && *msg_data == NULL)
+    {
+        ESP_LOGE(TAG, "%s: mqtt_get_publish_data() failed", __func__);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static char *mqtt_get_suback_data_v3(esp_mqtt_client_handle_t client, uint8_t *buffer, size_t *length)
+{
+    return mqtt_get_suback_data(buffer, length);
+}
+
+static const mqtt_protocol_ops_t mqtt_protocol_v3_ops = {
+    .get_id = mqtt_get_id,
+    .get_publish_data = mqtt_get_publish_data_v3,
+    .get_suback_data = mqtt_get_suback_data_v3,
+    .puback = mqtt_msg_puback,
+    .pubrec = mqtt_msg_pubrec,
+    .pubrel = mqtt_msg_pubrel,
+    .pubcomp = mqtt_msg_pubcomp,
+};
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static char *mqtt_get_suback_data_v5(esp_mqtt_client_handle_t client, uint8_t *buffer, size_t *length)
+{
+    return mqtt5_get_suback_data(buffer, length, &client->event.property->user_property);
+}
+
+static void mqtt_event_dispatched_v5(esp_mqtt_client_handle_t client)
+{
+    esp_mqtt5_client_delete_user_property(client->event.property->user_property);
+    client->event.property->user_property = NULL;
+}
+
+static const mqtt_protocol_ops_t mqtt_protocol_v5_ops = {
+    .get_id = mqtt5_get_id,
+    .get_publish_data = esp_mqtt5_get_publish_data,
+    .get_suback_data = mqtt_get_suback_data_v5,
+    .puback = mqtt5_msg_puback,
+    .pubrec = mqtt5_msg_pubrec,
+    .pubrel = mqtt5_msg_pubrel,
+    .pubcomp = mqtt5_msg_pubcomp,
+    .publish_completed = esp_mqtt5_decrement_packet_counter,
+    .event_dispatched = mqtt_event_dispatched_v5,
+};
+
+#define MQTT_OPS(client) ((client)->protocol_ops)
+#else
+// a single protocol, the calls are resolved at compile time
+#define MQTT_OPS(client) (&mqtt_protocol_v3_ops)
+#endif
+
+/**
+ * @brief Selects the codec of the configured protocol version, before connecting
+ */
+static void mqtt_select_protocol_ops(esp_mqtt_client_handle_t client)
+{
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    client->protocol_ops = client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5 ?
+                           &mqtt_protocol_v5_ops : &mqtt_protocol_v3_ops;
+#endif
+}
 
 /**
  * @brief Processes error reported from transport layer (considering the message read status)
@@ -340,12 +429,12 @@ static esp_err_t esp_mqtt_check_cfg_conflict(const mqtt_config_storage_t *cfg, c
     return ret;
 }
 
-bool esp_mqtt_set_if_config(char const *const new_config, char **old_config)
+bool esp_mqtt_set_if_config(esp_mqtt_client_handle_t client, char const *const new_config, char **old_config)
 {
     if (new_config)
     {
-        free(*old_config);
-        *old_config = strdup(new_config);
+        mqtt_free(&client->alloc.state, *old_config);
+        *old_config = mqtt_strdup(&client->alloc.state, new_config);
         if (*old_config == NULL)
         {
             return false;
@@ -354,6 +443,41 @@ bool esp_mqtt_set_if_config(char const *const new_config, char **old_config)
     return true;
 }
 
+#define MQTT_MEMORY_ALIGN 8
+
+static inline size_t mqtt_memory_align(size_t size)
+{
+    return (size + MQTT_MEMORY_ALIGN - 1) & ~(size_t)(MQTT_MEMORY_ALIGN - 1);
+}
+
+void *mqtt_client_calloc(esp_mqtt_client_handle_t client, size_t size)
+{
+    if (client->memory == NULL)
+    {
+        return mqtt_calloc(&client->alloc.state, 1, size);
+    }
+    uintptr_t start = (uintptr_t)client->memory;
+    size_t offset = mqtt_memory_align(start + client->memory_used) - start;
+    if (offset + size > client->memory_size)
+    {
+        ESP_LOGE(TAG, "Client memory region exhausted (%" NEWLIB_NANO_COMPAT_FORMAT " bytes)", NEWLIB_NANO_COMPAT_CAST(client->memory_size));
+        return NULL;
+    }
+    client->memory_used = offset + size;
+    memset(client->memory + offset, 0, size);
+    return client->memory + offset;
+}
+
+void mqtt_client_free(esp_mqtt_client_handle_t client, void *ptr)
+{
+    // carved objects are released with the whole region, by its owner
+    if (client->memory && (uint8_t *)ptr >= client->memory && (uint8_t *)ptr < client->memory + client->memory_size)
+    {
+        return;
+    }
+    mqtt_free(&client->alloc.state, ptr);
+}
+
 static esp_err_t esp_mqtt_client_create_transport(esp_mqtt_client_handle_t client)
 {
     esp_err_t ret = ESP_OK;
@@ -458,14 +582,13 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
     esp_err_t err = ESP_OK;
     if (!client->config)
     {
-        client->config = calloc(1, sizeof(mqtt_config_storage_t));
+        client->config = mqtt_client_calloc(client, sizeof(mqtt_config_storage_t));
         ESP_MEM_CHECK(TAG, client->config, {
             MQTT_API_UNLOCK(client);
             return ESP_ERR_NO_MEM;
         });
     }
 
-    mqtt_msg_buffer_destroy(&client->mqtt_state.connection);
     int buffer_size = config->buffer.size;
     if (buffer_size <= 0)
     {
@@ -474,15 +597,39 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
 
     // use separate value for output buffer size if configured
     int out_buffer_size = config->buffer.out_size > 0 ? config->buffer.out_size : buffer_size;
-    if (mqtt_msg_buffer_init(&client->mqtt_state.connection, out_buffer_size) != ESP_OK)
+    if (client->memory && client->mqtt_state.in_buffer)
     {
-        goto _mqtt_set_config_failed;
+        // the buffers of a static client are carved once
+        if (buffer_size != client->mqtt_state.in_buffer_size || out_buffer_size != client->mqtt_state.connection.buffer_length)
+        {
+            ESP_LOGW(TAG, "Buffer sizes of a static client can't change");
+        }
+    }
+    else if (client->memory)
+    {
+        client->mqtt_state.connection.buffer = mqtt_client_calloc(client, out_buffer_size);
+        ESP_MEM_CHECK(TAG, client->mqtt_state.connection.buffer, goto _mqtt_set_config_failed);
+        client->mqtt_state.connection.buffer_length = out_buffer_size;
+        client->mqtt_state.in_buffer = mqtt_client_calloc(client, buffer_size);
+        ESP_MEM_CHECK(TAG, client->mqtt_state.in_buffer, goto _mqtt_set_config_failed);
+        client->mqtt_state.in_buffer_length = buffer_size;
+        client->mqtt_state.in_buffer_size = buffer_size;
     }
+    else
+    {
+        mqtt_msg_buffer_destroy(&client->mqtt_state.connection);
+        if (mqtt_msg_buffer_init(&client->mqtt_state.connection, out_buffer_size) != ESP_OK)
+        {
+            goto _mqtt_set_config_failed;
+        }
 
-    free(client->mqtt_state.in_buffer);
-    client->mqtt_state.in_buffer = (uint8_t *)malloc(buffer_size);
-    ESP_MEM_CHECK(TAG, client->mqtt_state.in_buffer, goto _mqtt_set_config_failed);
-    client->mqtt_state.in_buffer_length = buffer_size;
+        mqtt_free(&client->alloc.state, client->mqtt_state.in_buffer);
+        client->mqtt_state.in_buffer = (uint8_t *)mqtt_alloc(&client->alloc.state, buffer_size);
+        ESP_MEM_CHECK(TAG, client->mqtt_state.in_buffer, goto _mqtt_set_config_failed);
+        client->mqtt_state.in_buffer_length = buffer_size;
+        client->mqtt_state.in_buffer_size = buffer_size;
+        client->mqtt_state.in_buffer_max_size = config->buffer.max_size > buffer_size ? config->buffer.max_size : 0;
+    }
 
     client->config->message_retransmit_timeout = config->session.message_retransmit_timeout;
     if (config->session.message_retransmit_timeout <= 0)
@@ -513,40 +660,42 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
     }
 
     err = ESP_ERR_NO_MEM;
-    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(config->broker.address.hostname, &client->config->host), goto _mqtt_set_config_failed);
-    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(config->broker.address.path, &client->config->path), goto _mqtt_set_config_failed);
-    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(config->credentials.username, &client->mqtt_state.connection.information.username), goto _mqtt_set_config_failed);
-    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(config->credentials.authentication.password, &client->mqtt_state.connection.information.password), goto _mqtt_set_config_failed);
+    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, config->broker.address.hostname, &client->config->host), goto _mqtt_set_config_failed);
+    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, config->broker.address.path, &client->config->path), goto _mqtt_set_config_failed);
+    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, config->credentials.username, &client->mqtt_state.connection.information.username), goto _mqtt_set_config_failed);
+    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, config->credentials.authentication.password, &client->mqtt_state.connection.information.password), goto _mqtt_set_config_failed);
 
     if (!config->credentials.set_null_client_id)
     {
         if (config->credentials.client_id)
         {
-            ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(config->credentials.client_id, &client->mqtt_state.connection.information.client_id), goto _mqtt_set_config_failed);
+            ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, config->credentials.client_id, &client->mqtt_state.connection.information.client_id), goto _mqtt_set_config_failed);
         }
         else if (client->mqtt_state.connection.information.client_id == NULL)
         {
-            client->mqtt_state.connection.information.client_id = platform_create_id_string();
+            char *id = platform_create_id_string();
+            client->mqtt_state.connection.information.client_id = id ? mqtt_strdup(&client->alloc.state, id) : NULL;
+            free(id);
         }
         ESP_MEM_CHECK(TAG, client->mqtt_state.connection.information.client_id, goto _mqtt_set_config_failed);
         ESP_LOGD(TAG, "MQTT client_id=%s", client->mqtt_state.connection.information.client_id);
     }
 
-    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(config->broker.address.uri, &client->config->uri), goto _mqtt_set_config_failed);
-    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(config->session.last_will.topic, &client->mqtt_state.connection.information.will_topic), goto _mqtt_set_config_failed);
+    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, config->broker.address.uri, &client->config->uri), goto _mqtt_set_config_failed);
+    ESP_MEM_CHECK(TAG, esp_mqtt_set_if_config(client, config->session.last_will.topic, &client->mqtt_state.connection.information.will_topic), goto _mqtt_set_config_failed);
 
     if (config->session.last_will.msg_len && config->session.last_will.msg)
     {
-        free(client->mqtt_state.connection.information.will_message);
-        client->mqtt_state.connection.information.will_message = malloc(config->session.last_will.msg_len);
+        mqtt_free(&client->alloc.state, client->mqtt_state.connection.information.will_message);
+        client->mqtt_state.connection.information.will_message = mqtt_alloc(&client->alloc.state, config->session.last_will.msg_len);
         ESP_MEM_CHECK(TAG, client->mqtt_state.connection.information.will_message, goto _mqtt_set_config_failed);
         memcpy(client->mqtt_state.connection.information.will_message, config->session.last_will.msg, config->session.last_will.msg_len);
         client->mqtt_state.connection.information.will_length = config->session.last_will.msg_len;
     }
     else if (config->session.last_will.msg)
     {
-        free(client->mqtt_state.connection.information.will_message);
-        client->mqtt_state.connection.information.will_message = strdup(config->session.last_will.msg);
+        mqtt_free(&client->alloc.state, client->mqtt_state.connection.information.will_message);
+        client->mqtt_state.connection.information.will_message = mqtt_strdup(&client->alloc.state, config->session.last_will.msg);
         ESP_MEM_CHECK(TAG, client->mqtt_state.connection.information.will_message, goto _mqtt_set_config_failed);
         client->mqtt_state.connection.information.will_length = strlen(config->session.last_will.msg);
     }
@@ -602,6 +751,7 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
         goto _mqtt_set_config_failed;
 #endif
     }
+    mqtt_select_protocol_ops(client);
 
     client->config->network_timeout_ms = config->network.timeout_ms;
     if (client->config->network_timeout_ms <= 0)
@@ -633,7 +783,8 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
 
     if (config->network.if_name)
     {
-        client->config->if_name = calloc(1, sizeof(struct ifreq) + 1);
+        mqtt_free(&client->alloc.state, client->config->if_name);
+        client->config->if_name = mqtt_calloc(&client->alloc.state, 1, sizeof(struct ifreq) + 1);
         ESP_MEM_CHECK(TAG, client->config->if_name, goto _mqtt_set_config_failed);
         memcpy(client->config->if_name, config->network.if_name, sizeof(struct ifreq));
     }
@@ -642,9 +793,9 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
     {
         for (int i = 0; i < client->config->num_alpn_protos; i++)
         {
-            free(client->config->alpn_protos[i]);
+            mqtt_free(&client->alloc.state, client->config->alpn_protos[i]);
         }
-        free(client->config->alpn_protos);
+        mqtt_free(&client->alloc.state, client->config->alpn_protos);
         client->config->num_alpn_protos = 0;
 
         const char **p;
@@ -654,12 +805,12 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
             client->config->num_alpn_protos++;
         }
         // mbedTLS expects the list to be null-terminated
-        client->config->alpn_protos = calloc(client->config->num_alpn_protos + 1, sizeof(*config->broker.verification.alpn_protos));
+        client->config->alpn_protos = mqtt_calloc(&client->alloc.state, client->config->num_alpn_protos + 1, sizeof(*config->broker.verification.alpn_protos));
         ESP_MEM_CHECK(TAG, client->config->alpn_protos, goto _mqtt_set_config_failed);
 
         for (int i = 0; i < client->config->num_alpn_protos; i++)
         {
-            client->config->alpn_protos[i] = strdup(config->broker.verification.alpn_protos[i]);
+            client->config->alpn_protos[i] = mqtt_strdup(&client->alloc.state, config->broker.verification.alpn_protos[i]);
             ESP_MEM_CHECK(TAG, client->config->alpn_protos[i], goto _mqtt_set_config_failed);
         }
     }
@@ -685,38 +836,39 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
     if (config->credentials.authentication.key_password && config->credentials.authentication.key_password_len)
     {
         client->config->clientkey_password_len = config->credentials.authentication.key_password_len;
-        client->config->clientkey_password = malloc(client->config->clientkey_password_len);
+        mqtt_free(&client->alloc.state, client->config->clientkey_password);
+        client->config->clientkey_password = mqtt_alloc(&client->alloc.state, client->config->clientkey_password_len);
         ESP_MEM_CHECK(TAG, client->config->clientkey_password, goto _mqtt_set_config_failed);
         memcpy(client->config->clientkey_password, config->credentials.authentication.key_password, client->config->clientkey_password_len);
     }
 
     if (config->broker.address.transport)
     {
-        free(client->config->scheme);
+        mqtt_free(&client->alloc.state, client->config->scheme);
         client->config->scheme = NULL;
         if (config->broker.address.transport == MQTT_TRANSPORT_OVER_TCP)
         {
-            client->config->scheme = create_string(MQTT_OVER_TCP_SCHEME, strlen(MQTT_OVER_TCP_SCHEME));
+            client->config->scheme = create_string(client, MQTT_OVER_TCP_SCHEME, strlen(MQTT_OVER_TCP_SCHEME));
             ESP_MEM_CHECK(TAG, client->config->scheme, goto _mqtt_set_config_failed);
         }
 #if MQTT_ENABLE_WS
         else if (config->broker.address.transport == MQTT_TRANSPORT_OVER_WS)
         {
-            client->config->scheme = create_string(MQTT_OVER_WS_SCHEME, strlen(MQTT_OVER_WS_SCHEME));
+            client->config->scheme = create_string(client, MQTT_OVER_WS_SCHEME, strlen(MQTT_OVER_WS_SCHEME));
             ESP_MEM_CHECK(TAG, client->config->scheme, goto _mqtt_set_config_failed);
         }
 #endif
 #if MQTT_ENABLE_SSL
         else if (config->broker.address.transport == MQTT_TRANSPORT_OVER_SSL)
         {
-            client->config->scheme = create_string(MQTT_OVER_SSL_SCHEME, strlen(MQTT_OVER_SSL_SCHEME));
+            client->config->scheme = create_string(client, MQTT_OVER_SSL_SCHEME, strlen(MQTT_OVER_SSL_SCHEME));
             ESP_MEM_CHECK(TAG, client->config->scheme, goto _mqtt_set_config_failed);
         }
 #endif
 #if MQTT_ENABLE_WSS
         else if (config->broker.address.transport == MQTT_TRANSPORT_OVER_WSS)
         {
-            client->config->scheme = create_string(MQTT_OVER_WSS_SCHEME, strlen(MQTT_OVER_WSS_SCHEME));
+            client->config->scheme = create_string(client, MQTT_OVER_WSS_SCHEME, strlen(MQTT_OVER_WSS_SCHEME));
             ESP_MEM_CHECK(TAG, client->config->scheme, goto _mqtt_set_config_failed);
         }
 #endif
@@ -732,6 +884,17 @@ esp_err_t esp_mqtt_set_config(esp_mqtt_client_handle_t client, const esp_mqtt_cl
         }
     }
     client->config->outbox_limit = config->outbox.limit;
+    client->config->coalesce_topics = config->outbox.coalesce_topics;
+#ifdef MQTT_COMPRESSION
+    client->config->compression_topics = config->compression.topics;
+    client->config->compression_min_size = config->compression.min_size > 0 ? config->compression.min_size : MQTT_COMPRESSION_MIN_SIZE;
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    client->config->local_topics = config->loopback.local_topics;
+#endif
+#ifdef MQTT_BROKER_FAILOVER
+    client->config->failover_connect_timeout_ms = config->failover.connect_timeout_ms;
+#endif
     esp_err_t config_has_conflict = esp_mqtt_check_cfg_conflict(client->config, config);
 
     MQTT_API_UNLOCK(client);
@@ -749,24 +912,27 @@ void esp_mqtt_destroy_config(esp_mqtt_client_handle_t client)
     {
         return;
     }
-    free(client->mqtt_state.in_buffer);
-    mqtt_msg_buffer_destroy(&client->mqtt_state.connection);
-    free(client->config->host);
-    free(client->config->uri);
-    free(client->config->path);
-    free(client->config->scheme);
+    mqtt_client_free(client, client->mqtt_state.in_buffer);
+    if (client->memory == NULL)
+    {
+        mqtt_msg_buffer_destroy(&client->mqtt_state.connection);
+    }
+    mqtt_free(&client->alloc.state, client->config->host);
+    mqtt_free(&client->alloc.state, client->config->uri);
+    mqtt_free(&client->alloc.state, client->config->path);
+    mqtt_free(&client->alloc.state, client->config->scheme);
     for (int i = 0; i < client->config->num_alpn_protos; i++)
     {
-        free(client->config->alpn_protos[i]);
+        mqtt_free(&client->alloc.state, client->config->alpn_protos[i]);
     }
-    free(client->config->alpn_protos);
-    free(client->config->clientkey_password);
-    free(client->config->if_name);
-    free(client->mqtt_state.connection.information.will_topic);
-    free(client->mqtt_state.connection.information.will_message);
-    free(client->mqtt_state.connection.information.client_id);
-    free(client->mqtt_state.connection.information.username);
-    free(client->mqtt_state.connection.information.password);
+    mqtt_free(&client->alloc.state, client->config->alpn_protos);
+    mqtt_free(&client->alloc.state, client->config->clientkey_password);
+    mqtt_free(&client->alloc.state, client->config->if_name);
+    mqtt_free(&client->alloc.state, client->mqtt_state.connection.information.will_topic);
+    mqtt_free(&client->alloc.state, client->mqtt_state.connection.information.will_message);
+    mqtt_free(&client->alloc.state, client->mqtt_state.connection.information.client_id);
+    mqtt_free(&client->alloc.state, client->mqtt_state.connection.information.username);
+    mqtt_free(&client->alloc.state, client->mqtt_state.connection.information.password);
 #ifdef CONFIG_MQTT_PROTOCOL_5
     esp_mqtt5_client_destory(client);
 #endif
@@ -779,7 +945,7 @@ void esp_mqtt_destroy_config(esp_mqtt_client_handle_t client)
 #endif
     esp_transport_destroy(client->config->transport);
     memset(client->config, 0, sizeof(mqtt_config_storage_t));
-    free(client->config);
+    mqtt_client_free(client, client->config);
     client->config = NULL;
 }
 
@@ -789,13 +955,28 @@ static inline bool has_timed_out(uint64_t last_tick, uint64_t timeout)
     return (int64_t)(next - platform_tick_get_ms()) <= 0;
 }
 
+/**
+ * @brief Returns true if reading from the transport is paused on exhausted receive credit
+ */
+static inline bool mqtt_inbound_paused(esp_mqtt_client_handle_t client)
+{
+#ifdef MQTT_INBOUND_FLOW_CONTROL
+    // only between messages, a message being read is completed first
+    return client->mqtt_state.in_buffer_read_len == 0 &&
+           ((client->inbound.window && client->inbound.messages <= 0) || (client->inbound.limit_bytes && client->inbound.bytes <= 0));
+#else
+    return false;
+#endif
+}
+
 static esp_err_t process_keepalive(esp_mqtt_client_handle_t client)
 {
     if (client->mqtt_state.connection.information.keepalive > 0)
     {
         const uint64_t keepalive_ms = client->mqtt_state.connection.information.keepalive * 1000;
 
-        if (client->wait_for_ping_resp == true)
+        // while reading is paused, PINGRESPs wait unread behind the held messages, pings go on
+        if (client->wait_for_ping_resp == true && !mqtt_inbound_paused(client))
         {
             if (has_timed_out(client->keepalive_tick, keepalive_ms))
             {
@@ -816,6 +997,9 @@ static esp_err_t process_keepalive(esp_mqtt_client_handle_t client)
                 return ESP_FAIL;
             }
             client->wait_for_ping_resp = true;
+#ifdef MQTT_BROKER_FAILOVER
+            client->ping_tick = platform_tick_get_ms();
+#endif
             return ESP_OK;
         }
     }
@@ -879,6 +1063,58 @@ static inline esp_err_t esp_mqtt_write(esp_mqtt_client_handle_t client)
     return ESP_OK;
 }
 
+#ifdef CONFIG_MQTT_PROTOCOL_5
+static void mqtt5_count_inflight(outbox_item_handle_t item, void *ctx)
+{
+    size_t len = 0;
+    int msg_type = 0;
+    int qos = 0;
+    outbox_item_get_data(item, &len, NULL, &msg_type, &qos);
+    if (msg_type == MQTT_MSG_TYPE_PUBLISH && qos > 0 && outbox_item_get_pending(item) != QUEUED)
+    {
+        ++*(uint16_t *)ctx;
+    }
+}
+
+static bool mqtt5_publish_needs_ack(outbox_item_handle_t item)
+{
+    size_t len = 0;
+    int msg_type = 0;
+    int qos = 0;
+    outbox_item_get_data(item, &len, NULL, &msg_type, &qos);
+    return msg_type == MQTT_MSG_TYPE_PUBLISH && qos > 0;
+}
+
+/**
+ * @brief Publishes of the session still waiting for PUBACK or PUBCOMP, they count in the receive maximum
+ */
+static uint16_t mqtt5_inflight_publish_count(esp_mqtt_client_handle_t client)
+{
+    uint16_t count = 0;
+    outbox_for_each(client->outbox, mqtt5_count_inflight, &count);
+    return count + mqtt_qos2_count(client->qos2, MQTT_QOS2_PUBREL_SENT);
+}
+
+/**
+ * @brief Checks a publish against the maximum packet size of the broker before encoding it
+ */
+static bool mqtt5_publish_too_large(esp_mqtt_client_handle_t client, const char *topic, int len, int qos)
+{
+    // fixed header, topic, message id and property length at least
+    size_t min_len = 2 + 2 + (topic ? strlen(topic) : 0) + (qos ? 2 : 0) + 1 + (len > 0 ? len : 0);
+    return esp_mqtt5_client_packet_too_large(client, min_len);
+}
+
+/**
+ * @brief Length of the encoded packet, including the payload left out of the connection buffer
+ */
+static size_t mqtt_outbound_packet_len(esp_mqtt_client_handle_t client)
+{
+    const mqtt_message_t *msg = &client->mqtt_state.connection.outbound_message;
+    return msg->fragmented_msg_total_length ? msg->fragmented_msg_total_length : msg->length;
+}
+#endif
+
 static esp_err_t esp_mqtt_connect(esp_mqtt_client_handle_t client, int timeout_ms)
 {
     int read_len, connect_rsp_code = 0;
@@ -916,12 +1152,21 @@ static esp_err_t esp_mqtt_connect(esp_mqtt_client_handle_t client, int timeout_m
     ESP_LOGI(TAG, "Pre-connect will_qos=%d", client->mqtt_state.connection.information.will_qos);
 
     /* Build CONNECT packet */
+    mqtt_select_protocol_ops(client);
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
     {
 #ifdef CONFIG_MQTT_PROTOCOL_5
+        esp_mqtt5_connection_property_storage_t connect_property = client->mqtt5_config->connect_property_info;
+#ifdef MQTT_INBOUND_FLOW_CONTROL
+        // the broker keeps at most this many QoS1/2 publishes unacknowledged, in line with the credit
+        if (client->inbound.window && (connect_property.receive_maximum == 0 || connect_property.receive_maximum > client->inbound.window))
+        {
+            connect_property.receive_maximum = client->inbound.window > UINT16_MAX ? UINT16_MAX : client->inbound.window;
+        }
+#endif
         mqtt5_msg_connect(&client->mqtt_state.connection,
                           &client->mqtt_state.connection.information,
-                          &client->mqtt5_config->connect_property_info,
+                          &connect_property,
                           &client->mqtt5_config->will_property_info);
 #endif
     }
@@ -988,26 +1233,20 @@ static esp_err_t esp_mqtt_connect(esp_mqtt_client_handle_t client, int timeout_m
     }
 
     /* Handle CONNACK */
-    client->mqtt_state.in_buffer_read_len = 0;
-
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
     {
 #ifdef CONFIG_MQTT_PROTOCOL_5
-        /* Minimal v5 handling: treat CONNACK as success */
-        connect_rsp_code = 0;
-        if (client->mqtt5_config)
+        // the broker limits (maximum QoS, receive maximum, packet size, topic aliases) apply from now on
+        if (esp_mqtt5_parse_connack(client, &connect_rsp_code) == ESP_OK)
         {
-            client->mqtt5_config->server_resp_property_info.max_qos = 2;
-            client->mqtt5_config->server_resp_property_info.receive_maximum = 20;
-            client->mqtt5_config->server_resp_property_info.maximum_packet_size = 0;
-            client->mqtt5_config->server_resp_property_info.topic_alias_maximum = 0;
+            client->send_publish_packet_count = mqtt5_inflight_publish_count(client);
+            return ESP_OK;
         }
-        client->send_publish_packet_count = 0;
-        return ESP_OK;
 #endif
     }
     else
     {
+        client->mqtt_state.in_buffer_read_len = 0;
         connect_rsp_code = mqtt_get_connect_return_code(client->mqtt_state.in_buffer);
         if (connect_rsp_code == MQTT_CONNECTION_ACCEPTED)
         {
@@ -1046,13 +1285,39 @@ static esp_err_t esp_mqtt_connect(esp_mqtt_client_handle_t client, int timeout_m
     return ESP_FAIL;
 }
 
+/**
+ * @brief Closes a failed or lost connection, the broker failover backs off the endpoint
+ */
 static void esp_mqtt_abort_connection(esp_mqtt_client_handle_t client)
+{
+    esp_mqtt_close_connection(client, true);
+}
+
+/**
+ * @brief Closes the connection, `failed` is false for the ones closed on purpose (disconnect request, refresh)
+ */
+static void esp_mqtt_close_connection(esp_mqtt_client_handle_t client, bool failed)
 {
     MQTT_API_LOCK(client);
     esp_transport_close(client->transport);
     client->wait_timeout_ms = client->config->reconnect_timeout_ms;
     client->reconnect_tick = platform_tick_get_ms();
+#ifdef MQTT_BROKER_FAILOVER
+    if (client->failover && failed)
+    {
+        // the endpoint backs off, the next one out of its delay is tried right away
+        mqtt_failover_failed(client->failover, client->reconnect_tick, platform_random);
+        client->wait_timeout_ms = mqtt_failover_wait(client->failover, client->reconnect_tick);
+    }
+#endif
     client->state = MQTT_STATE_WAIT_RECONNECT;
+#ifdef MQTT_OFFLINE_LOG
+    if (client->offline_log)
+    {
+        // unacknowledged messages are sent again from the last checkpoint
+        mqtt_offline_log_rewind(client->offline_log);
+    }
+#endif
     ESP_LOGD(TAG, "Reconnect after %d ms", client->wait_timeout_ms);
     client->event.event_id = MQTT_EVENT_DISCONNECTED;
     client->wait_for_ping_resp = false;
@@ -1062,31 +1327,103 @@ static void esp_mqtt_abort_connection(esp_mqtt_client_handle_t client)
 
 static bool create_client_data(esp_mqtt_client_handle_t client)
 {
-    client->event.error_handle = calloc(1, sizeof(esp_mqtt_error_codes_t));
+    client->event.error_handle = mqtt_client_calloc(client, sizeof(esp_mqtt_error_codes_t));
     ESP_MEM_CHECK(TAG, client->event.error_handle, return false)
 
-    client->api_lock = xSemaphoreCreateRecursiveMutex();
+    if (client->memory)
+    {
+        StaticSemaphore_t *lock = mqtt_client_calloc(client, sizeof(StaticSemaphore_t));
+        ESP_MEM_CHECK(TAG, lock, return false);
+        client->api_lock = xSemaphoreCreateRecursiveMutexStatic(lock);
+    }
+    else
+    {
+        client->api_lock = xSemaphoreCreateRecursiveMutex();
+    }
     ESP_MEM_CHECK(TAG, client->api_lock, return false);
 
-    client->outbox = outbox_init(client);
+    client->outbox = outbox_init(client, &client->alloc.message);
     ESP_MEM_CHECK(TAG, client->outbox, return false);
-    client->status_bits = xEventGroupCreate();
+    client->qos2 = mqtt_qos2_table_create(MQTT_QOS2_MAX_INFLIGHT, &client->alloc.state);
+    ESP_MEM_CHECK(TAG, client->qos2, return false);
+    if (client->memory)
+    {
+        StaticEventGroup_t *bits = mqtt_client_calloc(client, sizeof(StaticEventGroup_t));
+        ESP_MEM_CHECK(TAG, bits, return false);
+        client->status_bits = xEventGroupCreateStatic(bits);
+    }
+    else
+    {
+        client->status_bits = xEventGroupCreate();
+    }
     ESP_MEM_CHECK(TAG, client->status_bits, return false);
 
     return true;
 }
 
+static esp_mqtt_client_handle_t mqtt_client_create(esp_mqtt_client_handle_t client, const esp_mqtt_client_config_t *config);
+
 esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
 {
-    esp_mqtt_client_handle_t client = heap_caps_calloc(1, sizeof(struct esp_mqtt_client),
+    mqtt_allocator_t state;
+    mqtt_allocator_init(&state, &config->memory.state,
 #if MQTT_EVENT_QUEUE_SIZE > 1
-                                                       // if supporting multiple queued events, we keep track of them
-                                                       // using atomic variable, so need to make sure it won't get allocated in PSRAM
-                                                       MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+                        // if supporting multiple queued events, we keep track of them
+                        // using atomic variable, so need to make sure it won't get allocated in PSRAM
+                        MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
 #else
-                                                       MALLOC_CAP_DEFAULT);
+                        MALLOC_CAP_DEFAULT);
 #endif
+    esp_mqtt_client_handle_t client = mqtt_calloc(&state, 1, sizeof(struct esp_mqtt_client));
     ESP_MEM_CHECK(TAG, client, return NULL);
+    return mqtt_client_create(client, config);
+}
+
+size_t esp_mqtt_client_required_memory(const esp_mqtt_client_config_t *config)
+{
+    int buffer_size = config->buffer.size > 0 ? config->buffer.size : MQTT_BUFFER_SIZE_BYTE;
+    int out_buffer_size = config->buffer.out_size > 0 ? config->buffer.out_size : buffer_size;
+    // the region itself may be unaligned
+    size_t size = MQTT_MEMORY_ALIGN - 1;
+    size += mqtt_memory_align(sizeof(struct esp_mqtt_client));
+    size += mqtt_memory_align(sizeof(esp_mqtt_error_codes_t));
+    size += mqtt_memory_align(sizeof(StaticSemaphore_t));
+    size += mqtt_memory_align(sizeof(StaticEventGroup_t));
+    size += mqtt_memory_align(sizeof(mqtt_config_storage_t));
+    size += mqtt_memory_align(out_buffer_size);
+    size += mqtt_memory_align(buffer_size);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    size += mqtt_memory_align(sizeof(esp_mqtt5_event_property_t));
+    size += mqtt_memory_align(sizeof(mqtt5_config_storage_t));
+#endif
+    return size;
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init_static(const esp_mqtt_client_config_t *config, void *memory, size_t size)
+{
+    if (config == NULL || memory == NULL || size < esp_mqtt_client_required_memory(config))
+    {
+        ESP_LOGE(TAG, "Memory region missing or smaller than %" NEWLIB_NANO_COMPAT_FORMAT " bytes",
+                 NEWLIB_NANO_COMPAT_CAST(config ? esp_mqtt_client_required_memory(config) : 0));
+        return NULL;
+    }
+    // the client is carved first, then it keeps track of the region
+    uintptr_t start = mqtt_memory_align((uintptr_t)memory);
+    esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)start;
+    memset(client, 0, sizeof(struct esp_mqtt_client));
+    client->memory = memory;
+    client->memory_size = size;
+    client->memory_used = start - (uintptr_t)memory + sizeof(struct esp_mqtt_client);
+    return mqtt_client_create(client, config);
+}
+
+static esp_mqtt_client_handle_t mqtt_client_create(esp_mqtt_client_handle_t client, const esp_mqtt_client_config_t *config)
+{
+    mqtt_allocator_init(&client->alloc.state, &config->memory.state, MALLOC_CAP_DEFAULT);
+    mqtt_allocator_init(&client->alloc.message, &config->memory.message, MQTT_OUTBOX_MEMORY);
+    mqtt_allocator_init(&client->alloc.transient, &config->memory.transient, MALLOC_CAP_DEFAULT);
+    client->mqtt_state.connection.alloc = &client->alloc;
+    client->publish_priority = MQTT_PRIORITY_NORMAL;
     if (!create_client_data(client))
     {
         goto _mqtt_init_failed;
@@ -1096,6 +1433,94 @@ esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *co
     {
         goto _mqtt_init_failed;
     }
+#ifdef MQTT_OFFLINE_LOG
+    if (config->offline_log.storage || config->offline_log.path)
+    {
+        client->offline_log = mqtt_offline_log_open(config->offline_log.storage, config->offline_log.path,
+                                                    config->offline_log.segment_size ? config->offline_log.segment_size : MQTT_OFFLINE_LOG_SEGMENT_SIZE,
+                                                    config->offline_log.max_segments, MQTT_OFFLINE_LOG_REPLAY_BATCH,
+                                                    &client->alloc.message);
+        if (client->offline_log == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to open the offline log");
+            goto _mqtt_init_failed;
+        }
+    }
+#endif
+#ifdef MQTT_RATE_LIMIT
+    if (config->rate_limit.client.msgs_per_sec || config->rate_limit.client.bytes_per_sec || config->rate_limit.topics_count > 0)
+    {
+        client->rate_limit = mqtt_rate_limit_create(&config->rate_limit.client, config->rate_limit.topics,
+                                                    config->rate_limit.topics_count, &client->alloc.state);
+        if (client->rate_limit == NULL)
+        {
+            ESP_LOGE(TAG, "Failed to create the rate limiter");
+            goto _mqtt_init_failed;
+        }
+    }
+#endif
+#ifdef MQTT_BATCHING
+    client->batcher = mqtt_batcher_create(config->batch.max_size ? config->batch.max_size : MQTT_BATCH_MAX_SIZE,
+                                          config->batch.max_samples,
+                                          config->batch.max_latency_ms ? config->batch.max_latency_ms : MQTT_BATCH_MAX_LATENCY_MS,
+                                          config->batch.max_topics > 0 ? config->batch.max_topics : MQTT_BATCH_MAX_TOPICS,
+                                          mqtt_batch_publish, client, &client->alloc.message);
+    if (client->batcher == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to create the telemetry batcher");
+        goto _mqtt_init_failed;
+    }
+#endif
+#ifdef MQTT_INBOUND_FLOW_CONTROL
+    client->inbound.window = config->inbound.messages > 0 ? config->inbound.messages : 0;
+    client->inbound.messages = client->inbound.window;
+    client->inbound.limit_bytes = config->inbound.bytes > 0;
+    client->inbound.bytes = config->inbound.bytes;
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    if (config->loopback.enable)
+    {
+        client->loopback = mqtt_loopback_create(MQTT_LOOPBACK_DEDUP_SIZE, &client->alloc.state);
+        if (client->loopback == NULL)
+        {
+            goto _mqtt_init_failed;
+        }
+    }
+#endif
+#ifdef MQTT_BROKER_FAILOVER
+    if (config->failover.uris)
+    {
+        client->failover = mqtt_failover_create(config->failover.uris, client->config->reconnect_timeout_ms,
+                                                config->failover.max_backoff_ms > 0 ? config->failover.max_backoff_ms : MQTT_FAILOVER_MAX_BACKOFF_MS,
+                                                &client->alloc.state);
+        if (client->failover == NULL)
+        {
+            goto _mqtt_init_failed;
+        }
+    }
+#endif
+#ifdef MQTT_SESSION_PERSISTENCE
+    if (config->session.storage && !config->session.disable_clean_session)
+    {
+        ESP_LOGW(TAG, "Session storage is not used with clean session");
+    }
+    else if (config->session.storage)
+    {
+        client->session = mqtt_session_create(config->session.storage, MQTT_SESSION_MAX_SIZE, &client->alloc.state);
+        if (client->session == NULL)
+        {
+            goto _mqtt_init_failed;
+        }
+        uint16_t last_message_id = 0;
+        if (mqtt_session_restore(client->session, client->outbox, client->qos2, &last_message_id) == ESP_OK)
+        {
+#if MQTT_MSG_ID_INCREMENTAL
+            client->mqtt_state.connection.last_message_id = last_message_id;
+#endif
+        }
+        client->session_save_tick = platform_tick_get_ms();
+    }
+#endif
 #ifdef MQTT_SUPPORTED_FEATURE_EVENT_LOOP
     esp_event_loop_args_t no_task_loop = {
         .queue_size = MQTT_EVENT_QUEUE_SIZE,
@@ -1105,6 +1530,20 @@ esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *co
 #if MQTT_EVENT_QUEUE_SIZE > 1
     atomic_init(&client->queued_events, 0);
 #endif
+#endif
+#if defined(MQTT_LOCAL_LOOPBACK) && defined(MQTT_SUPPORTED_FEATURE_EVENT_LOOP)
+    if (client->loopback || client->config->local_topics)
+    {
+        // a loop nothing else posts to, so that the handlers of a local delivery run before the publish returns
+        esp_event_loop_args_t loopback_loop = {
+            .queue_size = 1,
+            .task_name = NULL,
+        };
+        if (esp_event_loop_create(&loopback_loop, &client->loopback_loop) != ESP_OK)
+        {
+            goto _mqtt_init_failed;
+        }
+    }
 #endif
 
     client->keepalive_tick = platform_tick_get_ms();
@@ -1138,10 +1577,46 @@ esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
     {
         esp_transport_list_destroy(client->transport_list);
     }
+#ifdef MQTT_SESSION_PERSISTENCE
+    if (client->session)
+    {
+        mqtt_save_session(client);
+        mqtt_session_destroy(client->session);
+    }
+#endif
     if (client->outbox)
     {
         outbox_destroy(client->outbox);
     }
+    mqtt_qos2_table_destroy(client->qos2);
+#ifdef MQTT_OFFLINE_LOG
+    mqtt_offline_log_close(client->offline_log);
+#endif
+#ifdef MQTT_RATE_LIMIT
+    mqtt_rate_limit_destroy(client->rate_limit);
+#endif
+#ifdef MQTT_BATCHING
+    mqtt_batcher_destroy(client->batcher);
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    mqtt_loopback_destroy(client->loopback);
+#ifdef MQTT_SUPPORTED_FEATURE_EVENT_LOOP
+    if (client->loopback_loop)
+    {
+        esp_event_loop_delete(client->loopback_loop);
+    }
+#endif
+#endif
+#ifdef MQTT_BROKER_FAILOVER
+    mqtt_failover_destroy(client->failover);
+#endif
+#ifdef MQTT_REASSEMBLY
+    for (int i = 0; i < client->data_storage_count; ++i)
+    {
+        mqtt_free(&client->alloc.state, client->data_storage[i].filter);
+    }
+    mqtt_free(&client->alloc.state, client->data_storage);
+#endif
     if (client->status_bits)
     {
         vEventGroupDelete(client->status_bits);
@@ -1150,19 +1625,19 @@ esp_err_t esp_mqtt_client_destroy(esp_mqtt_client_handle_t client)
     {
         vSemaphoreDelete(client->api_lock);
     }
-    free(client->event.error_handle);
-    free(client);
+    mqtt_client_free(client, client->event.error_handle);
+    mqtt_client_free(client, client);
     return ESP_OK;
 }
 
-static char *create_string(const char *ptr, int len)
+static char *create_string(esp_mqtt_client_handle_t client, const char *ptr, int len)
 {
     char *ret;
     if (len <= 0)
     {
         return NULL;
     }
-    ret = calloc(1, len + 1);
+    ret = mqtt_calloc(&client->alloc.state, 1, len + 1);
     ESP_MEM_CHECK(TAG, ret, return NULL);
     memcpy(ret, ptr, len);
     return ret;
@@ -1190,12 +1665,12 @@ esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *u
 #pragma GCC diagnostic ignored "-Wpragmas"
 #endif
 #pragma GCC diagnostic ignored "-Wanalyzer-malloc-leak"
-    free(client->config->scheme);
-    free(client->config->host);
-    free(client->config->path);
+    mqtt_free(&client->alloc.state, client->config->scheme);
+    mqtt_free(&client->alloc.state, client->config->host);
+    mqtt_free(&client->alloc.state, client->config->path);
 
-    client->config->scheme = create_string(uri + puri.field_data[UF_SCHEMA].off, puri.field_data[UF_SCHEMA].len);
-    client->config->host = create_string(uri + puri.field_data[UF_HOST].off, puri.field_data[UF_HOST].len);
+    client->config->scheme = create_string(client, uri + puri.field_data[UF_SCHEMA].off, puri.field_data[UF_SCHEMA].len);
+    client->config->host = create_string(client, uri + puri.field_data[UF_HOST].off, puri.field_data[UF_HOST].len);
     client->config->path = NULL;
 #pragma GCC diagnostic pop
 
@@ -1204,22 +1679,22 @@ esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *u
         int asprintf_ret_value;
         if (puri.field_data[UF_QUERY].len == 0)
         {
-            asprintf_ret_value = asprintf(&client->config->path,
-                                          "%.*s",
-                                          puri.field_data[UF_PATH].len, uri + puri.field_data[UF_PATH].off);
+            asprintf_ret_value = mqtt_asprintf(&client->alloc.state, &client->config->path,
+                                               "%.*s",
+                                               puri.field_data[UF_PATH].len, uri + puri.field_data[UF_PATH].off);
         }
         else if (puri.field_data[UF_PATH].len == 0)
         {
-            asprintf_ret_value = asprintf(&client->config->path,
-                                          "/?%.*s",
-                                          puri.field_data[UF_QUERY].len, uri + puri.field_data[UF_QUERY].off);
+            asprintf_ret_value = mqtt_asprintf(&client->alloc.state, &client->config->path,
+                                               "/?%.*s",
+                                               puri.field_data[UF_QUERY].len, uri + puri.field_data[UF_QUERY].off);
         }
         else
         {
-            asprintf_ret_value = asprintf(&client->config->path,
-                                          "%.*s?%.*s",
-                                          puri.field_data[UF_PATH].len, uri + puri.field_data[UF_PATH].off,
-                                          puri.field_data[UF_QUERY].len, uri + puri.field_data[UF_QUERY].off);
+            asprintf_ret_value = mqtt_asprintf(&client->alloc.state, &client->config->path,
+                                               "%.*s?%.*s",
+                                               puri.field_data[UF_PATH].len, uri + puri.field_data[UF_PATH].off,
+                                               puri.field_data[UF_QUERY].len, uri + puri.field_data[UF_QUERY].off);
         }
 
         if (asprintf_ret_value == -1)
@@ -1235,7 +1710,7 @@ esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *u
         client->config->port = strtol((const char *)(uri + puri.field_data[UF_PORT].off), NULL, 10);
     }
 
-    char *user_info = create_string(uri + puri.field_data[UF_USERINFO].off, puri.field_data[UF_USERINFO].len);
+    char *user_info = create_string(client, uri + puri.field_data[UF_USERINFO].off, puri.field_data[UF_USERINFO].len);
     if (user_info)
     {
         char *pass = strchr(user_info, ':');
@@ -1243,11 +1718,11 @@ esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *u
         {
             pass[0] = 0; // terminal username
             pass++;
-            client->mqtt_state.connection.information.password = strdup(pass);
+            client->mqtt_state.connection.information.password = mqtt_strdup(&client->alloc.state, pass);
         }
-        client->mqtt_state.connection.information.username = strdup(user_info);
+        client->mqtt_state.connection.information.username = mqtt_strdup(&client->alloc.state, user_info);
 
-        free(user_info);
+        mqtt_free(&client->alloc.state, user_info);
     }
 
     MQTT_API_UNLOCK(client);
@@ -1256,16 +1731,7 @@ esp_err_t esp_mqtt_client_set_uri(esp_mqtt_client_handle_t client, const char *u
 
 static esp_err_t esp_mqtt_dispatch_event_with_msgid(esp_mqtt_client_handle_t client)
 {
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-    {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        client->event.msg_id = mqtt5_get_id(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_length);
-#endif
-    }
-    else
-    {
-        client->event.msg_id = mqtt_get_id(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_length);
-    }
+    client->event.msg_id = MQTT_OPS(client)->get_id(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_length);
     return esp_mqtt_dispatch_event(client);
 }
 
@@ -1293,60 +1759,192 @@ static esp_err_t esp_mqtt_dispatch_event(esp_mqtt_client_handle_t client)
 #else
     return ESP_FAIL;
 #endif
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+    if (MQTT_OPS(client)->event_dispatched)
     {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        esp_mqtt5_client_delete_user_property(client->event.property->user_property);
-        client->event.property->user_property = NULL;
-#endif
+        MQTT_OPS(client)->event_dispatched(client);
     }
     return ret;
 }
 
-static esp_err_t deliver_publish(esp_mqtt_client_handle_t client)
+/**
+ * @brief Posts received publish data, responses to pending requests complete their request instead
+ */
+static void mqtt_dispatch_data(esp_mqtt_client_handle_t client)
 {
-    uint8_t *msg_buf = client->mqtt_state.in_buffer;
-    size_t msg_read_len = client->mqtt_state.in_buffer_read_len;
-    size_t msg_total_len = client->mqtt_state.message_length;
-    size_t msg_topic_len = msg_read_len;
-    size_t msg_data_len = msg_read_len;
-    size_t msg_data_offset = 0;
-    size_t saved_msg_topic_len = 0;
-    char *saved_msg_topic = NULL;
-    char *msg_topic = NULL;
-    char *msg_data = NULL;
+#ifdef MQTT_REQUEST_RESPONSE
+    if (esp_mqtt5_request_respond(client))
+    {
+        return;
+    }
+#endif
+    esp_mqtt_dispatch_event(client);
+}
 
-    // ESP_LOGI(TAG, "deliver_publish: enter, msg_total_len=%d, msg_read_len=%d",
-    //          (int)msg_total_len, (int)msg_read_len);
-    // ESP_LOG_BUFFER_HEX_LEVEL(TAG, msg_buf, msg_read_len, ESP_LOG_DEBUG);
+#ifdef MQTT_COMPRESSION
+static bool mqtt_compression_topic(esp_mqtt_client_handle_t client, const char *topic, size_t topic_len)
+{
+    return mqtt_topic_matches_any(client->config->compression_topics, topic, topic_len);
+}
 
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+/**
+ * @brief Compresses the payload if configured for the topic and only if it gets smaller
+ *
+ * @return the compressed frame, data and len are updated to point to it;
+ *         NULL if the payload is to be sent as is
+ */
+static uint8_t *mqtt_compress_payload(esp_mqtt_client_handle_t client, const char *topic, const char **data, int *len)
+{
+    if (topic == NULL || *data == NULL || *len < client->config->compression_min_size ||
+            !mqtt_compression_topic(client, topic, strlen(topic)))
     {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        if (esp_mqtt5_get_publish_data(client, msg_buf, msg_read_len, &msg_topic, &msg_topic_len, &msg_data, &msg_data_len) != ESP_OK)
-        {
-            ESP_LOGE(TAG, "%s: esp_mqtt5_get_publish_data() failed", __func__);
-            return ESP_FAIL;
-        }
-#endif
+        return NULL;
     }
-    else
+    size_t bound = mqtt_compress_bound(*len, MQTT_COMPRESSION_BLOCK_SHIFT);
+    uint8_t *frame = mqtt_alloc(&client->alloc.transient, bound);
+    ESP_MEM_CHECK(TAG, frame, return NULL);
+    int frame_len = mqtt_compress((const uint8_t *)*data, *len, frame, bound, MQTT_COMPRESSION_BLOCK_SHIFT,
+                                  &client->alloc.transient);
+    if (frame_len < 0 || frame_len >= *len)
     {
-        msg_topic = mqtt_get_publish_topic(msg_buf, &msg_topic_len);
-        if (msg_topic == NULL)
-        {
-            ESP_LOGE(TAG, "%s: mqtt_get_publish_topic() failed", __func__);
-            return ESP_FAIL;
-        }
-        ESP_LOGD(TAG, "%s: msg_topic_len=%" NEWLIB_NANO_COMPAT_FORMAT, __func__, NEWLIB_NANO_COMPAT_CAST(msg_topic_len));
-
-        // get payload
-        msg_data = mqtt_get_publish_data(msg_buf, &msg_data_len);
-        if (msg_data_len > 0 && msg_data == NULL)
-        {
-            ESP_LOGE(TAG, "%s: mqtt_get_publish_data() failed", __func__);
-            return ESP_FAIL;
+        mqtt_free(&client->alloc.transient, frame);
+        return NULL;
+    }
+    ESP_LOGD(TAG, "Payload compressed from %d to %d bytes", *len, frame_len);
+    *data = (const char *)frame;
+    *len = frame_len;
+    return frame;
+}
+
+/**
+ * @brief Checks if the received payload is a compressed frame, returns its decompressed length
+ */
+static bool mqtt_payload_compressed(esp_mqtt_client_handle_t client, const char *topic, size_t topic_len,
+                                    const char *data, size_t data_len, size_t *raw_len)
+{
+    bool tagged = false;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+    {
+        const esp_mqtt5_event_property_t *property = client->event.property;
+        tagged = property && property->content_type &&
+                 property->content_type_len == strlen(MQTT_COMPRESSION_CONTENT_TYPE) &&
+                 memcmp(property->content_type, MQTT_COMPRESSION_CONTENT_TYPE, property->content_type_len) == 0;
+    }
+    else
+#endif
+    {
+        // MQTT 3.1.1 cannot tag the payload, rely on the configured topics and the frame header
+        tagged = topic && mqtt_compression_topic(client, topic, topic_len);
+    }
+    return tagged && mqtt_compress_is_frame((const uint8_t *)data, data_len, raw_len);
+}
+
+typedef struct {
+    esp_mqtt_client_handle_t client;
+    size_t offset;
+} mqtt_decompress_ctx_t;
+
+static esp_err_t mqtt_dispatch_decompressed(void *ctx, const uint8_t *data, size_t len)
+{
+    mqtt_decompress_ctx_t *decompress_ctx = ctx;
+    esp_mqtt_client_handle_t client = decompress_ctx->client;
+    client->event.data = (char *)data;
+    client->event.data_len = len;
+    client->event.current_data_offset = decompress_ctx->offset;
+    mqtt_dispatch_data(client);
+    decompress_ctx->offset += len;
+#ifndef CONFIG_MQTT_TOPIC_PRESENT_ALL_DATA_EVENTS
+    client->event.topic = NULL;
+    client->event.topic_len = 0;
+#endif
+    return ESP_OK;
+}
+
+/**
+ * @brief Tells the application that the DATA events of a compressed message ended before its total length
+ */
+static void mqtt_dispatch_decompress_error(esp_mqtt_client_handle_t client, size_t delivered)
+{
+    client->event.event_id = MQTT_EVENT_ERROR;
+    client->event.data = NULL;
+    client->event.data_len = 0;
+    client->event.current_data_offset = delivered;
+    client->event.topic = NULL;
+    client->event.topic_len = 0;
+    client->event.error_handle->error_type = MQTT_ERROR_TYPE_DECOMPRESSION_FAILED;
+    client->event.error_handle->connect_return_code = 0;
+    client->event.error_handle->esp_tls_stack_err = 0;
+    client->event.error_handle->esp_tls_last_esp_err = 0;
+    client->event.error_handle->esp_tls_cert_verify_flags = 0;
+    esp_mqtt_dispatch_event(client);
+}
+#endif
+
+#ifdef MQTT_REASSEMBLY
+static const esp_mqtt_data_storage_t *mqtt_data_storage_find(esp_mqtt_client_handle_t client, const char *topic, size_t topic_len)
+{
+    for (int i = 0; i < client->data_storage_count; ++i)
+    {
+        if (mqtt_topic_matches(client->data_storage[i].filter, topic, topic_len))
+        {
+            return &client->data_storage[i].storage;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads the rest of the payload right into the application buffer and delivers it in one event
+ */
+static esp_err_t deliver_publish_complete(esp_mqtt_client_handle_t client, const esp_mqtt_data_storage_t *storage,
+        char *buf, const char *msg_data, size_t msg_data_len, size_t remaining_len)
+{
+    if (msg_data_len > 0)
+    {
+        memcpy(buf, msg_data, msg_data_len);
+    }
+    size_t offset = msg_data_len;
+    while (remaining_len > 0)
+    {
+        int ret = esp_transport_read(client->transport, buf + offset, remaining_len, client->config->network_timeout_ms);
+        if (ret <= 0)
+        {
+            storage->release(storage->ctx, buf);
+            return esp_mqtt_handle_transport_read_error(ret, client, false) == 0 ? ESP_OK : ESP_FAIL;
         }
+        offset += ret;
+        remaining_len -= ret;
+    }
+    client->event.event_id = MQTT_EVENT_DATA;
+    client->event.data = buf;
+    client->event.data_len = offset;
+    client->event.current_data_offset = 0;
+    esp_mqtt_dispatch_event(client);
+    return ESP_OK;
+}
+#endif
+
+static esp_err_t deliver_publish(esp_mqtt_client_handle_t client)
+{
+    uint8_t *msg_buf = client->mqtt_state.in_buffer;
+    size_t msg_read_len = client->mqtt_state.in_buffer_read_len;
+    size_t msg_total_len = client->mqtt_state.message_length;
+    size_t msg_topic_len = msg_read_len;
+    size_t msg_data_len = msg_read_len;
+    size_t msg_data_offset = 0;
+    size_t saved_msg_topic_len = 0;
+    char *saved_msg_topic = NULL;
+    char *msg_topic = NULL;
+    char *msg_data = NULL;
+
+    // ESP_LOGI(TAG, "deliver_publish: enter, msg_total_len=%d, msg_read_len=%d",
+    //          (int)msg_total_len, (int)msg_read_len);
+    // ESP_LOG_BUFFER_HEX_LEVEL(TAG, msg_buf, msg_read_len, ESP_LOG_DEBUG);
+
+    if (MQTT_OPS(client)->get_publish_data(client, msg_buf, msg_read_len, &msg_topic, &msg_topic_len, &msg_data, &msg_data_len) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "%s: failed to parse the publish", __func__);
+        return ESP_FAIL;
     }
 
     ESP_LOGI(TAG, "deliver_publish: topic_len=%d, data_len=%d",
@@ -1361,19 +1959,65 @@ static esp_err_t deliver_publish(esp_mqtt_client_handle_t client)
     // }
 
     client->event.retain = mqtt_get_retain(msg_buf);
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+    client->event.msg_id = MQTT_OPS(client)->get_id(msg_buf, msg_read_len);
+    client->event.qos = mqtt_get_qos(msg_buf);
+    client->event.dup = mqtt_get_dup(msg_buf);
+    client->event.total_data_len = msg_data_len + msg_total_len - msg_read_len;
+#ifdef MQTT_REQUEST_RESPONSE
+    esp_mqtt5_request_match(client, msg_topic, msg_topic_len);
+#endif
+    bool echo = false;
+#ifdef MQTT_LOCAL_LOOPBACK
+    if (client->loopback && client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5)
     {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        client->event.msg_id = mqtt5_get_id(msg_buf, msg_read_len);
+        echo = mqtt_loopback_is_echo(client->loopback, msg_topic, msg_topic_len, msg_data, msg_data_len,
+                                     client->event.total_data_len, platform_tick_get_ms(), MQTT_LOOPBACK_DEDUP_WINDOW_MS);
+    }
+    if (echo)
+    {
+        ESP_LOGD(TAG, "Dropping the echo of msg_id=%d, delivered locally", client->event.msg_id);
+    }
 #endif
+
+#ifdef MQTT_COMPRESSION
+    mqtt_decompress_handle_t decompress = NULL;
+    mqtt_decompress_ctx_t decompress_ctx = { .client = client };
+    bool decompress_failed = false;
+    size_t raw_len = 0;
+    if (!echo && mqtt_payload_compressed(client, msg_topic, msg_topic_len, msg_data, msg_data_len, &raw_len))
+    {
+        decompress = mqtt_decompress_create(&client->alloc.transient);
+        ESP_MEM_CHECK(TAG, decompress, return ESP_ERR_NO_MEM);
+        client->event.total_data_len = raw_len;
     }
-    else
+#endif
+#ifdef MQTT_INBOUND_FLOW_CONTROL
+    if (!echo)
     {
-        client->event.msg_id = mqtt_get_id(msg_buf, msg_read_len);
+        --client->inbound.messages;
+        client->inbound.bytes -= client->event.total_data_len;
     }
-    client->event.qos = mqtt_get_qos(msg_buf);
-    client->event.dup = mqtt_get_dup(msg_buf);
-    client->event.total_data_len = msg_data_len + msg_total_len - msg_read_len;
+#endif
+
+#ifdef MQTT_REASSEMBLY
+    const esp_mqtt_data_storage_t *storage = echo ? NULL : mqtt_data_storage_find(client, msg_topic, msg_topic_len);
+#ifdef MQTT_COMPRESSION
+    storage = decompress ? NULL : storage;
+#endif
+#ifdef MQTT_REQUEST_RESPONSE
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5 && client->mqtt5_config->response_received)
+    {
+        storage = NULL;
+    }
+#endif
+    char *storage_buf = storage ? storage->alloc(storage->ctx, msg_topic, msg_topic_len, client->event.total_data_len) : NULL;
+    if (storage_buf)
+    {
+        client->event.topic = msg_topic;
+        client->event.topic_len = msg_topic_len;
+        return deliver_publish_complete(client, storage, storage_buf, msg_data, msg_data_len, msg_total_len - msg_read_len);
+    }
+#endif
 
     bool send_event = true;
     while (send_event)
@@ -1390,7 +2034,26 @@ static esp_err_t deliver_publish(esp_mqtt_client_handle_t client)
         ESP_LOGI(TAG, "deliver_publish: dispatching MQTT_EVENT_DATA, msg_id=%d, qos=%d, retain=%d, dup=%d",
                  client->event.msg_id, client->event.qos, client->event.retain, client->event.dup);
 
-        esp_mqtt_dispatch_event(client);
+        if (echo)
+        {
+            // only read to stay in sync with the stream
+        }
+#ifdef MQTT_COMPRESSION
+        else if (decompress)
+        {
+            if (!decompress_failed &&
+                    mqtt_decompress_feed(decompress, (const uint8_t *)msg_data, msg_data_len, mqtt_dispatch_decompressed, &decompress_ctx) != ESP_OK)
+            {
+                // keep reading the rest of the message to stay in sync with the stream
+                ESP_LOGE(TAG, "Failed to decompress payload, dropping the rest of the message");
+                decompress_failed = true;
+            }
+        }
+#endif
+        else
+        {
+            mqtt_dispatch_data(client);
+        }
         send_event = false;
 
         if (msg_read_len < msg_total_len)
@@ -1399,7 +2062,7 @@ static esp_err_t deliver_publish(esp_mqtt_client_handle_t client)
 #ifdef CONFIG_MQTT_TOPIC_PRESENT_ALL_DATA_EVENTS
             if (!saved_msg_topic)
             {
-                saved_msg_topic = strndup(msg_topic, msg_topic_len);
+                saved_msg_topic = mqtt_strndup(&client->alloc.transient, msg_topic, msg_topic_len);
                 ESP_MEM_CHECK(TAG, saved_msg_topic, return ESP_ERR_NO_MEM);
                 saved_msg_topic_len = msg_topic_len;
             }
@@ -1418,6 +2081,9 @@ static esp_err_t deliver_publish(esp_mqtt_client_handle_t client)
                                          client->config->network_timeout_ms);
             if (ret <= 0)
             {
+#ifdef MQTT_COMPRESSION
+                mqtt_decompress_destroy(decompress);
+#endif
                 return esp_mqtt_handle_transport_read_error(ret, client, false) == 0 ? ESP_OK : ESP_FAIL;
             }
 
@@ -1428,31 +2094,32 @@ static esp_err_t deliver_publish(esp_mqtt_client_handle_t client)
             msg_read_len += msg_data_len;
         }
     }
-    free(saved_msg_topic);
+    mqtt_free(&client->alloc.transient, saved_msg_topic);
+#ifdef MQTT_COMPRESSION
+    if (decompress && !decompress_failed && !mqtt_decompress_is_done(decompress))
+    {
+        ESP_LOGE(TAG, "Compressed payload truncated");
+        decompress_failed = true;
+    }
+    if (decompress_failed)
+    {
+        // the application already expects total_data_len bytes
+        mqtt_dispatch_decompress_error(client, decompress_ctx.offset);
+    }
+    mqtt_decompress_destroy(decompress);
+#endif
     ESP_LOGI(TAG, "deliver_publish: exit OK, total_data_len=%d", client->event.total_data_len);
 
     return ESP_OK;
 }
 
-static esp_err_t deliver_suback(esp_mqtt_client_handle_t client)
+static esp_err_t deliver_suback(esp_mqtt_client_handle_t client, int msg_id)
 {
     uint8_t *msg_buf = client->mqtt_state.in_buffer;
     size_t msg_data_len = client->mqtt_state.in_buffer_read_len;
     char *msg_data = NULL;
 
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-    {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        msg_data = mqtt5_get_suback_data(msg_buf, &msg_data_len, &client->event.property->user_property);
-#else
-        // SUBACK Using MQTT5 received but MQTT5 is disabled, This is unlikely to happen.
-        return ESP_FAIL;
-#endif
-    }
-    else
-    {
-        msg_data = mqtt_get_suback_data(msg_buf, &msg_data_len);
-    }
+    msg_data = MQTT_OPS(client)->get_suback_data(client, msg_buf, &msg_data_len);
     if (msg_data_len <= 0)
     {
         ESP_LOGE(TAG, "Failed to acquire suback data");
@@ -1472,6 +2139,18 @@ static esp_err_t deliver_suback(esp_mqtt_client_handle_t client)
             break;
         }
     }
+#ifdef MQTT_SESSION_PERSISTENCE
+    if (client->session)
+    {
+        mqtt_session_suback(client->session, msg_id, (uint8_t *)msg_data, msg_data_len);
+    }
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    if (client->loopback)
+    {
+        mqtt_loopback_suback(client->loopback, msg_id, (uint8_t *)msg_data, msg_data_len);
+    }
+#endif
     client->event.data_len = msg_data_len;
     client->event.total_data_len = msg_data_len;
     client->event.event_id = MQTT_EVENT_SUBSCRIBED;
@@ -1486,6 +2165,13 @@ static esp_err_t deliver_suback(esp_mqtt_client_handle_t client)
 // Return false when message is not found, making the received counterpart invalid.
 static bool remove_initiator_message(esp_mqtt_client_handle_t client, int msg_type, int msg_id)
 {
+#ifdef MQTT_OFFLINE_LOG
+    if (client->offline_log && msg_type == MQTT_MSG_TYPE_PUBLISH && mqtt_offline_log_ack(client->offline_log, msg_id))
+    {
+        ESP_LOGD(TAG, "Acknowledged offline log message id=%d", msg_id);
+        return true;
+    }
+#endif
     if (outbox_delete(client->outbox, msg_id, msg_type) == ESP_OK)
     {
         ESP_LOGD(TAG, "Removed pending_id=%d", msg_id);
@@ -1512,6 +2198,52 @@ static outbox_item_handle_t mqtt_enqueue(esp_mqtt_client_handle_t client, uint8_
     return outbox_enqueue(client->outbox, &msg, platform_tick_get_ms());
 }
 
+/**
+ * @brief Grows the input buffer to fit a message of total_len bytes, up to the configured maximum
+ */
+static bool mqtt_in_buffer_grow(esp_mqtt_client_handle_t client, size_t total_len)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    if (total_len > (size_t)state->in_buffer_max_size)
+    {
+        return false;
+    }
+    // double the size at least, so that a few growing messages don't reallocate each time
+    size_t new_len = 2 * state->in_buffer_length;
+    new_len = new_len < total_len ? total_len : new_len;
+    new_len = new_len > (size_t)state->in_buffer_max_size ? (size_t)state->in_buffer_max_size : new_len;
+    uint8_t *buffer = mqtt_realloc(&client->alloc.state, state->in_buffer, new_len);
+    if (buffer == NULL)
+    {
+        ESP_LOGW(TAG, "Failed to grow the input buffer to %" NEWLIB_NANO_COMPAT_FORMAT, NEWLIB_NANO_COMPAT_CAST(new_len));
+        return false;
+    }
+    ESP_LOGD(TAG, "Input buffer grown to %" NEWLIB_NANO_COMPAT_FORMAT, NEWLIB_NANO_COMPAT_CAST(new_len));
+    state->in_buffer = buffer;
+    state->in_buffer_length = new_len;
+    return true;
+}
+
+/**
+ * @brief Shrinks a grown input buffer back to its configured size once no large message came for a while
+ */
+static void mqtt_in_buffer_shrink(esp_mqtt_client_handle_t client)
+{
+    mqtt_state_t *state = &client->mqtt_state;
+    if (state->in_buffer_length <= state->in_buffer_size || state->in_buffer_read_len != 0 ||
+            !has_timed_out(state->in_buffer_tick, MQTT_IN_BUFFER_SHRINK_TIMEOUT_MS))
+    {
+        return;
+    }
+    uint8_t *buffer = mqtt_realloc(&client->alloc.state, state->in_buffer, state->in_buffer_size);
+    if (buffer)
+    {
+        ESP_LOGD(TAG, "Input buffer shrunk to %d", state->in_buffer_size);
+        state->in_buffer = buffer;
+        state->in_buffer_length = state->in_buffer_size;
+    }
+}
+
 /*
  * Returns:
  *     -2 in case of failure or EOF (clean connection closure)
@@ -1579,6 +2311,14 @@ static int mqtt_message_receive(esp_mqtt_client_handle_t client, int read_poll_t
     total_len = mqtt_get_total_length(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len, &fixed_header_len);
     ESP_LOGD(TAG, "%s: total message length: %d (already read: %" NEWLIB_NANO_COMPAT_FORMAT ")", __func__, total_len, NEWLIB_NANO_COMPAT_CAST(client->mqtt_state.in_buffer_read_len));
     client->mqtt_state.message_length = total_len;
+    if (total_len > client->mqtt_state.in_buffer_size)
+    {
+        client->mqtt_state.in_buffer_tick = platform_tick_get_ms();
+    }
+    if (client->mqtt_state.in_buffer_length < total_len && mqtt_in_buffer_grow(client, total_len))
+    {
+        buf = client->mqtt_state.in_buffer + client->mqtt_state.in_buffer_read_len;
+    }
     if (client->mqtt_state.in_buffer_length < total_len)
     {
         if (mqtt_get_type(client->mqtt_state.in_buffer) == MQTT_MSG_TYPE_PUBLISH)
@@ -1685,16 +2425,7 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
     // If the message was valid, get the type, quality of service and id of the message
     msg_type = mqtt_get_type(client->mqtt_state.in_buffer);
     msg_qos = mqtt_get_qos(client->mqtt_state.in_buffer);
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-    {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        msg_id = mqtt5_get_id(client->mqtt_state.in_buffer, read_len);
-#endif
-    }
-    else
-    {
-        msg_id = mqtt_get_id(client->mqtt_state.in_buffer, read_len);
-    }
+    msg_id = MQTT_OPS(client)->get_id(client->mqtt_state.in_buffer, read_len);
 
     ESP_LOGD(TAG, "mqtt_process_receive msg_type=%d, msg_id=%d", msg_type, msg_id);
 
@@ -1708,7 +2439,7 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
 #endif
             ESP_LOGD(TAG, "deliver_suback, message_length_read=%" NEWLIB_NANO_COMPAT_FORMAT ", message_length=%" NEWLIB_NANO_COMPAT_FORMAT,
                      NEWLIB_NANO_COMPAT_CAST(client->mqtt_state.in_buffer_read_len), NEWLIB_NANO_COMPAT_CAST(client->mqtt_state.message_length));
-            if (deliver_suback(client) != ESP_OK)
+            if (deliver_suback(client, msg_id) != ESP_OK)
             {
                 ESP_LOGE(TAG, "Failed to deliver suback message id=%d", msg_id);
                 return ESP_FAIL;
@@ -1720,6 +2451,18 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
         {
 #ifdef CONFIG_MQTT_PROTOCOL_5
             esp_mqtt5_parse_unsuback(client);
+#endif
+#ifdef MQTT_SESSION_PERSISTENCE
+            if (client->session)
+            {
+                mqtt_session_unsuback(client->session, msg_id);
+            }
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+            if (client->loopback)
+            {
+                mqtt_loopback_unsuback(client->loopback, msg_id);
+            }
 #endif
             ESP_LOGD(TAG, "UnSubscribe successful");
             client->event.event_id = MQTT_EVENT_UNSUBSCRIBED;
@@ -1737,29 +2480,11 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
         {
             if (msg_qos == 1)
             {
-                if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-                {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-                    mqtt5_msg_puback(&client->mqtt_state.connection, msg_id);
-#endif
-                }
-                else
-                {
-                    mqtt_msg_puback(&client->mqtt_state.connection, msg_id);
-                }
+                MQTT_OPS(client)->puback(&client->mqtt_state.connection, msg_id);
             }
             else if (msg_qos == 2)
             {
-                if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-                {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-                    mqtt5_msg_pubrec(&client->mqtt_state.connection, msg_id);
-#endif
-                }
-                else
-                {
-                    mqtt_msg_pubrec(&client->mqtt_state.connection, msg_id);
-                }
+                MQTT_OPS(client)->pubrec(&client->mqtt_state.connection, msg_id);
             }
             if (client->mqtt_state.connection.outbound_message.length == 0)
             {
@@ -1777,12 +2502,10 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
         }
         break;
     case MQTT_MSG_TYPE_PUBACK:
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+        if (MQTT_OPS(client)->publish_completed)
         {
-            esp_mqtt5_decrement_packet_counter(client);
+            MQTT_OPS(client)->publish_completed(client);
         }
-#endif
         if (remove_initiator_message(client, MQTT_MSG_TYPE_PUBLISH, msg_id))
         {
             ESP_LOGD(TAG, "received MQTT_MSG_TYPE_PUBACK, finish QoS1 publish");
@@ -1795,39 +2518,33 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
         break;
     case MQTT_MSG_TYPE_PUBREC:
         ESP_LOGD(TAG, "received MQTT_MSG_TYPE_PUBREC");
-        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-        {
 #ifdef CONFIG_MQTT_PROTOCOL_5
-            ESP_LOGI(TAG, "MQTT_MSG_TYPE_PUBREC return code is %d", mqtt5_msg_get_reason_code(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len));
-            mqtt5_msg_pubrel(&client->mqtt_state.connection, msg_id);
-#endif
-        }
-        else
+        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
         {
-            mqtt_msg_pubrel(&client->mqtt_state.connection, msg_id);
+            ESP_LOGD(TAG, "MQTT_MSG_TYPE_PUBREC return code is %d", mqtt5_msg_get_reason_code(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len));
         }
+#endif
+        MQTT_OPS(client)->pubrel(&client->mqtt_state.connection, msg_id);
         if (client->mqtt_state.connection.outbound_message.length == 0)
         {
             ESP_LOGE(TAG, "Publish response message PUBREL cannot be created");
             return ESP_FAIL;
         }
 
-        outbox_set_pending(client->outbox, msg_id, ACKNOWLEDGED);
+        // the broker owns the message now, only its packet id is kept until PUBCOMP
+        outbox_delete_item(client->outbox, outbox_get(client->outbox, msg_id));
+        mqtt_qos2_pubrel_sent(client->qos2, msg_id, platform_tick_get_ms());
         esp_mqtt_write(client);
         break;
     case MQTT_MSG_TYPE_PUBREL:
         ESP_LOGD(TAG, "received MQTT_MSG_TYPE_PUBREL");
-        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-        {
 #ifdef CONFIG_MQTT_PROTOCOL_5
-            ESP_LOGI(TAG, "MQTT_MSG_TYPE_PUBREL return code is %d", mqtt5_msg_get_reason_code(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len));
-            mqtt5_msg_pubcomp(&client->mqtt_state.connection, msg_id);
-#endif
-        }
-        else
+        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
         {
-            mqtt_msg_pubcomp(&client->mqtt_state.connection, msg_id);
+            ESP_LOGD(TAG, "MQTT_MSG_TYPE_PUBREL return code is %d", mqtt5_msg_get_reason_code(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len));
         }
+#endif
+        MQTT_OPS(client)->pubcomp(&client->mqtt_state.connection, msg_id);
         if (client->mqtt_state.connection.outbound_message.length == 0)
         {
             ESP_LOGE(TAG, "Publish response message PUBCOMP cannot be created");
@@ -1838,12 +2555,11 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
         break;
     case MQTT_MSG_TYPE_PUBCOMP:
         ESP_LOGD(TAG, "received MQTT_MSG_TYPE_PUBCOMP");
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+        if (MQTT_OPS(client)->publish_completed)
         {
-            esp_mqtt5_decrement_packet_counter(client);
+            MQTT_OPS(client)->publish_completed(client);
         }
-#endif
+        mqtt_qos2_pubcomp(client->qos2, msg_id);
         if (remove_initiator_message(client, MQTT_MSG_TYPE_PUBLISH, msg_id))
         {
             ESP_LOGD(TAG, "Receive MQTT_MSG_TYPE_PUBCOMP, finish QoS2 publish");
@@ -1856,6 +2572,12 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
         break;
     case MQTT_MSG_TYPE_PINGRESP:
         ESP_LOGD(TAG, "MQTT_MSG_TYPE_PINGRESP");
+#ifdef MQTT_BROKER_FAILOVER
+        if (client->failover && client->wait_for_ping_resp)
+        {
+            mqtt_failover_ping(client->failover, platform_tick_get_ms() - client->ping_tick);
+        }
+#endif
         client->wait_for_ping_resp = false;
         /* It is the responsibility of the Client to ensure that the interval between Control Packets
          * being sent does not exceed the Keep Alive value. In the absence of sending any other Control
@@ -1883,44 +2605,256 @@ static esp_err_t mqtt_process_receive(esp_mqtt_client_handle_t client)
     return ESP_OK;
 }
 
-static esp_err_t mqtt_resend_queued(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
+static void mqtt_delete_expired_messages(esp_mqtt_client_handle_t client)
 {
-    // decode queued data
-    client->mqtt_state.connection.outbound_message.data = outbox_item_get_data(item, &client->mqtt_state.connection.outbound_message.length, &client->mqtt_state.pending_msg_id,
-                                                                               &client->mqtt_state.pending_msg_type, &client->mqtt_state.pending_publish_qos);
-    // set duplicate flag for QoS-1 and QoS-2 messages
-    if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_publish_qos > 0 && (outbox_item_get_pending(item) == TRANSMITTED))
-    {
-        mqtt_set_dup(client->mqtt_state.connection.outbound_message.data);
-        ESP_LOGD(TAG, "Sending Duplicated QoS%d message with id=%d", client->mqtt_state.pending_publish_qos, client->mqtt_state.pending_msg_id);
-    }
-
-    // try to resend the data
-    if (esp_mqtt_write(client) != ESP_OK)
+    // Delete message after OUTBOX_EXPIRED_TIMEOUT_MS milliseconds or past its own expiry
+#if MQTT_REPORT_DELETED_MESSAGES
+    // also report the deleted items as MQTT_EVENT_DELETED events if enabled
+    int msg_id = 0;
+    while ((msg_id = outbox_delete_single_expired(client->outbox, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS)) >= 0)
     {
-        ESP_LOGE(TAG, "Error to resend data ");
-        esp_mqtt_abort_connection(client);
-        return ESP_FAIL;
+        client->event.event_id = MQTT_EVENT_DELETED;
+        client->event.msg_id = msg_id;
+        if (esp_mqtt_dispatch_event(client) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to post event on deleting message id=%d", msg_id);
+        }
     }
+#else
+    outbox_delete_expired(client->outbox, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS);
+#endif
+    mqtt_qos2_delete_expired(client->qos2, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS);
+}
 
-    return ESP_OK;
+#ifdef MQTT_RATE_LIMIT
+/**
+ * @brief Finds the topic and the counted length of a queued publish, returns false for other messages
+ */
+static bool mqtt_rate_limit_item(outbox_item_handle_t item, const char **topic, size_t *topic_len, size_t *len)
+{
+    size_t data_len = 0;
+    int msg_type = 0;
+    uint8_t *data = outbox_item_get_data(item, &data_len, NULL, &msg_type, NULL);
+    if (msg_type != MQTT_MSG_TYPE_PUBLISH)
+    {
+        return false;
+    }
+    *topic_len = data_len;
+    *topic = mqtt_get_publish_topic(data, topic_len);
+    size_t payload_len = data_len;
+    size_t shared_len = 0;
+    outbox_item_get_shared(item, &shared_len);
+    // with MQTT5 the publish properties are counted as payload
+    mqtt_get_publish_data(data, &payload_len);
+    *len = payload_len + shared_len;
+    return true;
 }
 
-static esp_err_t mqtt_resend_pubrel(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
+/**
+ * @brief Returns false if a queued publish has to stay in the outbox for now, the wait until its tokens are refilled is kept for the poll
+ */
+static bool mqtt_rate_limit_release(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
 {
-    client->mqtt_state.connection.outbound_message.data = outbox_item_get_data(item, &client->mqtt_state.connection.outbound_message.length, &client->mqtt_state.pending_msg_id,
-                                                                               &client->mqtt_state.pending_msg_type, &client->mqtt_state.pending_publish_qos);
-    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+    const char *topic = NULL;
+    size_t topic_len = 0;
+    size_t len = 0;
+    if (client->rate_limit == NULL || !mqtt_rate_limit_item(item, &topic, &topic_len, &len))
     {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-        ESP_LOGI(TAG, "MQTT_MSG_TYPE_PUBREC return code is %d", mqtt5_msg_get_reason_code(client->mqtt_state.in_buffer, client->mqtt_state.in_buffer_read_len));
-        mqtt5_msg_pubrel(&client->mqtt_state.connection, client->mqtt_state.pending_msg_id);
-#endif
+        return true;
     }
-    else
+    uint64_t now = platform_tick_get_ms();
+    if (mqtt_rate_limit_check(client->rate_limit, topic, topic_len, now))
     {
-        mqtt_msg_pubrel(&client->mqtt_state.connection, client->mqtt_state.pending_msg_id);
+        return true;
     }
+    client->rate_limit_wait_ms = mqtt_rate_limit_wait_ms(client->rate_limit, topic, topic_len, now);
+    return false;
+}
+
+/**
+ * @brief Takes the tokens of a queued publish once it's written, so that a failed send doesn't cost any
+ */
+static void mqtt_rate_limit_sent(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
+{
+    const char *topic = NULL;
+    size_t topic_len = 0;
+    size_t len = 0;
+    if (client->rate_limit && mqtt_rate_limit_item(item, &topic, &topic_len, &len))
+    {
+        mqtt_rate_limit_consume(client->rate_limit, topic, topic_len, len, platform_tick_get_ms());
+    }
+}
+#endif
+
+static esp_err_t mqtt_resend_queued(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
+{
+    // decode queued data
+    client->mqtt_state.connection.outbound_message.data = outbox_item_get_data(item, &client->mqtt_state.connection.outbound_message.length, &client->mqtt_state.pending_msg_id,
+                                                                               &client->mqtt_state.pending_msg_type, &client->mqtt_state.pending_publish_qos);
+    outbox_tick_t expiry = outbox_item_get_expiry(item);
+    if (expiry)
+    {
+        outbox_tick_t now = platform_tick_get_ms();
+        if (now >= expiry)
+        {
+            ESP_LOGW(TAG, "Dropping expired message with id=%d", client->mqtt_state.pending_msg_id);
+            mqtt_delete_expired_messages(client);
+            return ESP_ERR_TIMEOUT;
+        }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+        {
+            // the receiver gets the remaining lifetime, not the original one
+            mqtt5_msg_set_message_expiry(client->mqtt_state.connection.outbound_message.data,
+                                         client->mqtt_state.connection.outbound_message.length, (expiry - now + 999) / 1000);
+        }
+#endif
+    }
+    // set duplicate flag for QoS-1 and QoS-2 messages
+    if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_publish_qos > 0 && (outbox_item_get_pending(item) == TRANSMITTED))
+    {
+        mqtt_set_dup(client->mqtt_state.connection.outbound_message.data);
+        ESP_LOGD(TAG, "Sending Duplicated QoS%d message with id=%d", client->mqtt_state.pending_publish_qos, client->mqtt_state.pending_msg_id);
+    }
+
+    // try to resend the data, a shared payload follows the header of this client
+    size_t shared_len = 0;
+    const uint8_t *shared = outbox_item_get_shared(item, &shared_len);
+    esp_err_t err;
+    if (shared)
+    {
+        mqtt_message_t *outbound = &client->mqtt_state.connection.outbound_message;
+        outbound->fragmented_msg_data_offset = outbound->length;
+        outbound->fragmented_msg_total_length = outbound->length + shared_len;
+        err = esp_mqtt_write_publish(client, (const char *)shared, shared_len);
+    }
+    else
+    {
+        err = esp_mqtt_write(client);
+    }
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Error to resend data ");
+        esp_mqtt_abort_connection(client);
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * @brief Records a QoS2 publish (re)transmitted with msg_id in the in-flight table
+ */
+static void mqtt_track_qos2(esp_mqtt_client_handle_t client, int msg_id, int qos)
+{
+    if (qos == 2)
+    {
+        mqtt_qos2_publish_sent(client->qos2, msg_id, platform_tick_get_ms());
+    }
+}
+
+/**
+ * @brief Returns true if the queued message is a QoS2 publish and too many are in flight already
+ */
+static bool mqtt_queued_qos2_blocked(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
+{
+    size_t len = 0;
+    int msg_type = 0;
+    int qos = 0;
+    outbox_item_get_data(item, &len, NULL, &msg_type, &qos);
+    return msg_type == MQTT_MSG_TYPE_PUBLISH && qos == 2 && mqtt_qos2_is_full(client->qos2);
+}
+
+/**
+ * @brief Updates the outbox once a queued message has been sent by mqtt_resend_queued()
+ */
+static void mqtt_queued_sent(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
+{
+    if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_publish_qos == 0)
+    {
+        // delete all qos0 publish messages once we process them
+        if (outbox_delete_item(client->outbox, item) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to remove queued qos0 message from the outbox");
+        }
+    }
+    if (client->mqtt_state.pending_publish_qos > 0)
+    {
+        outbox_set_pending(client->outbox, client->mqtt_state.pending_msg_id, TRANSMITTED);
+        mqtt_track_qos2(client, client->mqtt_state.pending_msg_id, client->mqtt_state.pending_publish_qos);
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+        {
+            esp_mqtt5_increment_packet_counter(client);
+        }
+#endif
+    }
+}
+
+/**
+ * @brief Dequeues the oldest queued message if it may be sent now, NULL if there is none or it's held back
+ */
+static outbox_item_handle_t mqtt_dequeue_sendable(esp_mqtt_client_handle_t client)
+{
+#ifdef MQTT_RATE_LIMIT
+    client->rate_limit_wait_ms = 0;
+#endif
+    outbox_item_handle_t item = outbox_dequeue(client->outbox, QUEUED, NULL);
+    if (item == NULL)
+    {
+        return NULL;
+    }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (esp_mqtt5_client_flow_blocked(client) && mqtt5_publish_needs_ack(item))
+    {
+        // the queue keeps its order, waiting for acknowledgements
+        return NULL;
+    }
+#endif
+    if (mqtt_queued_qos2_blocked(client, item))
+    {
+        // held until a PUBCOMP frees an entry of the in-flight table
+        return NULL;
+    }
+#ifdef MQTT_RATE_LIMIT
+    if (!mqtt_rate_limit_release(client, item))
+    {
+        // held back until the buckets refill, retransmissions are not limited
+        return NULL;
+    }
+#endif
+    return item;
+}
+
+/**
+ * @brief Sends a queued message, followed by the next ones as long as the rate limiter has tokens for them
+ */
+static void mqtt_send_queued(esp_mqtt_client_handle_t client, outbox_item_handle_t item)
+{
+    while (item && mqtt_resend_queued(client, item) == ESP_OK)
+    {
+#ifdef MQTT_RATE_LIMIT
+        mqtt_rate_limit_sent(client, item);
+#endif
+        mqtt_queued_sent(client, item);
+        item = NULL;
+#ifdef MQTT_RATE_LIMIT
+        if (client->rate_limit && client->state == MQTT_STATE_CONNECTED)
+        {
+            // a backlog held back by the limiter drains at its rate rather than one message per poll
+            item = mqtt_dequeue_sendable(client);
+        }
+#endif
+    }
+}
+
+/**
+ * @brief Sends again the PUBREL of a QoS2 publish, it's built from the packet id alone
+ */
+static esp_err_t mqtt_resend_pubrel(uint16_t msg_id, void *ctx)
+{
+    esp_mqtt_client_handle_t client = ctx;
+    MQTT_OPS(client)->pubrel(&client->mqtt_state.connection, msg_id);
     if (client->mqtt_state.connection.outbound_message.length == 0)
     {
         ESP_LOGE(TAG, "Publish response message PUBREL cannot be created");
@@ -1937,37 +2871,131 @@ static esp_err_t mqtt_resend_pubrel(esp_mqtt_client_handle_t client, outbox_item
     return ESP_OK;
 }
 
-static void mqtt_delete_expired_messages(esp_mqtt_client_handle_t client)
+
+#ifdef MQTT_OFFLINE_LOG
+/**
+ * @brief Replays messages stored in the offline log while disconnected, one batch at a time
+ */
+static esp_err_t mqtt_replay_offline_log(esp_mqtt_client_handle_t client)
 {
-    // Delete message after OUTBOX_EXPIRED_TIMEOUT_MS milliseconds
-#if MQTT_REPORT_DELETED_MESSAGES
-    // also report the deleted items as MQTT_EVENT_DELETED events if enabled
-    int msg_id = 0;
-    while ((msg_id = outbox_delete_single_expired(client->outbox, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS)) >= 0)
+    mqtt_offline_log_record_t record;
+    while (mqtt_offline_log_read(client->offline_log, &record) == ESP_OK)
     {
-        client->event.event_id = MQTT_EVENT_DELETED;
-        client->event.msg_id = msg_id;
-        if (esp_mqtt_dispatch_event(client) != ESP_OK)
+#ifdef MQTT_RATE_LIMIT
+        if (client->rate_limit)
         {
-            ESP_LOGE(TAG, "Failed to post event on deleting message id=%d", msg_id);
+            // replayed messages are only held by the client limit, to not reorder the log
+            mqtt_rate_limit_consume(client->rate_limit, record.topic, strlen(record.topic), record.data_len, platform_tick_get_ms());
+        }
+#endif
+        const char *data = record.data;
+        int data_len = record.data_len;
+#ifdef MQTT_COMPRESSION
+        uint8_t *frame = mqtt_compress_payload(client, record.topic, &data, &data_len);
+        client->payload_compressed = frame != NULL;
+#endif
+        int msg_id = make_publish(client, record.topic, data, data_len, record.qos, record.retain);
+        esp_err_t err = msg_id < 0 ? ESP_OK : esp_mqtt_write_publish(client, data, data_len);
+#ifdef MQTT_COMPRESSION
+        client->payload_compressed = false;
+        mqtt_free(&client->alloc.transient, frame);
+#endif
+        if (msg_id < 0)
+        {
+            // cannot be ever sent, skip it so it doesn't block the rest of the log
+            ESP_LOGE(TAG, "Dropping message from the offline log, topic=%s", record.topic);
+            mqtt_offline_log_sent(client->offline_log, 0);
+            continue;
+        }
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Error to replay offline log message");
+            esp_mqtt_abort_connection(client);
+            return ESP_FAIL;
+        }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        if (record.qos > 0 && client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+        {
+            esp_mqtt5_increment_packet_counter(client);
+        }
+#endif
+        mqtt_offline_log_sent(client->offline_log, msg_id);
+        mqtt_track_qos2(client, msg_id, record.qos);
+        if (mqtt_qos2_is_full(client->qos2))
+        {
+            break;
+        }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        if (esp_mqtt5_client_flow_blocked(client))
+        {
+            break;
         }
+#endif
+#ifdef MQTT_RATE_LIMIT
+        if (client->rate_limit && !mqtt_rate_limit_ready(client->rate_limit, platform_tick_get_ms()))
+        {
+            break;
+        }
+#endif
     }
-#else
-    outbox_delete_expired(client->outbox, platform_tick_get_ms(), OUTBOX_EXPIRED_TIMEOUT_MS);
+    return ESP_OK;
+}
+#endif
+
+#ifdef MQTT_SESSION_PERSISTENCE
+static esp_err_t mqtt_save_session(esp_mqtt_client_handle_t client)
+{
+    uint16_t last_message_id = 0;
+#if MQTT_MSG_ID_INCREMENTAL
+    last_message_id = client->mqtt_state.connection.last_message_id;
 #endif
+    client->session_save_tick = platform_tick_get_ms();
+    return mqtt_session_save(client->session, client->outbox, client->qos2, last_message_id);
+}
+
+/**
+ * @brief Subscribes again to the topics of the session if the broker didn't keep it
+ */
+static void mqtt_resubscribe_session(esp_mqtt_client_handle_t client)
+{
+    esp_mqtt_topic_t topic_list[MQTT_SESSION_RESUBSCRIBE_TOPICS];
+    int offset = 0;
+    int count;
+    while ((count = mqtt_session_get_subscriptions(client->session, topic_list, MQTT_SESSION_RESUBSCRIBE_TOPICS, offset)) > 0)
+    {
+        if (esp_mqtt_client_subscribe_multiple(client, topic_list, count) < 0)
+        {
+            ESP_LOGE(TAG, "Failed to resubscribe session topics");
+            return;
+        }
+        offset += count;
+    }
+    if (offset > 0)
+    {
+        ESP_LOGI(TAG, "Session not present on the broker, resubscribed %d topics", offset);
+    }
 }
+#endif
 
 /**
  * @brief When using multiple queued item, we'd like to reduce the poll timeout to proceed with event loop exacution
  */
 static inline int max_poll_timeout(esp_mqtt_client_handle_t client, int max_timeout)
 {
-    return
+#ifdef MQTT_RATE_LIMIT
+    if (client->state == MQTT_STATE_CONNECTED && client->rate_limit_wait_ms > 0 && client->rate_limit_wait_ms < (uint32_t)max_timeout)
+    {
+        // wake up once the rate limited message at the head of the outbox may be sent
+        max_timeout = (int)client->rate_limit_wait_ms;
+    }
+#endif
 #if MQTT_EVENT_QUEUE_SIZE > 1
-        atomic_load(&client->queued_events) > 0 ? 10 : max_timeout;
-#else
-        max_timeout;
+    if (atomic_load(&client->queued_events) > 0 && max_timeout > 10)
+    {
+        max_timeout = 10;
+    }
 #endif
+    return max_timeout;
 }
 
 static inline void run_event_loop(esp_mqtt_client_handle_t client)
@@ -1987,6 +3015,40 @@ static inline void run_event_loop(esp_mqtt_client_handle_t client)
     }
 }
 
+#ifdef MQTT_BROKER_FAILOVER
+/**
+ * @brief Points the client to the best ranked broker endpoint before connecting
+ */
+static void mqtt_failover_use_endpoint(esp_mqtt_client_handle_t client)
+{
+    client->connect_tick = platform_tick_get_ms();
+    const char *uri = mqtt_failover_uri(client->failover, mqtt_failover_select(client->failover, client->connect_tick));
+    // the port of the uri, the default one of its scheme otherwise
+    client->config->port = 0;
+    if (esp_mqtt_client_set_uri(client, uri) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to use broker endpoint %s", uri);
+        return;
+    }
+    ESP_LOGI(TAG, "Connecting to broker endpoint %s", uri);
+}
+#endif
+
+/**
+ * @brief Timeout of the transport connection, shorter if another broker endpoint could be tried instead
+ */
+static int mqtt_connect_timeout(esp_mqtt_client_handle_t client)
+{
+#ifdef MQTT_BROKER_FAILOVER
+    if (client->failover && client->config->failover_connect_timeout_ms > 0 &&
+            mqtt_failover_ready(client->failover, platform_tick_get_ms()) > 1)
+    {
+        return client->config->failover_connect_timeout_ms;
+    }
+#endif
+    return client->config->network_timeout_ms;
+}
+
 static void esp_mqtt_task(void *pv)
 {
     esp_mqtt_client_handle_t client = (esp_mqtt_client_handle_t)pv;
@@ -2002,6 +3064,22 @@ static void esp_mqtt_task(void *pv)
         run_event_loop(client);
         // delete long pending messages
         mqtt_delete_expired_messages(client);
+#ifdef MQTT_REQUEST_RESPONSE
+        esp_mqtt5_request_expire(client);
+#endif
+#ifdef MQTT_BATCHING
+        if (client->state == MQTT_STATE_CONNECTED)
+        {
+            mqtt_batcher_flush_expired(client->batcher, platform_tick_get_ms());
+        }
+#endif
+        mqtt_in_buffer_shrink(client);
+#ifdef MQTT_SESSION_PERSISTENCE
+        if (client->session && has_timed_out(client->session_save_tick, MQTT_SESSION_SAVE_INTERVAL_MS))
+        {
+            mqtt_save_session(client);
+        }
+#endif
         mqtt_client_state_t state = client->state;
         switch (state)
         {
@@ -2009,6 +3087,12 @@ static void esp_mqtt_task(void *pv)
             break;
         case MQTT_STATE_INIT:
             xEventGroupClearBits(client->status_bits, RECONNECT_BIT | DISCONNECT_BIT);
+#ifdef MQTT_BROKER_FAILOVER
+            if (client->failover)
+            {
+                mqtt_failover_use_endpoint(client);
+            }
+#endif
 
             client->transport = client->config->transport;
             if (!client->transport)
@@ -2051,7 +3135,7 @@ static void esp_mqtt_task(void *pv)
             if (esp_transport_connect(client->transport,
                                       client->config->host,
                                       client->config->port,
-                                      client->config->network_timeout_ms) < 0)
+                                      mqtt_connect_timeout(client)) < 0)
             {
                 ESP_LOGE(TAG, "Error transport connect");
                 esp_mqtt_client_dispatch_transport_error(client);
@@ -2071,6 +3155,28 @@ static void esp_mqtt_task(void *pv)
                 client->event.session_present = mqtt_get_connect_session_present(client->mqtt_state.in_buffer);
             }
             client->state = MQTT_STATE_CONNECTED;
+#ifdef MQTT_BROKER_FAILOVER
+            if (client->failover)
+            {
+                mqtt_failover_connected(client->failover, platform_tick_get_ms() - client->connect_tick);
+            }
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+            if (client->loopback && !client->event.session_present)
+            {
+                // the subscriptions are gone, the ones made again are recorded again
+                mqtt_loopback_clear_subscriptions(client->loopback);
+            }
+#endif
+#ifdef MQTT_SESSION_PERSISTENCE
+            if (client->session && !client->event.session_present)
+            {
+                mqtt_resubscribe_session(client);
+            }
+#endif
+#ifdef MQTT_REQUEST_RESPONSE
+            esp_mqtt5_request_resubscribe(client);
+#endif
             esp_mqtt_dispatch_event_with_msgid(client);
             client->refresh_connection_tick = platform_tick_get_ms();
             client->keepalive_tick = platform_tick_get_ms();
@@ -2081,11 +3187,11 @@ static void esp_mqtt_task(void *pv)
             if (xEventGroupWaitBits(client->status_bits, DISCONNECT_BIT, true, true, 0) & DISCONNECT_BIT)
             {
                 send_disconnect_msg(client); // ignore error, if clean disconnect fails, just abort the connection
-                esp_mqtt_abort_connection(client);
+                esp_mqtt_close_connection(client, false);
                 break;
             }
-            // receive and process data
-            if (mqtt_process_receive(client) == ESP_FAIL)
+            // receive and process data, unless the application is out of credit
+            if (!mqtt_inbound_paused(client) && mqtt_process_receive(client) == ESP_FAIL)
             {
                 esp_mqtt_abort_connection(client);
                 break;
@@ -2098,32 +3204,28 @@ static void esp_mqtt_task(void *pv)
             }
 
             // resend all non-transmitted messages first
-            outbox_item_handle_t item = outbox_dequeue(client->outbox, QUEUED, NULL);
+            outbox_item_handle_t item = mqtt_dequeue_sendable(client);
             if (item)
             {
-                if (mqtt_resend_queued(client, item) == ESP_OK)
-                {
-                    if (client->mqtt_state.pending_msg_type == MQTT_MSG_TYPE_PUBLISH && client->mqtt_state.pending_publish_qos == 0)
-                    {
-                        // delete all qos0 publish messages once we process them
-                        if (outbox_delete_item(client->outbox, item) != ESP_OK)
-                        {
-                            ESP_LOGE(TAG, "Failed to remove queued qos0 message from the outbox");
-                        }
-                    }
-                    if (client->mqtt_state.pending_publish_qos > 0)
-                    {
-                        outbox_set_pending(client->outbox, client->mqtt_state.pending_msg_id, TRANSMITTED);
+                mqtt_send_queued(client, item);
+                // resend other "transmitted" messages after 1s
+            }
+#ifdef MQTT_OFFLINE_LOG
+            else if (client->offline_log && mqtt_offline_log_can_replay(client->offline_log) && !mqtt_qos2_is_full(client->qos2)
+#ifdef MQTT_RATE_LIMIT
+                     && client->rate_limit_wait_ms == 0 && (client->rate_limit == NULL || mqtt_rate_limit_ready(client->rate_limit, platform_tick_get_ms()))
+#endif
 #ifdef CONFIG_MQTT_PROTOCOL_5
-                        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-                        {
-                            esp_mqtt5_increment_packet_counter(client);
-                        }
+                     && !esp_mqtt5_client_flow_blocked(client)
 #endif
-                    }
+                    )
+            {
+                if (mqtt_replay_offline_log(client) != ESP_OK)
+                {
+                    break;
                 }
-                // resend other "transmitted" messages after 1s
             }
+#endif
             else if (has_timed_out(last_retransmit, client->config->message_retransmit_timeout))
             {
                 last_retransmit = platform_tick_get_ms();
@@ -2132,6 +3234,7 @@ static void esp_mqtt_task(void *pv)
                 {
                     if (mqtt_resend_queued(client, item) == ESP_OK)
                     {
+                        mqtt_track_qos2(client, client->mqtt_state.pending_msg_id, client->mqtt_state.pending_publish_qos);
 #ifdef CONFIG_MQTT_PROTOCOL_5
                         if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
                         {
@@ -2140,19 +3243,9 @@ static void esp_mqtt_task(void *pv)
 #endif
                     }
                 }
-                item = outbox_dequeue(client->outbox, ACKNOWLEDGED, &msg_tick);
-                if (item && (last_retransmit - msg_tick > client->config->message_retransmit_timeout))
-                {
-                    if (mqtt_resend_pubrel(client, item) == ESP_OK)
-                    {
-#ifdef CONFIG_MQTT_PROTOCOL_5
-                        if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
-                        {
-                            esp_mqtt5_increment_packet_counter(client);
-                        }
-#endif
-                    }
-                }
+                // the publishes are already counted in flight until their PUBCOMP
+                mqtt_qos2_resend_pubrel(client->qos2, last_retransmit, client->config->message_retransmit_timeout,
+                                        MQTT_QOS2_PUBREL_BATCH, mqtt_resend_pubrel, client);
             }
 
             if (process_keepalive(client) != ESP_OK)
@@ -2164,7 +3257,7 @@ static void esp_mqtt_task(void *pv)
                 has_timed_out(client->refresh_connection_tick, client->config->refresh_connection_after_ms))
             {
                 ESP_LOGD(TAG, "Refreshing the connection...");
-                esp_mqtt_abort_connection(client);
+                esp_mqtt_close_connection(client, false);
                 client->state = MQTT_STATE_INIT;
             }
 
@@ -2197,7 +3290,13 @@ static void esp_mqtt_task(void *pv)
             break;
         }
         MQTT_API_UNLOCK(client);
-        if (MQTT_STATE_CONNECTED == client->state)
+        if (MQTT_STATE_CONNECTED == client->state && mqtt_inbound_paused(client))
+        {
+            // the transport is left unread so that TCP pushes back on the broker
+            xEventGroupWaitBits(client->status_bits, CREDIT_BIT, true, true,
+                                max_poll_timeout(client, MQTT_POLL_READ_TIMEOUT_MS) / portTICK_PERIOD_MS);
+        }
+        else if (MQTT_STATE_CONNECTED == client->state)
         {
             if (esp_transport_poll_read(client->transport, max_poll_timeout(client, MQTT_POLL_READ_TIMEOUT_MS)) < 0)
             {
@@ -2207,7 +3306,18 @@ static void esp_mqtt_task(void *pv)
         }
     }
     esp_transport_close(client->transport);
-    outbox_delete_all_items(client->outbox);
+#ifdef MQTT_SESSION_PERSISTENCE
+    if (client->session)
+    {
+        // the session outlives the connection, keep the outbox for the next start
+        mqtt_save_session(client);
+    }
+    else
+#endif
+    {
+        outbox_delete_all_items(client->outbox);
+        mqtt_qos2_clear(client->qos2);
+    }
     client->state = MQTT_STATE_DISCONNECTED;
     xEventGroupSetBits(client->status_bits, STOPPED_BIT);
 
@@ -2387,6 +3497,9 @@ int esp_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client,
     }
 
     MQTT_API_LOCK(client);
+#ifdef MQTT_LOCAL_LOOPBACK
+    bool loopback = client->loopback != NULL;
+#endif
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
     {
 #ifdef CONFIG_MQTT_PROTOCOL_5
@@ -2404,10 +3517,29 @@ int esp_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client,
             MQTT_API_UNLOCK(client);
             return -1;
         }
-        mqtt5_msg_subscribe(&client->mqtt_state.connection,
-                            topic_list, size,
-                            &client->mqtt_state.pending_msg_id, client->mqtt5_config->subscribe_property_info);
-        if (client->mqtt_state.connection.outbound_message.length)
+        const esp_mqtt5_subscribe_property_config_t *property = client->mqtt5_config->subscribe_property_info;
+#ifdef MQTT_LOCAL_LOOPBACK
+        esp_mqtt5_subscribe_property_config_t no_local_property = {0};
+        if (property && property->is_share_subscribe)
+        {
+            // another client of the group may get the message, shared subscriptions are not looped back
+            loopback = false;
+        }
+        else if (loopback)
+        {
+            // messages published by the client are delivered locally, the broker must not send them back
+            if (property)
+            {
+                no_local_property = *property;
+            }
+            no_local_property.no_local_flag = true;
+            property = &no_local_property;
+        }
+#endif
+        mqtt5_msg_subscribe(&client->mqtt_state.connection,
+                            topic_list, size,
+                            &client->mqtt_state.pending_msg_id, property);
+        if (client->mqtt_state.connection.outbound_message.length)
         {
             client->mqtt5_config->subscribe_property_info = NULL;
         }
@@ -2434,6 +3566,18 @@ int esp_mqtt_client_subscribe_multiple(esp_mqtt_client_handle_t client,
         return -1;
     }
     outbox_set_pending(client->outbox, client->mqtt_state.pending_msg_id, TRANSMITTED); // handle error
+#ifdef MQTT_SESSION_PERSISTENCE
+    if (client->session)
+    {
+        mqtt_session_subscribe(client->session, client->mqtt_state.pending_msg_id, topic_list, size);
+    }
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    if (loopback)
+    {
+        mqtt_loopback_subscribe(client->loopback, client->mqtt_state.pending_msg_id, topic_list, size);
+    }
+#endif
 
     if (esp_mqtt_write(client) != ESP_OK)
     {
@@ -2500,6 +3644,18 @@ int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *top
         return -1;
     }
     outbox_set_pending(client->outbox, client->mqtt_state.pending_msg_id, TRANSMITTED); // handle error
+#ifdef MQTT_SESSION_PERSISTENCE
+    if (client->session)
+    {
+        mqtt_session_unsubscribe(client->session, client->mqtt_state.pending_msg_id, topic);
+    }
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    if (client->loopback)
+    {
+        mqtt_loopback_unsubscribe(client->loopback, client->mqtt_state.pending_msg_id, topic);
+    }
+#endif
 
     if (esp_mqtt_write(client) != ESP_OK)
     {
@@ -2515,12 +3671,96 @@ int esp_mqtt_client_unsubscribe(esp_mqtt_client_handle_t client, const char *top
     return pending_msg_id;
 }
 
-static int make_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
-                        int len, int qos, int retain)
+#ifdef CONFIG_MQTT_PROTOCOL_5
+/**
+ * @brief Publish properties of the message being built, compressed payloads are tagged with their content type
+ */
+static const esp_mqtt5_publish_property_config_t *mqtt5_publish_property(esp_mqtt_client_handle_t client,
+        esp_mqtt5_publish_property_config_t *storage)
 {
-    uint16_t pending_msg_id = 0;
+    const esp_mqtt5_publish_property_config_t *property = client->mqtt5_config->publish_property_info;
+    bool set_expiry = client->publish_ttl_ms && !(property && property->message_expiry_interval);
+    bool set_content_type = false;
+#ifdef MQTT_COMPRESSION
+    set_content_type = client->payload_compressed;
+#endif
+    if (!set_expiry && !set_content_type)
+    {
+        return property;
+    }
+    if (property)
+    {
+        *storage = *property;
+    }
+    else
+    {
+        memset(storage, 0, sizeof(*storage));
+    }
+    if (set_expiry)
+    {
+        storage->message_expiry_interval = (client->publish_ttl_ms + 999) / 1000;
+    }
+    if (set_content_type)
+    {
+        storage->payload_format_indicator = false;
+        storage->content_type = MQTT_COMPRESSION_CONTENT_TYPE;
+    }
+    return storage;
+}
+#endif
+
+/**
+ * @brief Time to live of the publish being built, from esp_mqtt_client_set_publish_ttl()
+ * or from the MQTT5 message expiry interval
+ */
+static uint32_t mqtt_publish_ttl(esp_mqtt_client_handle_t client)
+{
+    if (client->publish_ttl_ms)
+    {
+        return client->publish_ttl_ms;
+    }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5 &&
+            client->mqtt5_config->publish_property_info &&
+            client->mqtt5_config->publish_property_info->message_expiry_interval)
+    {
+        return client->mqtt5_config->publish_property_info->message_expiry_interval * 1000;
+    }
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5 &&
+            client->mqtt5_config->publish_property_block)
+    {
+        return client->mqtt5_config->publish_property_block->message_expiry_interval * 1000;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @brief Tracks a sent QoS1 message, state topics take the slot of their previous value
+ */
+static void mqtt_qos1_track(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len,
+                            int retain, int msg_id)
+{
+    size_t topic_len = strlen(topic);
+    mqtt_qos1q_handle_t qos1q = outbox_get_qos1_queue(client->outbox);
+    if (mqtt_topic_matches_any(client->config->coalesce_topics, topic, topic_len))
+    {
+        mqtt_qos1q_track_latest(qos1q, topic, topic_len, data, len, retain, msg_id);
+    }
+    else
+    {
+        mqtt_qos1q_track(qos1q, topic, topic_len, data, len, retain, msg_id);
+    }
+}
 
-    ESP_LOGI(TAG, "Publish check: max_qos=%u", client->mqtt5_config->server_resp_property_info.max_qos);
+/**
+ * @brief Builds a publish message in the connection buffer, or only its header (up to the payload)
+ * if header_only is set
+ */
+static int build_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                         int len, int qos, int retain, bool header_only)
+{
+    uint16_t pending_msg_id = 0;
 
     /* Diagnostics: parameters and null pointers */
     // ESP_LOGI(TAG, "[MAKE_PUBLISH] start: qos=%d retain=%d topic_len=%d payload_len=%d data_is_null=%d",
@@ -2538,10 +3778,21 @@ static int make_publish(esp_mqtt_client_handle_t client, const char *topic, cons
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
     {
 #ifdef CONFIG_MQTT_PROTOCOL_5
-        mqtt5_msg_publish(&client->mqtt_state.connection,
-                          topic, data, len,
-                          qos, retain,
-                          &pending_msg_id, client->mqtt5_config->publish_property_info, client->mqtt5_config->server_resp_property_info.response_info);
+        esp_mqtt5_publish_property_config_t property;
+        if (header_only)
+        {
+            mqtt5_msg_publish_header(&client->mqtt_state.connection,
+                                     topic, len,
+                                     qos, retain,
+                                     &pending_msg_id, mqtt5_publish_property(client, &property), client->mqtt5_config->publish_property_block, client->mqtt5_config->server_resp_property_info.response_info);
+        }
+        else
+        {
+            mqtt5_msg_publish(&client->mqtt_state.connection,
+                              topic, data, len,
+                              qos, retain,
+                              &pending_msg_id, mqtt5_publish_property(client, &property), client->mqtt5_config->publish_property_block, client->mqtt5_config->server_resp_property_info.response_info);
+        }
 
         ESP_LOGI(TAG, "[PUBLISH] built: outbound_len=%d",
                  client->mqtt_state.connection.outbound_message.length);
@@ -2549,6 +3800,12 @@ static int make_publish(esp_mqtt_client_handle_t client, const char *topic, cons
         //                    client->mqtt_state.connection.outbound_message.data,
         //                    client->mqtt_state.connection.outbound_message.length);
 
+        if (client->mqtt_state.connection.outbound_message.length &&
+                esp_mqtt5_client_packet_too_large(client, mqtt_outbound_packet_len(client)))
+        {
+            client->mqtt_state.connection.outbound_message.length = 0;
+            client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
+        }
         if (client->mqtt_state.connection.outbound_message.length)
         {
             client->mqtt5_config->publish_property_info = NULL;
@@ -2561,6 +3818,13 @@ static int make_publish(esp_mqtt_client_handle_t client, const char *topic, cons
         }
 #endif
     }
+    else if (header_only)
+    {
+        mqtt_msg_publish_header(&client->mqtt_state.connection,
+                                topic, len,
+                                qos, retain,
+                                &pending_msg_id);
+    }
     else
     {
         mqtt_msg_publish(&client->mqtt_state.connection,
@@ -2579,19 +3843,72 @@ static int make_publish(esp_mqtt_client_handle_t client, const char *topic, cons
         return -1;
     }
 
+    client->publish_ttl_ms = 0;
+    client->publish_priority = MQTT_PRIORITY_NORMAL;
     // ESP_LOGI(TAG, "[MAKE_PUBLISH] success, msg_id=%u", pending_msg_id);
     return pending_msg_id;
 }
 
-// This function is now QoS0/QoS2 only.
-// QoS1 is handled in esp_mqtt_client_enqueue() fast path.
+static int make_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                        int len, int qos, int retain)
+{
+    return build_publish(client, topic, data, len, qos, retain, false);
+}
+
+/**
+ * @brief Writes the publish message prepared in the connection buffer, followed by the rest
+ * of the payload if it didn't fit (fragmented message)
+ */
+static esp_err_t esp_mqtt_write_publish(esp_mqtt_client_handle_t client, const char *data, int len)
+{
+    int remaining_len = len;
+    const char *current_data = data;
+    bool sending = true;
+
+    while (sending)
+    {
+        ESP_LOGD(TAG, "[PUBLISH] sending chunk: remaining_len=%d", remaining_len);
+
+        if (esp_mqtt_write(client) != ESP_OK)
+        {
+            return ESP_FAIL;
+        }
+
+        int data_sent = client->mqtt_state.connection.outbound_message.length - client->mqtt_state.connection.outbound_message.fragmented_msg_data_offset;
+
+        /* Reset fragmentation markers (no allocation) */
+        client->mqtt_state.connection.outbound_message.fragmented_msg_data_offset = 0;
+        client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
+
+        remaining_len -= data_sent;
+        current_data += data_sent;
+
+        if (remaining_len > 0)
+        {
+            mqtt_connection_t *connection = &client->mqtt_state.connection;
+            int write_len = remaining_len > connection->buffer_length ? connection->buffer_length : remaining_len;
+            ESP_LOGD(TAG, "[PUBLISH] fragmented: write_len=%d of total=%d", write_len, len);
+            memcpy(connection->buffer, current_data, write_len);
+            connection->outbound_message.data = connection->buffer;
+            connection->outbound_message.length = write_len;
+            sending = true;
+        }
+        else
+        {
+            sending = false;
+        }
+    }
+    return ESP_OK;
+}
+
+// This function is QoS0/QoS2 only, QoS1 is handled in the fast paths,
+// unless held back by the rate limiter.
 static int mqtt_client_enqueue_publish(esp_mqtt_client_handle_t client,
                                        const char *topic,
                                        const char *data,
                                        int len,
                                        int qos,
-                                       int retain,
-                                       bool store)
+                                       int retain)
 {
     if (!client || !topic)
     {
@@ -2604,25 +3921,29 @@ static int mqtt_client_enqueue_publish(esp_mqtt_client_handle_t client,
         len = strlen(data);
     }
 
-    if (qos == 1)
-    {
-        ESP_LOGE(TAG, "Unexpected QoS1 in outbox path");
-        return -1;
-    }
-
     // Reserve a new msg_id
     uint16_t msg_id = client->mqtt_state.pending_msg_id++;
     struct mqtt_message *msg = NULL;
+    uint32_t ttl_ms = mqtt_publish_ttl(client);
+    esp_mqtt_priority_t priority = client->publish_priority;
 
     if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
     {
 #ifdef CONFIG_MQTT_PROTOCOL_5
+        esp_mqtt5_publish_property_config_t property;
         msg = mqtt5_msg_publish(&client->mqtt_state.connection,
                                 topic, data, len,
                                 qos, retain,
-                                store ? &msg_id : NULL,
-                                client->mqtt5_config->publish_property_info,
+                                &msg_id,
+                                mqtt5_publish_property(client, &property),
+                                client->mqtt5_config->publish_property_block,
                                 client->mqtt5_config->server_resp_property_info.response_info);
+        if (msg && esp_mqtt5_client_packet_too_large(client, mqtt_outbound_packet_len(client)))
+        {
+            client->mqtt_state.connection.outbound_message.length = 0;
+            client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
+            msg = NULL;
+        }
 
         if (client->mqtt_state.connection.outbound_message.length)
         {
@@ -2639,7 +3960,7 @@ static int mqtt_client_enqueue_publish(esp_mqtt_client_handle_t client,
         msg = mqtt_msg_publish(&client->mqtt_state.connection,
                                topic, data, len,
                                qos, retain,
-                               store ? &msg_id : NULL);
+                               &msg_id);
 
         ESP_LOGD(TAG, "[MAKE_PUBLISH] mqtt_msg_publish done, outbound_len=%d, msg_id=%u",
                  client->mqtt_state.connection.outbound_message.length, msg_id);
@@ -2650,6 +3971,8 @@ static int mqtt_client_enqueue_publish(esp_mqtt_client_handle_t client,
         ESP_LOGE(TAG, "Failed to build publish packet");
         return -1;
     }
+    client->publish_ttl_ms = 0;
+    client->publish_priority = MQTT_PRIORITY_NORMAL;
 
     // Wrap into outbox message
     outbox_message_t outbox_msg = {
@@ -2660,19 +3983,149 @@ static int mqtt_client_enqueue_publish(esp_mqtt_client_handle_t client,
         .msg_type = MQTT_MSG_TYPE_PUBLISH,
         .remaining_data = NULL,
         .remaining_len = 0};
+    if (client->mqtt_state.connection.outbound_message.fragmented_msg_total_length > 0)
+    {
+        // the payload didn't fit into the connection buffer, the outbox keeps the rest too
+        int first_fragment = msg->length - client->mqtt_state.connection.outbound_message.fragmented_msg_data_offset;
+        outbox_msg.remaining_data = (uint8_t *)data + first_fragment;
+        outbox_msg.remaining_len = len - first_fragment;
+    }
 
-    // Enqueue into outbox ring
-    outbox_enqueue(client->outbox, &outbox_msg, esp_timer_get_time() / 1000ULL);
+    // Enqueue into outbox ring, state topics replace their not yet transmitted value
+    outbox_item_handle_t item;
+    if (mqtt_topic_matches_any(client->config->coalesce_topics, topic, strlen(topic)))
+    {
+        item = outbox_enqueue_latest(client->outbox, &outbox_msg, esp_timer_get_time() / 1000ULL);
+    }
+    else
+    {
+        item = outbox_enqueue(client->outbox, &outbox_msg, esp_timer_get_time() / 1000ULL);
+    }
+    if (item == NULL && qos > 0)
+    {
+        return -1;
+    }
+    if (item && ttl_ms)
+    {
+        outbox_item_set_expiry(item, platform_tick_get_ms() + ttl_ms);
+    }
+    outbox_item_set_priority(item, priority);
 
     return outbox_msg.msg_id;
 }
 
-int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
-                            const char *topic,
-                            const char *data,
-                            int len,
-                            int qos,
-                            int retain)
+/**
+ * @brief Keeps a publish which can't be sent yet in the outbox, the client task sends it once allowed
+ */
+static int mqtt_defer_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                              int len, int qos, int retain)
+{
+    if (outbox_is_full(client->outbox) ||
+            (client->config->outbox_limit > 0 && len + outbox_get_size(client->outbox) > client->config->outbox_limit))
+    {
+        ESP_LOGW(TAG, "Publish can't be sent now and outbox full, message dropped");
+        return -2;
+    }
+    return mqtt_client_enqueue_publish(client, topic, data, len, qos, retain);
+}
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+/**
+ * @brief Sends a QoS0 publish right away with a topic alias of this connection, the topic itself
+ * goes only with the first publish of the alias. These publishes are not kept in the outbox,
+ * an alias-only topic would be invalid on a later connection.
+ *
+ * @return true if the publish was handled, msg_id is then the result of the publish
+ */
+static bool mqtt5_publish_aliased(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                                  int len, int retain, int *msg_id)
+{
+    const esp_mqtt5_publish_property_config_t *user_property = client->mqtt5_config->publish_property_info;
+    if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5 || topic == NULL ||
+            (user_property && user_property->topic_alias))
+    {
+        return false;
+    }
+    bool mapped;
+    uint16_t topic_alias = esp_mqtt5_client_own_topic_alias(client, topic, &mapped);
+    if (topic_alias == 0)
+    {
+        return false;
+    }
+
+    esp_mqtt5_publish_property_config_t property;
+    if (user_property)
+    {
+        property = *user_property;
+    }
+    else
+    {
+        memset(&property, 0, sizeof(property));
+    }
+    property.topic_alias = topic_alias;
+    client->mqtt5_config->publish_property_info = &property;
+    *msg_id = make_publish(client, mapped ? "" : topic, data, len, 0, retain);
+    if (client->mqtt5_config->publish_property_info == &property)
+    {
+        // not built, the properties set by the user still apply to the next publish
+        client->mqtt5_config->publish_property_info = user_property;
+    }
+    if (*msg_id < 0)
+    {
+        return true;
+    }
+
+    if (esp_mqtt_write_publish(client, data, len) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "[PUBLISH] esp_mqtt_write failed; aborting connection");
+        client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
+        esp_mqtt_abort_connection(client);
+        *msg_id = -1;
+        return true;
+    }
+    if (!mapped)
+    {
+        esp_mqtt5_client_own_topic_alias_sent(client, topic, topic_alias);
+    }
+    return true;
+}
+#endif
+
+#ifdef MQTT_RATE_LIMIT
+/**
+ * @brief Returns true if a publish may be sent right away
+ */
+static bool mqtt_rate_limit_allows(esp_mqtt_client_handle_t client, const char *topic, int len)
+{
+    if (client->rate_limit == NULL)
+    {
+        return true;
+    }
+    // nothing overtakes the messages already held back
+    if (outbox_dequeue(client->outbox, QUEUED, NULL))
+    {
+        return false;
+    }
+    return mqtt_rate_limit_acquire(client->rate_limit, topic, strlen(topic), len, platform_tick_get_ms());
+}
+
+/**
+ * @brief Keeps a publish over the rate limit in the outbox, the client task sends it once allowed
+ */
+static int mqtt_rate_limit_defer(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                                 int len, int qos, int retain)
+{
+    ESP_LOGD(TAG, "Rate limit reached, message held in the outbox");
+    return mqtt_defer_publish(client, topic, data, len, qos, retain);
+}
+#endif
+
+static int mqtt_client_publish(esp_mqtt_client_handle_t client,
+                               const char *topic,
+                               const char *data,
+                               int len,
+                               int qos,
+                               int retain)
 {
     if (!client)
     {
@@ -2719,15 +4172,40 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
     {
         esp_err_t check_res = esp_mqtt5_client_publish_check(client, effective_qos, retain);
         ESP_LOGD(TAG, "[PUBLISH] MQTT5 publish_check result=%d", check_res);
-        if (check_res != ESP_OK)
+        if (check_res != ESP_OK || mqtt5_publish_too_large(client, topic, len, effective_qos))
         {
             ESP_LOGI(TAG, "MQTT5 publish check fail");
             MQTT_API_UNLOCK(client);
             return -1;
         }
+        if (effective_qos > 0 && client->state == MQTT_STATE_CONNECTED && esp_mqtt5_client_flow_blocked(client))
+        {
+            // sent by the client task once the broker acknowledges the publishes in flight
+            ESP_LOGD(TAG, "[PUBLISH] receive maximum of the broker reached, held in the outbox");
+            int msg_id = mqtt_defer_publish(client, topic, data, len, effective_qos, retain);
+            MQTT_API_UNLOCK(client);
+            return msg_id;
+        }
     }
 #endif
 
+    if (effective_qos == 2 && client->state == MQTT_STATE_CONNECTED && mqtt_qos2_is_full(client->qos2))
+    {
+        // sent by the client task once a PUBCOMP frees an entry of the in-flight table
+        ESP_LOGD(TAG, "[PUBLISH] too many QoS2 publishes in flight, held in the outbox");
+        int msg_id = mqtt_defer_publish(client, topic, data, len, effective_qos, retain);
+        MQTT_API_UNLOCK(client);
+        return msg_id;
+    }
+
+    if (effective_qos == 2 && outbox_is_full(client->outbox))
+    {
+        // the publish would push out one still waiting for its PUBREC
+        ESP_LOGW(TAG, "[PUBLISH] outbox full, too many QoS2 publishes waiting for PUBREC");
+        MQTT_API_UNLOCK(client);
+        return -2;
+    }
+
     /* Outbox limit applies only to QoS > 0 and only for outbox path (QoS0/2) */
     if (client->config->outbox_limit > 0 && effective_qos > 0 && effective_qos != 1)
     {
@@ -2742,9 +4220,19 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
         }
     }
 
+#ifdef MQTT_RATE_LIMIT
+    if (client->state == MQTT_STATE_CONNECTED && topic && !mqtt_rate_limit_allows(client, topic, len))
+    {
+        int msg_id = mqtt_rate_limit_defer(client, topic, data, len, effective_qos, retain);
+        MQTT_API_UNLOCK(client);
+        return msg_id;
+    }
+#endif
+
     /* QoS1 fast path: build and send immediately, then track in QoS1 queue */
     if (effective_qos == 1)
     {
+        uint32_t ttl_ms = mqtt_publish_ttl(client);
         int msg_id = make_publish(client, topic, data, len, /*qos*/ 1, retain);
         ESP_LOGI(TAG, "[PUBLISH] QoS1 build result: msg_id=%d", msg_id);
         if (msg_id <= 0)
@@ -2753,7 +4241,7 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
             return -1;
         }
 
-        if (esp_mqtt_write(client) != ESP_OK)
+        if (esp_mqtt_write_publish(client, data, len) != ESP_OK)
         {
             ESP_LOGE(TAG, "[PUBLISH] esp_mqtt_write failed for QoS1");
             MQTT_API_UNLOCK(client);
@@ -2769,14 +4257,29 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
 #endif
 
         /* Track the message in QoS1 queue with final msg_id */
-        mqtt_qos1q_track(topic, strlen(topic), data, len, retain, msg_id);
+        mqtt_qos1_track(client, topic, data, len, retain, msg_id);
+        if (ttl_ms)
+        {
+            mqtt_qos1q_set_expiry(outbox_get_qos1_queue(client->outbox), msg_id, esp_timer_get_time() + ttl_ms * 1000ULL);
+        }
 
         MQTT_API_UNLOCK(client);
         return msg_id;
     }
 
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    /* QoS0 sent right away: topic alias of the connection when the broker allows them */
+    int aliased_msg_id;
+    if (effective_qos == 0 && client->state == MQTT_STATE_CONNECTED &&
+            mqtt5_publish_aliased(client, topic, data, len, retain, &aliased_msg_id))
+    {
+        MQTT_API_UNLOCK(client);
+        return aliased_msg_id;
+    }
+#endif
+
     /* QoS0/QoS2: original path — build and enqueue into outbox, then send with fragmentation if needed */
-    int pending_msg_id = mqtt_client_enqueue_publish(client, topic, data, len, effective_qos, retain, /*store*/ false);
+    int pending_msg_id = mqtt_client_enqueue_publish(client, topic, data, len, effective_qos, retain);
     ESP_LOGI(TAG, "[PUBLISH] enqueue result: msg_id=%d", pending_msg_id);
     if (pending_msg_id < 0)
     {
@@ -2795,47 +4298,12 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
     }
 
     /* Send (supports fragmentation via connection buffer; no heap) */
+    if (esp_mqtt_write_publish(client, data, len) != ESP_OK)
     {
-        int remaining_len = len;
-        const char *current_data = data;
-        bool sending = true;
-
-        while (sending)
-        {
-            ESP_LOGD(TAG, "[PUBLISH] sending chunk: remaining_len=%d", remaining_len);
-
-            if (esp_mqtt_write(client) != ESP_OK)
-            {
-                ESP_LOGE(TAG, "[PUBLISH] esp_mqtt_write failed; aborting connection");
-                esp_mqtt_abort_connection(client);
-                ret = -1;
-                goto cannot_publish;
-            }
-
-            int data_sent = client->mqtt_state.connection.outbound_message.length - client->mqtt_state.connection.outbound_message.fragmented_msg_data_offset;
-
-            /* Reset fragmentation markers (no allocation) */
-            client->mqtt_state.connection.outbound_message.fragmented_msg_data_offset = 0;
-            client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
-
-            remaining_len -= data_sent;
-            current_data += data_sent;
-
-            if (remaining_len > 0)
-            {
-                mqtt_connection_t *connection = &client->mqtt_state.connection;
-                int write_len = remaining_len > connection->buffer_length ? connection->buffer_length : remaining_len;
-                ESP_LOGD(TAG, "[PUBLISH] fragmented: write_len=%d of total=%d", write_len, len);
-                memcpy(connection->buffer, current_data, write_len);
-                connection->outbound_message.data = connection->buffer;
-                connection->outbound_message.length = write_len;
-                sending = true;
-            }
-            else
-            {
-                sending = false;
-            }
-        }
+        ESP_LOGE(TAG, "[PUBLISH] esp_mqtt_write failed; aborting connection");
+        esp_mqtt_abort_connection(client);
+        ret = -1;
+        goto cannot_publish;
     }
 
     if (effective_qos > 0)
@@ -2850,6 +4318,7 @@ int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
         /* Mark for retransmit (no allocation) */
         outbox_set_tick(client->outbox, pending_msg_id, platform_tick_get_ms());
         outbox_set_pending(client->outbox, pending_msg_id, TRANSMITTED);
+        mqtt_track_qos2(client, pending_msg_id, effective_qos);
         ESP_LOGD(TAG, "[PUBLISH] outbox marked TRANSMITTED for msg_id=%d", pending_msg_id);
     }
 
@@ -2867,20 +4336,290 @@ cannot_publish:
     return ret;
 }
 
-int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
-                            const char *topic,
-                            const char *data,
-                            int len,
-                            int qos,
-                            int retain,
-                            bool store)
+#ifdef MQTT_LOCAL_LOOPBACK
+typedef enum {
+    LOOPBACK_NONE,          /* not subscribed by the client */
+    LOOPBACK_DELIVERED,     /* delivered locally, to be sent to the broker as well */
+    LOOPBACK_LOCAL_ONLY,    /* delivered locally, never sent */
+    LOOPBACK_FAILED,        /* local only, the event couldn't be posted */
+} mqtt_loopback_result_t;
+
+/**
+ * @brief Delivers a published message as MQTT_EVENT_DATA, the handlers run in the publishing task before it returns
+ */
+static esp_err_t mqtt_loopback_dispatch(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len,
+                                        int qos, int retain)
 {
-    if (!client)
+    esp_mqtt_event_t event = {
+        .event_id = MQTT_EVENT_DATA,
+        .client = client,
+        .data = len > 0 ? (char *)data : NULL,
+        .data_len = len,
+        .total_data_len = len,
+        .topic = (char *)topic,
+        .topic_len = strlen(topic),
+        .error_handle = client->event.error_handle,
+        .qos = qos,
+        .retain = retain,
+        .protocol_ver = client->mqtt_state.connection.information.protocol_ver,
+    };
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    // properties of the publish, before it consumes them
+    esp_mqtt5_event_property_t property = {0};
+    const esp_mqtt5_publish_property_config_t *publish_property = client->mqtt5_config->publish_property_info;
+    if (publish_property)
+    {
+        property.payload_format_indicator = publish_property->payload_format_indicator;
+        property.response_topic = (char *)publish_property->response_topic;
+        property.response_topic_len = publish_property->response_topic ? strlen(publish_property->response_topic) : 0;
+        property.correlation_data = (char *)publish_property->correlation_data;
+        property.correlation_data_len = publish_property->correlation_data_len;
+        property.content_type = (char *)publish_property->content_type;
+        property.content_type_len = publish_property->content_type ? strlen(publish_property->content_type) : 0;
+    }
+    event.property = &property;
+#endif
+#ifdef MQTT_SUPPORTED_FEATURE_EVENT_LOOP
+    // the loop holds this event alone, running it once consumes it while topic, data and properties are valid
+    esp_err_t ret = esp_event_post_to(client->loopback_loop, MQTT_EVENTS, MQTT_EVENT_DATA, &event, sizeof(event), 0);
+    if (ret == ESP_OK)
     {
-        ESP_LOGE(TAG, "Client was not initialized");
-        return -1;
+        ret = esp_event_loop_run(client->loopback_loop, 0);
     }
-
+    return ret;
+#else
+    return ESP_FAIL;
+#endif
+}
+
+/**
+ * @brief Delivers a message published on a local only topic or on a topic the client subscribes to
+ */
+static mqtt_loopback_result_t mqtt_loopback_deliver(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+        int len, int qos, int retain)
+{
+    size_t topic_len = strlen(topic);
+    if (mqtt_topic_matches_any(client->config->local_topics, topic, topic_len))
+    {
+        if (mqtt_loopback_dispatch(client, topic, data, len, qos, retain) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to deliver the message on local topic %s", topic);
+            return LOOPBACK_FAILED;
+        }
+        // the settings of the next publish applied to this one
+        client->publish_ttl_ms = 0;
+        client->publish_priority = MQTT_PRIORITY_NORMAL;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        client->mqtt5_config->publish_property_info = NULL;
+#endif
+        return LOOPBACK_LOCAL_ONLY;
+    }
+    int granted_qos = mqtt_loopback_match(client->loopback, topic, topic_len);
+    if (granted_qos < 0)
+    {
+        return LOOPBACK_NONE;
+    }
+    if (mqtt_loopback_dispatch(client, topic, data, len, qos < granted_qos ? qos : granted_qos, retain) != ESP_OK)
+    {
+        // an MQTT 3.1.1 broker still sends it back
+        ESP_LOGW(TAG, "Failed to deliver the message on %s locally", topic);
+        return LOOPBACK_NONE;
+    }
+    return LOOPBACK_DELIVERED;
+}
+
+/**
+ * @brief Remembers the message (as sent) delivered locally, to drop its echo from an MQTT 3.1.1 broker
+ */
+static void mqtt_loopback_expect_echo(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len)
+{
+    if (client->mqtt_state.connection.information.protocol_ver != MQTT_PROTOCOL_V_5)
+    {
+        mqtt_loopback_delivered(client->loopback, topic, strlen(topic), data, len, platform_tick_get_ms());
+    }
+}
+#endif
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client,
+                            const char *topic,
+                            const char *data,
+                            int len,
+                            int qos,
+                            int retain)
+{
+#ifdef MQTT_LOCAL_LOOPBACK
+    bool looped_back = false;
+    if (client && client->loopback && topic)
+    {
+        if (len <= 0 && data != NULL)
+        {
+            len = strlen(data);
+        }
+        MQTT_API_LOCK(client);
+        mqtt_loopback_result_t loopback = mqtt_loopback_deliver(client, topic, data, len, qos, retain);
+        MQTT_API_UNLOCK(client);
+        if (loopback == LOOPBACK_LOCAL_ONLY || loopback == LOOPBACK_FAILED)
+        {
+            return loopback == LOOPBACK_LOCAL_ONLY ? 0 : -1;
+        }
+        looped_back = loopback == LOOPBACK_DELIVERED;
+    }
+#endif
+#ifdef MQTT_COMPRESSION
+    if (client && client->config->compression_topics)
+    {
+        if (len <= 0 && data != NULL)
+        {
+            len = strlen(data);
+        }
+        uint8_t *frame = mqtt_compress_payload(client, topic, &data, &len);
+        if (frame)
+        {
+            MQTT_API_LOCK(client);
+#ifdef MQTT_LOCAL_LOOPBACK
+            if (looped_back)
+            {
+                mqtt_loopback_expect_echo(client, topic, data, len);
+            }
+#endif
+            client->payload_compressed = true;
+            int ret = mqtt_client_publish(client, topic, data, len, qos, retain);
+            client->payload_compressed = false;
+            MQTT_API_UNLOCK(client);
+            mqtt_free(&client->alloc.transient, frame);
+            return ret;
+        }
+    }
+#endif
+#ifdef MQTT_LOCAL_LOOPBACK
+    if (looped_back)
+    {
+        MQTT_API_LOCK(client);
+        mqtt_loopback_expect_echo(client, topic, data, len);
+        MQTT_API_UNLOCK(client);
+    }
+#endif
+    return mqtt_client_publish(client, topic, data, len, qos, retain);
+}
+
+int esp_mqtt_client_publish_stream(esp_mqtt_client_handle_t client, const char *topic, int total_len,
+                                   int qos, esp_mqtt_publish_read_cb_t read_cb, void *ctx)
+{
+    if (!client || !topic || total_len < 0 || !read_cb)
+    {
+        ESP_LOGE(TAG, "Invalid arguments of streamed publish");
+        return -1;
+    }
+    MQTT_API_LOCK(client);
+    if (client->state != MQTT_STATE_CONNECTED)
+    {
+        ESP_LOGE(TAG, "Streamed publish requires a connected client");
+        MQTT_API_UNLOCK(client);
+        return -1;
+    }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+    {
+        uint8_t max_qos = client->mqtt5_config->server_resp_property_info.max_qos;
+        if (qos > (int)max_qos)
+        {
+            ESP_LOGW(TAG, "Downshifting QoS from %d to broker max %u", qos, max_qos);
+            qos = (int)max_qos;
+        }
+        if (esp_mqtt5_client_publish_check(client, qos, 0) != ESP_OK || mqtt5_publish_too_large(client, topic, total_len, qos) ||
+                (qos > 0 && esp_mqtt5_client_flow_blocked(client)))
+        {
+            ESP_LOGI(TAG, "MQTT5 publish check fail");
+            MQTT_API_UNLOCK(client);
+            return -1;
+        }
+    }
+#endif
+
+    if (qos == 2 && mqtt_qos2_is_full(client->qos2))
+    {
+        ESP_LOGE(TAG, "Too many QoS2 publishes in flight");
+        MQTT_API_UNLOCK(client);
+        return -1;
+    }
+
+    mqtt_connection_t *connection = &client->mqtt_state.connection;
+    int msg_id = build_publish(client, topic, NULL, total_len, qos, 0, /*header_only*/ true);
+    if (msg_id < 0)
+    {
+        MQTT_API_UNLOCK(client);
+        return -1;
+    }
+    connection->outbound_message.fragmented_msg_data_offset = 0;
+    connection->outbound_message.fragmented_msg_total_length = 0;
+
+    // the header goes first, then the payload is pulled into the connection buffer chunk by chunk
+    esp_err_t err = esp_mqtt_write(client);
+    int sent = 0;
+    while (err == ESP_OK && sent < total_len)
+    {
+        int chunk = total_len - sent > connection->buffer_length ? connection->buffer_length : total_len - sent;
+        int read_len = read_cb(ctx, (char *)connection->buffer, chunk);
+        if (read_len <= 0 || read_len > chunk)
+        {
+            ESP_LOGE(TAG, "Failed to read the payload at offset %d (ret=%d)", sent, read_len);
+            err = ESP_FAIL;
+            break;
+        }
+        connection->outbound_message.data = connection->buffer;
+        connection->outbound_message.length = read_len;
+        err = esp_mqtt_write(client);
+        sent += read_len;
+    }
+    if (err != ESP_OK)
+    {
+        // the broker got a partial message, the connection can't continue
+        ESP_LOGE(TAG, "Streamed publish failed after %d of %d bytes, aborting connection", sent, total_len);
+        esp_mqtt_abort_connection(client);
+        MQTT_API_UNLOCK(client);
+        return -1;
+    }
+
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (qos > 0 && client->mqtt_state.connection.information.protocol_ver == MQTT_PROTOCOL_V_5)
+    {
+        esp_mqtt5_increment_packet_counter(client);
+    }
+#endif
+    mqtt_track_qos2(client, msg_id, qos);
+#ifdef MQTT_RATE_LIMIT
+    if (client->rate_limit)
+    {
+        // nothing to defer, the message is charged once sent
+        mqtt_rate_limit_consume(client->rate_limit, topic, strlen(topic), total_len, platform_tick_get_ms());
+    }
+#endif
+    MQTT_API_UNLOCK(client);
+    return msg_id;
+}
+
+static int mqtt_client_enqueue(esp_mqtt_client_handle_t client,
+                               const char *topic,
+                               const char *data,
+                               int len,
+                               int qos,
+                               int retain,
+                               bool store);
+
+int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
+                            const char *topic,
+                            const char *data,
+                            int len,
+                            int qos,
+                            int retain,
+                            bool store)
+{
+    if (!client)
+    {
+        ESP_LOGE(TAG, "Client was not initialized");
+        return -1;
+    }
+
     ESP_LOGI(TAG, "Enqueue start: qos=%d retain=%d store=%d topic_len=%d payload_len=%d",
              qos, retain, store,
              topic ? (int)strlen(topic) : 0,
@@ -2897,6 +4636,51 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
         ESP_LOGD(TAG, "Adjusted payload_len to %d from string length", len);
     }
 
+#ifdef MQTT_OFFLINE_LOG
+    // keep the ordering: once anything is in the log, new messages go behind it until it's replayed
+    MQTT_API_LOCK(client);
+    if (client->offline_log && (qos > 0 || store) &&
+            (client->state != MQTT_STATE_CONNECTED || !mqtt_offline_log_is_drained(client->offline_log)))
+    {
+        esp_err_t err = mqtt_offline_log_append(client->offline_log, topic, topic ? strlen(topic) : 0, data, len, qos, retain);
+        client->publish_ttl_ms = 0;     // not kept in the log
+        client->publish_priority = MQTT_PRIORITY_NORMAL;
+        MQTT_API_UNLOCK(client);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Failed to append message to the offline log");
+            return -1;
+        }
+        return 0;
+    }
+    MQTT_API_UNLOCK(client);
+#endif
+
+#ifdef MQTT_COMPRESSION
+    // compressed after the offline log, which stores the payloads as they are
+    uint8_t *frame = mqtt_compress_payload(client, topic, &data, &len);
+    if (frame)
+    {
+        MQTT_API_LOCK(client);
+        client->payload_compressed = true;
+        int ret = mqtt_client_enqueue(client, topic, data, len, qos, retain, store);
+        client->payload_compressed = false;
+        MQTT_API_UNLOCK(client);
+        mqtt_free(&client->alloc.transient, frame);
+        return ret;
+    }
+#endif
+    return mqtt_client_enqueue(client, topic, data, len, qos, retain, store);
+}
+
+static int mqtt_client_enqueue(esp_mqtt_client_handle_t client,
+                               const char *topic,
+                               const char *data,
+                               int len,
+                               int qos,
+                               int retain,
+                               bool store)
+{
     if (client->config->outbox_limit > 0)
     {
         size_t projected_size = len + outbox_get_size(client->outbox);
@@ -2915,7 +4699,7 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
     {
         esp_err_t check_res = esp_mqtt5_client_publish_check(client, qos, retain);
         ESP_LOGD(TAG, "MQTT5 publish_check result=%d", check_res);
-        if (check_res != ESP_OK)
+        if (check_res != ESP_OK || mqtt5_publish_too_large(client, topic, len, qos))
         {
             ESP_LOGI(TAG, "esp_mqtt_client_enqueue check fail");
             MQTT_API_UNLOCK(client);
@@ -2924,17 +4708,32 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
     }
 #endif
 
-    int ret;
+    int ret = 0;
 
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (qos == 1 && client->state == MQTT_STATE_CONNECTED && esp_mqtt5_client_flow_blocked(client))
+    {
+        ret = mqtt_defer_publish(client, topic, data, len, qos, retain);
+    }
+    else
+#endif
+#ifdef MQTT_RATE_LIMIT
+    if (qos == 1 && client->state == MQTT_STATE_CONNECTED && topic && !mqtt_rate_limit_allows(client, topic, len))
+    {
+        ret = mqtt_rate_limit_defer(client, topic, data, len, qos, retain);
+    }
+    else
+#endif
     if (qos == 1)
     {
         /* --- QoS1 fast path: build and send, then track in queue --- */
+        uint32_t ttl_ms = mqtt_publish_ttl(client);
         ret = make_publish(client, topic, data, len, qos, retain);
         if (ret > 0)
         {
             if (client->state == MQTT_STATE_CONNECTED)
             {
-                if (esp_mqtt_write(client) != ESP_OK)
+                if (esp_mqtt_write_publish(client, data, len) != ESP_OK)
                 {
                     ESP_LOGW(TAG, "QoS1 send failed");
                     ret = -1;
@@ -2943,22 +4742,29 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
             else
             {
                 ESP_LOGW(TAG, "QoS1 client not connected");
+                client->mqtt_state.connection.outbound_message.fragmented_msg_total_length = 0;
             }
 
             if (ret > 0)
             {
                 // Track the message in the QoS1 queue with the final msg_id
-                mqtt_qos1q_track(topic, strlen(topic),
-                                 data, len,
-                                 retain,
-                                 ret);
+                mqtt_qos1_track(client, topic, data, len, retain, ret);
+                if (ttl_ms)
+                {
+                    mqtt_qos1q_set_expiry(outbox_get_qos1_queue(client->outbox), ret, esp_timer_get_time() + ttl_ms * 1000ULL);
+                }
             }
         }
     }
-    else
+    else if (qos > 0 && outbox_is_full(client->outbox))
+    {
+        ESP_LOGW(TAG, "Outbox full, too many QoS2 publishes waiting for PUBREC");
+        ret = -2;
+    }
+    else if (qos > 0 || store)
     {
         /* --- Original path for QoS0/QoS2 --- */
-        ret = mqtt_client_enqueue_publish(client, topic, data, len, qos, retain, store);
+        ret = mqtt_client_enqueue_publish(client, topic, data, len, qos, retain);
     }
 
     MQTT_API_UNLOCK(client);
@@ -2975,6 +4781,388 @@ int esp_mqtt_client_enqueue(esp_mqtt_client_handle_t client,
     return ret;
 }
 
+esp_err_t esp_mqtt_client_set_publish_ttl(esp_mqtt_client_handle_t client, uint32_t ttl_ms)
+{
+    if (!client)
+    {
+        ESP_LOGE(TAG, "Client was not initialized");
+        return ESP_ERR_INVALID_ARG;
+    }
+    MQTT_API_LOCK(client);
+    client->publish_ttl_ms = ttl_ms;
+    MQTT_API_UNLOCK(client);
+    return ESP_OK;
+}
+
+esp_err_t esp_mqtt_client_grant_credit(esp_mqtt_client_handle_t client, int messages, size_t bytes)
+{
+    if (client == NULL || messages < 0)
+    {
+        ESP_LOGE(TAG, "Invalid client or credit");
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifdef MQTT_INBOUND_FLOW_CONTROL
+    if (client->inbound.window == 0 && !client->inbound.limit_bytes)
+    {
+        ESP_LOGE(TAG, "Client configured without receive credit");
+        return ESP_ERR_INVALID_STATE;
+    }
+    MQTT_API_LOCK(client);
+    if (client->inbound.window)
+    {
+        client->inbound.messages += messages;
+    }
+    if (client->inbound.limit_bytes)
+    {
+        client->inbound.bytes += bytes;
+    }
+    bool resume = !mqtt_inbound_paused(client);
+    MQTT_API_UNLOCK(client);
+    if (resume)
+    {
+        xEventGroupSetBits(client->status_bits, CREDIT_BIT);
+    }
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_mqtt_client_set_publish_priority(esp_mqtt_client_handle_t client, esp_mqtt_priority_t priority)
+{
+    if (!client || priority < MQTT_PRIORITY_LOW || priority > MQTT_PRIORITY_URGENT)
+    {
+        ESP_LOGE(TAG, "Invalid client or priority");
+        return ESP_ERR_INVALID_ARG;
+    }
+    MQTT_API_LOCK(client);
+    client->publish_priority = priority;
+    MQTT_API_UNLOCK(client);
+    return ESP_OK;
+}
+
+#ifdef MQTT_BATCHING
+static int mqtt_batch_publish(void *ctx, const char *topic, const uint8_t *frame, size_t len, int qos, int retain)
+{
+    return esp_mqtt_client_publish((esp_mqtt_client_handle_t)ctx, topic, (const char *)frame, len, qos, retain);
+}
+#endif
+
+esp_err_t esp_mqtt_client_batch_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len,
+                                        int qos, int retain)
+{
+    if (client == NULL || topic == NULL || topic[0] == '\0' || qos < 0 || qos > 2)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifdef MQTT_BATCHING
+    if (len <= 0 && data != NULL)
+    {
+        len = strlen(data);
+    }
+    MQTT_API_LOCK(client);
+    esp_err_t err = mqtt_batcher_add(client->batcher, topic, (const uint8_t *)data, data ? len : 0, qos, retain,
+                                     platform_tick_get_ms());
+    MQTT_API_UNLOCK(client);
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_mqtt_client_batch_flush(esp_mqtt_client_handle_t client, const char *topic)
+{
+    if (client == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifdef MQTT_BATCHING
+    MQTT_API_LOCK(client);
+    esp_err_t err = mqtt_batcher_flush(client->batcher, topic);
+    MQTT_API_UNLOCK(client);
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_mqtt_batch_next(const char *data, int data_len, int *offset, const char **sample, int *sample_len)
+{
+    if (data == NULL || data_len < 0 || offset == NULL || *offset < 0 || sample == NULL || sample_len == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifdef MQTT_BATCHING
+    size_t pos = *offset;
+    const uint8_t *bytes = NULL;
+    size_t len = 0;
+    esp_err_t err = mqtt_batch_next((const uint8_t *)data, data_len, &pos, &bytes, &len);
+    if (err == ESP_OK)
+    {
+        *offset = pos;
+        *sample = (const char *)bytes;
+        *sample_len = len;
+    }
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+struct esp_mqtt_fanout
+{
+    esp_mqtt_client_handle_t *clients;
+    int count;
+};
+
+/* Publish header encoded once for the group, each client patches its packet id */
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    size_t id_offset;
+} mqtt_fanout_header_t;
+
+esp_mqtt_fanout_handle_t esp_mqtt_fanout_create(const esp_mqtt_client_handle_t *clients, int count)
+{
+    if (clients == NULL || count <= 0)
+    {
+        ESP_LOGE(TAG, "Invalid fan-out clients");
+        return NULL;
+    }
+    esp_mqtt_fanout_handle_t group = calloc(1, sizeof(struct esp_mqtt_fanout));
+    ESP_MEM_CHECK(TAG, group, return NULL);
+    group->clients = calloc(count, sizeof(esp_mqtt_client_handle_t));
+    ESP_MEM_CHECK(TAG, group->clients, free(group); return NULL);
+    for (int i = 0; i < count; ++i)
+    {
+        if (clients[i] == NULL)
+        {
+            ESP_LOGE(TAG, "Fan-out client %d was not initialized", i);
+            esp_mqtt_fanout_destroy(group);
+            return NULL;
+        }
+        group->clients[i] = clients[i];
+    }
+    group->count = count;
+    return group;
+}
+
+void esp_mqtt_fanout_destroy(esp_mqtt_fanout_handle_t group)
+{
+    if (group == NULL)
+    {
+        return;
+    }
+    free(group->clients);
+    free(group);
+}
+
+static esp_err_t mqtt_fanout_encode_header(mqtt_fanout_header_t *header, esp_mqtt_protocol_ver_t protocol_ver,
+                                           const char *topic, int len, int qos, int retain)
+{
+    // fixed header, topic, packet id and an empty MQTT5 property length
+    mqtt_connection_t connection = {0};
+    connection.buffer_length = strlen(topic) + 16;
+    connection.buffer = malloc(connection.buffer_length);
+    ESP_MEM_CHECK(TAG, connection.buffer, return ESP_ERR_NO_MEM);
+    uint16_t msg_id = 0;
+    mqtt_message_t *msg;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (protocol_ver == MQTT_PROTOCOL_V_5)
+    {
+        msg = mqtt5_msg_publish_header(&connection, topic, len, qos, retain, &msg_id, NULL, NULL, NULL);
+    }
+    else
+#endif
+    {
+        msg = mqtt_msg_publish_header(&connection, topic, len, qos, retain, &msg_id);
+    }
+    size_t topic_len = msg ? msg->length : 0;
+    const char *encoded_topic = topic_len ? mqtt_get_publish_topic(msg->data, &topic_len) : NULL;
+    if (encoded_topic == NULL)
+    {
+        ESP_LOGE(TAG, "Failed to encode fan-out publish header");
+        free(connection.buffer);
+        return ESP_FAIL;
+    }
+    header->id_offset = (const uint8_t *)encoded_topic + topic_len - msg->data;
+    header->len = msg->length;
+    memmove(connection.buffer, msg->data, msg->length);
+    header->data = connection.buffer;
+    return ESP_OK;
+}
+
+/**
+ * @brief Sends a fan-out QoS1 publish like esp_mqtt_client_publish() does, then tracks it in the QoS1 queue of the client
+ */
+static int mqtt_fanout_send_qos1(esp_mqtt_client_handle_t client, const mqtt_fanout_header_t *header,
+                                 const char *topic, const char *data, int len, int retain)
+{
+    mqtt_connection_t *connection = &client->mqtt_state.connection;
+    memcpy(connection->buffer, header->data, header->len);
+    int msg_id = mqtt_msg_next_id(connection);
+    connection->buffer[header->id_offset] = msg_id >> 8;
+    connection->buffer[header->id_offset + 1] = msg_id & 0xff;
+    mqtt_message_t *outbound = &connection->outbound_message;
+    outbound->data = connection->buffer;
+    outbound->length = header->len;
+    outbound->fragmented_msg_data_offset = header->len;
+    outbound->fragmented_msg_total_length = header->len + len;
+    if (esp_mqtt_write_publish(client, data, len) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Fan-out QoS1 message not sent");
+        return -1;
+    }
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (connection->information.protocol_ver == MQTT_PROTOCOL_V_5)
+    {
+        esp_mqtt5_increment_packet_counter(client);
+    }
+#endif
+    mqtt_qos1_track(client, topic, data, len, retain, msg_id);
+    return msg_id;
+}
+
+/**
+ * @brief Sends a fan-out publish on the path a publish of the client takes: QoS1 directly when the client
+ * may send now, otherwise queued in its outbox and sent if the client may send now
+ */
+static int mqtt_fanout_submit(esp_mqtt_client_handle_t client, const mqtt_fanout_header_t *header,
+                              outbox_shared_payload_handle_t payload, const char *topic, const char *data,
+                              int len, int qos, int retain)
+{
+    mqtt_connection_t *connection = &client->mqtt_state.connection;
+    bool send_now = client->state == MQTT_STATE_CONNECTED;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    if (connection->information.protocol_ver == MQTT_PROTOCOL_V_5)
+    {
+        if (esp_mqtt5_client_publish_check(client, qos, retain) != ESP_OK ||
+                esp_mqtt5_client_packet_too_large(client, header->len + len))
+        {
+            return -1;
+        }
+        send_now = send_now && !(qos > 0 && esp_mqtt5_client_flow_blocked(client));
+    }
+#endif
+#ifdef MQTT_RATE_LIMIT
+    send_now = send_now && mqtt_rate_limit_allows(client, topic, len);
+#endif
+    send_now = send_now && !(qos == 2 && mqtt_qos2_is_full(client->qos2));
+    if (qos == 0 && client->state != MQTT_STATE_CONNECTED)
+    {
+        ESP_LOGD(TAG, "Fan-out QoS0 message not sent, client not connected");
+        return -1;
+    }
+    if (header->len > connection->buffer_length)
+    {
+        ESP_LOGW(TAG, "Fan-out message header doesn't fit the buffer");
+        return -2;
+    }
+    if (qos == 1 && send_now)
+    {
+        return mqtt_fanout_send_qos1(client, header, topic, data, len, retain);
+    }
+    if (outbox_is_full(client->outbox) ||
+            (client->config->outbox_limit > 0 && len + outbox_get_size(client->outbox) > client->config->outbox_limit))
+    {
+        ESP_LOGW(TAG, "Fan-out message can't be queued, outbox full");
+        return -2;
+    }
+
+    // the header is patched in the connection buffer, the outbox copies it
+    memcpy(connection->buffer, header->data, header->len);
+    int msg_id = 0;
+    if (qos > 0)
+    {
+        msg_id = mqtt_msg_next_id(connection);
+        connection->buffer[header->id_offset] = msg_id >> 8;
+        connection->buffer[header->id_offset + 1] = msg_id & 0xff;
+    }
+    outbox_message_t msg = {
+        .data = connection->buffer,
+        .len = header->len,
+        .msg_id = qos > 0 ? msg_id : client->mqtt_state.pending_msg_id++,
+        .msg_qos = qos,
+        .msg_type = MQTT_MSG_TYPE_PUBLISH,
+        .shared = payload};
+    outbox_item_handle_t item = outbox_enqueue(client->outbox, &msg, platform_tick_get_ms());
+    if (item == NULL)
+    {
+        return -1;
+    }
+    if (send_now && mqtt_resend_queued(client, item) == ESP_OK)
+    {
+        mqtt_queued_sent(client, item);
+    }
+    return msg_id;
+}
+
+int esp_mqtt_fanout_publish(esp_mqtt_fanout_handle_t group, const char *topic, const char *data, int len,
+                            int qos, int retain, int *msg_ids)
+{
+    if (group == NULL || topic == NULL || topic[0] == '\0' || qos < 0 || qos > 2)
+    {
+        ESP_LOGE(TAG, "Invalid fan-out publish");
+        return -1;
+    }
+    if (len <= 0 && data != NULL)
+    {
+        len = strlen(data);
+    }
+    outbox_shared_payload_handle_t payload = outbox_shared_payload_create((const uint8_t *)data, data ? len : 0);
+    if (payload == NULL)
+    {
+        return -1;
+    }
+    len = data ? len : 0;
+
+    // [MQTT5][QoS], encoded on first use
+    mqtt_fanout_header_t headers[2][3] = {0};
+    int accepted = 0;
+    for (int i = 0; i < group->count; ++i)
+    {
+        esp_mqtt_client_handle_t client = group->clients[i];
+        int msg_id = -1;
+        MQTT_API_LOCK(client);
+        esp_mqtt_protocol_ver_t protocol_ver = client->mqtt_state.connection.information.protocol_ver;
+        bool v5 = false;
+        int member_qos = qos;
+#ifdef CONFIG_MQTT_PROTOCOL_5
+        v5 = protocol_ver == MQTT_PROTOCOL_V_5;
+        if (v5 && member_qos > client->mqtt5_config->server_resp_property_info.max_qos)
+        {
+            member_qos = client->mqtt5_config->server_resp_property_info.max_qos;
+        }
+#endif
+        mqtt_fanout_header_t *header = &headers[v5][member_qos];
+        if (header->data || mqtt_fanout_encode_header(header, protocol_ver, topic, len, member_qos, retain) == ESP_OK)
+        {
+            msg_id = mqtt_fanout_submit(client, header, payload, topic, data, len, member_qos, retain);
+        }
+        MQTT_API_UNLOCK(client);
+        if (msg_id >= 0)
+        {
+            ++accepted;
+        }
+        if (msg_ids)
+        {
+            msg_ids[i] = msg_id < 0 ? -1 : msg_id;
+        }
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            free(headers[i][j].data);
+        }
+    }
+    // the outboxes keep their references until sent or acknowledged
+    outbox_shared_payload_release(payload);
+    ESP_LOGD(TAG, "Fan-out publish accepted by %d of %d clients", accepted, group->count);
+    return accepted;
+}
+
 esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t event_handler, void *event_handler_arg)
 {
     if (client == NULL)
@@ -2982,6 +5170,16 @@ esp_err_t esp_mqtt_client_register_event(esp_mqtt_client_handle_t client, esp_mq
         return ESP_ERR_INVALID_ARG;
     }
 #ifdef MQTT_SUPPORTED_FEATURE_EVENT_LOOP
+#ifdef MQTT_LOCAL_LOOPBACK
+    if (client->loopback_loop)
+    {
+        esp_err_t err = esp_event_handler_register_with(client->loopback_loop, MQTT_EVENTS, event, event_handler, event_handler_arg);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+#endif
 
     return esp_event_handler_register_with(client->config->event_loop_handle, MQTT_EVENTS, event, event_handler, event_handler_arg);
 #else
@@ -2997,6 +5195,12 @@ esp_err_t esp_mqtt_client_unregister_event(esp_mqtt_client_handle_t client, esp_
         return ESP_ERR_INVALID_ARG;
     }
 #ifdef MQTT_SUPPORTED_FEATURE_EVENT_LOOP
+#ifdef MQTT_LOCAL_LOOPBACK
+    if (client->loopback_loop)
+    {
+        esp_event_handler_unregister_with(client->loopback_loop, MQTT_EVENTS, event, event_handler);
+    }
+#endif
 
     return esp_event_handler_unregister_with(client->config->event_loop_handle, MQTT_EVENTS, event, event_handler);
 #else
@@ -3045,6 +5249,77 @@ int esp_mqtt_client_get_outbox_size(esp_mqtt_client_handle_t client)
     return outbox_size;
 }
 
+esp_err_t esp_mqtt_client_save_session(esp_mqtt_client_handle_t client)
+{
+    if (client == NULL)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifdef MQTT_SESSION_PERSISTENCE
+    if (client->session == NULL)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    MQTT_API_LOCK(client);
+    esp_err_t err = mqtt_save_session(client);
+    MQTT_API_UNLOCK(client);
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+esp_err_t esp_mqtt_client_set_data_storage(esp_mqtt_client_handle_t client, const char *filter,
+        const esp_mqtt_data_storage_t *storage)
+{
+    if (client == NULL || filter == NULL || (storage && (storage->alloc == NULL || storage->release == NULL)))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+#ifdef MQTT_REASSEMBLY
+    esp_err_t err = ESP_OK;
+    MQTT_API_LOCK(client);
+    int index = 0;
+    while (index < client->data_storage_count && strcmp(client->data_storage[index].filter, filter) != 0)
+    {
+        ++index;
+    }
+    if (storage == NULL)
+    {
+        if (index == client->data_storage_count)
+        {
+            err = ESP_ERR_NOT_FOUND;
+            goto exit;
+        }
+        mqtt_free(&client->alloc.state, client->data_storage[index].filter);
+        memmove(&client->data_storage[index], &client->data_storage[index + 1],
+                (client->data_storage_count - index - 1) * sizeof(mqtt_data_storage_t));
+        --client->data_storage_count;
+        goto exit;
+    }
+    if (index == client->data_storage_count)
+    {
+        char *copy = mqtt_strdup(&client->alloc.state, filter);
+        mqtt_data_storage_t *entries = copy ? mqtt_realloc(&client->alloc.state, client->data_storage, (index + 1) * sizeof(mqtt_data_storage_t)) : NULL;
+        if (entries == NULL)
+        {
+            mqtt_free(&client->alloc.state, copy);
+            err = ESP_ERR_NO_MEM;
+            goto exit;
+        }
+        client->data_storage = entries;
+        client->data_storage[index].filter = copy;
+        ++client->data_storage_count;
+    }
+    client->data_storage[index].storage = *storage;
+exit:
+    MQTT_API_UNLOCK(client);
+    return err;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
 esp_transport_handle_t esp_mqtt_client_get_transport(esp_mqtt_client_handle_t client, char *transport_scheme)
 {
     if (client == NULL || (transport_scheme == NULL && client->config->transport == NULL))
@@ -14,6 +14,8 @@
 #include "esp_netif.h"
 #include "esp_log.h"
 #include "mqtt_client.h"
+#include "mqtt_client.hpp"
+#include "mqtt_client_coro.hpp"
 
 static const char *TAG = "mqtt_example";
 
@@ -79,6 +81,55 @@ static void mqtt_app_start(void)
     err = esp_mqtt_client_destroy(client);
 }
 
+static void mqtt_cpp_app_start(void)
+{
+    esp_mqtt_client_config_t mqtt_cfg = { };
+
+    esp_mqtt::client client(mqtt_cfg);
+    if (!client) {
+        return;
+    }
+    client.on_data([](const esp_mqtt::message_view & message) {
+        ESP_LOGI(TAG, "MQTT_EVENT_DATA %.*s: %.*s", (int)message.topic.size(), message.topic.data(),
+                 (int)message.text().size(), message.text().data());
+    });
+    client.on_event(MQTT_EVENT_CONNECTED, [](const esp_mqtt_event_t &event) {
+        ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+    });
+    client.start();
+    int msg_id = client.publish("/topic/qos1", "data", 1);
+    ESP_LOGI(TAG, "mqtt api returned %d", msg_id);
+    msg_id = client.subscribe("/topic/qos0");
+    ESP_LOGI(TAG, "mqtt api returned %d", msg_id);
+    esp_mqtt::client moved = std::move(client);
+    moved.stop();
+}
+
+static esp_mqtt::detached mqtt_coro_session(esp_mqtt::async_client &client)
+{
+    esp_mqtt::ack ack = co_await client.subscribe("/topic/qos1", 1);
+    ESP_LOGI(TAG, "subscribed %d, granted qos %d", ack.msg_id, ack.granted_qos);
+    ack = co_await client.publish("/topic/qos1", "data", 1);
+    ESP_LOGI(TAG, "published %d: %s", ack.msg_id, esp_err_to_name(ack.err));
+#ifdef CONFIG_MQTT_PROTOCOL_5
+    esp_mqtt::response response = co_await client.request("/topic/request", "data");
+    ESP_LOGI(TAG, "response %s: %.*s", esp_err_to_name(response.status), (int)response.len, response.data.get());
+#endif
+}
+
+static void mqtt_coro_app_start(void)
+{
+    esp_mqtt_client_config_t mqtt_cfg = { };
+
+    // must outlive the coroutines awaiting its operations
+    static esp_mqtt::async_client client(mqtt_cfg);
+    if (!client) {
+        return;
+    }
+    client.sync().start();
+    mqtt_coro_session(client);
+}
+
 extern "C" void app_main(void)
 {
     ESP_LOGI(TAG, "[APP] Startup..");
@@ -98,4 +149,6 @@ extern "C" void app_main(void)
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
     mqtt_app_start();
+    mqtt_cpp_app_start();
+    mqtt_coro_app_start();
 }
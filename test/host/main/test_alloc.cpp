@@ -0,0 +1,148 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <cstring>
+#include <memory_resource>
+#include <string>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_alloc.h"
+#include "mqtt_outbox.h"
+#include "mqtt_msg.h"
+extern "C" {
+#include "Mockesp_timer.h"
+}
+
+namespace {
+
+/* Counts the outstanding bytes, std::pmr checks the sizes passed back in debug builds only */
+class counting_resource : public std::pmr::memory_resource {
+public:
+    size_t allocated = 0;
+    int blocks = 0;
+private:
+    void *do_allocate(size_t size, size_t align) override
+    {
+        allocated += size;
+        ++blocks;
+        return std::pmr::new_delete_resource()->allocate(size, align);
+    }
+    void do_deallocate(void *ptr, size_t size, size_t align) override
+    {
+        REQUIRE(allocated >= size);
+        allocated -= size;
+        --blocks;
+        std::pmr::new_delete_resource()->deallocate(ptr, size, align);
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+};
+
+esp_mqtt_allocator_t hooks_of(std::pmr::memory_resource &resource)
+{
+    return {
+        .alloc = [](void *ctx, size_t size, size_t align) -> void *{
+            return static_cast<std::pmr::memory_resource *>(ctx)->allocate(size, align);
+        },
+        .free = [](void *ctx, void *ptr, size_t size, size_t align) {
+            static_cast<std::pmr::memory_resource *>(ctx)->deallocate(ptr, size, align);
+        },
+        .ctx = &resource,
+    };
+}
+
+}
+
+SCENARIO("Allocator hooks")
+{
+    counting_resource resource;
+    esp_mqtt_allocator_t hooks = hooks_of(resource);
+    mqtt_allocator_t allocator;
+    mqtt_allocator_init(&allocator, &hooks, 0);
+
+    GIVEN("Blocks allocated and resized through the hooks") {
+        char *str = mqtt_strdup(&allocator, "topic");
+        REQUIRE(str != nullptr);
+        void *ptr = mqtt_calloc(&allocator, 4, 100);
+        REQUIRE(ptr != nullptr);
+        ptr = mqtt_realloc(&allocator, ptr, 1000);
+        REQUIRE(ptr != nullptr);
+        CHECK(resource.blocks == 2);
+
+        THEN("The content is kept and the memory is returned with the sizes it was taken with") {
+            CHECK(std::strcmp(str, "topic") == 0);
+            CHECK(static_cast<uint8_t *>(ptr)[399] == 0);
+            mqtt_free(&allocator, str);
+            mqtt_free(&allocator, ptr);
+            CHECK(resource.blocks == 0);
+            CHECK(resource.allocated == 0);
+        }
+    }
+    GIVEN("An outbox using the allocator") {
+        esp_timer_get_time_IgnoreAndReturn(0);
+        auto outbox = outbox_init(nullptr, &allocator);
+        REQUIRE(outbox != nullptr);
+        std::string packet = "payload";
+        outbox_message_t msg = {};
+        msg.data = reinterpret_cast<uint8_t *>(packet.data());
+        msg.len = packet.size();
+        msg.msg_id = 1;
+        msg.msg_type = MQTT_MSG_TYPE_PUBLISH;
+        msg.msg_qos = 1;
+        REQUIRE(outbox_enqueue(outbox, &msg, 0) != nullptr);
+        CHECK(resource.blocks > 1);
+
+        THEN("All of its memory is returned once destroyed") {
+            outbox_destroy(outbox);
+            CHECK(resource.blocks == 0);
+            CHECK(resource.allocated == 0);
+        }
+    }
+}
+
+SCENARIO("QoS1 queues of clients with their own allocators")
+{
+    counting_resource first_resource, second_resource;
+    esp_mqtt_allocator_t first_hooks = hooks_of(first_resource);
+    esp_mqtt_allocator_t second_hooks = hooks_of(second_resource);
+    mqtt_allocator_t first_allocator, second_allocator;
+    mqtt_allocator_init(&first_allocator, &first_hooks, 0);
+    mqtt_allocator_init(&second_allocator, &second_hooks, 0);
+    esp_timer_get_time_IgnoreAndReturn(0);
+
+    GIVEN("Two outboxes tracking more messages than the static slots") {
+        auto first = outbox_init(nullptr, &first_allocator);
+        auto second = outbox_init(nullptr, &second_allocator);
+        REQUIRE(first != nullptr);
+        REQUIRE(second != nullptr);
+        std::string topic = "topic", payload = "payload";
+        auto track = [&](outbox_handle_t outbox, int msg_id) {
+            return mqtt_qos1q_track(outbox_get_qos1_queue(outbox), topic.c_str(), topic.size(),
+                                    payload.c_str(), payload.size(), false, msg_id);
+        };
+        for (int i = 1; i <= 2 * STATIC_SLOT_COUNT; ++i) {
+            REQUIRE(track(first, i) == i);
+            REQUIRE(track(second, i) == i);
+        }
+        size_t first_allocated = first_resource.allocated;
+
+        THEN("Destroying one returns its blocks to its own allocator only") {
+            outbox_destroy(second);
+            CHECK(second_resource.blocks == 0);
+            CHECK(first_resource.allocated == first_allocated);
+            AND_THEN("The other keeps allocating its blocks from its allocator") {
+                for (int i = 2 * STATIC_SLOT_COUNT + 1; i <= 4 * STATIC_SLOT_COUNT; ++i) {
+                    CHECK(track(first, i) == i);
+                }
+                CHECK(first_resource.allocated > first_allocated);
+                CHECK(second_resource.blocks == 0);
+                outbox_destroy(first);
+                CHECK(first_resource.blocks == 0);
+            }
+        }
+    }
+}
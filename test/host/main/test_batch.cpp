@@ -0,0 +1,95 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <string>
+#include <vector>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_batch.h"
+
+namespace {
+struct published {
+    std::string topic;
+    std::vector<uint8_t> frame;
+    int qos;
+};
+
+int collect(void *ctx, const char *topic, const uint8_t *frame, size_t len, int qos, int retain)
+{
+    static_cast<std::vector<published> *>(ctx)->push_back({topic, std::vector<uint8_t>(frame, frame + len), qos});
+    return 0;
+}
+
+std::vector<std::string> samples_of(const std::vector<uint8_t> &frame)
+{
+    std::vector<std::string> samples;
+    size_t offset = 0;
+    const uint8_t *sample;
+    size_t len;
+    while (mqtt_batch_next(frame.data(), frame.size(), &offset, &sample, &len) == ESP_OK) {
+        samples.emplace_back(reinterpret_cast<const char *>(sample), len);
+    }
+    return samples;
+}
+}
+
+SCENARIO("Telemetry batching")
+{
+    std::vector<published> out;
+    auto add = [](mqtt_batcher_handle_t batcher, const char *topic, const std::string & sample, int qos, uint64_t now) {
+        return mqtt_batcher_add(batcher, topic, reinterpret_cast<const uint8_t *>(sample.data()), sample.size(), qos, 0, now);
+    };
+
+    GIVEN("A batcher limited to 3 samples, 64 bytes and 100ms") {
+        auto batcher = mqtt_batcher_create(64, 3, 100, 2, collect, &out, nullptr);
+        REQUIRE(batcher != nullptr);
+
+        THEN("Samples are published together once the count is reached, with the highest QoS") {
+            CHECK(add(batcher, "t", "1", 0, 0) == ESP_OK);
+            CHECK(add(batcher, "t", "22", 1, 0) == ESP_OK);
+            CHECK(out.empty());
+            CHECK(add(batcher, "t", "", 0, 0) == ESP_OK);
+            REQUIRE(out.size() == 1);
+            CHECK(out[0].qos == 1);
+            CHECK(samples_of(out[0].frame) == std::vector<std::string> {"1", "22", ""});
+        }
+        THEN("A sample which doesn't fit publishes the batch first") {
+            CHECK(add(batcher, "t", std::string(40, 'a'), 0, 0) == ESP_OK);
+            CHECK(add(batcher, "t", std::string(40, 'b'), 0, 0) == ESP_OK);
+            REQUIRE(out.size() == 1);
+            CHECK(samples_of(out[0].frame) == std::vector<std::string> {std::string(40, 'a')});
+            CHECK(add(batcher, "t", std::string(64, 'c'), 0, 0) == ESP_ERR_INVALID_SIZE);
+        }
+        THEN("Batches are published once the latency budget is reached, per topic") {
+            add(batcher, "a", "1", 0, 0);
+            add(batcher, "b", "2", 0, 50);
+            CHECK(mqtt_batcher_flush_expired(batcher, 99) == 0);
+            CHECK(mqtt_batcher_flush_expired(batcher, 100) == 1);
+            REQUIRE(out.size() == 1);
+            CHECK(out[0].topic == "a");
+        }
+        THEN("A new topic takes the slot of the oldest batch") {
+            add(batcher, "a", "1", 0, 0);
+            add(batcher, "b", "2", 0, 10);
+            add(batcher, "c", "3", 0, 20);
+            REQUIRE(out.size() == 1);
+            CHECK(out[0].topic == "a");
+            CHECK(mqtt_batcher_flush(batcher, nullptr) == ESP_OK);
+            CHECK(out.size() == 3);
+        }
+        mqtt_batcher_destroy(batcher);
+    }
+    GIVEN("A malformed frame") {
+        const uint8_t frame[] = {'M', 'B', 1, 0x85, 0x01, 'x'};
+        size_t offset = 0;
+        const uint8_t *sample;
+        size_t len;
+        THEN("It's refused") {
+            CHECK(mqtt_batch_next(frame, sizeof(frame), &offset, &sample, &len) == ESP_ERR_INVALID_RESPONSE);
+            offset = 0;
+            CHECK(mqtt_batch_next(frame + 1, sizeof(frame) - 1, &offset, &sample, &len) == ESP_ERR_INVALID_RESPONSE);
+        }
+    }
+}
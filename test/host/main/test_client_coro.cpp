@@ -0,0 +1,96 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <vector>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_client_coro.hpp"
+
+using esp_mqtt::ack;
+using esp_mqtt::detail::ack_awaitable;
+using esp_mqtt::detail::pending_table;
+
+template <typename Issue>
+static esp_mqtt::detached operation(pending_table &table, Issue issue, std::vector<ack> &results)
+{
+    results.push_back(co_await ack_awaitable(table, issue, true));
+}
+
+static void acknowledge(pending_table &table, esp_mqtt_event_id_t id, int msg_id, char code = 0)
+{
+    esp_mqtt_event_t event = {};
+    event.event_id = id;
+    event.msg_id = msg_id;
+    event.data = &code;
+    event.data_len = 1;
+    esp_mqtt::detail::complete(table, event);
+}
+
+SCENARIO("Awaitable operations")
+{
+    pending_table table;
+    std::vector<ack> results;
+
+    GIVEN("Many coroutines waiting for their acknowledgement") {
+        constexpr int operations = 2000;
+        for (int id = 1; id <= operations; ++id) {
+            operation(table, [id] { return id; }, results);
+        }
+        REQUIRE(results.empty());
+        REQUIRE(table.size() == operations);
+
+        THEN("Each one is resumed by its acknowledgement, in any order") {
+            for (int id = operations; id > 0; id -= 2) {
+                acknowledge(table, MQTT_EVENT_PUBLISHED, id);
+            }
+            acknowledge(table, MQTT_EVENT_PUBLISHED, operations);
+            CHECK(results.size() == operations / 2);
+            for (int id = 1; id < operations; id += 2) {
+                acknowledge(table, MQTT_EVENT_DELETED, id);
+            }
+            REQUIRE(results.size() == operations);
+            CHECK(results.front().msg_id == operations);
+            CHECK(results.front().err == ESP_OK);
+            CHECK(results.back().msg_id == operations - 1);
+            CHECK(results.back().err == ESP_ERR_TIMEOUT);
+            CHECK(table.size() == 0);
+        }
+    }
+    GIVEN("An acknowledgement processed before the operation is awaited") {
+        operation(table, [&] {
+            acknowledge(table, MQTT_EVENT_SUBSCRIBED, 42, 1);
+            return 42;
+        }, results);
+        THEN("The coroutine isn't suspended") {
+            REQUIRE(results.size() == 1);
+            CHECK(results[0].msg_id == 42);
+            CHECK(results[0].granted_qos == 1);
+            CHECK(table.size() == 0);
+        }
+    }
+    GIVEN("Acknowledgements of operations nobody awaits") {
+        acknowledge(table, MQTT_EVENT_PUBLISHED, 7);
+        operation(table, [&] {
+            acknowledge(table, MQTT_EVENT_PUBLISHED, 8);
+            return 9;
+        }, results);
+        THEN("They aren't kept") {
+            CHECK(table.size() == 1);
+            acknowledge(table, MQTT_EVENT_PUBLISHED, 9);
+            CHECK(results.size() == 1);
+            CHECK(table.size() == 0);
+        }
+    }
+    GIVEN("Failed operations") {
+        operation(table, [] { return -1; }, results);
+        operation(table, [] { return 3; }, results);
+        acknowledge(table, MQTT_EVENT_SUBSCRIBED, 3, static_cast<char>(0x80));
+        THEN("They complete with an error") {
+            REQUIRE(results.size() == 2);
+            CHECK(results[0].err == ESP_FAIL);
+            CHECK(results[1].err == ESP_ERR_INVALID_RESPONSE);
+        }
+    }
+}
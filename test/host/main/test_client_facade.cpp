@@ -0,0 +1,50 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <string>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_client.hpp"
+
+SCENARIO("C++ facade message views")
+{
+    GIVEN("A data event of a message received in two parts") {
+        std::string topic = "sensors/temp";
+        std::string data = "21.5";
+        esp_mqtt_event_t event = {};
+        event.event_id = MQTT_EVENT_DATA;
+        event.topic = topic.data();
+        event.topic_len = topic.size();
+        event.data = data.data();
+        event.data_len = data.size();
+        event.total_data_len = 8;
+        event.qos = 1;
+
+        THEN("The first part refers to the event buffers") {
+            auto message = esp_mqtt::message_view::from(event);
+            CHECK(message.topic == "sensors/temp");
+            CHECK(message.text() == "21.5");
+            CHECK(static_cast<const void *>(message.data.data()) == data.data());
+            CHECK(message.is_first());
+            CHECK_FALSE(message.is_complete());
+        }
+        THEN("The last part completes the message") {
+            event.topic = nullptr;
+            event.topic_len = 0;
+            event.current_data_offset = 4;
+            auto message = esp_mqtt::message_view::from(event);
+            CHECK(message.topic.empty());
+            CHECK_FALSE(message.is_first());
+            CHECK(message.is_complete());
+        }
+    }
+    GIVEN("Topics from various strings") {
+        std::string topic = "a/b";
+        THEN("They are viewed without copy") {
+            CHECK(esp_mqtt::topic_view(topic).c_str() == topic.c_str());
+            CHECK(esp_mqtt::topic_view("c/d").view() == "c/d");
+        }
+    }
+}
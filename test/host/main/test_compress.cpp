@@ -0,0 +1,149 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_compress.h"
+#include "mqtt_msg.h"
+
+static std::string telemetry(size_t len)
+{
+    std::string json = "[";
+    std::mt19937 rng(42);
+    for (int i = 0; json.size() < len; ++i) {
+        json += "{\"id\":" + std::to_string(i) + ",\"temperature\":" + std::to_string(200 + rng() % 50) +
+                ",\"humidity\":" + std::to_string(rng() % 100) + ",\"status\":\"ok\"},";
+    }
+    json.resize(len);
+    return json;
+}
+
+static std::vector<uint8_t> compress(const std::string &payload, int block_shift)
+{
+    std::vector<uint8_t> frame(mqtt_compress_bound(payload.size(), block_shift));
+    int len = mqtt_compress(reinterpret_cast<const uint8_t *>(payload.data()), payload.size(), frame.data(), frame.size(), block_shift, nullptr);
+    REQUIRE(len > 0);
+    frame.resize(len);
+    return frame;
+}
+
+static esp_err_t append(void *ctx, const uint8_t *data, size_t len)
+{
+    static_cast<std::string *>(ctx)->append(reinterpret_cast<const char *>(data), len);
+    return ESP_OK;
+}
+
+static esp_err_t decompress(const std::vector<uint8_t> &frame, size_t chunk, std::string &out)
+{
+    auto decompress = mqtt_decompress_create(nullptr);
+    esp_err_t err = ESP_OK;
+    for (size_t pos = 0; pos < frame.size() && err == ESP_OK; pos += chunk) {
+        err = mqtt_decompress_feed(decompress, frame.data() + pos, std::min(chunk, frame.size() - pos), append, &out);
+    }
+    if (err == ESP_OK && !mqtt_decompress_is_done(decompress)) {
+        err = ESP_FAIL;
+    }
+    mqtt_decompress_destroy(decompress);
+    return err;
+}
+
+SCENARIO("Payload compression")
+{
+    GIVEN("A JSON telemetry payload spanning several blocks") {
+        auto payload = telemetry(10000);
+        auto frame = compress(payload, 10);
+        size_t raw_len = 0;
+        REQUIRE(mqtt_compress_is_frame(frame.data(), frame.size(), &raw_len));
+        CHECK(raw_len == payload.size());
+        CHECK(frame.size() < payload.size() / 2);
+
+        THEN("It is decompressed whatever the chunks it's received in") {
+            for (size_t chunk : {1, 7, 100, 1024, 100000}) {
+                std::string out;
+                REQUIRE(decompress(frame, chunk, out) == ESP_OK);
+                CHECK(out == payload);
+            }
+        }
+        THEN("A corrupted frame is refused") {
+            frame[frame.size() / 2] ^= 0x55;
+            frame[MQTT_COMPRESS_HEADER_LEN] ^= 0xFF;
+            std::string out;
+            CHECK(decompress(frame, 64, out) != ESP_OK);
+        }
+        THEN("The data of a frame corrupted past its first block stops short of its length") {
+            // what the client delivers before reporting MQTT_ERROR_TYPE_DECOMPRESSION_FAILED
+            size_t second = MQTT_COMPRESS_HEADER_LEN + MQTT_COMPRESS_BLOCK_HEADER_LEN + (frame[MQTT_COMPRESS_HEADER_LEN] | frame[MQTT_COMPRESS_HEADER_LEN + 1] << 8);
+            frame[second + 3] = 0xFF;
+            std::string out;
+            CHECK(decompress(frame, 64, out) != ESP_OK);
+            CHECK(out.size() == 1024);
+            CHECK(payload.compare(0, out.size(), out) == 0);
+        }
+        THEN("A truncated frame is not done") {
+            frame.resize(frame.size() * 3 / 4);
+            std::string out;
+            CHECK(decompress(frame, 100, out) != ESP_OK);
+            CHECK(out.size() < raw_len);
+            CHECK(payload.compare(0, out.size(), out) == 0);
+        }
+    }
+    GIVEN("Incompressible data") {
+        std::string payload(3000, '\0');
+        std::mt19937 rng(1);
+        for (auto &c : payload) {
+            c = static_cast<char>(rng());
+        }
+        auto frame = compress(payload, 12);
+        THEN("It is stored and still round trips") {
+            CHECK(frame.size() <= mqtt_compress_bound(payload.size(), 12));
+            std::string out;
+            REQUIRE(decompress(frame, 333, out) == ESP_OK);
+            CHECK(out == payload);
+        }
+    }
+}
+
+TEST_CASE("Topic filter matching")
+{
+    auto matches = [](const char *filter, const std::string & topic) {
+        return mqtt_topic_matches(filter, topic.c_str(), topic.size());
+    };
+    CHECK(matches("sensors/+/temperature", "sensors/kitchen/temperature"));
+    CHECK_FALSE(matches("sensors/+/temperature", "sensors/kitchen/humidity"));
+    CHECK(matches("sensors/#", "sensors"));
+    CHECK(matches("sensors/#", "sensors/a/b"));
+    CHECK(matches("#", "anything/at/all"));
+    CHECK_FALSE(matches("#", "$SYS/broker"));
+    CHECK_FALSE(matches("+/broker", "$SYS/broker"));
+    CHECK(matches("$SYS/#", "$SYS/broker"));
+    CHECK_FALSE(matches("sensors", "sensors/a"));
+}
+
+TEST_CASE("Payload compression benchmark", "[.][benchmark]")
+{
+    auto payload = telemetry(64 * 1024);
+    constexpr int rounds = 50;
+    std::vector<uint8_t> frame;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        frame = compress(payload, 12);
+    }
+    auto compressed = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        std::string out;
+        REQUIRE(decompress(frame, 1460, out) == ESP_OK);
+    }
+    auto done = std::chrono::steady_clock::now();
+    auto mbps = [&](auto duration) {
+        return payload.size() * rounds / std::chrono::duration<double>(duration).count() / 1e6;
+    };
+    printf("ratio %.2f, compress %.1f MB/s, decompress %.1f MB/s\n",
+           double(payload.size()) / frame.size(), mbps(compressed - start), mbps(done - compressed));
+}
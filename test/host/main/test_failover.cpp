@@ -0,0 +1,75 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <cstdint>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_failover.h"
+
+static int no_jitter(int max)
+{
+    (void)max;
+    return 0;
+}
+
+SCENARIO("Broker failover")
+{
+    const char *uris[] = {"mqtt://primary", "mqtts://secondary:8883", "mqtt://backup", nullptr};
+    auto failover = mqtt_failover_create(uris, 1000, 8000, nullptr);
+    REQUIRE(failover != nullptr);
+    REQUIRE(mqtt_failover_count(failover) == 3);
+
+    GIVEN("Endpoints not measured yet") {
+        THEN("They are tried in the configured order") {
+            CHECK(mqtt_failover_select(failover, 0) == 0);
+            mqtt_failover_failed(failover, 0, no_jitter);
+            CHECK(mqtt_failover_select(failover, 0) == 1);
+            CHECK(mqtt_failover_ready(failover, 0) == 2);
+            CHECK(mqtt_failover_wait(failover, 0) == 0);
+        }
+    }
+    GIVEN("Measured endpoints") {
+        mqtt_failover_select(failover, 0);
+        mqtt_failover_connected(failover, 400);
+        mqtt_failover_ping(failover, 200);
+        CHECK(mqtt_failover_score(failover, 0) == 600);
+        mqtt_failover_failed(failover, 0, no_jitter);
+        REQUIRE(mqtt_failover_select(failover, 0) == 1);
+        mqtt_failover_connected(failover, 100);
+
+        THEN("The healthiest one is preferred") {
+            CHECK(mqtt_failover_select(failover, 10000) == 1);
+            // the failure of the primary counts until it connects again
+            CHECK(mqtt_failover_score(failover, 0) > mqtt_failover_score(failover, 2));
+        }
+    }
+    GIVEN("A failing endpoint") {
+        const char *single[] = {"mqtt://primary", nullptr};
+        auto only = mqtt_failover_create(single, 1000, 4000, nullptr);
+        REQUIRE(only != nullptr);
+        REQUIRE(mqtt_failover_select(only, 0) == 0);
+
+        THEN("Its backoff doubles up to the maximum, half of it random") {
+            uint64_t now = 0;
+            for (uint32_t wait : {500, 1000, 2000, 2000}) {
+                mqtt_failover_failed(only, now, no_jitter);
+                CHECK(mqtt_failover_ready(only, now) == 0);
+                CHECK(mqtt_failover_wait(only, now) == wait);
+                now += wait;
+                CHECK(mqtt_failover_ready(only, now) == 1);
+            }
+        }
+        THEN("A connection resets the backoff") {
+            mqtt_failover_failed(only, 0, no_jitter);
+            mqtt_failover_failed(only, 0, no_jitter);
+            mqtt_failover_connected(only, 100);
+            CHECK(mqtt_failover_ready(only, 0) == 1);
+            mqtt_failover_failed(only, 0, no_jitter);
+            CHECK(mqtt_failover_wait(only, 0) == 500);
+        }
+        mqtt_failover_destroy(only);
+    }
+    mqtt_failover_destroy(failover);
+}
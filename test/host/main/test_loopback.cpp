@@ -0,0 +1,67 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_loopback.h"
+
+static bool is_echo(mqtt_loopback_handle_t loopback, const std::string &topic, const std::string &data, uint64_t now)
+{
+    return mqtt_loopback_is_echo(loopback, topic.data(), topic.size(), data.data(), data.size(), data.size(), now, 5000);
+}
+
+SCENARIO("Local loopback")
+{
+    auto loopback = mqtt_loopback_create(4, nullptr);
+    REQUIRE(loopback != nullptr);
+
+    GIVEN("Subscriptions of the client") {
+        esp_mqtt_topic_t topics[] = { {"sensors/+/temp", 1}, {"actuators/#", 2}, {"denied", 0} };
+        REQUIRE(mqtt_loopback_subscribe(loopback, 10, topics, 3) == ESP_OK);
+        std::string topic = "sensors/kitchen/temp";
+        CHECK(mqtt_loopback_match(loopback, topic.data(), topic.size()) == -1);
+
+        THEN("They match once acknowledged, with the granted QoS") {
+            const uint8_t codes[] = {0, 1, 0x80};
+            mqtt_loopback_suback(loopback, 10, codes, 3);
+            CHECK(mqtt_loopback_match(loopback, topic.data(), topic.size()) == 0);
+            CHECK(mqtt_loopback_match(loopback, "actuators/fan", 13) == 1);
+            CHECK(mqtt_loopback_match(loopback, "denied", 6) == -1);
+
+            mqtt_loopback_unsubscribe(loopback, 11, "actuators/#");
+            CHECK(mqtt_loopback_match(loopback, "actuators/fan", 13) == -1);
+            mqtt_loopback_unsuback(loopback, 11);
+            mqtt_loopback_clear_subscriptions(loopback);
+            CHECK(mqtt_loopback_match(loopback, topic.data(), topic.size()) == -1);
+        }
+    }
+    GIVEN("Messages delivered locally") {
+        std::string topic = "state";
+        std::string large(300, 'x');
+        mqtt_loopback_delivered(loopback, topic.data(), topic.size(), "on", 2, 1000);
+        mqtt_loopback_delivered(loopback, topic.data(), topic.size(), large.data(), large.size(), 1000);
+
+        THEN("Each echo within the window is dropped once") {
+            CHECK_FALSE(is_echo(loopback, topic, "off", 1100));
+            CHECK(is_echo(loopback, topic, "on", 1100));
+            CHECK_FALSE(is_echo(loopback, topic, "on", 1100));
+            // the first chunk of a large message is enough
+            CHECK(mqtt_loopback_is_echo(loopback, topic.data(), topic.size(), large.data(), 100, large.size(), 6000, 5000));
+        }
+        THEN("Echoes arriving too late are delivered") {
+            CHECK_FALSE(is_echo(loopback, topic, "on", 6001));
+        }
+        THEN("The oldest messages are forgotten when the window is full") {
+            for (int i = 0; i < 4; ++i) {
+                mqtt_loopback_delivered(loopback, topic.data(), topic.size(), "other", 5, 1000);
+            }
+            CHECK_FALSE(is_echo(loopback, topic, "on", 1100));
+        }
+    }
+    mqtt_loopback_destroy(loopback);
+}
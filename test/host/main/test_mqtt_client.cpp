@@ -3,11 +3,14 @@
  *
  * SPDX-License-Identifier: Apache-2.0
  */
+#include <algorithm>
+#include <cstdlib>
 #include <memory>
 #include <net/if.h>
 #include <random>
 #include <string_view>
 #include <type_traits>
+#include <vector>
 #include "esp_transport.h"
 #include <catch2/catch_test_macros.hpp>
 
@@ -126,6 +129,68 @@ SCENARIO("MQTT Client Operation")
                     REQUIRE(esp_mqtt_set_config(client.get(), &config)== ESP_OK);
                 }
             }
+            SECTION("User sizes the memory of a static client") {
+                auto required = esp_mqtt_client_required_memory(&config);
+                REQUIRE(required > 2 * 1024);
+                config.buffer.size = 4096;
+                REQUIRE(esp_mqtt_client_required_memory(&config) >= required + 2 * (4096 - 1024));
+                std::vector<uint8_t> memory(required);
+                REQUIRE(esp_mqtt_client_init_static(&config, memory.data(), memory.size()) == nullptr);
+            }
+            SECTION("User places a static client in a memory region") {
+                // the largest block taken from the heap, the buffers must come from the region
+                static size_t largest_alloc = 0;
+                largest_alloc = 0;
+                config.memory.state.alloc = [](void *, size_t size, size_t) -> void * {
+                    largest_alloc = std::max(largest_alloc, size);
+                    return malloc(size);
+                };
+                config.memory.state.free = [](void *, void *ptr, size_t, size_t) {
+                    free(ptr);
+                };
+                config.buffer.size = 16 * 1024;
+                std::vector<uint8_t> memory(esp_mqtt_client_required_memory(&config));
+                auto inside = [&](const void *ptr) {
+                    return ptr >= memory.data() && ptr < memory.data() + memory.size();
+                };
+                http_parser_parse_url_ExpectAnyArgsAndReturn(0);
+                http_parser_parse_url_ReturnThruPtr_u(&ret_uri);
+                xQueueCreateMutexStatic_ExpectAnyArgsAndReturn(reinterpret_cast<QueueHandle_t>(&mtx));
+                xEventGroupCreateStatic_IgnoreAndReturn(reinterpret_cast<EventGroupHandle_t>(&event_group));
+                auto static_client = esp_mqtt_client_init_static(&config, memory.data(), memory.size());
+                REQUIRE(static_client != nullptr);
+                CHECK(inside(static_client));
+                CHECK(largest_alloc < static_cast<size_t>(config.buffer.size));
+                http_parser_parse_url_ExpectAnyArgsAndReturn(0);
+                http_parser_parse_url_ReturnThruPtr_u(&ret_uri);
+                REQUIRE(esp_mqtt_set_config(static_client, &config) == ESP_OK);
+                CHECK(largest_alloc < static_cast<size_t>(config.buffer.size));
+                // freeing a block of the region would be reported by the address sanitizer
+                esp_mqtt_client_destroy(static_client);
+            }
+            SECTION("User sets the storage of complete messages") {
+                esp_mqtt_data_storage_t storage = {
+                    .alloc = [](void *, const char *, int, int total_len) { return static_cast<char *>(malloc(total_len)); },
+                    .release = [](void *, char *buf) { free(buf); },
+                };
+                REQUIRE(esp_mqtt_client_set_data_storage(client.get(), "files/#", &storage) == ESP_OK);
+                REQUIRE(esp_mqtt_client_set_data_storage(client.get(), "files/#", nullptr) == ESP_OK);
+                REQUIRE(esp_mqtt_client_set_data_storage(client.get(), "files/#", nullptr) == ESP_ERR_NOT_FOUND);
+                storage.release = nullptr;
+                REQUIRE(esp_mqtt_client_set_data_storage(client.get(), "files/#", &storage) == ESP_ERR_INVALID_ARG);
+            }
+            SECTION("User grants receive credit") {
+                REQUIRE(esp_mqtt_client_grant_credit(client.get(), 1, 0) == ESP_ERR_INVALID_STATE);
+                REQUIRE(esp_mqtt_client_grant_credit(client.get(), -1, 0) == ESP_ERR_INVALID_ARG);
+                http_parser_parse_url_ExpectAnyArgsAndReturn(0);
+                http_parser_parse_url_ReturnThruPtr_u(&ret_uri);
+                xQueueCreateMutex_ExpectAnyArgsAndReturn(reinterpret_cast<QueueHandle_t>(&mtx));
+                config.inbound.messages = 4;
+                auto limited = unique_mqtt_client{esp_mqtt_client_init(&config)};
+                REQUIRE(limited != nullptr);
+                xEventGroupSetBits_IgnoreAndReturn(0);
+                REQUIRE(esp_mqtt_client_grant_credit(limited.get(), 2, 0) == ESP_OK);
+            }
             SECTION("After Start Client Is Cleanly destroyed") {
                 REQUIRE(esp_mqtt_client_start(client.get()) == ESP_OK);
                 // Only need to start the client, destroy is called automatically at the end of
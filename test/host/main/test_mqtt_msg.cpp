@@ -0,0 +1,268 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_msg.h"
+#include "mqtt5_msg.h"
+
+SCENARIO("Publish header of a streamed payload")
+{
+    mqtt_connection_t connection = {};
+    REQUIRE(mqtt_msg_buffer_init(&connection, 64) == ESP_OK);
+    uint16_t msg_id = 0;
+
+    GIVEN("A payload larger than the buffer") {
+        auto msg = mqtt_msg_publish_header(&connection, "a/b", 1000, 1, 0, &msg_id);
+
+        THEN("Only the header is built, its remaining length covers the payload") {
+            REQUIRE(msg->length == 1 + 2 + 2 + 3 + 2);
+            CHECK(msg->data[0] == 0x32);
+            // 2 + 3 (topic) + 2 (message id) + 1000 = 1007
+            CHECK(msg->data[1] == (1007 % 128 | 0x80));
+            CHECK(msg->data[2] == 1007 / 128);
+            CHECK(msg_id != 0);
+        }
+    }
+    GIVEN("An empty payload") {
+        auto msg = mqtt_msg_publish_header(&connection, "a/b", 0, 0, 0, &msg_id);
+
+        THEN("The header is the whole message") {
+            REQUIRE(msg->length == 1 + 1 + 2 + 3);
+            CHECK(msg->data[1] == 5);
+            CHECK(msg_id == 0);
+        }
+    }
+    mqtt_msg_buffer_destroy(&connection);
+}
+
+SCENARIO("MQTT5 publish with a precompiled property block")
+{
+    mqtt_connection_t connection = {};
+    REQUIRE(mqtt_msg_buffer_init(&connection, 256) == ESP_OK);
+    uint16_t msg_id = 0;
+    auto publish = [&](const esp_mqtt5_publish_property_config_t * property, const mqtt5_property_block_t *block) {
+        auto msg = mqtt5_msg_publish(&connection, "a/b", "data", 4, 0, 0, &msg_id, property, block, nullptr);
+        REQUIRE(msg != nullptr);
+        return std::string(reinterpret_cast<char *>(msg->data), msg->length);
+    };
+    esp_mqtt5_publish_property_config_t property = {};
+    property.payload_format_indicator = true;
+    property.message_expiry_interval = 60;
+    property.content_type = "json";
+
+    GIVEN("A block of publish properties") {
+        auto block = mqtt5_property_block_create(&property);
+        REQUIRE(block != nullptr);
+
+        THEN("The message is the same as with the properties set for it") {
+            CHECK(publish(nullptr, block) == publish(&property, nullptr));
+        }
+        THEN("Properties set for the message replace those of the block") {
+            esp_mqtt5_publish_property_config_t message = {};
+            message.message_expiry_interval = 10;
+            auto with_block = publish(&message, block);
+            esp_mqtt5_publish_property_config_t expected = property;
+            expected.message_expiry_interval = 10;
+            CHECK(with_block.size() == publish(&expected, nullptr).size());
+            CHECK(with_block.find(std::string("\x02\x00\x00\x00\x0a", 5)) != std::string::npos);
+            CHECK(with_block.find(std::string("\x02\x00\x00\x00\x3c", 5)) == std::string::npos);
+        }
+        mqtt5_property_block_destroy(block);
+    }
+    GIVEN("Properties depending on the connection") {
+        property.response_topic = "reply";
+        THEN("They can't be precompiled") {
+            CHECK(mqtt5_property_block_create(&property) == nullptr);
+        }
+    }
+    mqtt_msg_buffer_destroy(&connection);
+}
+
+SCENARIO("MQTT5 properties of received packets")
+{
+    // PUBLISH QoS 1 on "a/b", message id 1
+    auto publish = [](const std::string & properties, const std::string & payload) {
+        std::string packet = std::string("\x00\x03" "a/b" "\x00\x01", 7) + static_cast<char>(properties.size()) + properties + payload;
+        return std::string(1, '\x32') + static_cast<char>(packet.size()) + packet;
+    };
+    auto parse_publish = [](std::string & packet, esp_mqtt5_publish_resp_property_t &property, mqtt5_user_property_handle_t &user_property, size_t &payload_len) {
+        char *topic = nullptr;
+        size_t topic_len = 0;
+        uint16_t property_len = 0;
+        return mqtt5_get_publish_property_payload(reinterpret_cast<uint8_t *>(packet.data()), packet.size(), &topic, &topic_len,
+                                                  &property, &property_len, &payload_len, &user_property);
+    };
+    const std::string properties("\x01\x01"                      // payload format indicator
+                                 "\x02\x00\x00\x00\x3c"          // message expiry interval
+                                 "\x23\x00\x05"                  // topic alias
+                                 "\x08\x00\x05" "reply"          // response topic
+                                 "\x09\x00\x02" "id"             // correlation data
+                                 "\x0b\x81\x01"                  // subscription identifier 129
+                                 "\x03\x00\x04" "json"           // content type
+                                 "\x26\x00\x01" "k" "\x00\x01" "v", 40);
+    esp_mqtt5_publish_resp_property_t property = {};
+    mqtt5_user_property_handle_t user_property = nullptr;
+    size_t payload_len = 0;
+
+    GIVEN("A publish with all its properties") {
+        auto packet = publish(properties, "data");
+
+        THEN("They are decoded in one pass") {
+            char *payload = parse_publish(packet, property, user_property, payload_len);
+            REQUIRE(payload != nullptr);
+            CHECK(std::string(payload, payload_len) == "data");
+            CHECK(property.payload_format_indicator);
+            CHECK(property.message_expiry_interval == 60);
+            CHECK(property.topic_alias == 5);
+            CHECK(std::string(property.response_topic, property.response_topic_len) == "reply");
+            CHECK(std::string(property.correlation_data, property.correlation_data_len) == "id");
+            CHECK(property.subscribe_id == 129);
+            CHECK(std::string(property.content_type, property.content_type_len) == "json");
+            REQUIRE(user_property != nullptr);
+            CHECK(std::string(STAILQ_FIRST(user_property)->key) == "k");
+            CHECK(std::string(STAILQ_FIRST(user_property)->value) == "v");
+        }
+    }
+    GIVEN("A publish without user properties") {
+        auto packet = publish(properties.substr(0, 33) + std::string("\x0b\x02", 2), "data");
+
+        THEN("They are decoded the same way") {
+            char *payload = parse_publish(packet, property, user_property, payload_len);
+            REQUIRE(payload != nullptr);
+            CHECK(std::string(payload, payload_len) == "data");
+            CHECK(property.message_expiry_interval == 60);
+            CHECK(property.topic_alias == 5);
+            CHECK(std::string(property.response_topic, property.response_topic_len) == "reply");
+            CHECK(std::string(property.correlation_data, property.correlation_data_len) == "id");
+            CHECK(std::string(property.content_type, property.content_type_len) == "json");
+            CHECK(property.subscribe_id == 2);
+            CHECK(user_property == nullptr);
+        }
+    }
+    GIVEN("Malformed properties") {
+        THEN("The packet is rejected") {
+            for (auto malformed : {
+                        std::string("\x2b\x00", 2),                      // unknown id
+                        std::string("\x23\x00\x05\x23\x00\x06", 6),      // duplicated topic alias
+                        std::string("\x08\x00\x10" "reply", 8),          // string past the properties
+                        std::string("\x0b\x81\x81\x81\x81\x01", 6),      // variable byte integer of five bytes
+                        std::string("\x26\x00\x01" "k", 4),              // user property without value
+                    }) {
+                auto packet = publish(malformed, "data");
+                CHECK(parse_publish(packet, property, user_property, payload_len) == nullptr);
+                CHECK(user_property == nullptr);
+            }
+        }
+        THEN("Properties not allowed in the packet are skipped") {
+            auto packet = publish(std::string("\x24\x01\x23\x00\x05", 5), "data");
+            CHECK(parse_publish(packet, property, user_property, payload_len) != nullptr);
+            CHECK(property.topic_alias == 5);
+        }
+    }
+    GIVEN("A connack with properties") {
+        const std::string connack_properties("\x21\x00\x0a"            // receive maximum
+                                             "\x24\x01"                // maximum QoS
+                                             "\x12\x00\x02" "id"       // assigned client identifier
+                                             "\x13\x00\x1e", 13);      // server keep alive
+        std::string packet = std::string("\x20\x10\x01\x00\x0d", 5) + connack_properties;
+        mqtt_connect_info_t info = {};
+        esp_mqtt5_connection_property_storage_t connection_property = {};
+        esp_mqtt5_connection_server_resp_property_t resp_property = {};
+        int reason_code = -1;
+        uint8_t ack_flag = 0;
+
+        THEN("They update the connection") {
+            REQUIRE(mqtt5_msg_parse_connack_property(reinterpret_cast<uint8_t *>(packet.data()), packet.size(), nullptr, &info, &connection_property,
+                                                     &resp_property, &reason_code, &ack_flag, &user_property) == ESP_OK);
+            CHECK(reason_code == 0);
+            CHECK(ack_flag == 1);
+            CHECK(resp_property.receive_maximum == 10);
+            CHECK(resp_property.max_qos == 1);
+            CHECK(std::string(info.client_id) == "id");
+            CHECK(info.keepalive == 30);
+        }
+        THEN("Truncated ones are rejected") {
+            packet[4] = 0x0e;
+            CHECK(mqtt5_msg_parse_connack_property(reinterpret_cast<uint8_t *>(packet.data()), packet.size(), nullptr, &info, &connection_property,
+                                                   &resp_property, &reason_code, &ack_flag, &user_property) == ESP_FAIL);
+        }
+        mqtt_free(nullptr, info.client_id);
+        mqtt_free(nullptr, resp_property.response_info);
+    }
+    GIVEN("Randomly corrupted packets") {
+        // fuzzing of the decoder, out of bounds accesses are caught by the address sanitizer
+        auto packet = publish(properties, "data");
+        uint32_t seed = 1;
+        auto next = [&seed]() {
+            seed = seed * 1103515245 + 12345;
+            return seed >> 16;
+        };
+
+        THEN("They are parsed within their bounds") {
+            for (int i = 0; i < 20000; ++i) {
+                std::string corrupted = packet.substr(0, 3 + next() % (packet.size() - 2));
+                for (int flips = 1 + next() % 4; flips > 0; --flips) {
+                    corrupted[1 + next() % (corrupted.size() - 1)] = static_cast<char>(next());
+                }
+                auto buffer = std::make_unique<uint8_t[]>(corrupted.size());
+                memcpy(buffer.get(), corrupted.data(), corrupted.size());
+                property = {};
+                char *topic = nullptr;
+                size_t topic_len = 0;
+                uint16_t property_len = 0;
+                char *payload = mqtt5_get_publish_property_payload(buffer.get(), corrupted.size(), &topic, &topic_len,
+                                                                   &property, &property_len, &payload_len, &user_property);
+                if (payload) {
+                    CHECK(payload + payload_len <= reinterpret_cast<char *>(buffer.get()) + corrupted.size());
+                }
+                esp_mqtt5_client_delete_user_property(user_property);
+                user_property = nullptr;
+            }
+        }
+    }
+    esp_mqtt5_client_delete_user_property(user_property);
+}
+
+/*
+ * Not run by default, select it with:
+ * ./build/host_mqtt_client_test.elf "[benchmark]"
+ */
+TEST_CASE("MQTT5 property parsing benchmark", "[.][benchmark]")
+{
+    auto publish = [](const std::string & properties) {
+        std::string packet = std::string("\x00\x0b" "sensors/t/1" "\x00\x01", 15) + static_cast<char>(properties.size()) + properties + "21.5";
+        return std::string(1, '\x32') + static_cast<char>(packet.size()) + packet;
+    };
+    auto run = [](const char *name, std::string packet) {
+        constexpr int rounds = 2000000;
+        auto start = std::chrono::steady_clock::now();
+        size_t checksum = 0;
+        int failed = 0;
+        for (int i = 0; i < rounds; ++i) {
+            char *topic = nullptr;
+            size_t topic_len = 0;
+            uint16_t property_len = 0;
+            size_t payload_len = 0;
+            esp_mqtt5_publish_resp_property_t property = {};
+            mqtt5_user_property_handle_t user_property = nullptr;
+            char *payload = mqtt5_get_publish_property_payload(reinterpret_cast<uint8_t *>(packet.data()), packet.size(), &topic, &topic_len,
+                                                               &property, &property_len, &payload_len, &user_property);
+            failed += payload == nullptr;
+            checksum += payload_len + property.topic_alias + property.message_expiry_interval;
+        }
+        auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rounds;
+        CHECK(failed == 0);
+        printf("%s: %.1f ns/publish (%zu)\n", name, ns, checksum);
+    };
+    run("no properties", publish(""));
+    run("topic alias", publish(std::string("\x23\x00\x05", 3)));
+    run("alias, expiry, format", publish(std::string("\x01\x01" "\x02\x00\x00\x00\x3c" "\x23\x00\x05", 10)));
+    run("request/response", publish(std::string("\x08\x00\x05" "reply" "\x09\x00\x02" "id" "\x03\x00\x04" "json" "\x0b\x81\x01", 23)));
+}
@@ -0,0 +1,175 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_offline_log.h"
+
+using unique_offline_log = std::unique_ptr < std::remove_pointer_t<mqtt_offline_log_handle_t>, decltype([](mqtt_offline_log_handle_t log)
+{
+    mqtt_offline_log_close(log);
+}) >;
+
+static std::filesystem::path make_log_dir()
+{
+    auto dir = std::filesystem::temp_directory_path() / ("mqtt_offline_log_" + std::to_string(std::random_device{}()));
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    return dir;
+}
+
+static int append_messages(mqtt_offline_log_handle_t log, int count, int qos = 1)
+{
+    for (int i = 0; i < count; ++i) {
+        auto payload = "payload-" + std::to_string(i);
+        if (mqtt_offline_log_append(log, "test/topic", 10, payload.data(), payload.size(), qos, i & 1) != ESP_OK) {
+            return i;
+        }
+    }
+    return count;
+}
+
+SCENARIO("MQTT offline log")
+{
+    auto dir = make_log_dir();
+    constexpr int batch = 4;
+    GIVEN("A log with small segments") {
+        auto log = unique_offline_log{mqtt_offline_log_open(nullptr, dir.c_str(), 128, 0, batch, nullptr)};
+        REQUIRE(log != nullptr);
+        REQUIRE(mqtt_offline_log_is_drained(log.get()));
+        REQUIRE(append_messages(log.get(), 10) == 10);
+        REQUIRE_FALSE(mqtt_offline_log_is_drained(log.get()));
+
+        SECTION("Messages are replayed in order, one batch at a time") {
+            mqtt_offline_log_record_t record;
+            for (int i = 0; i < batch; ++i) {
+                REQUIRE(mqtt_offline_log_read(log.get(), &record) == ESP_OK);
+                CHECK(std::string(record.topic) == "test/topic");
+                CHECK(std::string(record.data, record.data_len) == "payload-" + std::to_string(i));
+                CHECK(record.qos == 1);
+                CHECK(record.retain == (i & 1));
+                mqtt_offline_log_sent(log.get(), i + 1);
+            }
+            // batch is full until acknowledged
+            REQUIRE(mqtt_offline_log_read(log.get(), &record) == ESP_ERR_NOT_FOUND);
+            for (int i = 0; i < batch; ++i) {
+                REQUIRE(mqtt_offline_log_ack(log.get(), i + 1));
+            }
+            REQUIRE(mqtt_offline_log_read(log.get(), &record) == ESP_OK);
+            CHECK(std::string(record.data, record.data_len) == "payload-4");
+        }
+        SECTION("Unacknowledged messages are replayed again after rewind and reopen") {
+            mqtt_offline_log_record_t record;
+            for (int i = 0; i < batch; ++i) {
+                REQUIRE(mqtt_offline_log_read(log.get(), &record) == ESP_OK);
+                mqtt_offline_log_sent(log.get(), i + 1);
+                REQUIRE(mqtt_offline_log_ack(log.get(), i + 1));
+            }
+            REQUIRE(mqtt_offline_log_read(log.get(), &record) == ESP_OK);
+            mqtt_offline_log_sent(log.get(), 42);
+            mqtt_offline_log_rewind(log.get());
+            CHECK_FALSE(mqtt_offline_log_ack(log.get(), 42));
+
+            log.reset(mqtt_offline_log_open(nullptr, dir.c_str(), 128, 0, batch, nullptr));
+            REQUIRE(log != nullptr);
+            REQUIRE(mqtt_offline_log_read(log.get(), &record) == ESP_OK);
+            CHECK(std::string(record.data, record.data_len) == "payload-4");
+        }
+        SECTION("Delivered segments are compacted") {
+            mqtt_offline_log_record_t record;
+            while (!mqtt_offline_log_is_drained(log.get())) {
+                if (mqtt_offline_log_read(log.get(), &record) == ESP_OK) {
+                    mqtt_offline_log_sent(log.get(), 0);
+                }
+            }
+            mqtt_offline_log_stats_t stats;
+            mqtt_offline_log_get_stats(log.get(), &stats);
+            CHECK(stats.acked_records == 10);
+            CHECK(stats.compacted_segments > 0);
+            int segments = 0;
+            for (auto const &entry : std::filesystem::directory_iterator(dir)) {
+                segments += entry.path().extension() == ".log";
+            }
+            CHECK(segments == 0);
+        }
+        SECTION("Corrupted records are skipped") {
+            log.reset();
+            auto segment = dir / "00000000.log";
+            REQUIRE(std::filesystem::exists(segment));
+            {
+                std::fstream file(segment, std::ios::in | std::ios::out | std::ios::binary);
+                file.seekp(MQTT_OFFLINE_LOG_RECORD_HEADER_LEN + 2);
+                file.put('X');
+            }
+            log.reset(mqtt_offline_log_open(nullptr, dir.c_str(), 128, 0, batch, nullptr));
+            REQUIRE(log != nullptr);
+            mqtt_offline_log_record_t record;
+            REQUIRE(mqtt_offline_log_read(log.get(), &record) == ESP_OK);
+            CHECK(std::string(record.data, record.data_len) != "payload-0");
+            mqtt_offline_log_stats_t stats;
+            mqtt_offline_log_get_stats(log.get(), &stats);
+            CHECK(stats.corrupted_records > 0);
+        }
+    }
+    GIVEN("A log limited to two segments") {
+        auto log = unique_offline_log{mqtt_offline_log_open(nullptr, dir.c_str(), 64, 2, batch, nullptr)};
+        REQUIRE(log != nullptr);
+        REQUIRE(append_messages(log.get(), 20) == 20);
+        mqtt_offline_log_stats_t stats;
+        mqtt_offline_log_get_stats(log.get(), &stats);
+        CHECK(stats.dropped_segments > 0);
+        mqtt_offline_log_record_t record;
+        REQUIRE(mqtt_offline_log_read(log.get(), &record) == ESP_OK);
+        CHECK(std::string(record.data, record.data_len) != "payload-0");
+    }
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("MQTT offline log write amplification and replay throughput", "[.][benchmark]")
+{
+    auto dir = make_log_dir();
+    constexpr int messages = 50000;
+    constexpr int batch = 8;
+    std::string payload(100, 'x');
+    auto log = unique_offline_log{mqtt_offline_log_open(nullptr, dir.c_str(), 16 * 1024, 0, batch, nullptr)};
+    REQUIRE(log != nullptr);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < messages; ++i) {
+        REQUIRE(mqtt_offline_log_append(log.get(), "sensors/temperature", 19, payload.data(), payload.size(), 1, 0) == ESP_OK);
+    }
+    auto appended = std::chrono::steady_clock::now();
+    mqtt_offline_log_record_t record;
+    int msg_id = 1;
+    while (!mqtt_offline_log_is_drained(log.get())) {
+        int first = msg_id;
+        while (mqtt_offline_log_read(log.get(), &record) == ESP_OK) {
+            mqtt_offline_log_sent(log.get(), msg_id++);
+        }
+        for (int id = first; id < msg_id; ++id) {
+            mqtt_offline_log_ack(log.get(), id);
+        }
+    }
+    auto replayed = std::chrono::steady_clock::now();
+
+    mqtt_offline_log_stats_t stats;
+    mqtt_offline_log_get_stats(log.get(), &stats);
+    auto append_ms = std::chrono::duration<double, std::milli>(appended - start).count();
+    auto replay_ms = std::chrono::duration<double, std::milli>(replayed - appended).count();
+    double write_amplification = static_cast<double>(stats.written_bytes) / stats.appended_bytes;
+    WARN("append: " << messages / append_ms << " msg/ms, replay: " << messages / replay_ms << " msg/ms, write amplification: "
+         << write_amplification << ", compacted segments: " << stats.compacted_segments);
+    CHECK(stats.replayed_records == messages);
+    CHECK(write_amplification < 1.5);
+    std::filesystem::remove_all(dir);
+}
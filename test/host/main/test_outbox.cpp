@@ -0,0 +1,254 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <string>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_outbox.h"
+#include "mqtt_msg.h"
+#include "mqtt_config.h"
+extern "C" {
+#include "Mockesp_timer.h"
+}
+
+static outbox_item_handle_t enqueue(outbox_handle_t outbox, int msg_id, int qos, outbox_tick_t tick, std::string packet)
+{
+    outbox_message_t msg = {};
+    msg.data = reinterpret_cast<uint8_t *>(packet.data());
+    msg.len = packet.size();
+    msg.msg_id = msg_id;
+    msg.msg_type = MQTT_MSG_TYPE_PUBLISH;
+    msg.msg_qos = qos;
+    auto item = outbox_enqueue(outbox, &msg, tick);
+    REQUIRE(item != nullptr);
+    return item;
+}
+
+SCENARIO("Outbox message expiry")
+{
+    esp_timer_get_time_IgnoreAndReturn(0);
+    auto outbox = outbox_init(nullptr, nullptr);
+    constexpr outbox_tick_t timeout = 30000;
+
+    GIVEN("Queued messages with and without expiry") {
+        enqueue(outbox, 1, 0, 1000, "no-expiry");
+        outbox_item_set_expiry(enqueue(outbox, 2, 2, 1000, "short-lived"), 2000);
+        outbox_item_set_expiry(enqueue(outbox, 3, 2, 1000, "acknowledged"), 2000);
+        outbox_set_pending(outbox, 3, ACKNOWLEDGED);
+        CHECK(outbox_item_get_expiry(outbox_get(outbox, 2)) == 2000);
+
+        THEN("Nothing is removed before the expiry") {
+            CHECK(outbox_delete_expired(outbox, 1999, timeout) == 0);
+        }
+        THEN("Expired messages are removed, unless already received by the broker") {
+            CHECK(outbox_delete_single_expired(outbox, 2000, timeout) == 2);
+            CHECK(outbox_delete_single_expired(outbox, 2000, timeout) == -1);
+            CHECK(outbox_get(outbox, 1) != nullptr);
+            CHECK(outbox_get(outbox, 3) != nullptr);
+            CHECK(outbox_get_size(outbox) == std::string("no-expiry").size() + std::string("acknowledged").size());
+        }
+    }
+    outbox_destroy(outbox);
+}
+
+SCENARIO("Outbox priority lanes")
+{
+    esp_timer_get_time_IgnoreAndReturn(0);      // current tick is 0
+    auto outbox = outbox_init(nullptr, nullptr);
+    auto dequeued_id = [&]() {
+        uint16_t msg_id = 0;
+        outbox_item_get_data(outbox_dequeue(outbox, QUEUED, nullptr), nullptr, &msg_id, nullptr, nullptr);
+        return msg_id;
+    };
+
+    GIVEN("A large low priority message queued before an alarm") {
+        outbox_item_set_priority(enqueue(outbox, 1, 0, -100, std::string(4096, 'd')), MQTT_PRIORITY_LOW);
+        enqueue(outbox, 2, 2, -50, "normal");
+        outbox_item_set_priority(enqueue(outbox, 3, 2, -10, "alarm"), MQTT_PRIORITY_URGENT);
+
+        THEN("Lanes are served from the highest one") {
+            CHECK(dequeued_id() == 3);
+            outbox_set_pending(outbox, 3, TRANSMITTED);
+            CHECK(dequeued_id() == 2);
+            outbox_set_pending(outbox, 2, TRANSMITTED);
+            CHECK(dequeued_id() == 1);
+        }
+        THEN("Messages of the same lane are served in order") {
+            enqueue(outbox, 4, 2, -60, "older-normal");
+            outbox_set_pending(outbox, 3, TRANSMITTED);
+            CHECK(dequeued_id() == 4);
+        }
+    }
+    GIVEN("A low priority message waiting for a long time") {
+        outbox_item_set_priority(enqueue(outbox, 1, 0, -3 * MQTT_PRIORITY_AGING_MS - 1, "starving"), MQTT_PRIORITY_LOW);
+        outbox_item_set_priority(enqueue(outbox, 2, 2, 0, "alarm"), MQTT_PRIORITY_URGENT);
+        THEN("It outranks newer messages of higher lanes") {
+            CHECK(dequeued_id() == 1);
+        }
+    }
+    outbox_destroy(outbox);
+}
+
+SCENARIO("Outbox holding QoS2 publishes waiting for PUBREC")
+{
+    esp_timer_get_time_IgnoreAndReturn(0);
+    auto outbox = outbox_init(nullptr, nullptr);
+
+    GIVEN("More QoS2 publishes in flight than the static ring holds") {
+        for (int msg_id = 1; msg_id <= 20; ++msg_id) {
+            enqueue(outbox, msg_id, 2, 0, "in-flight-" + std::to_string(msg_id));
+            outbox_set_pending(outbox, msg_id, TRANSMITTED);
+        }
+        THEN("None of them is dropped") {
+            for (int msg_id = 1; msg_id <= 20; ++msg_id) {
+                CHECK(outbox_get(outbox, msg_id) != nullptr);
+            }
+            CHECK_FALSE(outbox_is_full(outbox));
+        }
+#ifndef CONFIG_MQTT_OUTBOX_POOL
+        THEN("The outbox holds as many as the QoS2 table before it's full") {
+            int msg_id = 20;
+            while (!outbox_is_full(outbox)) {
+                enqueue(outbox, ++msg_id, 2, 0, "in-flight");
+            }
+            CHECK(msg_id >= MQTT_QOS2_MAX_INFLIGHT);
+            CHECK(outbox_get(outbox, 1) != nullptr);
+        }
+#endif
+    }
+    outbox_destroy(outbox);
+}
+
+static std::string publish_packet(const std::string &topic, const std::string &payload)
+{
+    std::string packet = {'\x30', static_cast<char>(2 + topic.size() + payload.size()), 0, static_cast<char>(topic.size())};
+    return packet + topic + payload;
+}
+
+SCENARIO("Outbox coalescing of state topics")
+{
+    esp_timer_get_time_IgnoreAndReturn(0);
+    auto outbox = outbox_init(nullptr, nullptr);
+    auto enqueue_latest = [&](int msg_id, outbox_tick_t tick, const std::string & packet) {
+        outbox_message_t msg = {};
+        std::string data = packet;
+        msg.data = reinterpret_cast<uint8_t *>(data.data());
+        msg.len = data.size();
+        msg.msg_id = msg_id;
+        msg.msg_type = MQTT_MSG_TYPE_PUBLISH;
+        REQUIRE(outbox_enqueue_latest(outbox, &msg, tick) != nullptr);
+    };
+
+    GIVEN("A queued value of a state topic") {
+        enqueue_latest(1, -100, publish_packet("device/x/temperature", "20.5"));
+        enqueue_latest(2, -50, publish_packet("device/x/humidity", "40"));
+
+        WHEN("A new value is enqueued") {
+            enqueue_latest(3, 0, publish_packet("device/x/temperature", "21.0"));
+            THEN("It replaces the previous one and keeps its place") {
+                CHECK(outbox_get(outbox, 1) == nullptr);
+                CHECK(outbox_get(outbox, 2) != nullptr);
+                uint16_t msg_id = 0;
+                outbox_item_get_data(outbox_dequeue(outbox, QUEUED, nullptr), nullptr, &msg_id, nullptr, nullptr);
+                CHECK(msg_id == 3);
+            }
+        }
+        WHEN("The previous value has already been transmitted") {
+            outbox_set_pending(outbox, 1, TRANSMITTED);
+            enqueue_latest(3, 0, publish_packet("device/x/temperature", "21.0"));
+            THEN("Both are kept") {
+                CHECK(outbox_get(outbox, 1) != nullptr);
+                CHECK(outbox_get(outbox, 3) != nullptr);
+            }
+        }
+    }
+    outbox_destroy(outbox);
+}
+
+SCENARIO("Outbox payload shared by several outboxes")
+{
+    esp_timer_get_time_IgnoreAndReturn(0);
+    auto first = outbox_init(nullptr, nullptr);
+    auto second = outbox_init(nullptr, nullptr);
+    const std::string payload = "shared-payload";
+    auto shared = outbox_shared_payload_create(reinterpret_cast<const uint8_t *>(payload.data()), payload.size());
+    REQUIRE(shared != nullptr);
+    auto enqueue_shared = [&](outbox_handle_t outbox, int msg_id) {
+        std::string header = "header";
+        outbox_message_t msg = {};
+        msg.data = reinterpret_cast<uint8_t *>(header.data());
+        msg.len = header.size();
+        msg.msg_id = msg_id;
+        msg.msg_type = MQTT_MSG_TYPE_PUBLISH;
+        msg.msg_qos = 1;
+        msg.shared = shared;
+        return outbox_enqueue(outbox, &msg, 0);
+    };
+
+    GIVEN("A payload queued in two outboxes") {
+        REQUIRE(enqueue_shared(first, 1) != nullptr);
+        REQUIRE(enqueue_shared(second, 7) != nullptr);
+        outbox_shared_payload_release(shared);
+
+        THEN("Each item keeps its own header and refers to the payload") {
+            size_t len = 0;
+            auto data = outbox_item_get_shared(outbox_get(second, 7), &len);
+            REQUIRE(data != nullptr);
+            CHECK(std::string(reinterpret_cast<const char *>(data), len) == payload);
+            CHECK(outbox_get_size(first) == std::string("header").size() + payload.size());
+        }
+        THEN("The payload outlives the outbox that acknowledged it first") {
+            outbox_delete(first, 1, MQTT_MSG_TYPE_PUBLISH);
+            size_t len = 0;
+            auto data = outbox_item_get_shared(outbox_get(second, 7), &len);
+            REQUIRE(data != nullptr);
+            CHECK(std::string(reinterpret_cast<const char *>(data), len) == payload);
+        }
+    }
+    outbox_destroy(first);
+    outbox_destroy(second);
+}
+
+SCENARIO("QoS1 queues of the outboxes of two clients")
+{
+    esp_timer_get_time_IgnoreAndReturn(0);
+    auto first = outbox_init(nullptr, nullptr);
+    REQUIRE(first != nullptr);
+    std::string topic = "topic", payload = "payload";
+    auto track = [&](outbox_handle_t outbox, int msg_id) {
+        return mqtt_qos1q_track(outbox_get_qos1_queue(outbox), topic.c_str(), topic.size(),
+                                payload.c_str(), payload.size(), false, msg_id);
+    };
+    auto tracked = [](outbox_handle_t outbox) {
+        int count = 0;
+        mqtt_qos1q_for_each(outbox_get_qos1_queue(outbox), [](const MqttSlot *, void *ctx) {
+            ++*static_cast<int *>(ctx);
+        }, &count);
+        return count;
+    };
+    REQUIRE(track(first, 1) == 1);
+
+    GIVEN("A second client using the same message id") {
+        auto second = outbox_init(nullptr, nullptr);
+        REQUIRE(second != nullptr);
+        THEN("Creating it keeps the slots of the first") {
+            CHECK(tracked(first) == 1);
+            CHECK(tracked(second) == 0);
+        }
+        REQUIRE(track(second, 1) == 1);
+        THEN("A PUBACK of one client doesn't release the slot of the other") {
+            outbox_delete(second, 1, MQTT_MSG_TYPE_PUBLISH);
+            CHECK(tracked(second) == 0);
+            CHECK(tracked(first) == 1);
+        }
+        THEN("Destroying one client keeps the slots of the other") {
+            outbox_destroy(second);
+            second = nullptr;
+            CHECK(tracked(first) == 1);
+        }
+        outbox_destroy(second);
+    }
+    outbox_destroy(first);
+}
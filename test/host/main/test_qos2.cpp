@@ -0,0 +1,76 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <vector>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_qos2.h"
+
+static esp_err_t collect(uint16_t msg_id, void *ctx)
+{
+    static_cast<std::vector<int> *>(ctx)->push_back(msg_id);
+    return ESP_OK;
+}
+
+SCENARIO("QoS2 in-flight table")
+{
+    constexpr int capacity = 512;
+    auto table = mqtt_qos2_table_create(capacity, nullptr);
+    REQUIRE(table != nullptr);
+
+    GIVEN("Hundreds of publishes in flight") {
+        for (int id = 1; id <= capacity; ++id) {
+            // spread like random ids
+            REQUIRE(mqtt_qos2_publish_sent(table, id * 127, 0) == ESP_OK);
+        }
+        CHECK(mqtt_qos2_is_full(table));
+        CHECK(mqtt_qos2_publish_sent(table, 1, 0) == ESP_ERR_NO_MEM);
+
+        THEN("Each id goes through PUBREC and PUBCOMP, also after the others completed") {
+            for (int id = 2; id <= capacity; id += 2) {
+                REQUIRE(mqtt_qos2_pubrel_sent(table, id * 127, 10) == ESP_OK);
+                CHECK(mqtt_qos2_pubcomp(table, id * 127));
+            }
+            for (int id = 1; id <= capacity; ++id) {
+                CHECK(mqtt_qos2_get_state(table, id * 127) == (id % 2 ? MQTT_QOS2_PUBLISH_SENT : MQTT_QOS2_NONE));
+            }
+            CHECK(mqtt_qos2_count(table, MQTT_QOS2_PUBLISH_SENT) == capacity / 2);
+            CHECK(mqtt_qos2_count(table, MQTT_QOS2_PUBREL_SENT) == 0);
+            CHECK_FALSE(mqtt_qos2_is_full(table));
+        }
+        THEN("A publish received by the broker is not sent again") {
+            REQUIRE(mqtt_qos2_pubrel_sent(table, 127, 10) == ESP_OK);
+            CHECK(mqtt_qos2_publish_sent(table, 127, 20) == ESP_ERR_INVALID_STATE);
+            CHECK(mqtt_qos2_get_state(table, 127) == MQTT_QOS2_PUBREL_SENT);
+        }
+    }
+    GIVEN("PUBRELs waiting for PUBCOMP") {
+        for (int id = 1; id <= 40; ++id) {
+            REQUIRE(mqtt_qos2_pubrel_sent(table, id, id < 30 ? 1000 : 2500) == ESP_OK);
+        }
+
+        THEN("The ones due are resent in batches, oldest first") {
+            std::vector<int> sent;
+            CHECK(mqtt_qos2_resend_pubrel(table, 3000, 1000, 16, collect, &sent) == 16);
+            CHECK(mqtt_qos2_resend_pubrel(table, 3000, 1000, 16, collect, &sent) == 13);
+            CHECK(mqtt_qos2_resend_pubrel(table, 3000, 1000, 16, collect, &sent) == 0);
+            REQUIRE(sent.size() == 29);
+            for (int i = 0; i < 29; ++i) {
+                CHECK(sent[i] == i + 1);
+            }
+            sent.clear();
+            CHECK(mqtt_qos2_resend_pubrel(table, 4001, 1000, 64, collect, &sent) == 40);
+            CHECK(sent.front() == 30);
+        }
+        THEN("Unacknowledged ids expire from their first transmission") {
+            CHECK(mqtt_qos2_delete_expired(table, 31000, 30000) == 0);
+            CHECK(mqtt_qos2_delete_expired(table, 31001, 30000) == 29);
+            CHECK(mqtt_qos2_count(table, MQTT_QOS2_PUBREL_SENT) == 11);
+            CHECK_FALSE(mqtt_qos2_pubcomp(table, 1));
+            CHECK(mqtt_qos2_pubcomp(table, 30));
+        }
+    }
+    mqtt_qos2_table_destroy(table);
+}
@@ -0,0 +1,100 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <string>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_rate_limit.h"
+
+SCENARIO("Publish rate limiting")
+{
+    auto acquire = [](mqtt_rate_limit_handle_t limiter, const std::string & topic, size_t len, uint64_t now) {
+        return mqtt_rate_limit_acquire(limiter, topic.c_str(), topic.size(), len, now);
+    };
+
+    GIVEN("A client limit of 10 messages per second with a burst of 3") {
+        esp_mqtt_rate_limit_t limit = {.msgs_per_sec = 10, .msg_burst = 3};
+        auto limiter = mqtt_rate_limit_create(&limit, nullptr, 0, nullptr);
+        REQUIRE(limiter != nullptr);
+
+        THEN("The burst passes at once, then one message per 100ms") {
+            for (int i = 0; i < 3; ++i) {
+                CHECK(acquire(limiter, "a", 10, 1));
+            }
+            CHECK_FALSE(acquire(limiter, "a", 10, 1));
+            CHECK_FALSE(acquire(limiter, "a", 10, 100));
+            CHECK(acquire(limiter, "a", 10, 101));
+            CHECK_FALSE(acquire(limiter, "a", 10, 150));
+        }
+        THEN("Idle time doesn't accumulate over the burst") {
+            CHECK(acquire(limiter, "a", 10, 1));
+            for (int i = 0; i < 3; ++i) {
+                CHECK(acquire(limiter, "a", 10, 10000));
+            }
+            CHECK_FALSE(acquire(limiter, "a", 10, 10000));
+        }
+        mqtt_rate_limit_destroy(limiter);
+    }
+    GIVEN("A byte limit smaller than a message") {
+        esp_mqtt_rate_limit_t limit = {.bytes_per_sec = 1000};
+        auto limiter = mqtt_rate_limit_create(&limit, nullptr, 0, nullptr);
+        THEN("The message passes and the following ones wait until the debt is paid") {
+            CHECK(acquire(limiter, "a", 3000, 1));
+            CHECK_FALSE(acquire(limiter, "a", 1, 1000));
+            CHECK_FALSE(acquire(limiter, "a", 1, 2000));
+            CHECK(acquire(limiter, "a", 1, 2002));
+        }
+        mqtt_rate_limit_destroy(limiter);
+    }
+    GIVEN("A limit of a topic filter") {
+        esp_mqtt_topic_rate_limit_t topics[] = {{.filter = "debug/#", .limit = {.msgs_per_sec = 1}}};
+        auto limiter = mqtt_rate_limit_create(nullptr, topics, 1, nullptr);
+        REQUIRE(limiter != nullptr);
+        THEN("Only the matching topics are limited") {
+            CHECK(acquire(limiter, "debug/trace", 10, 1));
+            CHECK_FALSE(acquire(limiter, "debug/heap", 10, 1));
+            CHECK(acquire(limiter, "alarm", 10, 1));
+            CHECK(acquire(limiter, "debug/heap", 10, 1001));
+        }
+        mqtt_rate_limit_destroy(limiter);
+    }
+    GIVEN("A backlog drained by waiting for the next token") {
+        esp_mqtt_rate_limit_t limit = {.msgs_per_sec = 20, .msg_burst = 5};
+        esp_mqtt_topic_rate_limit_t topics[] = {{.filter = "slow", .limit = {.msgs_per_sec = 2}}};
+        auto limiter = mqtt_rate_limit_create(&limit, topics, 1, nullptr);
+        REQUIRE(limiter != nullptr);
+        auto drain = [&](const std::string & topic, uint64_t until) {
+            int sent = 0;
+            for (uint64_t now = 0; now < until;) {
+                while (mqtt_rate_limit_check(limiter, topic.c_str(), topic.size(), now)) {
+                    mqtt_rate_limit_consume(limiter, topic.c_str(), topic.size(), 10, now);
+                    ++sent;
+                }
+                uint32_t wait = mqtt_rate_limit_wait_ms(limiter, topic.c_str(), topic.size(), now);
+                REQUIRE(wait > 0);
+                now += wait;
+            }
+            return sent;
+        };
+        THEN("It goes out at the configured rate after the burst") {
+            // then one every 50ms up to 1950ms
+            CHECK(drain("fast", 2000) == 5 + 39);
+        }
+        THEN("The slowest matching bucket sets the pace") {
+            // a burst of one second, then one every 500ms
+            CHECK(drain("slow", 2000) == 2 + 3);
+        }
+        THEN("Nothing needs waiting while tokens are left") {
+            CHECK(mqtt_rate_limit_wait_ms(limiter, "fast", 4, 0) == 0);
+        }
+        mqtt_rate_limit_destroy(limiter);
+    }
+    GIVEN("No limit") {
+        esp_mqtt_rate_limit_t limit = {};
+        THEN("No limiter is created") {
+            CHECK(mqtt_rate_limit_create(&limit, nullptr, 0, nullptr) == nullptr);
+        }
+    }
+}
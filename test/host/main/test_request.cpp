@@ -0,0 +1,82 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <vector>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt5_request.h"
+#include "mqtt_config.h"
+
+static void on_response(esp_mqtt5_client_handle_t client, const esp_mqtt5_response_t *response, void *ctx)
+{
+}
+
+static void collect(const mqtt5_request_t *request, void *arg)
+{
+    static_cast<std::vector<int> *>(arg)->push_back(request->id);
+}
+
+SCENARIO("MQTT5 pending requests table")
+{
+    auto table = mqtt5_request_table_create(4, nullptr);
+    REQUIRE(table != nullptr);
+    auto take = [&](int id) {
+        uint8_t correlation[MQTT5_REQUEST_CORRELATION_LEN];
+        mqtt5_request_correlation(id, correlation);
+        mqtt5_request_t request = {};
+        return mqtt5_request_take(table, reinterpret_cast<const char *>(correlation), sizeof(correlation), &request) && request.id == id;
+    };
+
+    GIVEN("Pending requests") {
+        int first = mqtt5_request_add(table, on_response, nullptr, 1000);
+        int second = mqtt5_request_add(table, on_response, nullptr, 1000);
+        REQUIRE(first > 0);
+        REQUIRE(second > 0);
+        CHECK(first != second);
+
+        THEN("Responses are matched by the correlation data, only once") {
+            CHECK(take(second));
+            CHECK_FALSE(take(second));
+            CHECK(mqtt5_request_count(table) == 1);
+        }
+        THEN("A late response doesn't match the next request of the same slot") {
+            CHECK(mqtt5_request_remove(table, first, nullptr));
+            int reused = mqtt5_request_add(table, on_response, nullptr, 1000);
+            CHECK(reused != first);
+            CHECK_FALSE(take(first));
+            CHECK(take(reused));
+        }
+        THEN("Requests are refused when the table is full") {
+            CHECK(mqtt5_request_add(table, on_response, nullptr, 1000) > 0);
+            CHECK(mqtt5_request_add(table, on_response, nullptr, 1000) > 0);
+            CHECK(mqtt5_request_add(table, on_response, nullptr, 1000) == -1);
+        }
+    }
+    GIVEN("Requests with various deadlines") {
+        constexpr uint64_t wheel_span = MQTT_REQUEST_WHEEL_SLOTS * MQTT_REQUEST_WHEEL_TICK_MS;
+        int soon = mqtt5_request_add(table, on_response, nullptr, 250);
+        int later = mqtt5_request_add(table, on_response, nullptr, 250 + wheel_span);
+        int last = mqtt5_request_add(table, on_response, nullptr, 3 * wheel_span);
+        std::vector<int> expired;
+
+        THEN("They expire after their deadline, including those beyond one round of the wheel") {
+            CHECK(mqtt5_request_expire(table, 250, collect, &expired) == 0);
+            CHECK(mqtt5_request_expire(table, 250 + MQTT_REQUEST_WHEEL_TICK_MS, collect, &expired) == 1);
+            CHECK(expired == std::vector<int> {soon});
+            CHECK(mqtt5_request_expire(table, 2 * wheel_span, collect, &expired) == 1);
+            CHECK(expired == std::vector<int> {soon, later});
+            CHECK(mqtt5_request_expire(table, 4 * wheel_span, collect, &expired) == 1);
+            CHECK(expired == std::vector<int> {soon, later, last});
+            CHECK(mqtt5_request_count(table) == 0);
+        }
+        THEN("An expired request can't be answered") {
+            mqtt5_request_expire(table, wheel_span, collect, &expired);
+            CHECK_FALSE(take(soon));
+            CHECK(take(later));
+        }
+    }
+    std::vector<int> aborted;
+    mqtt5_request_table_destroy(table, collect, &aborted);
+}
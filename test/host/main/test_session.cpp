@@ -0,0 +1,149 @@
+/*
+ * SPDX-FileCopyrightText: 2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <catch2/catch_test_macros.hpp>
+
+#include "mqtt_session.h"
+#include "mqtt_blob.h"
+#include "mqtt_msg.h"
+extern "C" {
+#include "Mockesp_timer.h"
+}
+
+using unique_session = std::unique_ptr < std::remove_pointer_t<mqtt_session_handle_t>, decltype([](mqtt_session_handle_t session)
+{
+    mqtt_session_destroy(session);
+}) >;
+
+struct ram_storage {
+    std::vector<uint8_t> blob;
+    int saves = 0;
+};
+
+static esp_err_t ram_save(void *ctx, const void *data, size_t len)
+{
+    auto storage = static_cast<ram_storage *>(ctx);
+    auto bytes = static_cast<const uint8_t *>(data);
+    storage->blob.assign(bytes, bytes + len);
+    ++storage->saves;
+    return ESP_OK;
+}
+
+static int ram_load(void *ctx, void *data, size_t len)
+{
+    auto storage = static_cast<ram_storage *>(ctx);
+    if (storage->blob.empty() || storage->blob.size() > len) {
+        return -1;
+    }
+    memcpy(data, storage->blob.data(), storage->blob.size());
+    return storage->blob.size();
+}
+
+static void enqueue(outbox_handle_t outbox, int msg_id, int msg_type, int qos, pending_state_t state, std::string packet)
+{
+    outbox_message_t msg = {};
+    msg.data = reinterpret_cast<uint8_t *>(packet.data());
+    msg.len = packet.size();
+    msg.msg_id = msg_id;
+    msg.msg_type = msg_type;
+    msg.msg_qos = qos;
+    REQUIRE(outbox_enqueue(outbox, &msg, 0) != nullptr);
+    outbox_set_pending(outbox, msg_id, state);
+}
+
+static std::string item_data(outbox_handle_t outbox, int msg_id)
+{
+    size_t len = 0;
+    auto data = outbox_item_get_data(outbox_get(outbox, msg_id), &len, nullptr, nullptr, nullptr);
+    return data ? std::string(reinterpret_cast<char *>(data), len) : std::string();
+}
+
+SCENARIO("MQTT session persistence")
+{
+    esp_timer_get_time_IgnoreAndReturn(0);
+    ram_storage storage;
+    esp_mqtt_session_storage_t callbacks = {ram_save, ram_load, &storage};
+    auto outbox = outbox_init(nullptr, nullptr);
+    auto qos2 = mqtt_qos2_table_create(8, nullptr);
+
+    GIVEN("A session with in-flight messages and subscriptions") {
+        auto session = unique_session{mqtt_session_create(&callbacks, 4096, nullptr)};
+        REQUIRE(session != nullptr);
+        enqueue(outbox, 7, MQTT_MSG_TYPE_PUBLISH, 2, TRANSMITTED, "qos2-publish");
+        enqueue(outbox, 8, MQTT_MSG_TYPE_PUBLISH, 2, ACKNOWLEDGED, "waiting-for-pubcomp");
+        REQUIRE(mqtt_qos2_pubrel_sent(qos2, 9, 0) == ESP_OK);
+        enqueue(outbox, 0, MQTT_MSG_TYPE_PUBLISH, 0, QUEUED, "qos0-publish");
+        esp_mqtt_topic_t topics[] = {{"sensors/#", 1}, {"denied", 2}};
+        REQUIRE(mqtt_session_subscribe(session.get(), 10, topics, 2) == ESP_OK);
+        const uint8_t codes[] = {1, 0x80};
+        mqtt_session_suback(session.get(), 10, codes, 2);
+
+        REQUIRE(mqtt_session_save(session.get(), outbox, qos2, 42) == ESP_OK);
+        CHECK(storage.saves == 1);
+
+        THEN("An unchanged session is not stored again") {
+            REQUIRE(mqtt_session_save(session.get(), outbox, qos2, 42) == ESP_OK);
+            CHECK(storage.saves == 1);
+        }
+        THEN("A restarted client restores the session") {
+            session.reset(mqtt_session_create(&callbacks, 4096, nullptr));
+            outbox_delete_all_items(outbox);
+            mqtt_qos2_clear(qos2);
+            uint16_t last_message_id = 0;
+            REQUIRE(mqtt_session_restore(session.get(), outbox, qos2, &last_message_id) == ESP_OK);
+            CHECK(last_message_id == 42);
+            CHECK(item_data(outbox, 7) == "qos2-publish");
+            CHECK(outbox_item_get_pending(outbox_get(outbox, 7)) == TRANSMITTED);
+            // publishes received by the broker are restored as the ids waiting for PUBCOMP
+            CHECK(outbox_get(outbox, 8) == nullptr);
+            CHECK(mqtt_qos2_get_state(qos2, 8) == MQTT_QOS2_PUBREL_SENT);
+            CHECK(mqtt_qos2_get_state(qos2, 9) == MQTT_QOS2_PUBREL_SENT);
+            CHECK(outbox_get(outbox, 0) == nullptr);
+
+            esp_mqtt_topic_t restored[4];
+            REQUIRE(mqtt_session_get_subscriptions(session.get(), restored, 4, 0) == 1);
+            CHECK(std::string(restored[0].filter) == "sensors/#");
+            CHECK(restored[0].qos == 1);
+        }
+        THEN("Unsubscribed topics are forgotten once acknowledged") {
+            mqtt_session_unsubscribe(session.get(), 11, "sensors/#");
+            esp_mqtt_topic_t restored[4];
+            CHECK(mqtt_session_get_subscriptions(session.get(), restored, 4, 0) == 0);
+            mqtt_session_unsuback(session.get(), 11);
+            REQUIRE(mqtt_session_save(session.get(), outbox, qos2, 42) == ESP_OK);
+            CHECK(storage.saves == 2);
+        }
+        THEN("A corrupted snapshot is refused") {
+            storage.blob[storage.blob.size() / 2] ^= 0xFF;
+            session.reset(mqtt_session_create(&callbacks, 4096, nullptr));
+            uint16_t last_message_id = 0;
+            CHECK(mqtt_session_restore(session.get(), outbox, qos2, &last_message_id) == ESP_ERR_INVALID_CRC);
+        }
+        THEN("A snapshot with counts not matching its records is refused as a whole") {
+            // one more outbox item than stored, the pubrel record is read as its header
+            storage.blob[8] += 1;
+            size_t crc_offset = storage.blob.size() - 4;
+            uint32_t crc = mqtt_crc32_update(0, storage.blob.data(), crc_offset);
+            memcpy(&storage.blob[crc_offset], &crc, sizeof(crc));
+            session.reset(mqtt_session_create(&callbacks, 4096, nullptr));
+            outbox_delete_all_items(outbox);
+            mqtt_qos2_clear(qos2);
+            uint16_t last_message_id = 0;
+            CHECK(mqtt_session_restore(session.get(), outbox, qos2, &last_message_id) == ESP_ERR_INVALID_SIZE);
+            CHECK(last_message_id == 0);
+            CHECK(outbox_get(outbox, 7) == nullptr);
+            CHECK(mqtt_qos2_get_state(qos2, 8) == MQTT_QOS2_NONE);
+            esp_mqtt_topic_t restored[4];
+            CHECK(mqtt_session_get_subscriptions(session.get(), restored, 4, 0) == 0);
+        }
+    }
+    mqtt_qos2_table_destroy(qos2);
+    outbox_destroy(outbox);
+}